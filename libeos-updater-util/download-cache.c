@@ -0,0 +1,187 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <libeos-updater-util/download-cache.h>
+#include <libeos-updater-util/util.h>
+
+/* Downloads are cached on disk along with the validators (ETag and
+ * Last-Modified) the server sent for them, so that the next download can be
+ * made conditional and, if the file has not changed, be answered with a
+ * short 304 response rather than the full file. Each cached file is stored
+ * as one #GVariant of this type, so it is replaced atomically and its body
+ * and validators never get out of step. */
+#define CACHED_DOWNLOAD_FORMAT "(ssay)"
+
+/**
+ * eos_download_cache_get_file:
+ * @cache_directory: directory the downloads are cached in
+ * @url: URL of the download
+ *
+ * Gets the file the download of @url is cached in. The name is a digest of
+ * @url, so any URL maps to a valid file name.
+ *
+ * Returns: (transfer full): the cache file
+ */
+GFile *
+eos_download_cache_get_file (GFile *cache_directory,
+                             const gchar *url)
+{
+  g_autofree gchar *name = NULL;
+
+  g_return_val_if_fail (G_IS_FILE (cache_directory), NULL);
+  g_return_val_if_fail (url != NULL, NULL);
+
+  name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, url, -1);
+
+  return g_file_get_child (cache_directory, name);
+}
+
+/**
+ * eos_download_cache_load:
+ * @cache_file: a file from eos_download_cache_get_file()
+ * @out_contents: (out) (transfer full): return location for the cached
+ *    contents
+ * @out_etag: (out) (transfer full): return location for the ETag, or an
+ *    empty string if the server sent none
+ * @out_last_modified: (out) (transfer full): return location for the
+ *    Last-Modified date, or an empty string if the server sent none
+ *
+ * Loads a download cached by eos_download_cache_save(). A missing or
+ * unreadable file, or one without any validators to revalidate it with, is
+ * not an error: the file must just be downloaded in full.
+ *
+ * Returns: %TRUE if a cached download was loaded, %FALSE otherwise
+ */
+gboolean
+eos_download_cache_load (GFile *cache_file,
+                         GBytes **out_contents,
+                         gchar **out_etag,
+                         gchar **out_last_modified)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GVariant) contents_variant = NULL;
+  g_autofree gchar *etag = NULL;
+  g_autofree gchar *last_modified = NULL;
+
+  g_return_val_if_fail (G_IS_FILE (cache_file), FALSE);
+  g_return_val_if_fail (out_contents != NULL, FALSE);
+  g_return_val_if_fail (out_etag != NULL, FALSE);
+  g_return_val_if_fail (out_last_modified != NULL, FALSE);
+
+  if (!eos_updater_read_file_to_bytes (cache_file, NULL, &bytes, NULL))
+    return FALSE;
+
+  /* The file is not trusted to be in normal form; a corrupt one reads as
+   * having no validators. */
+  variant = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (CACHED_DOWNLOAD_FORMAT),
+                                                          bytes,
+                                                          FALSE));
+  g_variant_get (variant, "(ss@ay)", &etag, &last_modified, &contents_variant);
+
+  if (*etag == '\0' && *last_modified == '\0')
+    return FALSE;
+
+  *out_contents = g_variant_get_data_as_bytes (contents_variant);
+  *out_etag = g_steal_pointer (&etag);
+  *out_last_modified = g_steal_pointer (&last_modified);
+  return TRUE;
+}
+
+/**
+ * eos_download_cache_save:
+ * @cache_file: a file from eos_download_cache_get_file()
+ * @etag: (nullable): the ETag the server sent, or %NULL if none
+ * @last_modified: (nullable): the Last-Modified date the server sent, or
+ *    %NULL if none
+ * @contents: the downloaded contents
+ *
+ * Caches a download, creating the cache directory if needed. If there are no
+ * validators, the download could never be revalidated, so any copy already
+ * cached is removed instead. Failures are only logged: the cache is an
+ * optimisation.
+ */
+void
+eos_download_cache_save (GFile *cache_file,
+                         const gchar *etag,
+                         const gchar *last_modified,
+                         GBytes *contents)
+{
+  g_autoptr(GFile) cache_directory = NULL;
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_return_if_fail (G_IS_FILE (cache_file));
+  g_return_if_fail (contents != NULL);
+
+  if (etag == NULL && last_modified == NULL)
+    {
+      g_file_delete (cache_file, NULL, NULL);
+      return;
+    }
+
+  variant = g_variant_ref_sink (g_variant_new ("(ss@ay)",
+                                               (etag != NULL) ? etag : "",
+                                               (last_modified != NULL) ? last_modified : "",
+                                               g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING,
+                                                                         contents,
+                                                                         TRUE)));
+
+  cache_directory = g_file_get_parent (cache_file);
+  if (!g_file_make_directory_with_parents (cache_directory, NULL, &error) &&
+      !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    {
+      g_debug ("Failed to create download cache directory: %s", error->message);
+      return;
+    }
+  g_clear_error (&error);
+
+  if (!g_file_replace_contents (cache_file,
+                                g_variant_get_data (variant),
+                                g_variant_get_size (variant),
+                                NULL,
+                                FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION,
+                                NULL,
+                                NULL,
+                                &error))
+    g_debug ("Failed to cache download: %s", error->message);
+}
+
+/**
+ * eos_download_cache_remove:
+ * @cache_directory: directory the downloads are cached in
+ * @url: URL of the download
+ *
+ * Removes the cached download of @url, if there is one, so that it is
+ * downloaded in full next time.
+ */
+void
+eos_download_cache_remove (GFile *cache_directory,
+                           const gchar *url)
+{
+  g_autoptr(GFile) cache_file = NULL;
+
+  g_return_if_fail (G_IS_FILE (cache_directory));
+  g_return_if_fail (url != NULL);
+
+  cache_file = eos_download_cache_get_file (cache_directory, url);
+  g_file_delete (cache_file, NULL, NULL);
+}
@@ -0,0 +1,44 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+GFile *eos_download_cache_get_file (GFile *cache_directory,
+                                    const gchar *url);
+
+gboolean eos_download_cache_load (GFile *cache_file,
+                                  GBytes **out_contents,
+                                  gchar **out_etag,
+                                  gchar **out_last_modified);
+
+void eos_download_cache_save (GFile *cache_file,
+                              const gchar *etag,
+                              const gchar *last_modified,
+                              GBytes *contents);
+
+void eos_download_cache_remove (GFile *cache_directory,
+                                const gchar *url);
+
+G_END_DECLS
@@ -0,0 +1,230 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <libeos-updater-util/lookup-preferences.h>
+
+/* The poller has several methods of finding the latest commit on a ref,
+ * identified by their index in its list, and tries them in that order. This
+ * remembers, for each remote URL, the first method worth trying: the ones
+ * before it were found not to exist there, so they are skipped. Only a
+ * missing file counts, since a method which failed for any other reason may
+ * well work next time, and the methods earlier in the list give more
+ * information. Remotes can start providing files they did not before, so the
+ * methods skipped are tried again after a while. Peers on the LAN each have
+ * their own URL, so the table is emptied if it gets too big.
+ *
+ * The fetchers run in their own threads, so the table is locked. */
+
+typedef struct
+{
+  gsize method;
+  gint64 since;  /* monotonic time when the earlier methods were found missing */
+} PreferredLookup;
+
+struct _EosLookupPreferences
+{
+  GObject parent_instance;
+
+  GTimeSpan retry_usecs;
+
+  GMutex lock;
+  GHashTable *table;  /* (owned) (element-type utf8 PreferredLookup) */
+};
+
+static void
+eos_lookup_preferences_finalize_impl (EosLookupPreferences *preferences)
+{
+  g_clear_pointer (&preferences->table, g_hash_table_unref);
+  g_mutex_clear (&preferences->lock);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_LOOKUP_PREFERENCES,
+                       EosLookupPreferences,
+                       eos_lookup_preferences,
+                       NULL,
+                       eos_lookup_preferences_finalize_impl)
+
+/**
+ * eos_lookup_preferences_new:
+ * @retry_usecs: how long to skip methods found missing for, before trying
+ *    them again
+ *
+ * Creates a new, empty table of preferred methods.
+ *
+ * Returns: (transfer full): a new #EosLookupPreferences
+ */
+EosLookupPreferences *
+eos_lookup_preferences_new (GTimeSpan retry_usecs)
+{
+  EosLookupPreferences *preferences;
+
+  g_return_val_if_fail (retry_usecs >= 0, NULL);
+
+  preferences = g_object_new (EOS_TYPE_LOOKUP_PREFERENCES, NULL);
+  preferences->retry_usecs = retry_usecs;
+  g_mutex_init (&preferences->lock);
+  preferences->table = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, g_free);
+
+  return preferences;
+}
+
+/**
+ * eos_lookup_preferences_get:
+ * @preferences: an #EosLookupPreferences
+ * @remote_url: URL of the remote
+ *
+ * Gets the first method worth trying for @remote_url.
+ *
+ * Returns: the index of the method, or 0 if all the methods should be tried
+ */
+gsize
+eos_lookup_preferences_get (EosLookupPreferences *preferences,
+                            const gchar *remote_url)
+{
+  PreferredLookup *preferred;
+  gsize method = 0;
+
+  g_return_val_if_fail (EOS_IS_LOOKUP_PREFERENCES (preferences), 0);
+  g_return_val_if_fail (remote_url != NULL, 0);
+
+  g_mutex_lock (&preferences->lock);
+  preferred = g_hash_table_lookup (preferences->table, remote_url);
+  if (preferred != NULL &&
+      g_get_monotonic_time () - preferred->since < preferences->retry_usecs)
+    method = preferred->method;
+  g_mutex_unlock (&preferences->lock);
+
+  return method;
+}
+
+/**
+ * eos_lookup_preferences_set:
+ * @preferences: an #EosLookupPreferences
+ * @remote_url: URL of the remote
+ * @method: index of the first method worth trying for @remote_url
+ *
+ * Sets @method as the first to try for @remote_url, from now until the
+ * retry time has passed, or forgets the preference if @method is 0.
+ */
+void
+eos_lookup_preferences_set (EosLookupPreferences *preferences,
+                            const gchar *remote_url,
+                            gsize method)
+{
+  PreferredLookup *preferred;
+
+  g_return_if_fail (EOS_IS_LOOKUP_PREFERENCES (preferences));
+  g_return_if_fail (remote_url != NULL);
+
+  g_mutex_lock (&preferences->lock);
+
+  if (method == 0)
+    {
+      g_hash_table_remove (preferences->table, remote_url);
+      g_mutex_unlock (&preferences->lock);
+      return;
+    }
+
+  if (g_hash_table_size (preferences->table) >= EOS_LOOKUP_PREFERENCES_MAX &&
+      !g_hash_table_contains (preferences->table, remote_url))
+    g_hash_table_remove_all (preferences->table);
+
+  preferred = g_new0 (PreferredLookup, 1);
+  preferred->method = method;
+  preferred->since = g_get_monotonic_time ();
+  g_hash_table_replace (preferences->table, g_strdup (remote_url), preferred);
+
+  g_mutex_unlock (&preferences->lock);
+}
+
+/**
+ * eos_lookup_preferences_update:
+ * @preferences: an #EosLookupPreferences
+ * @remote_url: URL of the remote
+ * @preferred: the method which was tried first, from
+ *    eos_lookup_preferences_get()
+ * @answer_method: the method whose answer was used
+ * @missing: (array): for each method before @answer_method, whether it was
+ *    found not to exist this time
+ *
+ * Works out which method to try first next time, once there is an answer:
+ * the earliest one which was not found to be missing, either this time or,
+ * for those skipped, before. If that is still @preferred, the preference is
+ * left alone, so that the skipped methods are still retried on time.
+ */
+void
+eos_lookup_preferences_update (EosLookupPreferences *preferences,
+                               const gchar *remote_url,
+                               gsize preferred,
+                               gsize answer_method,
+                               const gboolean *missing)
+{
+  gsize method;
+
+  g_return_if_fail (EOS_IS_LOOKUP_PREFERENCES (preferences));
+  g_return_if_fail (remote_url != NULL);
+  g_return_if_fail (missing != NULL || answer_method == 0);
+
+  for (method = 0; method < answer_method; method++)
+    if (!missing[method] && method >= preferred)
+      break;
+
+  if (method != preferred)
+    eos_lookup_preferences_set (preferences, remote_url, method);
+}
+
+/**
+ * eos_lookup_preferences_answer_is_final:
+ * @preferred: the method which was tried first, from
+ *    eos_lookup_preferences_get()
+ * @answer_method: the earliest method which has given an answer so far
+ * @methods: (array length=n_started): the methods started, in the order
+ *    they were started
+ * @running: (array length=n_started): whether each of @methods is still
+ *    running
+ * @n_started: number of methods started
+ *
+ * Gets whether the answer from @answer_method is final: no method before it
+ * is still running, other than those skipped because they were found to be
+ * missing before @preferred. The answer from the earliest method is always
+ * used, rather than the first to arrive, so this is what decides when
+ * methods raced against each other are done.
+ *
+ * Returns: %TRUE if the answer is final, %FALSE otherwise
+ */
+gboolean
+eos_lookup_preferences_answer_is_final (gsize preferred,
+                                        gsize answer_method,
+                                        const gsize *methods,
+                                        const gboolean *running,
+                                        gsize n_started)
+{
+  gsize i;
+
+  g_return_val_if_fail (methods != NULL || n_started == 0, FALSE);
+  g_return_val_if_fail (running != NULL || n_started == 0, FALSE);
+
+  for (i = 0; i < n_started; i++)
+    if (running[i] && methods[i] >= preferred && methods[i] < answer_method)
+      return FALSE;
+
+  return TRUE;
+}
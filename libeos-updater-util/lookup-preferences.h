@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <libeos-updater-util/refcounted.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EOS_TYPE_LOOKUP_PREFERENCES eos_lookup_preferences_get_type ()
+EOS_DECLARE_REFCOUNTED (EosLookupPreferences, eos_lookup_preferences, EOS, LOOKUP_PREFERENCES)
+
+/* The most remote URLs remembered; the table is emptied when it is full. */
+#define EOS_LOOKUP_PREFERENCES_MAX 64
+
+EosLookupPreferences *eos_lookup_preferences_new (GTimeSpan retry_usecs);
+
+gsize eos_lookup_preferences_get (EosLookupPreferences *preferences,
+                                  const gchar *remote_url);
+
+void eos_lookup_preferences_set (EosLookupPreferences *preferences,
+                                 const gchar *remote_url,
+                                 gsize method);
+
+void eos_lookup_preferences_update (EosLookupPreferences *preferences,
+                                    const gchar *remote_url,
+                                    gsize preferred,
+                                    gsize answer_method,
+                                    const gboolean *missing);
+
+gboolean eos_lookup_preferences_answer_is_final (gsize preferred,
+                                                 gsize answer_method,
+                                                 const gsize *methods,
+                                                 const gboolean *running,
+                                                 gsize n_started);
+
+G_END_DECLS
@@ -0,0 +1,285 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <libeos-updater-util/pack.h>
+
+#include <gio/gio.h>
+#include <string.h>
+
+/* Serialised frame header layout, with integers in big endian:
+ *
+ *   0  4 bytes  magic, "EPK1"
+ *   4  1 byte   status (EosPackFrameStatus)
+ *   5  1 byte   object type (OstreeObjectType)
+ *   6  2 bytes  reserved, zero
+ *   8 32 bytes  binary SHA-256 checksum
+ *  40  8 bytes  payload length
+ */
+#define FRAME_MAGIC "EPK1"
+#define FRAME_MAGIC_LEN 4
+#define FRAME_STATUS_OFFSET 4
+#define FRAME_TYPE_OFFSET 5
+#define FRAME_CHECKSUM_OFFSET 8
+#define FRAME_LENGTH_OFFSET 40
+
+G_STATIC_ASSERT (FRAME_LENGTH_OFFSET + 8 == EOS_PACK_FRAME_HEADER_SIZE);
+
+/* Object types which can be packed, with the extensions they are named by. */
+static const struct
+{
+  const gchar *extension;
+  OstreeObjectType object_type;
+}
+packable_types[] =
+  {
+    { "commit", OSTREE_OBJECT_TYPE_COMMIT },
+    { "dirtree", OSTREE_OBJECT_TYPE_DIR_TREE },
+    { "dirmeta", OSTREE_OBJECT_TYPE_DIR_META },
+    { "file", OSTREE_OBJECT_TYPE_FILE },
+  };
+
+static gboolean
+object_type_is_packable (OstreeObjectType object_type)
+{
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (packable_types); i++)
+    if (packable_types[i].object_type == object_type)
+      return TRUE;
+
+  return FALSE;
+}
+
+/**
+ * eos_pack_object_name_parse:
+ * @object_name: an object name, like `$checksum.dirtree`
+ * @out_checksum: (out) (transfer full): return location for the checksum
+ * @out_object_type: (out): return location for the object type
+ * @error: return location for a #GError
+ *
+ * Parses an object name as listed in a pack request. Only commit, dirtree,
+ * dirmeta and file objects can be packed.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ */
+gboolean
+eos_pack_object_name_parse (const gchar *object_name,
+                            gchar **out_checksum,
+                            OstreeObjectType *out_object_type,
+                            GError **error)
+{
+  const gchar *dot;
+  g_autofree gchar *checksum = NULL;
+  gsize i;
+
+  g_return_val_if_fail (object_name != NULL, FALSE);
+  g_return_val_if_fail (out_checksum != NULL, FALSE);
+  g_return_val_if_fail (out_object_type != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  dot = strchr (object_name, '.');
+  if (dot == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Invalid object name ‘%s’", object_name);
+      return FALSE;
+    }
+
+  checksum = g_strndup (object_name, dot - object_name);
+  if (!ostree_validate_checksum_string (checksum, NULL))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Invalid checksum in object name ‘%s’", object_name);
+      return FALSE;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (packable_types); i++)
+    {
+      if (g_str_equal (dot + 1, packable_types[i].extension))
+        {
+          *out_checksum = g_steal_pointer (&checksum);
+          *out_object_type = packable_types[i].object_type;
+          return TRUE;
+        }
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Object ‘%s’ has a type which cannot be packed", object_name);
+  return FALSE;
+}
+
+/**
+ * eos_pack_request_new:
+ * @object_names: (array zero-terminated=1): names of the objects to request,
+ *    like `$checksum.dirtree`
+ *
+ * Builds the body of a request for a pack of @object_names: the names, each
+ * followed by a newline.
+ *
+ * Returns: (transfer full): the request body
+ */
+GBytes *
+eos_pack_request_new (const gchar * const *object_names)
+{
+  GString *body = g_string_new (NULL);
+  gsize i;
+
+  g_return_val_if_fail (object_names != NULL, NULL);
+
+  for (i = 0; object_names[i] != NULL; i++)
+    {
+      g_string_append (body, object_names[i]);
+      g_string_append_c (body, '\n');
+    }
+
+  return g_string_free_to_bytes (body);
+}
+
+/**
+ * eos_pack_request_parse:
+ * @data: (array length=len): the request body
+ * @len: length of @data
+ * @error: return location for a #GError
+ *
+ * Parses the body of a pack request, validating every object name in it.
+ * Empty lines are ignored. At most %EOS_PACK_MAX_OBJECTS objects may be
+ * requested at once.
+ *
+ * Returns: (transfer full) (element-type utf8): the requested object names,
+ *    or %NULL on error
+ */
+GPtrArray *
+eos_pack_request_parse (gconstpointer data,
+                        gsize len,
+                        GError **error)
+{
+  g_autoptr(GPtrArray) object_names = g_ptr_array_new_with_free_func (g_free);
+  const gchar *line = data;
+  const gchar *end = line + len;
+
+  g_return_val_if_fail (data != NULL || len == 0, NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  while (line < end)
+    {
+      const gchar *newline = memchr (line, '\n', end - line);
+      const gchar *line_end = (newline != NULL) ? newline : end;
+      g_autofree gchar *object_name = g_strndup (line, line_end - line);
+      g_autofree gchar *checksum = NULL;
+      OstreeObjectType object_type;
+
+      line = line_end + 1;
+
+      if (*object_name == '\0')
+        continue;
+
+      if (object_names->len == EOS_PACK_MAX_OBJECTS)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                       "Too many objects requested; at most %u are allowed",
+                       (guint) EOS_PACK_MAX_OBJECTS);
+          return NULL;
+        }
+
+      if (!eos_pack_object_name_parse (object_name, &checksum, &object_type,
+                                       error))
+        return NULL;
+
+      g_ptr_array_add (object_names, g_steal_pointer (&object_name));
+    }
+
+  return g_steal_pointer (&object_names);
+}
+
+/**
+ * eos_pack_frame_header_serialize:
+ * @header: the header to serialise
+ * @out_data: (out caller-allocates) (array fixed-size=48): return location
+ *    for %EOS_PACK_FRAME_HEADER_SIZE bytes
+ *
+ * Serialises @header as it is sent in a pack.
+ */
+void
+eos_pack_frame_header_serialize (const EosPackFrameHeader *header,
+                                 guint8 *out_data)
+{
+  g_autofree guchar *checksum = NULL;
+  guint64 length_be;
+
+  g_return_if_fail (header != NULL);
+  g_return_if_fail (out_data != NULL);
+  g_return_if_fail (object_type_is_packable (header->object_type));
+
+  checksum = ostree_checksum_to_bytes (header->checksum);
+  length_be = GUINT64_TO_BE (header->length);
+
+  memset (out_data, 0, EOS_PACK_FRAME_HEADER_SIZE);
+  memcpy (out_data, FRAME_MAGIC, FRAME_MAGIC_LEN);
+  out_data[FRAME_STATUS_OFFSET] = header->status;
+  out_data[FRAME_TYPE_OFFSET] = header->object_type;
+  memcpy (out_data + FRAME_CHECKSUM_OFFSET, checksum, 32);
+  memcpy (out_data + FRAME_LENGTH_OFFSET, &length_be, sizeof (length_be));
+}
+
+/**
+ * eos_pack_frame_header_parse:
+ * @data: (array fixed-size=48): %EOS_PACK_FRAME_HEADER_SIZE bytes from a pack
+ * @out_header: (out caller-allocates): return location for the header
+ * @error: return location for a #GError
+ *
+ * Parses a frame header from a pack.
+ *
+ * Returns: %TRUE on success, %FALSE if @data is not a valid header
+ */
+gboolean
+eos_pack_frame_header_parse (const guint8 *data,
+                             EosPackFrameHeader *out_header,
+                             GError **error)
+{
+  guint8 status;
+  guint8 object_type;
+  guint64 length_be;
+
+  g_return_val_if_fail (data != NULL, FALSE);
+  g_return_val_if_fail (out_header != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  status = data[FRAME_STATUS_OFFSET];
+  object_type = data[FRAME_TYPE_OFFSET];
+  memcpy (&length_be, data + FRAME_LENGTH_OFFSET, sizeof (length_be));
+
+  if (memcmp (data, FRAME_MAGIC, FRAME_MAGIC_LEN) != 0 ||
+      status > EOS_PACK_FRAME_STATUS_SKIPPED ||
+      !object_type_is_packable (object_type) ||
+      (status != EOS_PACK_FRAME_STATUS_PRESENT && length_be != 0))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "Invalid pack frame header");
+      return FALSE;
+    }
+
+  out_header->status = status;
+  out_header->object_type = object_type;
+  ostree_checksum_inplace_from_bytes (data + FRAME_CHECKSUM_OFFSET,
+                                      out_header->checksum);
+  out_header->length = GUINT64_FROM_BE (length_be);
+
+  return TRUE;
+}
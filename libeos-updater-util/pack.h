@@ -0,0 +1,84 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+/* Path and content type of the pack endpoint of the update server. A client
+ * POSTs a request listing objects (see eos_pack_request_new()), and the
+ * server replies with a pack: one frame per requested object, in order. Each
+ * frame is an #EosPackFrameHeader in its serialised form followed by
+ * #EosPackFrameHeader.length bytes of payload: the object file as it would be
+ * served for an archive-z2 repository (so file objects are .filez). */
+#define EOS_PACK_PATH "/objects/pack"
+#define EOS_PACK_CONTENT_TYPE "application/x-eos-updater-pack"
+
+/* The most objects a single pack request may list. */
+#define EOS_PACK_MAX_OBJECTS 1024
+
+#define EOS_PACK_FRAME_HEADER_SIZE 48
+
+typedef enum
+{
+  EOS_PACK_FRAME_STATUS_PRESENT = 0,
+  EOS_PACK_FRAME_STATUS_MISSING = 1,
+  EOS_PACK_FRAME_STATUS_SKIPPED = 2,
+} EosPackFrameStatus;
+
+/**
+ * EosPackFrameHeader:
+ * @status: whether the object follows; the payload is empty if the object is
+ *    missing on the server, or was skipped because it is too big to be worth
+ *    packing (the client should fetch it on its own)
+ * @object_type: type of the object
+ * @checksum: checksum of the object, as a hex string
+ * @length: length of the payload, in bytes
+ */
+typedef struct
+{
+  EosPackFrameStatus status;
+  OstreeObjectType object_type;
+  gchar checksum[65];  /* hex SHA-256, nul-terminated */
+  guint64 length;
+} EosPackFrameHeader;
+
+GBytes *eos_pack_request_new (const gchar * const *object_names);
+
+GPtrArray *eos_pack_request_parse (gconstpointer data,
+                                   gsize len,
+                                   GError **error);
+
+gboolean eos_pack_object_name_parse (const gchar *object_name,
+                                     gchar **out_checksum,
+                                     OstreeObjectType *out_object_type,
+                                     GError **error);
+
+void eos_pack_frame_header_serialize (const EosPackFrameHeader *header,
+                                      guint8 *out_data);
+
+gboolean eos_pack_frame_header_parse (const guint8 *data,
+                                      EosPackFrameHeader *out_header,
+                                      GError **error);
+
+G_END_DECLS
@@ -0,0 +1,187 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <libeos-updater-util/pack.h>
+#include <libeos-updater-util/repo-path.h>
+
+#include <string.h>
+
+/* This is called for every request the update server gets, so it does not
+ * allocate, and looks at each character of the path at most a couple of
+ * times. */
+
+#define CHECKSUM_LEN 64
+
+/* Object file name suffixes which are served, and how. */
+static const struct
+{
+  const gchar *suffix;
+  EosRepoPathKind kind;
+} object_suffixes[] =
+  {
+    { ".filez", EOS_REPO_PATH_OBJECT_FILEZ },
+    { ".dirtree", EOS_REPO_PATH_OBJECT },
+    { ".dirmeta", EOS_REPO_PATH_OBJECT },
+    { ".commit", EOS_REPO_PATH_OBJECT },
+    { ".commitmeta", EOS_REPO_PATH_OBJECT },
+    { ".sig", EOS_REPO_PATH_OBJECT },
+    { ".sizes2", EOS_REPO_PATH_OBJECT },
+  };
+
+/* Like g_str_has_prefix(), but for a literal @prefix, whose length is known at
+ * compile time. */
+#define HAS_PREFIX(str, prefix) (strncmp ((str), (prefix), sizeof (prefix) - 1) == 0)
+
+/* OSTree checksums are lower case. */
+static inline gboolean
+is_lower_xdigit (gchar c)
+{
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+}
+
+static gboolean
+is_lower_xdigits (const gchar *str,
+                  gsize len)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    if (!is_lower_xdigit (str[i]))
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Parses @rest, the part of an object path after `/objects/`, which should be
+ * `XX/YYYY….suffix`. */
+static EosRepoPathKind
+parse_object_path (const gchar *rest,
+                   EosRepoPath *out_path)
+{
+  const gchar *suffix;
+  gsize i;
+
+  /* The checks are ordered so that nothing is read past the nul terminator of
+   * a short path. */
+  if (!is_lower_xdigits (rest, 2) ||
+      rest[2] != '/' ||
+      !is_lower_xdigits (rest + 3, CHECKSUM_LEN - 2))
+    return EOS_REPO_PATH_NOT_FOUND;
+
+  suffix = rest + 3 + CHECKSUM_LEN - 2;
+  for (i = 0; i < G_N_ELEMENTS (object_suffixes); i++)
+    {
+      if (strcmp (suffix, object_suffixes[i].suffix) == 0)
+        {
+          memcpy (out_path->checksum, rest, 2);
+          memcpy (out_path->checksum + 2, rest + 3, CHECKSUM_LEN - 2);
+          out_path->checksum[CHECKSUM_LEN] = '\0';
+          out_path->suffix = suffix;
+
+          return object_suffixes[i].kind;
+        }
+    }
+
+  return EOS_REPO_PATH_NOT_FOUND;
+}
+
+/**
+ * eos_repo_path_parse:
+ * @path: path of a request to the update server, like `/objects/…`
+ * @out_path: (out caller-allocates): return location for the parsed path
+ *
+ * Works out what @path points to, without allocating. Paths containing `..`
+ * are %EOS_REPO_PATH_FORBIDDEN; paths which are not served at all are
+ * %EOS_REPO_PATH_NOT_FOUND. The fields of @out_path which are not relevant to
+ * the kind of path are cleared.
+ *
+ * Returns: the kind of path, also stored in @out_path
+ */
+EosRepoPathKind
+eos_repo_path_parse (const gchar *path,
+                     EosRepoPath *out_path)
+{
+  EosRepoPathKind kind = EOS_REPO_PATH_NOT_FOUND;
+
+  g_return_val_if_fail (path != NULL, EOS_REPO_PATH_NOT_FOUND);
+  g_return_val_if_fail (out_path != NULL, EOS_REPO_PATH_NOT_FOUND);
+
+  out_path->checksum[0] = '\0';
+  out_path->suffix = NULL;
+  out_path->tail = NULL;
+
+  if (strstr (path, "..") != NULL)
+    kind = EOS_REPO_PATH_FORBIDDEN;
+  else if (path[0] != '/')
+    kind = EOS_REPO_PATH_NOT_FOUND;
+  else
+    {
+      /* Dispatch on the first character of the first component, so each path
+       * is compared with at most a couple of prefixes. */
+      switch (path[1])
+        {
+        case 'o':
+          if (strcmp (path, EOS_PACK_PATH) == 0)
+            kind = EOS_REPO_PATH_OBJECTS_PACK;
+          else if (HAS_PREFIX (path, "/objects/"))
+            kind = parse_object_path (path + strlen ("/objects/"), out_path);
+          break;
+        case 'd':
+          if (HAS_PREFIX (path, "/deltas/"))
+            {
+              kind = EOS_REPO_PATH_DELTA;
+              out_path->tail = path + strlen ("/deltas/");
+            }
+          break;
+        case 'r':
+          if (HAS_PREFIX (path, "/refs/heads/"))
+            {
+              kind = EOS_REPO_PATH_REFS_HEADS;
+              out_path->tail = path + strlen ("/refs/heads/");
+            }
+          break;
+        case 's':
+          if (strcmp (path, "/summary") == 0 ||
+              strcmp (path, "/summary.sig") == 0)
+            kind = EOS_REPO_PATH_SUMMARY;
+          break;
+        case 'c':
+          if (strcmp (path, "/config") == 0)
+            kind = EOS_REPO_PATH_CONFIG;
+          break;
+        case 'm':
+          if (strcmp (path, "/metrics") == 0)
+            kind = EOS_REPO_PATH_METRICS;
+          break;
+        case 'e':
+          if (HAS_PREFIX (path, "/extensions/"))
+            {
+              kind = EOS_REPO_PATH_EXTENSION;
+              out_path->tail = path + strlen ("/extensions/");
+            }
+          break;
+        default:
+          break;
+        }
+    }
+
+  out_path->kind = kind;
+  return kind;
+}
@@ -0,0 +1,84 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EosRepoPathKind:
+ * @EOS_REPO_PATH_NOT_FOUND: not a path the update server serves
+ * @EOS_REPO_PATH_FORBIDDEN: a path trying to escape the repository
+ * @EOS_REPO_PATH_CONFIG: `/config`
+ * @EOS_REPO_PATH_SUMMARY: `/summary` or `/summary.sig`
+ * @EOS_REPO_PATH_OBJECTS_PACK: the pack endpoint, `/objects/pack`
+ * @EOS_REPO_PATH_OBJECT_FILEZ: a file object in archive-z2 form,
+ *    `/objects/XX/YYYY….filez`
+ * @EOS_REPO_PATH_OBJECT: a metadata object or object signature, served as it
+ *    is in the repository, like `/objects/XX/YYYY….dirtree`
+ * @EOS_REPO_PATH_DELTA: anything under `/deltas/`
+ * @EOS_REPO_PATH_EXTENSION: anything under `/extensions/`
+ * @EOS_REPO_PATH_REFS_HEADS: anything under `/refs/heads/`
+ * @EOS_REPO_PATH_METRICS: `/metrics`, the server’s monitoring metrics
+ *
+ * The kinds of path an update server is asked for.
+ */
+typedef enum
+{
+  EOS_REPO_PATH_NOT_FOUND = 0,
+  EOS_REPO_PATH_FORBIDDEN,
+  EOS_REPO_PATH_CONFIG,
+  EOS_REPO_PATH_SUMMARY,
+  EOS_REPO_PATH_OBJECTS_PACK,
+  EOS_REPO_PATH_OBJECT_FILEZ,
+  EOS_REPO_PATH_OBJECT,
+  EOS_REPO_PATH_DELTA,
+  EOS_REPO_PATH_EXTENSION,
+  EOS_REPO_PATH_REFS_HEADS,
+  EOS_REPO_PATH_METRICS,
+} EosRepoPathKind;
+
+/**
+ * EosRepoPath:
+ * @kind: what the path points to
+ * @checksum: for object paths, the object checksum (without the `/` after
+ *    the first two characters); otherwise empty
+ * @suffix: for object paths, the suffix of the object file name, like
+ *    `.dirtree`; otherwise %NULL
+ * @tail: for paths under `/deltas/`, `/extensions/` and `/refs/heads/`, the
+ *    part of the path after that prefix (possibly empty); otherwise %NULL
+ *
+ * A parsed request path. @suffix and @tail point into the parsed path, so are
+ * only valid as long as it is.
+ */
+typedef struct
+{
+  EosRepoPathKind kind;
+  gchar checksum[65];  /* hex SHA-256, nul-terminated */
+  const gchar *suffix;
+  const gchar *tail;
+} EosRepoPath;
+
+EosRepoPathKind eos_repo_path_parse (const gchar *path,
+                                     EosRepoPath *out_path);
+
+G_END_DECLS
@@ -0,0 +1,295 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-updater-util/download-cache.h>
+#include <locale.h>
+#include <string.h>
+
+#define SUMMARY_URL "http://example.com/ostree/summary"
+#define SUMMARY_SIG_URL "http://example.com/ostree/summary.sig"
+
+typedef struct
+{
+  gchar *tmp_dir;
+  GFile *cache_directory;  /* inside @tmp_dir, not created by setup() */
+} Fixture;
+
+/* Set up a temporary directory to keep the cache in. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *cache_path = NULL;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-updater-util-tests-download-cache-XXXXXX",
+                                     &error);
+  g_assert_no_error (error);
+
+  cache_path = g_build_filename (fixture->tmp_dir, "cache", "summaries", NULL);
+  fixture->cache_directory = g_file_new_for_path (cache_path);
+}
+
+static void
+remove_recursively (const gchar *path)
+{
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir != NULL)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          g_autofree gchar *child = g_build_filename (path, name, NULL);
+
+          remove_recursively (child);
+        }
+    }
+
+  g_assert_cmpint (g_remove (path), ==, 0);
+}
+
+/* Inverse of setup(). */
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  remove_recursively (fixture->tmp_dir);
+
+  g_clear_object (&fixture->cache_directory);
+  g_free (fixture->tmp_dir);
+}
+
+/* Assert that the download cached in @cache_file has the given contents and
+ * validators. */
+static void
+assert_cached (GFile       *cache_file,
+               const gchar *expected_contents,
+               const gchar *expected_etag,
+               const gchar *expected_last_modified)
+{
+  g_autoptr(GBytes) contents = NULL;
+  g_autofree gchar *etag = NULL;
+  g_autofree gchar *last_modified = NULL;
+  gconstpointer data;
+  gsize len;
+
+  g_assert_true (eos_download_cache_load (cache_file, &contents, &etag,
+                                          &last_modified));
+
+  data = g_bytes_get_data (contents, &len);
+  g_assert_cmpuint (len, ==, strlen (expected_contents));
+  g_assert_cmpint (memcmp (data, expected_contents, len), ==, 0);
+  g_assert_cmpstr (etag, ==, expected_etag);
+  g_assert_cmpstr (last_modified, ==, expected_last_modified);
+}
+
+static void
+assert_not_cached (GFile *cache_file)
+{
+  g_autoptr(GBytes) contents = NULL;
+  g_autofree gchar *etag = NULL;
+  g_autofree gchar *last_modified = NULL;
+
+  g_assert_false (eos_download_cache_load (cache_file, &contents, &etag,
+                                           &last_modified));
+  g_assert_null (contents);
+  g_assert_null (etag);
+  g_assert_null (last_modified);
+}
+
+static void
+save (GFile       *cache_file,
+      const gchar *etag,
+      const gchar *last_modified,
+      const gchar *contents)
+{
+  g_autoptr(GBytes) bytes = g_bytes_new (contents, strlen (contents));
+
+  eos_download_cache_save (cache_file, etag, last_modified, bytes);
+}
+
+/* Test that each URL gets its own cache file in the cache directory. */
+static void
+test_download_cache_file_names (Fixture       *fixture,
+                                gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GFile) summary_file = NULL;
+  g_autoptr(GFile) summary_file2 = NULL;
+  g_autoptr(GFile) sig_file = NULL;
+  g_autoptr(GFile) parent = NULL;
+
+  summary_file = eos_download_cache_get_file (fixture->cache_directory, SUMMARY_URL);
+  summary_file2 = eos_download_cache_get_file (fixture->cache_directory, SUMMARY_URL);
+  sig_file = eos_download_cache_get_file (fixture->cache_directory, SUMMARY_SIG_URL);
+
+  g_assert_true (g_file_equal (summary_file, summary_file2));
+  g_assert_false (g_file_equal (summary_file, sig_file));
+
+  parent = g_file_get_parent (summary_file);
+  g_assert_true (g_file_equal (parent, fixture->cache_directory));
+}
+
+/* Test that a saved download is loaded back with its validators, and that
+ * the cache directory is created as needed. */
+static void
+test_download_cache_round_trip (Fixture       *fixture,
+                                gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const struct
+    {
+      const gchar *etag;
+      const gchar *last_modified;
+      const gchar *expected_etag;
+      const gchar *expected_last_modified;
+    }
+  vectors[] =
+    {
+      { "\"abc\"", "Tue, 15 Nov 1994 08:12:31 GMT", "\"abc\"", "Tue, 15 Nov 1994 08:12:31 GMT" },
+      { "W/\"abc\"", NULL, "W/\"abc\"", "" },
+      { NULL, "Tue, 15 Nov 1994 08:12:31 GMT", "", "Tue, 15 Nov 1994 08:12:31 GMT" },
+    };
+  g_autoptr(GFile) cache_file = NULL;
+  gsize i;
+
+  cache_file = eos_download_cache_get_file (fixture->cache_directory, SUMMARY_URL);
+  assert_not_cached (cache_file);
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autofree gchar *contents = g_strdup_printf ("summary %" G_GSIZE_FORMAT, i);
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT, i);
+
+      save (cache_file, vectors[i].etag, vectors[i].last_modified, contents);
+      assert_cached (cache_file, contents,
+                     vectors[i].expected_etag, vectors[i].expected_last_modified);
+    }
+
+  /* Empty files are cached too. */
+  save (cache_file, "\"empty\"", NULL, "");
+  assert_cached (cache_file, "", "\"empty\"", "");
+}
+
+/* Test that a download without validators is not cached, since it could
+ * never be revalidated, and that it replaces any older copy. */
+static void
+test_download_cache_no_validators (Fixture       *fixture,
+                                   gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GFile) cache_file = NULL;
+
+  cache_file = eos_download_cache_get_file (fixture->cache_directory, SUMMARY_URL);
+
+  save (cache_file, NULL, NULL, "summary 1");
+  assert_not_cached (cache_file);
+  g_assert_false (g_file_query_exists (cache_file, NULL));
+
+  save (cache_file, "\"1\"", NULL, "summary 1");
+  assert_cached (cache_file, "summary 1", "\"1\"", "");
+
+  save (cache_file, NULL, NULL, "summary 2");
+  assert_not_cached (cache_file);
+  g_assert_false (g_file_query_exists (cache_file, NULL));
+}
+
+/* Test that a corrupt cache file is treated as a missing one. */
+static void
+test_download_cache_corrupt (Fixture       *fixture,
+                             gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *vectors[] =
+    {
+      "",
+      "not a variant",
+      "\xff\xff\xff\xff\xff\xff\xff\xff",
+    };
+  g_autoptr(GFile) cache_file = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize i;
+
+  cache_file = eos_download_cache_get_file (fixture->cache_directory, SUMMARY_URL);
+
+  g_file_make_directory_with_parents (fixture->cache_directory, NULL, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_test_message ("Vector %" G_GSIZE_FORMAT, i);
+
+      g_file_replace_contents (cache_file, vectors[i], strlen (vectors[i]),
+                               NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL,
+                               &error);
+      g_assert_no_error (error);
+
+      assert_not_cached (cache_file);
+    }
+}
+
+/* Test that removing a cached download only removes that one, and that
+ * removing one which is not cached does nothing. */
+static void
+test_download_cache_remove (Fixture       *fixture,
+                            gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GFile) summary_file = NULL;
+  g_autoptr(GFile) sig_file = NULL;
+
+  summary_file = eos_download_cache_get_file (fixture->cache_directory, SUMMARY_URL);
+  sig_file = eos_download_cache_get_file (fixture->cache_directory, SUMMARY_SIG_URL);
+
+  eos_download_cache_remove (fixture->cache_directory, SUMMARY_URL);
+
+  save (summary_file, "\"1\"", NULL, "summary");
+  save (sig_file, "\"2\"", NULL, "signature");
+
+  eos_download_cache_remove (fixture->cache_directory, SUMMARY_URL);
+  assert_not_cached (summary_file);
+  assert_cached (sig_file, "signature", "\"2\"", "");
+
+  eos_download_cache_remove (fixture->cache_directory, SUMMARY_SIG_URL);
+  assert_not_cached (sig_file);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/download-cache/file-names", Fixture, NULL, setup,
+              test_download_cache_file_names, teardown);
+  g_test_add ("/download-cache/round-trip", Fixture, NULL, setup,
+              test_download_cache_round_trip, teardown);
+  g_test_add ("/download-cache/no-validators", Fixture, NULL, setup,
+              test_download_cache_no_validators, teardown);
+  g_test_add ("/download-cache/corrupt", Fixture, NULL, setup,
+              test_download_cache_corrupt, teardown);
+  g_test_add ("/download-cache/remove", Fixture, NULL, setup,
+              test_download_cache_remove, teardown);
+
+  return g_test_run ();
+}
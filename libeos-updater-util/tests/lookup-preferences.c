@@ -0,0 +1,241 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+#include <libeos-updater-util/lookup-preferences.h>
+#include <locale.h>
+
+#define REMOTE_URL "http://example.com/ostree"
+#define OTHER_REMOTE_URL "http://example.org/ostree"
+
+/* The poller’s methods: extensions ref file, eos-summary, and summary. */
+#define N_METHODS 3
+
+/* Test that preferences are remembered per URL, and forgotten by setting
+ * method 0. */
+static void
+test_lookup_preferences_get_set (void)
+{
+  g_autoptr(EosLookupPreferences) preferences = eos_lookup_preferences_new (G_TIME_SPAN_HOUR);
+
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL), ==, 0);
+
+  eos_lookup_preferences_set (preferences, REMOTE_URL, 2);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL), ==, 2);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, OTHER_REMOTE_URL), ==, 0);
+
+  eos_lookup_preferences_set (preferences, REMOTE_URL, 1);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL), ==, 1);
+
+  eos_lookup_preferences_set (preferences, REMOTE_URL, 0);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL), ==, 0);
+}
+
+/* Test that the skipped methods are tried again once the retry time has
+ * passed. */
+static void
+test_lookup_preferences_retry (void)
+{
+  g_autoptr(EosLookupPreferences) preferences = NULL;
+  g_autoptr(EosLookupPreferences) no_retry_preferences = NULL;
+
+  preferences = eos_lookup_preferences_new (200 * G_TIME_SPAN_MILLISECOND);
+
+  eos_lookup_preferences_set (preferences, REMOTE_URL, 2);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL), ==, 2);
+
+  g_usleep (300 * G_TIME_SPAN_MILLISECOND);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL), ==, 0);
+
+  no_retry_preferences = eos_lookup_preferences_new (0);
+  eos_lookup_preferences_set (no_retry_preferences, REMOTE_URL, 2);
+  g_assert_cmpuint (eos_lookup_preferences_get (no_retry_preferences, REMOTE_URL), ==, 0);
+}
+
+/* Test that the table is emptied once it is full, but not when an existing
+ * preference is replaced. */
+static void
+test_lookup_preferences_limit (void)
+{
+  g_autoptr(EosLookupPreferences) preferences = eos_lookup_preferences_new (G_TIME_SPAN_HOUR);
+  gsize i;
+
+  for (i = 0; i < EOS_LOOKUP_PREFERENCES_MAX; i++)
+    {
+      g_autofree gchar *url = g_strdup_printf ("http://192.0.2.%" G_GSIZE_FORMAT ":43381", i);
+
+      eos_lookup_preferences_set (preferences, url, 2);
+    }
+
+  eos_lookup_preferences_set (preferences, "http://192.0.2.0:43381", 1);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, "http://192.0.2.0:43381"), ==, 1);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, "http://192.0.2.1:43381"), ==, 2);
+
+  eos_lookup_preferences_set (preferences, REMOTE_URL, 2);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL), ==, 2);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, "http://192.0.2.0:43381"), ==, 0);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, "http://192.0.2.1:43381"), ==, 0);
+}
+
+/* Test which method is preferred next time, given which was preferred this
+ * time, which one answered, and which were found missing. */
+static void
+test_lookup_preferences_update (void)
+{
+  const struct
+    {
+      gsize preferred;
+      gsize answer_method;
+      gboolean missing[N_METHODS];
+      gsize expected_preferred;
+    }
+  vectors[] =
+    {
+      /* The first method works. */
+      { 0, 0, { FALSE, FALSE, FALSE }, 0 },
+
+      /* A plain OSTree remote: skip straight to the summary. */
+      { 0, 2, { TRUE, TRUE, FALSE }, 2 },
+
+      /* Only a missing file counts: a method which failed for another reason
+       * is tried first next time. */
+      { 0, 2, { FALSE, FALSE, FALSE }, 0 },
+      { 0, 2, { TRUE, FALSE, FALSE }, 1 },
+      { 0, 1, { TRUE, FALSE, FALSE }, 1 },
+
+      /* Methods skipped because of the preference stay skipped. */
+      { 2, 2, { FALSE, FALSE, FALSE }, 2 },
+      { 1, 2, { FALSE, TRUE, FALSE }, 2 },
+
+      /* A skipped method which started working, when racing, is preferred
+       * again. */
+      { 2, 0, { FALSE, FALSE, FALSE }, 0 },
+      { 2, 1, { TRUE, FALSE, FALSE }, 1 },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(EosLookupPreferences) preferences = eos_lookup_preferences_new (G_TIME_SPAN_HOUR);
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT ": preferred %" G_GSIZE_FORMAT
+                      ", answer from %" G_GSIZE_FORMAT,
+                      i, vectors[i].preferred, vectors[i].answer_method);
+
+      eos_lookup_preferences_set (preferences, REMOTE_URL, vectors[i].preferred);
+      g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL),
+                        ==, vectors[i].preferred);
+
+      eos_lookup_preferences_update (preferences, REMOTE_URL,
+                                     vectors[i].preferred,
+                                     vectors[i].answer_method,
+                                     vectors[i].missing);
+      g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL),
+                        ==, vectors[i].expected_preferred);
+    }
+}
+
+/* Test that confirming a preference does not put off retrying the methods
+ * it skips, while changing it does. */
+static void
+test_lookup_preferences_update_retry (void)
+{
+  g_autoptr(EosLookupPreferences) preferences = NULL;
+  const gboolean missing[N_METHODS] = { TRUE, TRUE, FALSE };
+
+  preferences = eos_lookup_preferences_new (300 * G_TIME_SPAN_MILLISECOND);
+
+  eos_lookup_preferences_set (preferences, REMOTE_URL, 2);
+  g_usleep (200 * G_TIME_SPAN_MILLISECOND);
+
+  eos_lookup_preferences_update (preferences, REMOTE_URL, 2, 2, missing);
+  g_usleep (200 * G_TIME_SPAN_MILLISECOND);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL), ==, 0);
+
+  /* The retry found the earlier methods still missing. */
+  eos_lookup_preferences_update (preferences, REMOTE_URL, 0, 2, missing);
+  g_assert_cmpuint (eos_lookup_preferences_get (preferences, REMOTE_URL), ==, 2);
+}
+
+/* Test when the answer from a method is final: only once no earlier method
+ * which was not skipped is still running. */
+static void
+test_lookup_preferences_answer_is_final (void)
+{
+  const struct
+    {
+      gsize preferred;
+      gsize answer_method;
+      gsize methods[N_METHODS];
+      gboolean running[N_METHODS];
+      gsize n_started;
+      gboolean expected_final;
+    }
+  vectors[] =
+    {
+      /* One at a time. */
+      { 0, 0, { 0, 0, 0 }, { FALSE, FALSE, FALSE }, 1, TRUE },
+      { 0, 1, { 0, 1, 0 }, { FALSE, FALSE, FALSE }, 2, TRUE },
+      { 2, 2, { 2, 0, 0 }, { FALSE, FALSE, FALSE }, 1, TRUE },
+
+      /* Racing: a later method answered first. */
+      { 0, 1, { 0, 1, 2 }, { TRUE, FALSE, TRUE }, 3, FALSE },
+      { 0, 2, { 0, 1, 2 }, { FALSE, TRUE, FALSE }, 3, FALSE },
+      { 0, 1, { 0, 1, 2 }, { FALSE, FALSE, TRUE }, 3, TRUE },
+      { 1, 2, { 1, 0, 2 }, { TRUE, FALSE, FALSE }, 3, FALSE },
+
+      /* Racing: methods skipped because of the preference are not waited
+       * for. */
+      { 2, 2, { 2, 0, 1 }, { FALSE, TRUE, TRUE }, 3, TRUE },
+      { 1, 1, { 1, 0, 2 }, { FALSE, TRUE, TRUE }, 3, TRUE },
+      { 1, 2, { 1, 0, 2 }, { FALSE, TRUE, FALSE }, 3, TRUE },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_test_message ("Vector %" G_GSIZE_FORMAT, i);
+
+      g_assert_cmpint (eos_lookup_preferences_answer_is_final (vectors[i].preferred,
+                                                               vectors[i].answer_method,
+                                                               vectors[i].methods,
+                                                               vectors[i].running,
+                                                               vectors[i].n_started),
+                       ==, vectors[i].expected_final);
+    }
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/lookup-preferences/get-set", test_lookup_preferences_get_set);
+  g_test_add_func ("/lookup-preferences/retry", test_lookup_preferences_retry);
+  g_test_add_func ("/lookup-preferences/limit", test_lookup_preferences_limit);
+  g_test_add_func ("/lookup-preferences/update", test_lookup_preferences_update);
+  g_test_add_func ("/lookup-preferences/update-retry", test_lookup_preferences_update_retry);
+  g_test_add_func ("/lookup-preferences/answer-is-final", test_lookup_preferences_answer_is_final);
+
+  return g_test_run ();
+}
@@ -0,0 +1,204 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-updater-util/pack.h>
+#include <locale.h>
+#include <ostree.h>
+#include <string.h>
+
+#define CHECKSUM1 "3a1e0a3ad2e24a5f4c45cc4fc54f2b26a8a1c5e6d3b5c9b8f3e0c1d2b4a69788"
+#define CHECKSUM2 "f0e1d2c3b4a5968778695a4b3c2d1e0ff0e1d2c3b4a5968778695a4b3c2d1e0f"
+
+/* Test that a request body can be built and parsed back. */
+static void
+test_pack_request_round_trip (void)
+{
+  const gchar * const object_names[] =
+    {
+      CHECKSUM1 ".dirtree",
+      CHECKSUM2 ".file",
+      CHECKSUM1 ".commit",
+      NULL
+    };
+  g_autoptr(GBytes) body = NULL;
+  g_autoptr(GPtrArray) parsed = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize i;
+
+  body = eos_pack_request_new (object_names);
+  parsed = eos_pack_request_parse (g_bytes_get_data (body, NULL),
+                                   g_bytes_get_size (body),
+                                   &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (parsed);
+  g_assert_cmpuint (parsed->len, ==, G_N_ELEMENTS (object_names) - 1);
+
+  for (i = 0; object_names[i] != NULL; i++)
+    g_assert_cmpstr (g_ptr_array_index (parsed, i), ==, object_names[i]);
+}
+
+/* Test that empty lines and a missing final newline are accepted. */
+static void
+test_pack_request_lenient (void)
+{
+  const gchar *body = "\n" CHECKSUM1 ".dirmeta\n\n" CHECKSUM2 ".dirtree";
+  g_autoptr(GPtrArray) parsed = NULL;
+  g_autoptr(GError) error = NULL;
+
+  parsed = eos_pack_request_parse (body, strlen (body), &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (parsed);
+  g_assert_cmpuint (parsed->len, ==, 2);
+  g_assert_cmpstr (g_ptr_array_index (parsed, 0), ==, CHECKSUM1 ".dirmeta");
+  g_assert_cmpstr (g_ptr_array_index (parsed, 1), ==, CHECKSUM2 ".dirtree");
+}
+
+/* Test that invalid object names are rejected. */
+static void
+test_pack_request_invalid (void)
+{
+  const gchar *vectors[] =
+    {
+      "not a checksum.dirtree\n",
+      CHECKSUM1 "\n",
+      CHECKSUM1 ".filez\n",
+      CHECKSUM1 ".commitmeta\n",
+      "../../" CHECKSUM1 ".file\n",
+      CHECKSUM1 ".dirtree\n" CHECKSUM2 ".\n",
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(GPtrArray) parsed = NULL;
+      g_autoptr(GError) error = NULL;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT ": %s", i, vectors[i]);
+
+      parsed = eos_pack_request_parse (vectors[i], strlen (vectors[i]), &error);
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+      g_assert_null (parsed);
+    }
+}
+
+/* Test that requests for too many objects are rejected. */
+static void
+test_pack_request_too_many (void)
+{
+  g_autoptr(GString) body = g_string_new (NULL);
+  g_autoptr(GPtrArray) parsed = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize i;
+
+  for (i = 0; i <= EOS_PACK_MAX_OBJECTS; i++)
+    g_string_append (body, CHECKSUM1 ".file\n");
+
+  parsed = eos_pack_request_parse (body->str, body->len, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE);
+  g_assert_null (parsed);
+}
+
+/* Test that frame headers survive serialisation, and that their fields end up
+ * in the documented places. */
+static void
+test_pack_frame_header_round_trip (void)
+{
+  const EosPackFrameHeader headers[] =
+    {
+      { EOS_PACK_FRAME_STATUS_PRESENT, OSTREE_OBJECT_TYPE_FILE, CHECKSUM1, G_GUINT64_CONSTANT (0x0102030405060708) },
+      { EOS_PACK_FRAME_STATUS_MISSING, OSTREE_OBJECT_TYPE_DIR_TREE, CHECKSUM2, 0 },
+      { EOS_PACK_FRAME_STATUS_SKIPPED, OSTREE_OBJECT_TYPE_FILE, CHECKSUM2, 0 },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (headers); i++)
+    {
+      guint8 data[EOS_PACK_FRAME_HEADER_SIZE];
+      EosPackFrameHeader parsed;
+      g_autoptr(GError) error = NULL;
+
+      eos_pack_frame_header_serialize (&headers[i], data);
+      g_assert_cmpint (memcmp (data, "EPK1", 4), ==, 0);
+
+      g_assert_true (eos_pack_frame_header_parse (data, &parsed, &error));
+      g_assert_no_error (error);
+      g_assert_cmpint (parsed.status, ==, headers[i].status);
+      g_assert_cmpint (parsed.object_type, ==, headers[i].object_type);
+      g_assert_cmpstr (parsed.checksum, ==, headers[i].checksum);
+      g_assert_cmpuint (parsed.length, ==, headers[i].length);
+    }
+
+  {
+    guint8 data[EOS_PACK_FRAME_HEADER_SIZE];
+
+    eos_pack_frame_header_serialize (&headers[0], data);
+    g_assert_cmpuint (data[40], ==, 0x01);
+    g_assert_cmpuint (data[47], ==, 0x08);
+  }
+}
+
+/* Test that corrupt frame headers are rejected. */
+static void
+test_pack_frame_header_invalid (void)
+{
+  const EosPackFrameHeader header =
+    { EOS_PACK_FRAME_STATUS_MISSING, OSTREE_OBJECT_TYPE_DIR_META, CHECKSUM1, 0 };
+  const gsize corrupt_offsets[] = { 0, 4, 5, 47 };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (corrupt_offsets); i++)
+    {
+      guint8 data[EOS_PACK_FRAME_HEADER_SIZE];
+      EosPackFrameHeader parsed;
+      g_autoptr(GError) error = NULL;
+
+      g_test_message ("Corrupting byte %" G_GSIZE_FORMAT, corrupt_offsets[i]);
+
+      /* A missing object must not have a payload, so corrupting the length
+       * is caught too. */
+      eos_pack_frame_header_serialize (&header, data);
+      data[corrupt_offsets[i]] = 0x7f;
+
+      g_assert_false (eos_pack_frame_header_parse (data, &parsed, &error));
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    }
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/pack/request/round-trip", test_pack_request_round_trip);
+  g_test_add_func ("/pack/request/lenient", test_pack_request_lenient);
+  g_test_add_func ("/pack/request/invalid", test_pack_request_invalid);
+  g_test_add_func ("/pack/request/too-many", test_pack_request_too_many);
+  g_test_add_func ("/pack/frame-header/round-trip",
+                   test_pack_frame_header_round_trip);
+  g_test_add_func ("/pack/frame-header/invalid",
+                   test_pack_frame_header_invalid);
+
+  return g_test_run ();
+}
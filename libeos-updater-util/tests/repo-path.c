@@ -0,0 +1,251 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+#include <libeos-updater-util/repo-path.h>
+#include <locale.h>
+#include <string.h>
+
+#define CHECKSUM "3a1e0a3ad2e24a5f4c45cc4fc54f2b26a8a1c5e6d3b5c9b8f3e0c1d2b4a69788"
+#define OBJECT_PATH(suffix) "/objects/3a/1e0a3ad2e24a5f4c45cc4fc54f2b26a8a1c5e6d3b5c9b8f3e0c1d2b4a69788" suffix
+
+/* Test that each kind of path is recognised, with the right fields set. */
+static void
+test_repo_path_parse (void)
+{
+  const struct
+    {
+      const gchar *path;
+      EosRepoPathKind expected_kind;
+      const gchar *expected_checksum;
+      const gchar *expected_suffix;
+      const gchar *expected_tail;
+    }
+  vectors[] =
+    {
+      { "/config", EOS_REPO_PATH_CONFIG, "", NULL, NULL },
+      { "/summary", EOS_REPO_PATH_SUMMARY, "", NULL, NULL },
+      { "/summary.sig", EOS_REPO_PATH_SUMMARY, "", NULL, NULL },
+      { "/objects/pack", EOS_REPO_PATH_OBJECTS_PACK, "", NULL, NULL },
+      { OBJECT_PATH (".filez"), EOS_REPO_PATH_OBJECT_FILEZ, CHECKSUM, ".filez", NULL },
+      { OBJECT_PATH (".dirtree"), EOS_REPO_PATH_OBJECT, CHECKSUM, ".dirtree", NULL },
+      { OBJECT_PATH (".dirmeta"), EOS_REPO_PATH_OBJECT, CHECKSUM, ".dirmeta", NULL },
+      { OBJECT_PATH (".commit"), EOS_REPO_PATH_OBJECT, CHECKSUM, ".commit", NULL },
+      { OBJECT_PATH (".commitmeta"), EOS_REPO_PATH_OBJECT, CHECKSUM, ".commitmeta", NULL },
+      { OBJECT_PATH (".sig"), EOS_REPO_PATH_OBJECT, CHECKSUM, ".sig", NULL },
+      { OBJECT_PATH (".sizes2"), EOS_REPO_PATH_OBJECT, CHECKSUM, ".sizes2", NULL },
+      { "/deltas/Om/abc-def/superblock", EOS_REPO_PATH_DELTA, "", NULL, "Om/abc-def/superblock" },
+      { "/extensions/eos/eos-extensions.sig", EOS_REPO_PATH_EXTENSION, "", NULL, "eos/eos-extensions.sig" },
+      { "/refs/heads/os/eos/amd64/master", EOS_REPO_PATH_REFS_HEADS, "", NULL, "os/eos/amd64/master" },
+      { "/refs/heads/", EOS_REPO_PATH_REFS_HEADS, "", NULL, "" },
+      { "/metrics", EOS_REPO_PATH_METRICS, "", NULL, NULL },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      EosRepoPath parsed;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT ": %s", i, vectors[i].path);
+
+      g_assert_cmpint (eos_repo_path_parse (vectors[i].path, &parsed), ==,
+                       vectors[i].expected_kind);
+      g_assert_cmpint (parsed.kind, ==, vectors[i].expected_kind);
+      g_assert_cmpstr (parsed.checksum, ==, vectors[i].expected_checksum);
+      g_assert_cmpstr (parsed.suffix, ==, vectors[i].expected_suffix);
+      g_assert_cmpstr (parsed.tail, ==, vectors[i].expected_tail);
+    }
+}
+
+/* Test that paths which are not served are rejected, and that paths escaping
+ * the repository are forbidden. */
+static void
+test_repo_path_parse_invalid (void)
+{
+  const struct
+    {
+      const gchar *path;
+      EosRepoPathKind expected_kind;
+    }
+  vectors[] =
+    {
+      { "", EOS_REPO_PATH_NOT_FOUND },
+      { "/", EOS_REPO_PATH_NOT_FOUND },
+      { "config", EOS_REPO_PATH_NOT_FOUND },
+      { "/config/", EOS_REPO_PATH_NOT_FOUND },
+      { "/summary.sig2", EOS_REPO_PATH_NOT_FOUND },
+      { "/objects/", EOS_REPO_PATH_NOT_FOUND },
+      { "/objects/3a", EOS_REPO_PATH_NOT_FOUND },
+      { "/objects/3a/", EOS_REPO_PATH_NOT_FOUND },
+      { "/objects/3a/1e0a.filez", EOS_REPO_PATH_NOT_FOUND },
+      { OBJECT_PATH (""), EOS_REPO_PATH_NOT_FOUND },
+      { OBJECT_PATH (".file"), EOS_REPO_PATH_NOT_FOUND },
+      { OBJECT_PATH (".filez2"), EOS_REPO_PATH_NOT_FOUND },
+      { OBJECT_PATH ("0.filez"), EOS_REPO_PATH_NOT_FOUND },
+      { "/objects/3A/1e0a3ad2e24a5f4c45cc4fc54f2b26a8a1c5e6d3b5c9b8f3e0c1d2b4a69788.filez", EOS_REPO_PATH_NOT_FOUND },
+      { "/objects/3a/1e0a3ad2e24a5f4c45cc4fc54f2b26a8a1c5e6d3b5c9b8f3e0c1d2b4a6978g.filez", EOS_REPO_PATH_NOT_FOUND },
+      { "/objects/3a1e0a3ad2e24a5f4c45cc4fc54f2b26a8a1c5e6d3b5c9b8f3e0c1d2b4a69788.filez", EOS_REPO_PATH_NOT_FOUND },
+      { "/deltas", EOS_REPO_PATH_NOT_FOUND },
+      { "/metrics/", EOS_REPO_PATH_NOT_FOUND },
+      { "/refs/remotes/eos/master", EOS_REPO_PATH_NOT_FOUND },
+      { "/etc/shadow", EOS_REPO_PATH_NOT_FOUND },
+      { "/refs/heads/../../etc/shadow", EOS_REPO_PATH_FORBIDDEN },
+      { "/deltas/..", EOS_REPO_PATH_FORBIDDEN },
+      { "/..", EOS_REPO_PATH_FORBIDDEN },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      EosRepoPath parsed;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT ": %s", i, vectors[i].path);
+
+      g_assert_cmpint (eos_repo_path_parse (vectors[i].path, &parsed), ==,
+                       vectors[i].expected_kind);
+      g_assert_cmpstr (parsed.checksum, ==, "");
+      g_assert_null (parsed.suffix);
+      g_assert_null (parsed.tail);
+    }
+}
+
+/* The routing which eos_repo_path_parse() replaced in the update server, kept
+ * as a baseline for the benchmark: a regex match and three allocations for
+ * file objects, and a chain of prefix and suffix checks and a path build for
+ * everything else. */
+static gboolean
+legacy_route (GRegex *filez_regex,
+              const gchar *path)
+{
+  static const gchar *const as_is_suffixes[] =
+    { ".commit", ".commitmeta", ".dirmeta", ".dirtree", ".sig", ".sizes2", NULL };
+  g_autofree gchar *raw_path = NULL;
+  guint idx;
+
+  if (strstr (path, "..") != NULL)
+    return FALSE;
+
+  if (g_str_has_prefix (path, "/objects/") && g_str_has_suffix (path, ".filez"))
+    {
+      g_autoptr(GMatchInfo) match = NULL;
+      g_autofree gchar *first_two = NULL;
+      g_autofree gchar *rest = NULL;
+      g_autofree gchar *checksum = NULL;
+
+      if (!g_regex_match (filez_regex, path, 0, &match))
+        return FALSE;
+
+      first_two = g_match_info_fetch (match, 1);
+      rest = g_match_info_fetch (match, 2);
+      checksum = g_strdup_printf ("%s%s", first_two, rest);
+
+      return TRUE;
+    }
+
+  if (g_str_has_prefix (path, "/objects/"))
+    {
+      for (idx = 0; as_is_suffixes[idx] != NULL; idx++)
+        if (g_str_has_suffix (path, as_is_suffixes[idx]))
+          break;
+      if (as_is_suffixes[idx] == NULL)
+        return FALSE;
+    }
+  else if (!g_str_has_prefix (path, "/deltas/") &&
+           !g_str_has_prefix (path, "/extensions/") &&
+           !g_str_equal (path, "/summary") &&
+           !g_str_equal (path, "/summary.sig"))
+    return FALSE;
+
+  raw_path = g_build_filename ("/var/lib/eos-updater/repo", path, NULL);
+
+  return TRUE;
+}
+
+static gboolean
+new_route (const gchar *path)
+{
+  EosRepoPath parsed;
+
+  return (eos_repo_path_parse (path, &parsed) != EOS_REPO_PATH_NOT_FOUND);
+}
+
+/* Benchmark eos_repo_path_parse() against the routing it replaced, on the
+ * mix of paths a client pulling an update asks for. Run with `-m perf`. */
+static void
+test_repo_path_parse_perf (void)
+{
+  const gchar * const paths[] =
+    {
+      OBJECT_PATH (".filez"),
+      OBJECT_PATH (".filez"),
+      OBJECT_PATH (".filez"),
+      OBJECT_PATH (".filez"),
+      OBJECT_PATH (".dirtree"),
+      OBJECT_PATH (".dirmeta"),
+      OBJECT_PATH (".commit"),
+      "/summary",
+    };
+  const guint n_iterations = 200000;
+  g_autoptr(GRegex) filez_regex = NULL;
+  gdouble legacy_elapsed, new_elapsed;
+  guint i;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Benchmark only run in perf mode");
+      return;
+    }
+
+  filez_regex = g_regex_new ("^/objects/([a-fA-F0-9]{2})/([a-fA-F0-9]{62})\\.filez$",
+                             G_REGEX_OPTIMIZE, 0, NULL);
+  g_assert_nonnull (filez_regex);
+
+  g_test_timer_start ();
+  for (i = 0; i < n_iterations; i++)
+    g_assert_true (legacy_route (filez_regex, paths[i % G_N_ELEMENTS (paths)]));
+  legacy_elapsed = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  for (i = 0; i < n_iterations; i++)
+    g_assert_true (new_route (paths[i % G_N_ELEMENTS (paths)]));
+  new_elapsed = g_test_timer_elapsed ();
+
+  g_test_message ("GRegex routing: %.1f ns per request",
+                  legacy_elapsed * 1e9 / n_iterations);
+  g_test_message ("eos_repo_path_parse(): %.1f ns per request",
+                  new_elapsed * 1e9 / n_iterations);
+  g_test_minimized_result (new_elapsed * 1e9 / n_iterations,
+                           "%.1f ns per request", new_elapsed * 1e9 / n_iterations);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/repo-path/parse", test_repo_path_parse);
+  g_test_add_func ("/repo-path/parse/invalid", test_repo_path_parse_invalid);
+  g_test_add_func ("/repo-path/parse/perf", test_repo_path_parse_perf);
+
+  return g_test_run ();
+}
@@ -0,0 +1,331 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-updater-util/verified-digests.h>
+#include <locale.h>
+#include <string.h>
+#include <utime.h>
+
+#define STAMP "keyring stamp"
+#define FINGERPRINT "0123456789ABCDEF0123456789ABCDEF01234567"
+
+static gchar *
+compute_key (const gchar *remote_name,
+             gboolean     is_summary,
+             const gchar *contents,
+             const gchar *signature)
+{
+  g_autoptr(GBytes) contents_bytes = g_bytes_new (contents, strlen (contents));
+  g_autoptr(GBytes) signature_bytes = g_bytes_new (signature, strlen (signature));
+
+  return eos_verified_digests_compute_key (remote_name, is_summary,
+                                           contents_bytes, signature_bytes);
+}
+
+/* Test that the key covers every input to the verification, and cannot be
+ * matched by moving bytes between the data and the signature. */
+static void
+test_verified_digests_key (void)
+{
+  g_autofree gchar *key = compute_key ("eos", FALSE, "ab", "c");
+  const struct
+    {
+      const gchar *remote_name;
+      gboolean is_summary;
+      const gchar *contents;
+      const gchar *signature;
+      gboolean expected_equal;
+    }
+  vectors[] =
+    {
+      { "eos", FALSE, "ab", "c", TRUE },
+      { "eos2", FALSE, "ab", "c", FALSE },
+      { "eo", FALSE, "ab", "c", FALSE },
+      { "eos", TRUE, "ab", "c", FALSE },
+      { "eos", FALSE, "ac", "c", FALSE },
+      { "eos", FALSE, "ab", "d", FALSE },
+      { "eos", FALSE, "a", "bc", FALSE },
+      { "eos", FALSE, "abc", "", FALSE },
+    };
+  gsize i;
+
+  g_assert_cmpuint (strlen (key), ==, 64);
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autofree gchar *other_key = NULL;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT, i);
+
+      other_key = compute_key (vectors[i].remote_name, vectors[i].is_summary,
+                               vectors[i].contents, vectors[i].signature);
+
+      if (vectors[i].expected_equal)
+        g_assert_cmpstr (other_key, ==, key);
+      else
+        g_assert_cmpstr (other_key, !=, key);
+    }
+}
+
+/* Test that a result is only found while the keyrings are unchanged, and can
+ * be replaced. */
+static void
+test_verified_digests_lookup (void)
+{
+  g_autoptr(EosVerifiedDigests) digests = eos_verified_digests_new ();
+  g_autofree gchar *key = compute_key ("eos", TRUE, "summary", "signature");
+  g_autofree gchar *fingerprint = NULL;
+  g_autofree gchar *new_fingerprint = NULL;
+
+  g_assert_false (eos_verified_digests_lookup (digests, key, STAMP, &fingerprint));
+  g_assert_null (fingerprint);
+
+  eos_verified_digests_insert (digests, key, STAMP, FINGERPRINT);
+
+  g_assert_true (eos_verified_digests_lookup (digests, key, STAMP, &fingerprint));
+  g_assert_cmpstr (fingerprint, ==, FINGERPRINT);
+  g_assert_true (eos_verified_digests_lookup (digests, key, STAMP, NULL));
+  g_assert_false (eos_verified_digests_lookup (digests, key, "other stamp", NULL));
+  g_assert_false (eos_verified_digests_lookup (digests, key, "", NULL));
+
+  /* Verifying again against new keyrings replaces the result. */
+  eos_verified_digests_insert (digests, key, "other stamp", "FEDCBA");
+  g_assert_false (eos_verified_digests_lookup (digests, key, STAMP, NULL));
+  g_assert_true (eos_verified_digests_lookup (digests, key, "other stamp", &new_fingerprint));
+  g_assert_cmpstr (new_fingerprint, ==, "FEDCBA");
+}
+
+/* Test that the table is emptied once it is full, but not when an existing
+ * result is replaced. */
+static void
+test_verified_digests_limit (void)
+{
+  g_autoptr(EosVerifiedDigests) digests = eos_verified_digests_new ();
+  g_autoptr(GPtrArray) keys = g_ptr_array_new_with_free_func (g_free);
+  g_autofree gchar *extra_key = NULL;
+  gsize i;
+
+  for (i = 0; i < EOS_VERIFIED_DIGESTS_MAX; i++)
+    {
+      g_autofree gchar *contents = g_strdup_printf ("ref file %" G_GSIZE_FORMAT, i);
+
+      g_ptr_array_add (keys, compute_key ("eos", FALSE, contents, "signature"));
+      eos_verified_digests_insert (digests, g_ptr_array_index (keys, i),
+                                   STAMP, FINGERPRINT);
+    }
+
+  eos_verified_digests_insert (digests, g_ptr_array_index (keys, 0),
+                               STAMP, FINGERPRINT);
+
+  for (i = 0; i < keys->len; i++)
+    g_assert_true (eos_verified_digests_lookup (digests, g_ptr_array_index (keys, i),
+                                                STAMP, NULL));
+
+  extra_key = compute_key ("eos", FALSE, "another ref file", "signature");
+  eos_verified_digests_insert (digests, extra_key, STAMP, FINGERPRINT);
+
+  g_assert_true (eos_verified_digests_lookup (digests, extra_key, STAMP, NULL));
+  for (i = 0; i < keys->len; i++)
+    g_assert_false (eos_verified_digests_lookup (digests, g_ptr_array_index (keys, i),
+                                                 STAMP, NULL));
+}
+
+typedef struct
+{
+  gchar *tmp_dir;
+  GFile *repo_directory;
+  GFile *global_keyring_directory;
+} Fixture;
+
+/* Set up a temporary directory with an empty repository directory and global
+ * keyring directory in. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *repo_path = NULL;
+  g_autofree gchar *global_keyring_path = NULL;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-updater-util-tests-verified-digests-XXXXXX",
+                                     &error);
+  g_assert_no_error (error);
+
+  repo_path = g_build_filename (fixture->tmp_dir, "repo", NULL);
+  fixture->repo_directory = g_file_new_for_path (repo_path);
+  g_file_make_directory (fixture->repo_directory, NULL, &error);
+  g_assert_no_error (error);
+
+  global_keyring_path = g_build_filename (fixture->tmp_dir, "trusted.gpg.d", NULL);
+  fixture->global_keyring_directory = g_file_new_for_path (global_keyring_path);
+  g_file_make_directory (fixture->global_keyring_directory, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+remove_recursively (const gchar *path)
+{
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir != NULL)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          g_autofree gchar *child = g_build_filename (path, name, NULL);
+
+          remove_recursively (child);
+        }
+    }
+
+  g_assert_cmpint (g_remove (path), ==, 0);
+}
+
+/* Inverse of setup(). */
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  remove_recursively (fixture->tmp_dir);
+
+  g_clear_object (&fixture->global_keyring_directory);
+  g_clear_object (&fixture->repo_directory);
+  g_free (fixture->tmp_dir);
+}
+
+/* Write @contents to @name in @directory, with a modification time of
+ * @mtime. */
+static void
+write_keyring (GFile       *directory,
+               const gchar *name,
+               const gchar *contents,
+               time_t       mtime)
+{
+  g_autoptr(GFile) file = g_file_get_child (directory, name);
+  g_autofree gchar *path = g_file_get_path (file);
+  g_autoptr(GError) error = NULL;
+  struct utimbuf times = { mtime, mtime };
+
+  g_file_replace_contents (file, contents, strlen (contents), NULL, FALSE,
+                           G_FILE_CREATE_NONE, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (g_utime (path, &times), ==, 0);
+}
+
+static gchar *
+get_stamp (Fixture *fixture)
+{
+  return eos_verified_digests_get_keyring_stamp (fixture->repo_directory,
+                                                 "eos",
+                                                 fixture->global_keyring_directory);
+}
+
+/* Test that the keyring stamp changes whenever a keyring the remote is
+ * checked against is added, changed or removed, and only then. */
+static void
+test_verified_digests_keyring_stamp (Fixture       *fixture,
+                                     gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *empty_stamp = NULL;
+  g_autofree gchar *remote_stamp = NULL;
+  g_autofree gchar *global_stamp = NULL;
+  g_autofree gchar *stamp = NULL;
+  g_autoptr(GFile) remote_keyring = NULL;
+  g_autoptr(GFile) missing_directory = NULL;
+  g_autoptr(GError) error = NULL;
+
+  /* No keyrings at all. */
+  empty_stamp = get_stamp (fixture);
+  g_assert_cmpstr (empty_stamp, ==, "");
+
+  write_keyring (fixture->repo_directory, "eos.trustedkeys.gpg", "key 1", 1000);
+  remote_stamp = get_stamp (fixture);
+  g_assert_cmpstr (remote_stamp, !=, empty_stamp);
+
+  write_keyring (fixture->global_keyring_directory, "endless.gpg", "key 2", 1000);
+  global_stamp = get_stamp (fixture);
+  g_assert_cmpstr (global_stamp, !=, remote_stamp);
+
+  /* Unchanged keyrings give the same stamp. */
+  stamp = get_stamp (fixture);
+  g_assert_cmpstr (stamp, ==, global_stamp);
+  g_clear_pointer (&stamp, g_free);
+
+  /* Other remotes’ keyrings, and files which are not keyrings, do not
+   * count. */
+  write_keyring (fixture->repo_directory, "other.trustedkeys.gpg", "key 3", 1000);
+  write_keyring (fixture->global_keyring_directory, "README", "not a key", 1000);
+  stamp = get_stamp (fixture);
+  g_assert_cmpstr (stamp, ==, global_stamp);
+  g_clear_pointer (&stamp, g_free);
+
+  /* Changing the size or modification time of a keyring does. */
+  write_keyring (fixture->repo_directory, "eos.trustedkeys.gpg", "key 1 and 4", 1000);
+  stamp = get_stamp (fixture);
+  g_assert_cmpstr (stamp, !=, global_stamp);
+  g_clear_pointer (&stamp, g_free);
+
+  write_keyring (fixture->repo_directory, "eos.trustedkeys.gpg", "key 1", 1000);
+  stamp = get_stamp (fixture);
+  g_assert_cmpstr (stamp, ==, global_stamp);
+  g_clear_pointer (&stamp, g_free);
+
+  write_keyring (fixture->global_keyring_directory, "endless.gpg", "key 5", 2000);
+  stamp = get_stamp (fixture);
+  g_assert_cmpstr (stamp, !=, global_stamp);
+  g_clear_pointer (&stamp, g_free);
+
+  /* So does removing a keyring. */
+  remote_keyring = g_file_get_child (fixture->repo_directory, "eos.trustedkeys.gpg");
+  g_file_delete (remote_keyring, NULL, &error);
+  g_assert_no_error (error);
+  stamp = get_stamp (fixture);
+  g_assert_cmpstr (stamp, !=, global_stamp);
+  g_clear_pointer (&stamp, g_free);
+
+  /* A missing global keyring directory is not an error. */
+  missing_directory = g_file_get_child (fixture->global_keyring_directory, "missing");
+  stamp = eos_verified_digests_get_keyring_stamp (fixture->repo_directory,
+                                                  "eos",
+                                                  missing_directory);
+  g_assert_cmpstr (stamp, ==, "");
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/verified-digests/key", test_verified_digests_key);
+  g_test_add_func ("/verified-digests/lookup", test_verified_digests_lookup);
+  g_test_add_func ("/verified-digests/limit", test_verified_digests_limit);
+  g_test_add ("/verified-digests/keyring-stamp", Fixture, NULL, setup,
+              test_verified_digests_keyring_stamp, teardown);
+
+  return g_test_run ();
+}
@@ -0,0 +1,295 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <libeos-updater-util/verified-digests.h>
+
+#include <string.h>
+
+/* Results of GPG verification are remembered in memory, keyed by a digest of
+ * the data and signature, so that polling again and downloading the same
+ * ref file or summary does not pay for a full verification each time. Each
+ * result records the state of the keyrings it was checked against, and is
+ * not used once they change. Only successful verifications are remembered.
+ *
+ * The table is kept in memory only, so a writable file can never vouch for
+ * a signature. It is used from the threads the fetchers run in, so it is
+ * locked. */
+
+typedef struct
+{
+  gchar *keyring_stamp;  /* (owned) */
+  gchar *fingerprint;  /* (owned) */
+} VerifiedDigest;
+
+static void
+verified_digest_free (VerifiedDigest *verified)
+{
+  g_free (verified->keyring_stamp);
+  g_free (verified->fingerprint);
+  g_free (verified);
+}
+
+struct _EosVerifiedDigests
+{
+  GObject parent_instance;
+
+  GMutex lock;
+  GHashTable *table;  /* (owned) (element-type utf8 VerifiedDigest) */
+};
+
+static void
+eos_verified_digests_finalize_impl (EosVerifiedDigests *digests)
+{
+  g_clear_pointer (&digests->table, g_hash_table_unref);
+  g_mutex_clear (&digests->lock);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_VERIFIED_DIGESTS,
+                       EosVerifiedDigests,
+                       eos_verified_digests,
+                       NULL,
+                       eos_verified_digests_finalize_impl)
+
+/**
+ * eos_verified_digests_new:
+ *
+ * Creates a new, empty table of verification results.
+ *
+ * Returns: (transfer full): a new #EosVerifiedDigests
+ */
+EosVerifiedDigests *
+eos_verified_digests_new (void)
+{
+  EosVerifiedDigests *digests = g_object_new (EOS_TYPE_VERIFIED_DIGESTS, NULL);
+
+  g_mutex_init (&digests->lock);
+  digests->table = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free,
+                                          (GDestroyNotify) verified_digest_free);
+
+  return digests;
+}
+
+/**
+ * eos_verified_digests_compute_key:
+ * @remote_name: name of the remote the data comes from
+ * @is_summary: whether the data is a summary, verified with
+ *    ostree_repo_verify_summary(), rather than verified with
+ *    ostree_repo_gpg_verify_data()
+ * @contents: the signed data
+ * @signature: the signature
+ *
+ * Computes the key a verification result is remembered under: a SHA-256
+ * digest of all the inputs to the verification.
+ *
+ * Returns: (transfer full): the key, as a hex string
+ */
+gchar *
+eos_verified_digests_compute_key (const gchar *remote_name,
+                                  gboolean is_summary,
+                                  GBytes *contents,
+                                  GBytes *signature)
+{
+  g_autoptr(GChecksum) checksum = NULL;
+  GBytes *parts[] = { contents, signature };
+  gsize i;
+
+  g_return_val_if_fail (remote_name != NULL, NULL);
+  g_return_val_if_fail (contents != NULL, NULL);
+  g_return_val_if_fail (signature != NULL, NULL);
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, (const guchar *) remote_name, strlen (remote_name) + 1);
+  g_checksum_update (checksum, (const guchar *) (is_summary ? "summary" : "data"), -1);
+
+  /* Length-prefix each part so that moving bytes between them changes the
+   * digest. */
+  for (i = 0; i < G_N_ELEMENTS (parts); i++)
+    {
+      gsize len;
+      gconstpointer data = g_bytes_get_data (parts[i], &len);
+      guint64 len_be = GUINT64_TO_BE ((guint64) len);
+
+      g_checksum_update (checksum, (const guchar *) &len_be, sizeof (len_be));
+      g_checksum_update (checksum, data, len);
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static void
+append_keyring_stamp (GString *stamp,
+                      GFile *keyring)
+{
+  g_autoptr(GFileInfo) info = NULL;
+  g_autofree gchar *path = g_file_get_path (keyring);
+
+  info = g_file_query_info (keyring,
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+                            G_FILE_QUERY_INFO_NONE,
+                            NULL,
+                            NULL);
+  if (info == NULL)
+    return;
+
+  g_string_append_printf (stamp, "%s:%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%u;",
+                          path,
+                          (guint64) g_file_info_get_size (info),
+                          g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                          g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC));
+}
+
+/**
+ * eos_verified_digests_get_keyring_stamp:
+ * @repo_directory: directory of the repository
+ * @remote_name: name of the remote
+ * @global_keyring_directory: directory of the keyrings trusted for all
+ *    remotes, like `/usr/share/ostree/trusted.gpg.d`
+ *
+ * Describes the keyrings libostree checks signatures for @remote_name
+ * against: the remote’s own `<remote>.trustedkeys.gpg` in the repository,
+ * and each `.gpg` keyring in @global_keyring_directory. The stamp has the
+ * path, size and modification time of each, so any change to them changes
+ * it. Keyrings which do not exist are left out.
+ *
+ * Returns: (transfer full): the stamp
+ */
+gchar *
+eos_verified_digests_get_keyring_stamp (GFile *repo_directory,
+                                        const gchar *remote_name,
+                                        GFile *global_keyring_directory)
+{
+  g_autoptr(GString) stamp = g_string_new ("");
+  g_autofree gchar *remote_keyring_name = NULL;
+  g_autoptr(GFile) remote_keyring = NULL;
+  g_autoptr(GFileEnumerator) enumerator = NULL;
+
+  g_return_val_if_fail (G_IS_FILE (repo_directory), NULL);
+  g_return_val_if_fail (remote_name != NULL, NULL);
+  g_return_val_if_fail (G_IS_FILE (global_keyring_directory), NULL);
+
+  remote_keyring_name = g_strdup_printf ("%s.trustedkeys.gpg", remote_name);
+  remote_keyring = g_file_get_child (repo_directory, remote_keyring_name);
+  append_keyring_stamp (stamp, remote_keyring);
+
+  enumerator = g_file_enumerate_children (global_keyring_directory,
+                                          G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                          G_FILE_QUERY_INFO_NONE,
+                                          NULL,
+                                          NULL);
+
+  while (enumerator != NULL)
+    {
+      GFileInfo *info;
+      GFile *child;
+
+      if (!g_file_enumerator_iterate (enumerator, &info, &child, NULL, NULL) ||
+          info == NULL)
+        break;
+
+      if (g_str_has_suffix (g_file_info_get_name (info), ".gpg"))
+        append_keyring_stamp (stamp, child);
+    }
+
+  return g_string_free (g_steal_pointer (&stamp), FALSE);
+}
+
+/**
+ * eos_verified_digests_lookup:
+ * @digests: an #EosVerifiedDigests
+ * @key: a key from eos_verified_digests_compute_key()
+ * @keyring_stamp: the current stamp of the keyrings, from
+ *    eos_verified_digests_get_keyring_stamp()
+ * @out_fingerprint: (out) (transfer full) (optional): return location for
+ *    the fingerprint of the key which made the valid signature
+ *
+ * Looks up whether the data and signature @key was computed from were
+ * verified before, against the same keyrings.
+ *
+ * Returns: %TRUE if they were, %FALSE otherwise
+ */
+gboolean
+eos_verified_digests_lookup (EosVerifiedDigests *digests,
+                             const gchar *key,
+                             const gchar *keyring_stamp,
+                             gchar **out_fingerprint)
+{
+  VerifiedDigest *verified;
+  gboolean found = FALSE;
+
+  g_return_val_if_fail (EOS_IS_VERIFIED_DIGESTS (digests), FALSE);
+  g_return_val_if_fail (key != NULL, FALSE);
+  g_return_val_if_fail (keyring_stamp != NULL, FALSE);
+
+  g_mutex_lock (&digests->lock);
+
+  verified = g_hash_table_lookup (digests->table, key);
+  if (verified != NULL && g_str_equal (verified->keyring_stamp, keyring_stamp))
+    {
+      found = TRUE;
+      if (out_fingerprint != NULL)
+        *out_fingerprint = g_strdup (verified->fingerprint);
+    }
+
+  g_mutex_unlock (&digests->lock);
+
+  return found;
+}
+
+/**
+ * eos_verified_digests_insert:
+ * @digests: an #EosVerifiedDigests
+ * @key: a key from eos_verified_digests_compute_key()
+ * @keyring_stamp: the stamp of the keyrings the verification was done
+ *    against, from eos_verified_digests_get_keyring_stamp()
+ * @fingerprint: fingerprint of the key which made the valid signature
+ *
+ * Remembers a successful verification, replacing any result for @key. If
+ * %EOS_VERIFIED_DIGESTS_MAX results are already remembered, they are all
+ * forgotten first.
+ */
+void
+eos_verified_digests_insert (EosVerifiedDigests *digests,
+                             const gchar *key,
+                             const gchar *keyring_stamp,
+                             const gchar *fingerprint)
+{
+  VerifiedDigest *verified;
+
+  g_return_if_fail (EOS_IS_VERIFIED_DIGESTS (digests));
+  g_return_if_fail (key != NULL);
+  g_return_if_fail (keyring_stamp != NULL);
+  g_return_if_fail (fingerprint != NULL);
+
+  verified = g_new0 (VerifiedDigest, 1);
+  verified->keyring_stamp = g_strdup (keyring_stamp);
+  verified->fingerprint = g_strdup (fingerprint);
+
+  g_mutex_lock (&digests->lock);
+
+  if (g_hash_table_size (digests->table) >= EOS_VERIFIED_DIGESTS_MAX &&
+      !g_hash_table_contains (digests->table, key))
+    g_hash_table_remove_all (digests->table);
+  g_hash_table_replace (digests->table, g_strdup (key), verified);
+
+  g_mutex_unlock (&digests->lock);
+}
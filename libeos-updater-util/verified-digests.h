@@ -0,0 +1,57 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <libeos-updater-util/refcounted.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EOS_TYPE_VERIFIED_DIGESTS eos_verified_digests_get_type ()
+EOS_DECLARE_REFCOUNTED (EosVerifiedDigests, eos_verified_digests, EOS, VERIFIED_DIGESTS)
+
+/* The most results remembered; the table is emptied when it is full. */
+#define EOS_VERIFIED_DIGESTS_MAX 64
+
+EosVerifiedDigests *eos_verified_digests_new (void);
+
+gchar *eos_verified_digests_compute_key (const gchar *remote_name,
+                                         gboolean is_summary,
+                                         GBytes *contents,
+                                         GBytes *signature);
+
+gchar *eos_verified_digests_get_keyring_stamp (GFile *repo_directory,
+                                               const gchar *remote_name,
+                                               GFile *global_keyring_directory);
+
+gboolean eos_verified_digests_lookup (EosVerifiedDigests *digests,
+                                      const gchar *key,
+                                      const gchar *keyring_stamp,
+                                      gchar **out_fingerprint);
+
+void eos_verified_digests_insert (EosVerifiedDigests *digests,
+                                  const gchar *key,
+                                  const gchar *keyring_stamp,
+                                  const gchar *fingerprint);
+
+G_END_DECLS
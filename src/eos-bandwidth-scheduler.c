@@ -0,0 +1,675 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include "eos-bandwidth-scheduler.h"
+
+/* Shares the upload bandwidth of the repo server between its clients.
+ *
+ * Before sending a piece of data to a client, the server requests permission
+ * to send that many bytes, and sends them once the request is granted.
+ * Requests are granted by deficit round robin across the clients (identified
+ * by address) which have requests queued: each round, a client may send up to
+ * EOS_BANDWIDTH_SCHEDULER_QUANTUM bytes times its weight, so that when the
+ * bandwidth is limited, it is shared in proportion to the weights. The total
+ * rate, and the rate for each client, are limited by token buckets which may
+ * go into debt by up to one request, so requests of any size can be granted.
+ *
+ * Requests are granted from a timer in the main context which the scheduler
+ * was created in. The scheduler may be shared between threads: each grant
+ * callback is called in the thread-default main context of the thread which
+ * made the request, and may queue further requests. A request granted to
+ * another thread wakes the scheduler up as soon as it is replaced, rather
+ * than at the next tick, so that a client of another thread is not held to
+ * one request per tick. */
+
+#define TICK_MS 20
+#define BURST_USECS (100 * 1000)
+#define REPORT_INTERVAL_USECS (5 * G_USEC_PER_SEC)
+
+typedef struct _Client Client;
+
+typedef struct
+{
+  guint id;
+  Client *client;  /* (unowned) (nullable) NULL once granted */
+  gsize bytes;
+  EosBandwidthGrantFunc func;
+  gpointer user_data;
+  GMainContext *context;  /* (owned) to call @func in */
+} Request;
+
+struct _Client
+{
+  gchar *address;
+  guint weight;
+  GQueue requests;  /* (owned) Request */
+  gint64 deficit;
+  gboolean in_turn;  /* whether its quantum for this turn has been added */
+  gdouble tokens;
+  GList *active_link;  /* (unowned) in EosBandwidthScheduler.active_clients */
+};
+
+struct _EosBandwidthScheduler
+{
+  GObject parent_instance;
+
+  /* Protects everything below but the rates and @context, which are set at
+   * construction. */
+  GMutex lock;
+
+  guint64 max_rate;  /* bytes per second, 0 for unlimited */
+  guint64 max_client_rate;  /* bytes per second, 0 for unlimited */
+
+  GHashTable *weights;  /* (owned) address → weight */
+  GHashTable *clients;  /* (owned) address → (owned) Client */
+  GHashTable *requests;  /* (unowned) ID → (unowned) Request, queued or granted but not yet called */
+  GQueue active_clients;  /* (unowned) Client, in round robin order */
+  guint next_request_id;
+
+  gdouble tokens;
+  gint64 last_refill_time;
+
+  GMainContext *context;
+  GSource *tick_source;
+  GSource *wakeup_source;  /* grants requests before the next tick */
+
+  GHashTable *sent_bytes;  /* (owned) address → guint64, since the last report */
+  gint64 last_report_time;
+};
+
+static void
+request_free (Request *request)
+{
+  g_main_context_unref (request->context);
+  g_free (request);
+}
+
+static void
+client_free (Client *client)
+{
+  g_queue_free_full (&client->requests, (GDestroyNotify) request_free);
+  g_free (client->address);
+  g_free (client);
+}
+
+static guint
+get_client_weight (EosBandwidthScheduler *scheduler,
+                   const gchar *address)
+{
+  gpointer weight = g_hash_table_lookup (scheduler->weights, address);
+
+  return (weight != NULL) ? GPOINTER_TO_UINT (weight) : 1;
+}
+
+static gdouble
+get_burst (guint64 rate)
+{
+  return (gdouble) rate * BURST_USECS / G_USEC_PER_SEC;
+}
+
+static void
+clear_source (GSource **source)
+{
+  if (*source == NULL)
+    return;
+
+  g_source_destroy (*source);
+  g_clear_pointer (source, g_source_unref);
+}
+
+static void
+eos_bandwidth_scheduler_dispose_impl (EosBandwidthScheduler *scheduler)
+{
+  g_mutex_lock (&scheduler->lock);
+  clear_source (&scheduler->tick_source);
+  clear_source (&scheduler->wakeup_source);
+  g_mutex_unlock (&scheduler->lock);
+}
+
+static void
+eos_bandwidth_scheduler_finalize_impl (EosBandwidthScheduler *scheduler)
+{
+  g_queue_clear (&scheduler->active_clients);
+  g_clear_pointer (&scheduler->requests, g_hash_table_unref);
+  g_clear_pointer (&scheduler->clients, g_hash_table_unref);
+  g_clear_pointer (&scheduler->weights, g_hash_table_unref);
+  g_clear_pointer (&scheduler->sent_bytes, g_hash_table_unref);
+  g_clear_pointer (&scheduler->context, g_main_context_unref);
+  g_mutex_clear (&scheduler->lock);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_BANDWIDTH_SCHEDULER,
+                       EosBandwidthScheduler,
+                       eos_bandwidth_scheduler,
+                       eos_bandwidth_scheduler_dispose_impl,
+                       eos_bandwidth_scheduler_finalize_impl)
+
+/**
+ * eos_bandwidth_scheduler_new:
+ * @max_rate: the maximum total rate, in bytes per second, or 0 for no limit
+ * @max_client_rate: the maximum rate for each client, in bytes per second, or
+ *    0 for no limit
+ *
+ * Creates a scheduler which grants requests from the thread-default main
+ * context. It can be shared by servers running in other threads.
+ *
+ * Returns: (transfer full): a new scheduler
+ */
+EosBandwidthScheduler *
+eos_bandwidth_scheduler_new (guint64 max_rate,
+                             guint64 max_client_rate)
+{
+  EosBandwidthScheduler *scheduler = g_object_new (EOS_TYPE_BANDWIDTH_SCHEDULER, NULL);
+
+  g_mutex_init (&scheduler->lock);
+  scheduler->max_rate = max_rate;
+  scheduler->max_client_rate = max_client_rate;
+  scheduler->weights = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  scheduler->clients = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) client_free);
+  scheduler->requests = g_hash_table_new (NULL, NULL);
+  scheduler->sent_bytes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_queue_init (&scheduler->active_clients);
+  scheduler->next_request_id = 1;
+  scheduler->tokens = get_burst (max_rate);
+  scheduler->last_refill_time = g_get_monotonic_time ();
+  scheduler->last_report_time = scheduler->last_refill_time;
+  scheduler->context = g_main_context_ref_thread_default ();
+
+  return scheduler;
+}
+
+/**
+ * eos_bandwidth_scheduler_set_client_weight:
+ * @scheduler: a scheduler
+ * @address: the address of the client
+ * @weight: its weight relative to other clients; clients default to 1
+ *
+ * Sets how big a share of the bandwidth the client gets when the bandwidth is
+ * contended.
+ */
+void
+eos_bandwidth_scheduler_set_client_weight (EosBandwidthScheduler *scheduler,
+                                           const gchar *address,
+                                           guint weight)
+{
+  Client *client;
+
+  g_return_if_fail (EOS_IS_BANDWIDTH_SCHEDULER (scheduler));
+  g_return_if_fail (address != NULL);
+  g_return_if_fail (weight > 0);
+
+  g_mutex_lock (&scheduler->lock);
+
+  g_hash_table_replace (scheduler->weights, g_strdup (address), GUINT_TO_POINTER (weight));
+
+  client = g_hash_table_lookup (scheduler->clients, address);
+  if (client != NULL)
+    client->weight = weight;
+
+  g_mutex_unlock (&scheduler->lock);
+}
+
+static void
+refill_tokens (EosBandwidthScheduler *scheduler)
+{
+  gint64 now = g_get_monotonic_time ();
+  gdouble elapsed_secs = (gdouble) (now - scheduler->last_refill_time) / G_USEC_PER_SEC;
+  GHashTableIter iter;
+  gpointer value;
+
+  scheduler->last_refill_time = now;
+
+  if (scheduler->max_rate > 0)
+    scheduler->tokens = MIN (scheduler->tokens + scheduler->max_rate * elapsed_secs,
+                             get_burst (scheduler->max_rate));
+
+  if (scheduler->max_client_rate > 0)
+    {
+      g_hash_table_iter_init (&iter, scheduler->clients);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          Client *client = value;
+
+          client->tokens = MIN (client->tokens + scheduler->max_client_rate * elapsed_secs,
+                                get_burst (scheduler->max_client_rate));
+        }
+    }
+}
+
+static void
+account_sent_bytes (EosBandwidthScheduler *scheduler,
+                    const gchar *address,
+                    gsize bytes)
+{
+  guint64 *sent = g_hash_table_lookup (scheduler->sent_bytes, address);
+
+  if (sent == NULL)
+    {
+      sent = g_new0 (guint64, 1);
+      g_hash_table_insert (scheduler->sent_bytes, g_strdup (address), sent);
+    }
+
+  *sent += bytes;
+}
+
+static void
+report_shares (EosBandwidthScheduler *scheduler)
+{
+  gint64 now = g_get_monotonic_time ();
+  gdouble elapsed_secs = (gdouble) (now - scheduler->last_report_time) / G_USEC_PER_SEC;
+  guint64 total = 0;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (now - scheduler->last_report_time < REPORT_INTERVAL_USECS)
+    return;
+
+  g_hash_table_iter_init (&iter, scheduler->sent_bytes);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    total += *((guint64 *) value);
+
+  g_hash_table_iter_init (&iter, scheduler->sent_bytes);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const gchar *address = key;
+      guint64 sent = *((guint64 *) value);
+
+      g_debug ("Client %s: weight %u, %.1f%% of the bandwidth, %.0f KiB/s",
+               address,
+               get_client_weight (scheduler, address),
+               (total > 0) ? 100.0 * sent / total : 0.0,
+               sent / 1024.0 / elapsed_secs);
+    }
+
+  g_hash_table_remove_all (scheduler->sent_bytes);
+  scheduler->last_report_time = now;
+}
+
+static gboolean
+can_send (EosBandwidthScheduler *scheduler,
+          Client *client)
+{
+  return ((scheduler->max_rate == 0 || scheduler->tokens > 0) &&
+          (scheduler->max_client_rate == 0 || client->tokens > 0));
+}
+
+static void
+deactivate_client (EosBandwidthScheduler *scheduler,
+                   Client *client)
+{
+  client->deficit = 0;
+  client->in_turn = FALSE;
+  g_queue_delete_link (&scheduler->active_clients, client->active_link);
+  client->active_link = NULL;
+}
+
+/* Ends the turn of the client at the head of the round robin. */
+static void
+end_turn (EosBandwidthScheduler *scheduler,
+          Client *client)
+{
+  client->in_turn = FALSE;
+  g_queue_unlink (&scheduler->active_clients, client->active_link);
+  g_queue_push_tail_link (&scheduler->active_clients, client->active_link);
+}
+
+/* Grants one deficit round robin round of queued requests, as far as the
+ * token buckets allow. The client at the head of the round robin has the
+ * turn: it adds a quantum (times its weight) to its deficit, is granted
+ * requests until the deficit runs out, and then goes to the back. If the
+ * total rate runs out first, it keeps the turn for the next round, so that
+ * the clients later in the round robin are not starved by those earlier in
+ * it. The granted requests are returned to be called once the lock is
+ * dropped; until then they stay in @scheduler->requests so that they can
+ * still be cancelled. */
+static GPtrArray *
+grant_round_locked (EosBandwidthScheduler *scheduler)
+{
+  GPtrArray *granted = g_ptr_array_new ();
+  guint n_turns = 0;
+
+  while (n_turns < scheduler->active_clients.length)
+    {
+      Client *client = g_queue_peek_head (&scheduler->active_clients);
+      Request *request;
+
+      if (scheduler->max_rate > 0 && scheduler->tokens <= 0)
+        break;
+
+      /* A client over its own rate loses its turn, and the rest of its
+       * deficit, so it cannot save up for a burst. */
+      if (!can_send (scheduler, client))
+        {
+          client->deficit = 0;
+          end_turn (scheduler, client);
+          n_turns++;
+          continue;
+        }
+
+      if (!client->in_turn)
+        {
+          client->deficit += (gint64) EOS_BANDWIDTH_SCHEDULER_QUANTUM * client->weight;
+          client->in_turn = TRUE;
+        }
+
+      while ((request = g_queue_peek_head (&client->requests)) != NULL &&
+             (gint64) request->bytes <= client->deficit &&
+             can_send (scheduler, client))
+        {
+          g_queue_pop_head (&client->requests);
+          request->client = NULL;
+
+          client->deficit -= request->bytes;
+          client->tokens -= request->bytes;
+          scheduler->tokens -= request->bytes;
+          account_sent_bytes (scheduler, client->address, request->bytes);
+
+          g_ptr_array_add (granted, request);
+        }
+
+      if (g_queue_is_empty (&client->requests))
+        {
+          deactivate_client (scheduler, client);
+        }
+      else if ((gint64) request->bytes > client->deficit)
+        {
+          /* A request bigger than the deficit waits for the next turn, with
+           * the deficit carried over. */
+          end_turn (scheduler, client);
+          n_turns++;
+        }
+      else if (scheduler->max_client_rate > 0 && client->tokens <= 0)
+        {
+          client->deficit = 0;
+          end_turn (scheduler, client);
+          n_turns++;
+        }
+    }
+
+  return granted;
+}
+
+typedef struct
+{
+  EosBandwidthScheduler *scheduler;  /* (owned) */
+  Request *request;  /* (owned) (nullable) NULL once called */
+} Grant;
+
+static void
+grant_free (Grant *grant)
+{
+  if (grant->request != NULL)
+    {
+      /* The requesting context went away without calling it. */
+      g_mutex_lock (&grant->scheduler->lock);
+      g_hash_table_remove (grant->scheduler->requests, GUINT_TO_POINTER (grant->request->id));
+      g_mutex_unlock (&grant->scheduler->lock);
+      request_free (grant->request);
+    }
+
+  g_object_unref (grant->scheduler);
+  g_free (grant);
+}
+
+/* Called in the requesting context. Cancelling happens in that context too,
+ * so once the request is known not to have been cancelled, it cannot be. */
+static gboolean
+grant_cb (gpointer user_data)
+{
+  Grant *grant = user_data;
+  Request *request = g_steal_pointer (&grant->request);
+  EosBandwidthScheduler *scheduler = grant->scheduler;
+  gboolean cancelled;
+
+  g_mutex_lock (&scheduler->lock);
+  cancelled = (g_hash_table_lookup (scheduler->requests, GUINT_TO_POINTER (request->id)) != request);
+  if (!cancelled)
+    g_hash_table_remove (scheduler->requests, GUINT_TO_POINTER (request->id));
+  g_mutex_unlock (&scheduler->lock);
+
+  if (!cancelled)
+    request->func (request->bytes, request->user_data);
+  request_free (request);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Grants as many queued requests as the token buckets allow, in deficit round
+ * robin order. Requests from the scheduler’s own context are called straight
+ * away, and may queue further requests which are granted in the next round;
+ * the others are called from their own contexts. */
+static void
+grant_requests (EosBandwidthScheduler *scheduler)
+{
+  gboolean progress;
+
+  do
+    {
+      g_autoptr(GPtrArray) granted = NULL;
+      guint idx;
+
+      g_mutex_lock (&scheduler->lock);
+      granted = grant_round_locked (scheduler);
+      g_mutex_unlock (&scheduler->lock);
+
+      progress = (granted->len > 0);
+
+      for (idx = 0; idx < granted->len; ++idx)
+        {
+          Grant *grant = g_new0 (Grant, 1);
+
+          grant->scheduler = g_object_ref (scheduler);
+          grant->request = g_ptr_array_index (granted, idx);
+
+          /* This calls grant_cb() straight away if the request came from this
+           * thread. */
+          g_main_context_invoke_full (grant->request->context,
+                                      G_PRIORITY_DEFAULT,
+                                      grant_cb,
+                                      grant,
+                                      (GDestroyNotify) grant_free);
+        }
+    }
+  while (progress);
+}
+
+/* Forgets the clients which have nothing queued and whose buckets are full
+ * again, as they would be when starting afresh. */
+static void
+prune_clients (EosBandwidthScheduler *scheduler)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, scheduler->clients);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Client *client = value;
+
+      if (client->active_link == NULL &&
+          (scheduler->max_client_rate == 0 ||
+           client->tokens >= get_burst (scheduler->max_client_rate)))
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
+static gboolean
+tick_cb (gpointer user_data)
+{
+  EosBandwidthScheduler *scheduler = EOS_BANDWIDTH_SCHEDULER (user_data);
+  gboolean keep_ticking;
+
+  g_mutex_lock (&scheduler->lock);
+  refill_tokens (scheduler);
+  g_mutex_unlock (&scheduler->lock);
+
+  grant_requests (scheduler);
+
+  g_mutex_lock (&scheduler->lock);
+  prune_clients (scheduler);
+  report_shares (scheduler);
+
+  keep_ticking = (g_hash_table_size (scheduler->clients) > 0);
+  if (!keep_ticking)
+    g_clear_pointer (&scheduler->tick_source, g_source_unref);
+  g_mutex_unlock (&scheduler->lock);
+
+  return keep_ticking ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gboolean
+wakeup_cb (gpointer user_data)
+{
+  EosBandwidthScheduler *scheduler = EOS_BANDWIDTH_SCHEDULER (user_data);
+
+  g_mutex_lock (&scheduler->lock);
+  g_clear_pointer (&scheduler->wakeup_source, g_source_unref);
+  refill_tokens (scheduler);
+  g_mutex_unlock (&scheduler->lock);
+
+  grant_requests (scheduler);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * eos_bandwidth_scheduler_request:
+ * @scheduler: a scheduler
+ * @address: the address of the client to send to
+ * @bytes: how many bytes to send
+ * @func: function to call once the bytes may be sent
+ * @user_data: data to pass to @func
+ *
+ * Queues a request to send @bytes to a client. @func is called from the
+ * thread-default main context of the calling thread once the request is
+ * granted; never from within this function.
+ *
+ * Returns: an ID which can be passed to eos_bandwidth_scheduler_cancel() until
+ *    @func has been called
+ */
+guint
+eos_bandwidth_scheduler_request (EosBandwidthScheduler *scheduler,
+                                 const gchar *address,
+                                 gsize bytes,
+                                 EosBandwidthGrantFunc func,
+                                 gpointer user_data)
+{
+  Client *client;
+  Request *request;
+  guint id;
+
+  g_return_val_if_fail (EOS_IS_BANDWIDTH_SCHEDULER (scheduler), 0);
+  g_return_val_if_fail (address != NULL, 0);
+  g_return_val_if_fail (func != NULL, 0);
+
+  g_mutex_lock (&scheduler->lock);
+
+  client = g_hash_table_lookup (scheduler->clients, address);
+  if (client == NULL)
+    {
+      client = g_new0 (Client, 1);
+      client->address = g_strdup (address);
+      client->weight = get_client_weight (scheduler, address);
+      g_queue_init (&client->requests);
+      client->tokens = get_burst (scheduler->max_client_rate);
+      g_hash_table_insert (scheduler->clients, client->address, client);
+    }
+
+  request = g_new0 (Request, 1);
+  request->id = scheduler->next_request_id++;
+  if (scheduler->next_request_id == 0)
+    scheduler->next_request_id = 1;
+  request->client = client;
+  request->bytes = bytes;
+  request->func = func;
+  request->user_data = user_data;
+  request->context = g_main_context_ref_thread_default ();
+
+  g_queue_push_tail (&client->requests, request);
+  g_hash_table_insert (scheduler->requests, GUINT_TO_POINTER (request->id), request);
+
+  if (client->active_link == NULL)
+    {
+      g_queue_push_tail (&scheduler->active_clients, client);
+      client->active_link = scheduler->active_clients.tail;
+    }
+
+  if (scheduler->tick_source == NULL)
+    {
+      refill_tokens (scheduler);
+      scheduler->tick_source = g_timeout_source_new (TICK_MS);
+      g_source_set_callback (scheduler->tick_source, tick_cb, scheduler, NULL);
+      g_source_attach (scheduler->tick_source, scheduler->context);
+    }
+  else if (request->context != scheduler->context &&
+           scheduler->wakeup_source == NULL)
+    {
+      scheduler->wakeup_source = g_idle_source_new ();
+      g_source_set_callback (scheduler->wakeup_source, wakeup_cb, scheduler, NULL);
+      g_source_attach (scheduler->wakeup_source, scheduler->context);
+    }
+
+  id = request->id;
+
+  g_mutex_unlock (&scheduler->lock);
+
+  return id;
+}
+
+/**
+ * eos_bandwidth_scheduler_cancel:
+ * @scheduler: a scheduler
+ * @request_id: an ID returned by eos_bandwidth_scheduler_request()
+ *
+ * Cancels a request whose callback has not been called yet. It must be
+ * called from the thread which made the request.
+ */
+void
+eos_bandwidth_scheduler_cancel (EosBandwidthScheduler *scheduler,
+                                guint request_id)
+{
+  Request *request;
+  Client *client;
+
+  g_return_if_fail (EOS_IS_BANDWIDTH_SCHEDULER (scheduler));
+
+  g_mutex_lock (&scheduler->lock);
+
+  request = g_hash_table_lookup (scheduler->requests, GUINT_TO_POINTER (request_id));
+  if (request == NULL)
+    goto out;
+
+  g_hash_table_remove (scheduler->requests, GUINT_TO_POINTER (request_id));
+
+  /* A granted request is freed by grant_cb(), which sees it is gone. */
+  client = request->client;
+  if (client == NULL)
+    goto out;
+
+  g_queue_remove (&client->requests, request);
+  request_free (request);
+
+  if (g_queue_is_empty (&client->requests) && client->active_link != NULL)
+    deactivate_client (scheduler, client);
+
+out:
+  g_mutex_unlock (&scheduler->lock);
+}
@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#pragma once
+
+#include <libeos-updater-util/refcounted.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EOS_TYPE_BANDWIDTH_SCHEDULER eos_bandwidth_scheduler_get_type ()
+EOS_DECLARE_REFCOUNTED (EosBandwidthScheduler, eos_bandwidth_scheduler, EOS, BANDWIDTH_SCHEDULER)
+
+/* The largest amount of data worth requesting at once; bigger requests are
+ * allowed, but make the sharing coarser. */
+#define EOS_BANDWIDTH_SCHEDULER_QUANTUM (64 * 1024)
+
+typedef void (*EosBandwidthGrantFunc) (gsize bytes,
+                                       gpointer user_data);
+
+EosBandwidthScheduler *eos_bandwidth_scheduler_new (guint64 max_rate,
+                                                    guint64 max_client_rate);
+
+void eos_bandwidth_scheduler_set_client_weight (EosBandwidthScheduler *scheduler,
+                                                const gchar *address,
+                                                guint weight);
+
+guint eos_bandwidth_scheduler_request (EosBandwidthScheduler *scheduler,
+                                       const gchar *address,
+                                       gsize bytes,
+                                       EosBandwidthGrantFunc func,
+                                       gpointer user_data);
+
+void eos_bandwidth_scheduler_cancel (EosBandwidthScheduler *scheduler,
+                                     guint request_id);
+
+G_END_DECLS
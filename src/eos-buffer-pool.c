@@ -0,0 +1,239 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include "eos-buffer-pool.h"
+
+/* A pool of reusable memory buffers, sorted into power-of-four size classes
+ * from 4 KiB (the typical size of a small compressed object) up to 2 MiB (the
+ * largest chunk the repo server reads at once). Buffers are handed out with a
+ * small header in front of them which records where they came from, so they
+ * can be released (or wrapped in a #GBytes which releases them when it is
+ * freed) without having to keep track of the pool separately.
+ *
+ * Released buffers are kept for reuse until the pool holds @max_free_bytes of
+ * them; further released buffers are freed. Buffers larger than the biggest
+ * size class are never pooled. The pool is protected by a mutex, so buffers
+ * may be acquired and released from any thread. */
+
+static const gsize size_classes[] =
+  {
+    4 * 1024,
+    16 * 1024,
+    64 * 1024,
+    256 * 1024,
+    1024 * 1024,
+    2 * 1024 * 1024,
+  };
+
+#define N_SIZE_CLASSES G_N_ELEMENTS (size_classes)
+#define NO_SIZE_CLASS G_MAXUINT
+
+typedef struct
+{
+  EosBufferPool *pool;  /* (owned) while the buffer is in use */
+  gpointer next_free;  /* (unowned) while the buffer is in a free list */
+  gsize size;
+  guint size_class;
+  /* Keep the payload aligned for any use. */
+  gdouble data[];
+} PoolBuffer;
+
+struct _EosBufferPool
+{
+  GObject parent_instance;
+
+  gsize max_free_bytes;
+
+  GMutex lock;
+  PoolBuffer *free_buffers[N_SIZE_CLASSES];
+  gsize free_bytes;
+};
+
+static void
+eos_buffer_pool_finalize_impl (EosBufferPool *pool)
+{
+  guint idx;
+
+  /* The buffers in the free lists do not hold a reference on the pool, so
+   * they are all here by now. */
+  for (idx = 0; idx < N_SIZE_CLASSES; ++idx)
+    {
+      while (pool->free_buffers[idx] != NULL)
+        {
+          PoolBuffer *pool_buffer = pool->free_buffers[idx];
+
+          pool->free_buffers[idx] = pool_buffer->next_free;
+          g_free (pool_buffer);
+        }
+    }
+
+  g_mutex_clear (&pool->lock);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_BUFFER_POOL,
+                       EosBufferPool,
+                       eos_buffer_pool,
+                       NULL,
+                       eos_buffer_pool_finalize_impl)
+
+/**
+ * eos_buffer_pool_new:
+ * @max_free_bytes: how many bytes of released buffers to keep for reuse
+ *
+ * Returns: (transfer full): a new, empty buffer pool
+ */
+EosBufferPool *
+eos_buffer_pool_new (gsize max_free_bytes)
+{
+  EosBufferPool *pool = g_object_new (EOS_TYPE_BUFFER_POOL, NULL);
+
+  pool->max_free_bytes = max_free_bytes;
+  g_mutex_init (&pool->lock);
+
+  return pool;
+}
+
+static PoolBuffer *
+get_pool_buffer (gpointer buffer)
+{
+  return (PoolBuffer *) ((guint8 *) buffer - G_STRUCT_OFFSET (PoolBuffer, data));
+}
+
+/**
+ * eos_buffer_pool_acquire:
+ * @pool: a buffer pool
+ * @size: the minimum size of the buffer
+ * @out_allocated_size: (out) (optional): return location for the actual size
+ *    of the buffer, which is @size rounded up to the size class
+ *
+ * Gets a buffer of at least @size bytes, reusing a released one if possible.
+ * Its contents are undefined.
+ *
+ * Returns: (transfer full): the buffer; release it with
+ *    eos_buffer_pool_release() or hand it over to eos_buffer_pool_bytes_new()
+ */
+gpointer
+eos_buffer_pool_acquire (EosBufferPool *pool,
+                         gsize size,
+                         gsize *out_allocated_size)
+{
+  PoolBuffer *pool_buffer = NULL;
+  guint size_class = NO_SIZE_CLASS;
+  guint idx;
+
+  g_return_val_if_fail (EOS_IS_BUFFER_POOL (pool), NULL);
+
+  for (idx = 0; idx < N_SIZE_CLASSES; ++idx)
+    {
+      if (size <= size_classes[idx])
+        {
+          size_class = idx;
+          size = size_classes[idx];
+          break;
+        }
+    }
+
+  if (size_class != NO_SIZE_CLASS)
+    {
+      g_mutex_lock (&pool->lock);
+      pool_buffer = pool->free_buffers[size_class];
+      if (pool_buffer != NULL)
+        {
+          pool->free_buffers[size_class] = pool_buffer->next_free;
+          pool->free_bytes -= size;
+        }
+      g_mutex_unlock (&pool->lock);
+    }
+
+  if (pool_buffer == NULL)
+    {
+      pool_buffer = g_malloc (G_STRUCT_OFFSET (PoolBuffer, data) + size);
+      pool_buffer->size = size;
+      pool_buffer->size_class = size_class;
+    }
+
+  pool_buffer->pool = g_object_ref (pool);
+  pool_buffer->next_free = NULL;
+
+  if (out_allocated_size != NULL)
+    *out_allocated_size = pool_buffer->size;
+
+  return pool_buffer->data;
+}
+
+/**
+ * eos_buffer_pool_release:
+ * @buffer: (transfer full): a buffer from eos_buffer_pool_acquire()
+ *
+ * Gives the buffer back to the pool it came from.
+ */
+void
+eos_buffer_pool_release (gpointer buffer)
+{
+  PoolBuffer *pool_buffer;
+  g_autoptr(EosBufferPool) pool = NULL;
+  gboolean pooled = FALSE;
+
+  if (buffer == NULL)
+    return;
+
+  pool_buffer = get_pool_buffer (buffer);
+  pool = g_steal_pointer (&pool_buffer->pool);
+
+  if (pool_buffer->size_class != NO_SIZE_CLASS)
+    {
+      g_mutex_lock (&pool->lock);
+      if (pool->free_bytes + pool_buffer->size <= pool->max_free_bytes)
+        {
+          pool_buffer->next_free = pool->free_buffers[pool_buffer->size_class];
+          pool->free_buffers[pool_buffer->size_class] = pool_buffer;
+          pool->free_bytes += pool_buffer->size;
+          pooled = TRUE;
+        }
+      g_mutex_unlock (&pool->lock);
+    }
+
+  if (!pooled)
+    g_free (pool_buffer);
+}
+
+/**
+ * eos_buffer_pool_bytes_new:
+ * @buffer: (transfer full): a buffer from eos_buffer_pool_acquire()
+ * @len: how many bytes at the start of @buffer are valid
+ *
+ * Wraps the buffer in a #GBytes without copying it. The buffer is given back
+ * to its pool once the #GBytes is freed.
+ *
+ * Returns: (transfer full): a new #GBytes
+ */
+GBytes *
+eos_buffer_pool_bytes_new (gpointer buffer,
+                           gsize len)
+{
+  g_return_val_if_fail (buffer != NULL, NULL);
+  g_return_val_if_fail (len <= get_pool_buffer (buffer)->size, NULL);
+
+  return g_bytes_new_with_free_func (buffer,
+                                     len,
+                                     eos_buffer_pool_release,
+                                     buffer);
+}
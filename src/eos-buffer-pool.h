@@ -0,0 +1,44 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#pragma once
+
+#include <libeos-updater-util/refcounted.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EOS_TYPE_BUFFER_POOL eos_buffer_pool_get_type ()
+EOS_DECLARE_REFCOUNTED (EosBufferPool, eos_buffer_pool, EOS, BUFFER_POOL)
+
+EosBufferPool *eos_buffer_pool_new (gsize max_free_bytes);
+
+gpointer eos_buffer_pool_acquire (EosBufferPool *pool,
+                                  gsize size,
+                                  gsize *out_allocated_size);
+
+void eos_buffer_pool_release (gpointer buffer);
+
+GBytes *eos_buffer_pool_bytes_new (gpointer buffer,
+                                   gsize len);
+
+G_END_DECLS
@@ -0,0 +1,300 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-cache-warmer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Warms up the repo server for the commit it advertises, before any client
+ * asks for it.
+ *
+ * A thread walks the commit: metadata objects, which are served as they are,
+ * are read ahead into the page cache with posix_fadvise(), and file objects
+ * are compressed into the server’s object cache by the caller’s
+ * #EosCacheWarmerFileFunc, until @max_cached_bytes have been cached (beyond
+ * that, the cache would only evict what has just been warmed).
+ *
+ * Warming must not slow down real requests, so it pauses whenever the server
+ * is busy (see eos_cache_warmer_set_busy()), and when it runs it only works
+ * for WARM_DUTY_PERCENT of the time, sleeping in between objects. */
+
+#define WARM_DUTY_PERCENT 25
+
+/* How often to check whether the server is still busy. */
+#define BUSY_POLL_USECS (G_USEC_PER_SEC / 2)
+
+struct _EosCacheWarmer
+{
+  GObject parent_instance;
+
+  OstreeRepo *repo;
+  gchar *commit_checksum;
+  guint64 max_cached_bytes;
+  EosCacheWarmerFileFunc file_func;
+  gpointer user_data;
+
+  GCancellable *cancellable;
+  GThread *thread;
+
+  GMutex lock;
+  GCond cond;
+  gboolean busy;  /* (lock) */
+  gboolean stopping;  /* (lock) */
+};
+
+static void
+eos_cache_warmer_dispose_impl (EosCacheWarmer *warmer)
+{
+  eos_cache_warmer_stop (warmer);
+  g_clear_object (&warmer->cancellable);
+  g_clear_object (&warmer->repo);
+}
+
+static void
+eos_cache_warmer_finalize_impl (EosCacheWarmer *warmer)
+{
+  g_mutex_clear (&warmer->lock);
+  g_cond_clear (&warmer->cond);
+  g_free (warmer->commit_checksum);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_CACHE_WARMER,
+                       EosCacheWarmer,
+                       eos_cache_warmer,
+                       eos_cache_warmer_dispose_impl,
+                       eos_cache_warmer_finalize_impl)
+
+/* Sleeps until @end_time, or for as long as the server is busy, whichever is
+ * later. Returns %FALSE if the warmer is being stopped. */
+static gboolean
+wait_for_turn (EosCacheWarmer *warmer,
+               gint64 end_time)
+{
+  gboolean stopping;
+
+  g_mutex_lock (&warmer->lock);
+  while (!warmer->stopping)
+    {
+      gint64 now = g_get_monotonic_time ();
+
+      if (warmer->busy)
+        g_cond_wait_until (&warmer->cond, &warmer->lock, now + BUSY_POLL_USECS);
+      else if (now < end_time)
+        g_cond_wait_until (&warmer->cond, &warmer->lock, end_time);
+      else
+        break;
+    }
+  stopping = warmer->stopping;
+  g_mutex_unlock (&warmer->lock);
+
+  return !stopping;
+}
+
+/* Reads a loose metadata object ahead into the page cache. */
+static void
+read_ahead_metadata (EosCacheWarmer *warmer,
+                     const gchar *checksum,
+                     OstreeObjectType object_type)
+{
+  g_autofree gchar *relative_path = NULL;
+  int fd;
+
+  relative_path = g_strdup_printf ("objects/%.2s/%s.%s",
+                                   checksum,
+                                   checksum + 2,
+                                   ostree_object_type_to_string (object_type));
+  fd = openat (ostree_repo_get_dfd (warmer->repo), relative_path,
+               O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  (void) posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+  close (fd);
+}
+
+static gpointer
+warm_thread_func (gpointer warmer_ptr)
+{
+  EosCacheWarmer *warmer = EOS_CACHE_WARMER (warmer_ptr);
+  g_autoptr(GHashTable) reachable = NULL;
+  g_autoptr(GError) local_error = NULL;
+  GHashTableIter iter;
+  GVariant *object_name;
+  guint64 cached_bytes = 0;
+  guint n_files = 0;
+  guint n_metadata = 0;
+  gint64 start_time = g_get_monotonic_time ();
+  gint64 next_turn = start_time;
+
+  if (!wait_for_turn (warmer, next_turn))
+    return NULL;
+
+  if (!ostree_repo_traverse_commit (warmer->repo,
+                                    warmer->commit_checksum,
+                                    0,
+                                    &reachable,
+                                    warmer->cancellable,
+                                    &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_warning ("Not warming the cache for %s: %s",
+                   warmer->commit_checksum, local_error->message);
+      return NULL;
+    }
+
+  g_hash_table_iter_init (&iter, reachable);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &object_name, NULL) &&
+         cached_bytes < warmer->max_cached_bytes)
+    {
+      const gchar *checksum;
+      OstreeObjectType object_type;
+      gint64 object_start_time;
+
+      if (!wait_for_turn (warmer, next_turn))
+        return NULL;
+
+      object_start_time = g_get_monotonic_time ();
+      ostree_object_name_deserialize (object_name, &checksum, &object_type);
+
+      if (object_type == OSTREE_OBJECT_TYPE_FILE)
+        {
+          guint64 object_cached_bytes = 0;
+
+          if (!warmer->file_func (checksum, &object_cached_bytes,
+                                  warmer->user_data, warmer->cancellable,
+                                  &local_error))
+            {
+              if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                return NULL;
+
+              g_debug ("Failed to warm the cache for file %s: %s",
+                       checksum, local_error->message);
+              g_clear_error (&local_error);
+            }
+
+          cached_bytes += object_cached_bytes;
+          n_files++;
+        }
+      else
+        {
+          read_ahead_metadata (warmer, checksum, object_type);
+          n_metadata++;
+        }
+
+      /* Sleep for long enough to stay within our share of the time. */
+      next_turn = g_get_monotonic_time ();
+      next_turn += (next_turn - object_start_time) *
+                   (100 - WARM_DUTY_PERCENT) / WARM_DUTY_PERCENT;
+    }
+
+  g_message ("Warmed %u file objects (%" G_GUINT64_FORMAT " KiB cached) and "
+             "%u metadata objects of %s in %" G_GINT64_FORMAT " s",
+             n_files, cached_bytes / 1024, n_metadata, warmer->commit_checksum,
+             (g_get_monotonic_time () - start_time) / G_USEC_PER_SEC);
+
+  return NULL;
+}
+
+/**
+ * eos_cache_warmer_new:
+ * @repo: the repository to warm up
+ * @commit_checksum: the commit to warm up
+ * @max_cached_bytes: stop after @file_func has cached this much
+ * @file_func: function to cache a file object
+ * @user_data: data for @file_func
+ *
+ * Starts warming up @commit_checksum in a background thread. @user_data must
+ * stay valid until eos_cache_warmer_stop() is called.
+ *
+ * Returns: (transfer full): a new warmer
+ */
+EosCacheWarmer *
+eos_cache_warmer_new (OstreeRepo *repo,
+                      const gchar *commit_checksum,
+                      guint64 max_cached_bytes,
+                      EosCacheWarmerFileFunc file_func,
+                      gpointer user_data)
+{
+  EosCacheWarmer *warmer;
+
+  g_return_val_if_fail (OSTREE_IS_REPO (repo), NULL);
+  g_return_val_if_fail (ostree_validate_checksum_string (commit_checksum, NULL), NULL);
+  g_return_val_if_fail (file_func != NULL, NULL);
+
+  warmer = g_object_new (EOS_TYPE_CACHE_WARMER, NULL);
+  warmer->repo = g_object_ref (repo);
+  warmer->commit_checksum = g_strdup (commit_checksum);
+  warmer->max_cached_bytes = max_cached_bytes;
+  warmer->file_func = file_func;
+  warmer->user_data = user_data;
+  warmer->cancellable = g_cancellable_new ();
+  g_mutex_init (&warmer->lock);
+  g_cond_init (&warmer->cond);
+  warmer->thread = g_thread_new ("cache-warmer", warm_thread_func, warmer);
+
+  return warmer;
+}
+
+/**
+ * eos_cache_warmer_set_busy:
+ * @warmer: an #EosCacheWarmer
+ * @busy: whether the server is busy serving requests
+ *
+ * Pauses warming while the server is busy, and resumes it afterwards.
+ */
+void
+eos_cache_warmer_set_busy (EosCacheWarmer *warmer,
+                           gboolean busy)
+{
+  g_return_if_fail (EOS_IS_CACHE_WARMER (warmer));
+
+  g_mutex_lock (&warmer->lock);
+  warmer->busy = busy;
+  g_cond_broadcast (&warmer->cond);
+  g_mutex_unlock (&warmer->lock);
+}
+
+/**
+ * eos_cache_warmer_stop:
+ * @warmer: an #EosCacheWarmer
+ *
+ * Stops warming, and waits for the thread to finish. After this returns,
+ * the #EosCacheWarmerFileFunc is not called any more. Calling this more than
+ * once is harmless.
+ */
+void
+eos_cache_warmer_stop (EosCacheWarmer *warmer)
+{
+  g_return_if_fail (EOS_IS_CACHE_WARMER (warmer));
+
+  if (warmer->thread == NULL)
+    return;
+
+  g_mutex_lock (&warmer->lock);
+  warmer->stopping = TRUE;
+  g_cond_broadcast (&warmer->cond);
+  g_mutex_unlock (&warmer->lock);
+  g_cancellable_cancel (warmer->cancellable);
+
+  g_thread_join (warmer->thread);
+  warmer->thread = NULL;
+}
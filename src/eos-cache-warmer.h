@@ -0,0 +1,54 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <libeos-updater-util/refcounted.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+#define EOS_TYPE_CACHE_WARMER eos_cache_warmer_get_type ()
+EOS_DECLARE_REFCOUNTED (EosCacheWarmer, eos_cache_warmer, EOS, CACHE_WARMER)
+
+/* Called in the warmer’s thread to cache the compressed form of a file
+ * object. Sets @out_cached_bytes to how much space the object takes in the
+ * cache. */
+typedef gboolean (*EosCacheWarmerFileFunc) (const gchar *checksum,
+                                            guint64 *out_cached_bytes,
+                                            gpointer user_data,
+                                            GCancellable *cancellable,
+                                            GError **error);
+
+EosCacheWarmer *eos_cache_warmer_new (OstreeRepo *repo,
+                                      const gchar *commit_checksum,
+                                      guint64 max_cached_bytes,
+                                      EosCacheWarmerFileFunc file_func,
+                                      gpointer user_data);
+
+void eos_cache_warmer_set_busy (EosCacheWarmer *warmer,
+                                gboolean busy);
+
+void eos_cache_warmer_stop (EosCacheWarmer *warmer);
+
+G_END_DECLS
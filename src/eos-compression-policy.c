@@ -0,0 +1,426 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-compression-policy.h"
+
+#include <sys/resource.h>
+#include <sys/time.h>
+
+/* Chooses the zlib level file objects are compressed with.
+ *
+ * Compressing harder only pays off if the link to the client is slower than
+ * the compression: a client on a slow link gets the object sooner if it is
+ * smaller, while a client on a fast link would be kept waiting for the CPU.
+ * So the level starts from the measured throughput to the client (see
+ * eos_compression_policy_note_transfer()), and is then lowered when the
+ * server is busy — measured by its CPU usage, how many of the compression
+ * threads are in use, and how many requests are pending — or raised when it
+ * is idle.
+ *
+ * The policy is used from the main context and from worker threads, so it is
+ * locked. */
+
+/* Levels above this cost a lot more CPU for little gain. */
+#define ADAPTIVE_LEVEL_MAX 6
+
+/* Throughputs (bytes per second) above which a client's link is considered
+ * fast enough for the given level. */
+#define GIGABIT_RATE (50 * 1000 * 1000)
+#define FAST_RATE (10 * 1000 * 1000)
+#define MEDIUM_RATE (2 * 1000 * 1000)
+
+/* Load (0 to 1) above which the server is considered busy or saturated, and
+ * below which it is considered idle. */
+#define BUSY_LOAD 0.6
+#define SATURATED_LOAD 0.9
+#define IDLE_LOAD 0.25
+
+/* How often the CPU usage is sampled. */
+#define CPU_SAMPLE_INTERVAL_USECS (G_USEC_PER_SEC)
+
+/* Weight of a new throughput measurement in a client's average. */
+#define RATE_SMOOTHING 0.3
+
+/* Throughputs of clients not heard of for this long are forgotten. */
+#define CLIENT_EXPIRY_USECS (10 * 60 * G_USEC_PER_SEC)
+#define MAX_CLIENTS 1024
+
+typedef struct
+{
+  gdouble rate;  /* bytes per second */
+  gint64 updated;  /* monotonic time */
+} ClientRate;
+
+typedef struct
+{
+  guint64 n_chosen;
+  guint64 n_objects;
+  guint64 uncompressed_bytes;
+  guint64 compressed_bytes;
+} LevelStats;
+
+struct _EosCompressionPolicy
+{
+  GObject parent_instance;
+
+  gint fixed_level;  /* or EOS_COMPRESSION_LEVEL_ADAPTIVE */
+  guint n_threads;
+
+  GMutex lock;
+  GHashTable *client_rates;  /* (owned) address → (owned) ClientRate */
+  gdouble cpu_load;
+  gint64 last_cpu_sample_time;
+  gint64 last_cpu_usecs;
+  LevelStats stats[EOS_COMPRESSION_LEVEL_MAX + 1];
+};
+
+static void
+eos_compression_policy_finalize_impl (EosCompressionPolicy *policy)
+{
+  g_clear_pointer (&policy->client_rates, g_hash_table_unref);
+  g_mutex_clear (&policy->lock);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_COMPRESSION_POLICY,
+                       EosCompressionPolicy,
+                       eos_compression_policy,
+                       NULL,
+                       eos_compression_policy_finalize_impl)
+
+static gint64
+get_process_cpu_usecs (void)
+{
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+    return 0;
+
+  return ((gint64) usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/**
+ * eos_compression_policy_new:
+ * @fixed_level: zlib level to always use, or %EOS_COMPRESSION_LEVEL_ADAPTIVE
+ *    to choose one for each object
+ * @n_threads: number of threads compressing objects
+ *
+ * Creates a new compression policy.
+ *
+ * Returns: (transfer full): a new policy
+ */
+EosCompressionPolicy *
+eos_compression_policy_new (gint fixed_level,
+                            guint n_threads)
+{
+  EosCompressionPolicy *policy;
+
+  g_return_val_if_fail (fixed_level == EOS_COMPRESSION_LEVEL_ADAPTIVE ||
+                        (fixed_level >= 0 && fixed_level <= EOS_COMPRESSION_LEVEL_MAX), NULL);
+
+  policy = g_object_new (EOS_TYPE_COMPRESSION_POLICY, NULL);
+  policy->fixed_level = fixed_level;
+  policy->n_threads = MAX (n_threads, 1);
+  g_mutex_init (&policy->lock);
+  policy->client_rates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+  policy->last_cpu_sample_time = g_get_monotonic_time ();
+  policy->last_cpu_usecs = get_process_cpu_usecs ();
+
+  return policy;
+}
+
+/**
+ * eos_compression_policy_is_adaptive:
+ * @policy: an #EosCompressionPolicy
+ *
+ * Gets whether the level is chosen for each object. If so, the same object
+ * may be compressed differently at different times.
+ *
+ * Returns: %TRUE if the level is adaptive
+ */
+gboolean
+eos_compression_policy_is_adaptive (EosCompressionPolicy *policy)
+{
+  g_return_val_if_fail (EOS_IS_COMPRESSION_POLICY (policy), FALSE);
+
+  return policy->fixed_level == EOS_COMPRESSION_LEVEL_ADAPTIVE;
+}
+
+/* Must be called with the lock held. */
+static void
+update_cpu_load (EosCompressionPolicy *policy)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 cpu_usecs;
+
+  if (now - policy->last_cpu_sample_time < CPU_SAMPLE_INTERVAL_USECS)
+    return;
+
+  cpu_usecs = get_process_cpu_usecs ();
+  policy->cpu_load = (gdouble) (cpu_usecs - policy->last_cpu_usecs) /
+                     ((gdouble) (now - policy->last_cpu_sample_time) *
+                      g_get_num_processors ());
+  policy->cpu_load = CLAMP (policy->cpu_load, 0.0, 1.0);
+  policy->last_cpu_sample_time = now;
+  policy->last_cpu_usecs = cpu_usecs;
+}
+
+/**
+ * eos_compression_policy_choose_level:
+ * @policy: an #EosCompressionPolicy
+ * @client_address: (nullable): address of the client the object is for, or
+ *    %NULL if it is not for a particular client
+ * @pending_requests: number of requests the server is handling
+ * @n_compressions: number of objects being compressed
+ *
+ * Chooses the level to compress an object with, and counts it in the
+ * statistics.
+ *
+ * Returns: a zlib compression level
+ */
+gint
+eos_compression_policy_choose_level (EosCompressionPolicy *policy,
+                                     const gchar *client_address,
+                                     guint pending_requests,
+                                     guint n_compressions)
+{
+  ClientRate *client_rate = NULL;
+  gdouble load;
+  gint level;
+
+  g_return_val_if_fail (EOS_IS_COMPRESSION_POLICY (policy), EOS_COMPRESSION_LEVEL_DEFAULT);
+
+  g_mutex_lock (&policy->lock);
+
+  if (policy->fixed_level != EOS_COMPRESSION_LEVEL_ADAPTIVE)
+    {
+      level = policy->fixed_level;
+      goto out;
+    }
+
+  /* Start from what the link to the client can take. */
+  if (client_address != NULL)
+    client_rate = g_hash_table_lookup (policy->client_rates, client_address);
+
+  if (client_rate == NULL)
+    level = EOS_COMPRESSION_LEVEL_DEFAULT;
+  else if (client_rate->rate >= GIGABIT_RATE)
+    level = 1;
+  else if (client_rate->rate >= FAST_RATE)
+    level = 2;
+  else if (client_rate->rate >= MEDIUM_RATE)
+    level = 4;
+  else
+    level = ADAPTIVE_LEVEL_MAX;
+
+  /* Then adjust for what the server can do. */
+  update_cpu_load (policy);
+  load = MAX (policy->cpu_load, (gdouble) n_compressions / policy->n_threads);
+
+  if (load >= SATURATED_LOAD || pending_requests >= 4 * policy->n_threads)
+    level = (client_rate != NULL && client_rate->rate >= GIGABIT_RATE) ? 0 : MIN (level, 1);
+  else if (load >= BUSY_LOAD)
+    level = MIN (level, EOS_COMPRESSION_LEVEL_DEFAULT);
+  else if (load < IDLE_LOAD && pending_requests <= 1)
+    level = MIN (level + 1, ADAPTIVE_LEVEL_MAX);
+
+out:
+  policy->stats[level].n_chosen++;
+  g_mutex_unlock (&policy->lock);
+
+  return level;
+}
+
+/**
+ * eos_compression_policy_note_transfer:
+ * @policy: an #EosCompressionPolicy
+ * @client_address: address of the client
+ * @bytes: number of bytes sent to the client
+ * @duration_usecs: time the connection spent sending them
+ *
+ * Records a measurement of the throughput to a client. The duration should
+ * only cover the time the connection had data to send, so that it measures
+ * the link rather than how fast the data was produced.
+ */
+void
+eos_compression_policy_note_transfer (EosCompressionPolicy *policy,
+                                      const gchar *client_address,
+                                      guint64 bytes,
+                                      gint64 duration_usecs)
+{
+  ClientRate *client_rate;
+  gdouble rate;
+  gint64 now = g_get_monotonic_time ();
+
+  g_return_if_fail (EOS_IS_COMPRESSION_POLICY (policy));
+  g_return_if_fail (client_address != NULL);
+
+  if (duration_usecs <= 0)
+    return;
+
+  rate = (gdouble) bytes * G_USEC_PER_SEC / duration_usecs;
+
+  g_mutex_lock (&policy->lock);
+
+  client_rate = g_hash_table_lookup (policy->client_rates, client_address);
+  if (client_rate == NULL)
+    {
+      /* Forget about clients not seen for a while, rather than growing
+       * forever. */
+      if (g_hash_table_size (policy->client_rates) >= MAX_CLIENTS)
+        {
+          GHashTableIter iter;
+          ClientRate *other;
+
+          g_hash_table_iter_init (&iter, policy->client_rates);
+          while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &other))
+            if (now - other->updated > CLIENT_EXPIRY_USECS)
+              g_hash_table_iter_remove (&iter);
+
+          if (g_hash_table_size (policy->client_rates) >= MAX_CLIENTS)
+            g_hash_table_remove_all (policy->client_rates);
+        }
+
+      client_rate = g_new0 (ClientRate, 1);
+      client_rate->rate = rate;
+      g_hash_table_insert (policy->client_rates, g_strdup (client_address), client_rate);
+    }
+  else
+    {
+      client_rate->rate = RATE_SMOOTHING * rate + (1 - RATE_SMOOTHING) * client_rate->rate;
+    }
+  client_rate->updated = now;
+
+  g_debug ("Throughput to %s: %.0f KiB/s (average %.0f KiB/s)",
+           client_address, rate / 1024, client_rate->rate / 1024);
+
+  g_mutex_unlock (&policy->lock);
+}
+
+/**
+ * eos_compression_policy_note_compression:
+ * @policy: an #EosCompressionPolicy
+ * @level: level the object was compressed with
+ * @uncompressed_bytes: size of the object
+ * @compressed_bytes: size of the compressed object
+ *
+ * Records the outcome of compressing an object in the statistics.
+ */
+void
+eos_compression_policy_note_compression (EosCompressionPolicy *policy,
+                                         gint level,
+                                         guint64 uncompressed_bytes,
+                                         guint64 compressed_bytes)
+{
+  g_return_if_fail (EOS_IS_COMPRESSION_POLICY (policy));
+  g_return_if_fail (level >= 0 && level <= EOS_COMPRESSION_LEVEL_MAX);
+
+  g_mutex_lock (&policy->lock);
+  policy->stats[level].n_objects++;
+  policy->stats[level].uncompressed_bytes += uncompressed_bytes;
+  policy->stats[level].compressed_bytes += compressed_bytes;
+  g_mutex_unlock (&policy->lock);
+}
+
+/**
+ * eos_compression_policy_get_stats:
+ * @policy: an #EosCompressionPolicy
+ * @level: a zlib compression level
+ * @out_n_chosen: (out) (optional): return location for the number of times
+ *    @level was chosen
+ * @out_n_objects: (out) (optional): return location for the number of objects
+ *    compressed with @level to the end
+ * @out_uncompressed_bytes: (out) (optional): return location for the total
+ *    size of those objects
+ * @out_compressed_bytes: (out) (optional): return location for their total
+ *    compressed size
+ *
+ * Gets the statistics for @level since @policy was created.
+ */
+void
+eos_compression_policy_get_stats (EosCompressionPolicy *policy,
+                                  gint level,
+                                  guint64 *out_n_chosen,
+                                  guint64 *out_n_objects,
+                                  guint64 *out_uncompressed_bytes,
+                                  guint64 *out_compressed_bytes)
+{
+  LevelStats stats;
+
+  g_return_if_fail (EOS_IS_COMPRESSION_POLICY (policy));
+  g_return_if_fail (level >= 0 && level <= EOS_COMPRESSION_LEVEL_MAX);
+
+  g_mutex_lock (&policy->lock);
+  stats = policy->stats[level];
+  g_mutex_unlock (&policy->lock);
+
+  if (out_n_chosen != NULL)
+    *out_n_chosen = stats.n_chosen;
+  if (out_n_objects != NULL)
+    *out_n_objects = stats.n_objects;
+  if (out_uncompressed_bytes != NULL)
+    *out_uncompressed_bytes = stats.uncompressed_bytes;
+  if (out_compressed_bytes != NULL)
+    *out_compressed_bytes = stats.compressed_bytes;
+}
+
+/**
+ * eos_compression_policy_format_stats:
+ * @policy: an #EosCompressionPolicy
+ *
+ * Formats the statistics of the levels which have been used, one per line,
+ * for logging.
+ *
+ * Returns: (transfer full): the statistics, or an empty string if nothing has
+ *    been compressed
+ */
+gchar *
+eos_compression_policy_format_stats (EosCompressionPolicy *policy)
+{
+  g_autoptr(GString) str = g_string_new ("");
+  gint level;
+
+  g_return_val_if_fail (EOS_IS_COMPRESSION_POLICY (policy), NULL);
+
+  g_mutex_lock (&policy->lock);
+
+  for (level = 0; level <= EOS_COMPRESSION_LEVEL_MAX; level++)
+    {
+      const LevelStats *stats = &policy->stats[level];
+
+      if (stats->n_chosen == 0 && stats->n_objects == 0)
+        continue;
+
+      g_string_append_printf (str,
+                              "level %d: chosen %" G_GUINT64_FORMAT " times, "
+                              "%" G_GUINT64_FORMAT " objects, "
+                              "%" G_GUINT64_FORMAT " → %" G_GUINT64_FORMAT " bytes "
+                              "(%.1f%%)\n",
+                              level, stats->n_chosen, stats->n_objects,
+                              stats->uncompressed_bytes, stats->compressed_bytes,
+                              (stats->uncompressed_bytes > 0) ?
+                              100.0 * stats->compressed_bytes / stats->uncompressed_bytes : 0.0);
+    }
+
+  g_mutex_unlock (&policy->lock);
+
+  return g_string_free (g_steal_pointer (&str), FALSE);
+}
@@ -0,0 +1,69 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <libeos-updater-util/refcounted.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EOS_TYPE_COMPRESSION_POLICY eos_compression_policy_get_type ()
+EOS_DECLARE_REFCOUNTED (EosCompressionPolicy, eos_compression_policy, EOS, COMPRESSION_POLICY)
+
+/* Pass as the fixed level to choose the level for each object. */
+#define EOS_COMPRESSION_LEVEL_ADAPTIVE (-1)
+
+/* The level used when nothing is known about the load or the client. */
+#define EOS_COMPRESSION_LEVEL_DEFAULT 2
+
+#define EOS_COMPRESSION_LEVEL_MAX 9
+
+EosCompressionPolicy *eos_compression_policy_new (gint fixed_level,
+                                                  guint n_threads);
+
+gboolean eos_compression_policy_is_adaptive (EosCompressionPolicy *policy);
+
+gint eos_compression_policy_choose_level (EosCompressionPolicy *policy,
+                                          const gchar *client_address,
+                                          guint pending_requests,
+                                          guint n_compressions);
+
+void eos_compression_policy_note_transfer (EosCompressionPolicy *policy,
+                                           const gchar *client_address,
+                                           guint64 bytes,
+                                           gint64 duration_usecs);
+
+void eos_compression_policy_note_compression (EosCompressionPolicy *policy,
+                                              gint level,
+                                              guint64 uncompressed_bytes,
+                                              guint64 compressed_bytes);
+
+void eos_compression_policy_get_stats (EosCompressionPolicy *policy,
+                                       gint level,
+                                       guint64 *out_n_chosen,
+                                       guint64 *out_n_objects,
+                                       guint64 *out_uncompressed_bytes,
+                                       guint64 *out_compressed_bytes);
+
+gchar *eos_compression_policy_format_stats (EosCompressionPolicy *policy);
+
+G_END_DECLS
@@ -0,0 +1,360 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-delta-generator.h"
+
+#include <string.h>
+
+/* Generates static deltas to the commit the server advertises, so that
+ * clients can download an update as a few large delta parts rather than
+ * object by object.
+ *
+ * Which deltas to generate is learnt from the requests for delta superblocks
+ * which clients make while pulling: each one names the commit the client is
+ * updating from. Deltas are generated one at a time in a worker thread, most
+ * requested source commit first, and written into the repository, from where
+ * they are served like any other delta. Each source commit is only tried
+ * once; if the delta cannot be generated (typically because the source
+ * commit is not in the repository), clients keep pulling object by object. */
+
+/* Upper bound on the number of source commits waiting for a delta, so that
+ * clients cannot make the server queue unbounded amounts of work. */
+#define MAX_PENDING_DELTAS 16
+
+/* Length of a checksum in OSTree’s modified base64 encoding. */
+#define CHECKSUM_B64_LEN 43
+
+typedef struct
+{
+  gchar *from_commit;
+  gchar *superblock_path;  /* relative to the repository */
+  guint n_requests;
+} PendingDelta;
+
+static void
+pending_delta_free (PendingDelta *pending)
+{
+  g_free (pending->from_commit);
+  g_free (pending->superblock_path);
+  g_free (pending);
+}
+
+struct _EosDeltaGenerator
+{
+  GObject parent_instance;
+
+  OstreeRepo *repo;
+  gchar *target_commit;
+  GCancellable *cancellable;
+
+  GHashTable *pending;  /* (owned) source commit → (owned) PendingDelta */
+  GHashTable *attempted;  /* (owned) set of source commits */
+  gboolean generating;
+};
+
+static void
+eos_delta_generator_dispose_impl (EosDeltaGenerator *generator)
+{
+  if (generator->cancellable != NULL)
+    g_cancellable_cancel (generator->cancellable);
+  g_clear_object (&generator->cancellable);
+  g_clear_object (&generator->repo);
+}
+
+static void
+eos_delta_generator_finalize_impl (EosDeltaGenerator *generator)
+{
+  g_clear_pointer (&generator->pending, g_hash_table_unref);
+  g_clear_pointer (&generator->attempted, g_hash_table_unref);
+  g_free (generator->target_commit);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_DELTA_GENERATOR,
+                       EosDeltaGenerator,
+                       eos_delta_generator,
+                       eos_delta_generator_dispose_impl,
+                       eos_delta_generator_finalize_impl)
+
+/**
+ * eos_delta_generator_new:
+ * @repo: the repository to read commits from and write deltas to
+ * @target_commit: checksum of the commit to generate deltas to
+ *
+ * Creates a generator for static deltas to @target_commit. Deltas are
+ * generated in worker threads, and completions are handled in the
+ * thread-default main context.
+ *
+ * Returns: (transfer full): a new generator
+ */
+EosDeltaGenerator *
+eos_delta_generator_new (OstreeRepo *repo,
+                         const gchar *target_commit)
+{
+  EosDeltaGenerator *generator;
+
+  g_return_val_if_fail (OSTREE_IS_REPO (repo), NULL);
+  g_return_val_if_fail (ostree_validate_checksum_string (target_commit, NULL), NULL);
+
+  generator = g_object_new (EOS_TYPE_DELTA_GENERATOR, NULL);
+  generator->repo = g_object_ref (repo);
+  generator->target_commit = g_strdup (target_commit);
+  generator->cancellable = g_cancellable_new ();
+  generator->pending = g_hash_table_new_full (g_str_hash,
+                                              g_str_equal,
+                                              NULL,
+                                              (GDestroyNotify) pending_delta_free);
+  generator->attempted = g_hash_table_new_full (g_str_hash,
+                                                g_str_equal,
+                                                g_free,
+                                                NULL);
+
+  return generator;
+}
+
+static gchar *
+checksum_from_b64 (const gchar *b64,
+                   gsize len)
+{
+  g_autofree gchar *terminated = NULL;
+  g_autofree guchar *bytes = NULL;
+  gsize i;
+
+  if (len != CHECKSUM_B64_LEN)
+    return NULL;
+
+  for (i = 0; i < len; i++)
+    if (!g_ascii_isalnum (b64[i]) && b64[i] != '+' && b64[i] != '_')
+      return NULL;
+
+  terminated = g_strndup (b64, len);
+  bytes = ostree_checksum_b64_to_bytes (terminated);
+
+  return ostree_checksum_from_bytes (bytes);
+}
+
+/* Parses a delta superblock path like
+ * /deltas/$FROM[0:2]/$FROM[2:]-$TO/superblock, where both checksums are in
+ * modified base64. Deltas from scratch (without $FROM) are not handled: they
+ * are as big as the whole commit, so generating them on demand is not worth
+ * it. */
+static gboolean
+parse_superblock_path (const gchar *requested_path,
+                       gchar **out_from_commit,
+                       gchar **out_to_commit)
+{
+  const gchar *prefix = "/deltas/";
+  const gchar *suffix = "/superblock";
+  const gchar *name;
+  gsize name_len;
+  g_autofree gchar *joined = NULL;
+  const gchar *separator;
+  g_autofree gchar *from_commit = NULL;
+  g_autofree gchar *to_commit = NULL;
+
+  if (!g_str_has_prefix (requested_path, prefix) ||
+      !g_str_has_suffix (requested_path, suffix))
+    return FALSE;
+
+  name = requested_path + strlen (prefix);
+  name_len = strlen (name) - strlen (suffix);
+  if (name_len < 3 || name[2] != '/')
+    return FALSE;
+
+  joined = g_strdup_printf ("%.2s%.*s", name, (gint) (name_len - 3), name + 3);
+  separator = strchr (joined, '-');
+  if (separator == NULL)
+    return FALSE;
+
+  from_commit = checksum_from_b64 (joined, separator - joined);
+  to_commit = checksum_from_b64 (separator + 1, strlen (separator + 1));
+  if (from_commit == NULL || to_commit == NULL)
+    return FALSE;
+
+  *out_from_commit = g_steal_pointer (&from_commit);
+  *out_to_commit = g_steal_pointer (&to_commit);
+  return TRUE;
+}
+
+static gboolean
+generate_delta (OstreeRepo *repo,
+                const gchar *from_commit,
+                const gchar *to_commit,
+                const gchar *superblock_path,
+                GCancellable *cancellable,
+                GError **error)
+{
+  g_autoptr(GFile) superblock = NULL;
+  g_autoptr(GVariant) params = NULL;
+  OstreeRepoCommitState state;
+
+  /* Somebody may have put the delta in place already. */
+  superblock = g_file_resolve_relative_path (ostree_repo_get_path (repo),
+                                             superblock_path);
+  if (g_file_query_exists (superblock, cancellable))
+    return TRUE;
+
+  if (!ostree_repo_load_commit (repo, from_commit, NULL, &state, error))
+    return FALSE;
+
+  if (state & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "Commit %s is only partially in the repository",
+                   from_commit);
+      return FALSE;
+    }
+
+  params = g_variant_ref_sink (g_variant_new ("a{sv}", NULL));
+
+  return ostree_repo_static_delta_generate (repo,
+                                            OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                            from_commit,
+                                            to_commit,
+                                            NULL,
+                                            params,
+                                            cancellable,
+                                            error);
+}
+
+static void
+generate_thread_func (GTask *task,
+                      gpointer source_object,
+                      gpointer task_data,
+                      GCancellable *cancellable)
+{
+  EosDeltaGenerator *generator = EOS_DELTA_GENERATOR (source_object);
+  PendingDelta *pending = task_data;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!generate_delta (generator->repo,
+                       pending->from_commit,
+                       generator->target_commit,
+                       pending->superblock_path,
+                       cancellable,
+                       &local_error))
+    g_task_return_error (task, g_steal_pointer (&local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void maybe_generate_next (EosDeltaGenerator *generator);
+
+static void
+generate_ready_cb (GObject *source_object,
+                   GAsyncResult *result,
+                   gpointer user_data)
+{
+  EosDeltaGenerator *generator = EOS_DELTA_GENERATOR (source_object);
+  PendingDelta *pending = g_task_get_task_data (G_TASK (result));
+  g_autoptr(GError) local_error = NULL;
+
+  generator->generating = FALSE;
+
+  if (!g_task_propagate_boolean (G_TASK (result), &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      g_message ("Failed to generate a static delta from %s to %s: %s",
+                 pending->from_commit, generator->target_commit,
+                 local_error->message);
+    }
+  else
+    {
+      g_message ("Generated a static delta from %s to %s",
+                 pending->from_commit, generator->target_commit);
+    }
+
+  maybe_generate_next (generator);
+}
+
+static void
+maybe_generate_next (EosDeltaGenerator *generator)
+{
+  GHashTableIter iter;
+  PendingDelta *candidate;
+  PendingDelta *next = NULL;
+  g_autoptr(GTask) task = NULL;
+
+  if (generator->generating)
+    return;
+
+  g_hash_table_iter_init (&iter, generator->pending);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &candidate))
+    if (next == NULL || candidate->n_requests > next->n_requests)
+      next = candidate;
+
+  if (next == NULL)
+    return;
+
+  g_hash_table_steal (generator->pending, next->from_commit);
+  g_hash_table_add (generator->attempted, g_strdup (next->from_commit));
+  g_debug ("Generating a static delta from %s to %s, requested %u times",
+           next->from_commit, generator->target_commit, next->n_requests);
+
+  generator->generating = TRUE;
+  task = g_task_new (generator, generator->cancellable, generate_ready_cb, NULL);
+  g_task_set_source_tag (task, maybe_generate_next);
+  g_task_set_task_data (task, next, (GDestroyNotify) pending_delta_free);
+  g_task_run_in_thread (task, generate_thread_func);
+}
+
+/**
+ * eos_delta_generator_note_request:
+ * @generator: an #EosDeltaGenerator
+ * @requested_path: path of a request to the server
+ *
+ * Records a request which the server has received. If it is for the
+ * superblock of a delta to the target commit, the delta will be generated in
+ * the background if it does not exist yet.
+ */
+void
+eos_delta_generator_note_request (EosDeltaGenerator *generator,
+                                  const gchar *requested_path)
+{
+  g_autofree gchar *from_commit = NULL;
+  g_autofree gchar *to_commit = NULL;
+  PendingDelta *pending;
+
+  g_return_if_fail (EOS_IS_DELTA_GENERATOR (generator));
+  g_return_if_fail (requested_path != NULL);
+
+  if (!parse_superblock_path (requested_path, &from_commit, &to_commit) ||
+      g_strcmp0 (to_commit, generator->target_commit) != 0 ||
+      g_strcmp0 (from_commit, to_commit) == 0 ||
+      g_hash_table_contains (generator->attempted, from_commit))
+    return;
+
+  pending = g_hash_table_lookup (generator->pending, from_commit);
+  if (pending == NULL)
+    {
+      if (g_hash_table_size (generator->pending) >= MAX_PENDING_DELTAS)
+        return;
+
+      pending = g_new0 (PendingDelta, 1);
+      pending->from_commit = g_strdup (from_commit);
+      pending->superblock_path = g_strdup (requested_path + 1);
+      g_hash_table_insert (generator->pending, pending->from_commit, pending);
+    }
+
+  pending->n_requests++;
+
+  maybe_generate_next (generator);
+}
@@ -0,0 +1,40 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <libeos-updater-util/refcounted.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+#define EOS_TYPE_DELTA_GENERATOR eos_delta_generator_get_type ()
+EOS_DECLARE_REFCOUNTED (EosDeltaGenerator, eos_delta_generator, EOS, DELTA_GENERATOR)
+
+EosDeltaGenerator *eos_delta_generator_new (OstreeRepo *repo,
+                                            const gchar *target_commit);
+
+void eos_delta_generator_note_request (EosDeltaGenerator *generator,
+                                       const gchar *requested_path);
+
+G_END_DECLS
@@ -0,0 +1,599 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-object-cache.h"
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A size-bounded, least-recently-used cache of finished object payloads,
+ * stored on disk and keyed by object name (for example,
+ * `$checksum.filez`). The layout mirrors the objects directory of a
+ * repository: the payload for `abcdef….filez` lives in `ab/cdef….filez`.
+ *
+ * Entries are written to a temporary file first and only renamed into place
+ * once complete, so a reader never sees a partially written payload. The
+ * index is protected by a mutex, so the cache can be shared between
+ * threads. */
+
+#define TMP_PREFIX "tmp-"
+
+typedef struct
+{
+  gchar *object_name;
+  guint64 size;
+  gint64 last_use;
+  GList *lru_link;
+} CacheEntry;
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_free (entry->object_name);
+  g_free (entry);
+}
+
+struct _EosObjectCache
+{
+  GObject parent_instance;
+
+  gchar *raw_directory;
+  guint64 max_size;
+
+  GMutex lock;
+  GHashTable *entries;  /* (owned) object name → (owned) CacheEntry */
+  GQueue lru;  /* (unowned) CacheEntry, most recently used first */
+  guint64 total_size;
+};
+
+struct _EosObjectCacheWriter
+{
+  EosObjectCache *cache;
+  gchar *object_name;
+  gchar *tmp_path;
+  gint fd;
+  guint64 size;
+};
+
+static void
+eos_object_cache_finalize_impl (EosObjectCache *cache)
+{
+  g_queue_clear (&cache->lru);
+  g_clear_pointer (&cache->entries, g_hash_table_unref);
+  g_mutex_clear (&cache->lock);
+  g_free (cache->raw_directory);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_OBJECT_CACHE,
+                       EosObjectCache,
+                       eos_object_cache,
+                       NULL,
+                       eos_object_cache_finalize_impl)
+
+static gchar *
+get_entry_path (EosObjectCache *cache,
+                const gchar *object_name)
+{
+  const gchar prefix[] = { object_name[0], object_name[1], '\0' };
+
+  return g_build_filename (cache->raw_directory, prefix, object_name + 2, NULL);
+}
+
+static gboolean
+object_name_is_valid (const gchar *object_name)
+{
+  return (object_name != NULL &&
+          strlen (object_name) > 2 &&
+          strchr (object_name, '/') == NULL &&
+          !g_str_has_prefix (object_name, TMP_PREFIX));
+}
+
+static void
+remove_entry_locked (EosObjectCache *cache,
+                     CacheEntry *entry)
+{
+  g_queue_delete_link (&cache->lru, entry->lru_link);
+  cache->total_size -= entry->size;
+  g_hash_table_remove (cache->entries, entry->object_name);
+}
+
+static void
+add_entry_locked (EosObjectCache *cache,
+                  CacheEntry *entry,
+                  gboolean most_recent)
+{
+  CacheEntry *old_entry = g_hash_table_lookup (cache->entries,
+                                               entry->object_name);
+
+  if (old_entry != NULL)
+    remove_entry_locked (cache, old_entry);
+
+  if (most_recent)
+    g_queue_push_head (&cache->lru, entry);
+  else
+    g_queue_push_tail (&cache->lru, entry);
+  entry->lru_link = most_recent ? cache->lru.head : cache->lru.tail;
+  cache->total_size += entry->size;
+  g_hash_table_insert (cache->entries, entry->object_name, entry);
+}
+
+static void
+evict_locked (EosObjectCache *cache)
+{
+  while (cache->total_size > cache->max_size)
+    {
+      CacheEntry *entry = g_queue_peek_tail (&cache->lru);
+      g_autofree gchar *path = NULL;
+
+      if (entry == NULL)
+        break;
+
+      path = get_entry_path (cache, entry->object_name);
+      g_debug ("Evicting %s from the object cache", entry->object_name);
+      if (g_unlink (path) != 0 && errno != ENOENT)
+        g_warning ("Failed to remove cached object %s: %s",
+                   path, g_strerror (errno));
+
+      remove_entry_locked (cache, entry);
+    }
+}
+
+static gint
+compare_entries_by_last_use (gconstpointer a_ptr,
+                             gconstpointer b_ptr)
+{
+  const CacheEntry *a = *((const CacheEntry **) a_ptr);
+  const CacheEntry *b = *((const CacheEntry **) b_ptr);
+
+  /* Most recently used first. */
+  if (a->last_use > b->last_use)
+    return -1;
+  if (a->last_use < b->last_use)
+    return 1;
+  return 0;
+}
+
+static gboolean
+scan_subdirectory (EosObjectCache *cache,
+                   const gchar *prefix,
+                   GPtrArray *found,
+                   GError **error)
+{
+  g_autofree gchar *raw_subdir = g_build_filename (cache->raw_directory,
+                                                   prefix,
+                                                   NULL);
+  g_autoptr(GDir) dir = g_dir_open (raw_subdir, 0, error);
+  const gchar *name;
+
+  if (dir == NULL)
+    return FALSE;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *path = g_build_filename (raw_subdir, name, NULL);
+      GStatBuf buf;
+      CacheEntry *entry;
+
+      if (g_lstat (path, &buf) != 0 || !S_ISREG (buf.st_mode))
+        continue;
+
+      entry = g_new0 (CacheEntry, 1);
+      entry->object_name = g_strconcat (prefix, name, NULL);
+      entry->size = buf.st_size;
+      entry->last_use = MAX (buf.st_atime, buf.st_mtime);
+      g_ptr_array_add (found, entry);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+scan_directory (EosObjectCache *cache,
+                GCancellable *cancellable,
+                GError **error)
+{
+  g_autoptr(GDir) dir = NULL;
+  g_autoptr(GPtrArray) found = NULL;
+  const gchar *name;
+  guint idx;
+
+  dir = g_dir_open (cache->raw_directory, 0, error);
+  if (dir == NULL)
+    return FALSE;
+
+  found = g_ptr_array_new ();
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          g_ptr_array_set_free_func (found, (GDestroyNotify) cache_entry_free);
+          return FALSE;
+        }
+
+      /* Left over from a writer which never finished. */
+      if (g_str_has_prefix (name, TMP_PREFIX))
+        {
+          g_autofree gchar *path = g_build_filename (cache->raw_directory,
+                                                     name,
+                                                     NULL);
+
+          g_unlink (path);
+          continue;
+        }
+
+      if (strlen (name) != 2 ||
+          !g_ascii_isxdigit (name[0]) ||
+          !g_ascii_isxdigit (name[1]))
+        continue;
+
+      if (!scan_subdirectory (cache, name, found, error))
+        {
+          g_ptr_array_set_free_func (found, (GDestroyNotify) cache_entry_free);
+          return FALSE;
+        }
+    }
+
+  g_ptr_array_sort (found, compare_entries_by_last_use);
+
+  g_mutex_lock (&cache->lock);
+  for (idx = 0; idx < found->len; ++idx)
+    add_entry_locked (cache, g_ptr_array_index (found, idx), FALSE);
+  evict_locked (cache);
+  g_mutex_unlock (&cache->lock);
+
+  g_debug ("Object cache in %s holds %u entries (%" G_GUINT64_FORMAT " bytes)",
+           cache->raw_directory, found->len, cache->total_size);
+
+  return TRUE;
+}
+
+/**
+ * eos_object_cache_new:
+ * @directory: the directory to keep the cached payloads in
+ * @max_size: the maximum total size of all the payloads, in bytes
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Creates a cache of object payloads in @directory, creating the directory if
+ * needed. Any payloads already in the directory are indexed, and the least
+ * recently used ones are removed if they exceed @max_size.
+ *
+ * Returns: (transfer full): the cache, or %NULL on error
+ */
+EosObjectCache *
+eos_object_cache_new (GFile *directory,
+                      guint64 max_size,
+                      GCancellable *cancellable,
+                      GError **error)
+{
+  g_autoptr(EosObjectCache) cache = NULL;
+  int saved_errno;
+
+  g_return_val_if_fail (G_IS_FILE (directory), NULL);
+  g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  cache = g_object_new (EOS_TYPE_OBJECT_CACHE, NULL);
+  cache->raw_directory = g_file_get_path (directory);
+  cache->max_size = max_size;
+  g_mutex_init (&cache->lock);
+  cache->entries = g_hash_table_new_full (g_str_hash,
+                                          g_str_equal,
+                                          NULL,
+                                          (GDestroyNotify) cache_entry_free);
+  g_queue_init (&cache->lru);
+
+  if (g_mkdir_with_parents (cache->raw_directory, 0755) != 0)
+    {
+      saved_errno = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to create object cache directory %s: %s",
+                   cache->raw_directory, g_strerror (saved_errno));
+      return NULL;
+    }
+
+  if (!scan_directory (cache, cancellable, error))
+    return NULL;
+
+  return g_steal_pointer (&cache);
+}
+
+/**
+ * eos_object_cache_lookup:
+ * @cache: an #EosObjectCache
+ * @object_name: the name of the object, like `$checksum.filez`
+ *
+ * Looks up the payload of @object_name in the cache and marks it as the most
+ * recently used entry.
+ *
+ * Returns: (transfer full) (nullable): a mapping of the payload, or %NULL if
+ *    it is not cached
+ */
+GMappedFile *
+eos_object_cache_lookup (EosObjectCache *cache,
+                         const gchar *object_name)
+{
+  g_autofree gchar *path = NULL;
+  g_autoptr(GMappedFile) mapping = NULL;
+  g_autoptr(GError) error = NULL;
+  CacheEntry *entry;
+
+  g_return_val_if_fail (EOS_IS_OBJECT_CACHE (cache), NULL);
+  g_return_val_if_fail (object_name_is_valid (object_name), NULL);
+
+  g_mutex_lock (&cache->lock);
+  entry = g_hash_table_lookup (cache->entries, object_name);
+  if (entry != NULL)
+    {
+      g_queue_unlink (&cache->lru, entry->lru_link);
+      g_queue_push_head_link (&cache->lru, entry->lru_link);
+    }
+  g_mutex_unlock (&cache->lock);
+
+  if (entry == NULL)
+    return NULL;
+
+  path = get_entry_path (cache, object_name);
+  mapping = g_mapped_file_new (path, FALSE, &error);
+  if (mapping == NULL)
+    {
+      /* Someone removed the file from under us; forget about it. Another
+       * thread may have evicted the entry and committed a new one for the
+       * same object since, which must be left alone, so only the entry we
+       * found is removed. It is only compared, never dereferenced, as it
+       * may have been freed. */
+      g_debug ("Failed to map cached object %s: %s", path, error->message);
+
+      g_mutex_lock (&cache->lock);
+      if (g_hash_table_lookup (cache->entries, object_name) == entry)
+        remove_entry_locked (cache, entry);
+      g_mutex_unlock (&cache->lock);
+
+      return NULL;
+    }
+
+  return g_steal_pointer (&mapping);
+}
+
+/**
+ * eos_object_cache_begin:
+ * @cache: an #EosObjectCache
+ * @object_name: the name of the object, like `$checksum.filez`
+ * @error: return location for a #GError
+ *
+ * Starts adding the payload of @object_name to the cache. Append the payload
+ * with eos_object_cache_writer_append() and make it visible with
+ * eos_object_cache_writer_commit(). Freeing the writer without committing it
+ * discards everything written so far.
+ *
+ * Returns: (transfer full): a new writer, or %NULL on error
+ */
+EosObjectCacheWriter *
+eos_object_cache_begin (EosObjectCache *cache,
+                        const gchar *object_name,
+                        GError **error)
+{
+  g_autofree gchar *tmp_path = NULL;
+  gint fd;
+  int saved_errno;
+  EosObjectCacheWriter *writer;
+
+  g_return_val_if_fail (EOS_IS_OBJECT_CACHE (cache), NULL);
+  g_return_val_if_fail (object_name_is_valid (object_name), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  tmp_path = g_build_filename (cache->raw_directory, TMP_PREFIX "XXXXXX", NULL);
+  fd = g_mkstemp (tmp_path);
+  if (fd < 0)
+    {
+      saved_errno = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to create temporary file for cached object %s: %s",
+                   object_name, g_strerror (saved_errno));
+      return NULL;
+    }
+
+  writer = g_new0 (EosObjectCacheWriter, 1);
+  writer->cache = g_object_ref (cache);
+  writer->object_name = g_strdup (object_name);
+  writer->tmp_path = g_steal_pointer (&tmp_path);
+  writer->fd = fd;
+
+  return writer;
+}
+
+/**
+ * eos_object_cache_writer_append:
+ * @writer: an #EosObjectCacheWriter
+ * @data: (array length=len): the next part of the payload
+ * @len: the length of @data
+ * @error: return location for a #GError
+ *
+ * Appends @data to the payload being written.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+eos_object_cache_writer_append (EosObjectCacheWriter *writer,
+                                gconstpointer data,
+                                gsize len,
+                                GError **error)
+{
+  const guint8 *raw = data;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+  g_return_val_if_fail (writer->fd >= 0, FALSE);
+  g_return_val_if_fail (data != NULL || len == 0, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  while (len > 0)
+    {
+      gssize written = write (writer->fd, raw, len);
+
+      if (written < 0)
+        {
+          int saved_errno = errno;
+
+          if (saved_errno == EINTR)
+            continue;
+
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                       "Failed to write cached object %s: %s",
+                       writer->object_name, g_strerror (saved_errno));
+          return FALSE;
+        }
+
+      raw += written;
+      len -= written;
+      writer->size += written;
+    }
+
+  return TRUE;
+}
+
+/**
+ * eos_object_cache_writer_get_path:
+ * @writer: an #EosObjectCacheWriter
+ *
+ * Gets the path of the temporary file the payload is being written to, so it
+ * can be checked before it is committed.
+ *
+ * Returns: the path of the temporary file
+ */
+const gchar *
+eos_object_cache_writer_get_path (EosObjectCacheWriter *writer)
+{
+  g_return_val_if_fail (writer != NULL, NULL);
+
+  return writer->tmp_path;
+}
+
+/**
+ * eos_object_cache_writer_commit:
+ * @writer: an #EosObjectCacheWriter
+ * @error: return location for a #GError
+ *
+ * Makes the payload written so far visible in the cache, evicting the least
+ * recently used entries if the cache grows too big. Payloads bigger than the
+ * whole cache are silently dropped.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+eos_object_cache_writer_commit (EosObjectCacheWriter *writer,
+                                GError **error)
+{
+  EosObjectCache *cache;
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *parent = NULL;
+  CacheEntry *entry;
+  int saved_errno;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+  g_return_val_if_fail (writer->fd >= 0, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  cache = writer->cache;
+
+  if (writer->size > cache->max_size)
+    {
+      g_debug ("Not caching %s, it is bigger than the whole cache",
+               writer->object_name);
+      return TRUE;
+    }
+
+  /* Make sure the payload hits the disk before it becomes visible, so a
+   * power cut can’t leave us serving a truncated object. */
+  if (fdatasync (writer->fd) != 0)
+    {
+      saved_errno = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to write cached object %s: %s",
+                   writer->object_name, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  if (close (writer->fd) != 0)
+    {
+      saved_errno = errno;
+      writer->fd = -1;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to write cached object %s: %s",
+                   writer->object_name, g_strerror (saved_errno));
+      return FALSE;
+    }
+  writer->fd = -1;
+
+  path = get_entry_path (cache, writer->object_name);
+  parent = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (parent, 0755) != 0 ||
+      g_rename (writer->tmp_path, path) != 0)
+    {
+      saved_errno = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to store cached object %s: %s",
+                   writer->object_name, g_strerror (saved_errno));
+      return FALSE;
+    }
+  g_clear_pointer (&writer->tmp_path, g_free);
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->object_name = g_strdup (writer->object_name);
+  entry->size = writer->size;
+  entry->last_use = g_get_real_time () / G_USEC_PER_SEC;
+
+  g_mutex_lock (&cache->lock);
+  add_entry_locked (cache, entry, TRUE);
+  evict_locked (cache);
+  g_mutex_unlock (&cache->lock);
+
+  g_debug ("Cached %s (%" G_GUINT64_FORMAT " bytes)",
+           writer->object_name, writer->size);
+
+  return TRUE;
+}
+
+/**
+ * eos_object_cache_writer_free:
+ * @writer: (transfer full): an #EosObjectCacheWriter
+ *
+ * Frees @writer. If it was not committed, the partially written payload is
+ * discarded.
+ */
+void
+eos_object_cache_writer_free (EosObjectCacheWriter *writer)
+{
+  if (writer == NULL)
+    return;
+
+  if (writer->fd >= 0)
+    close (writer->fd);
+  if (writer->tmp_path != NULL)
+    g_unlink (writer->tmp_path);
+
+  g_free (writer->tmp_path);
+  g_free (writer->object_name);
+  g_clear_object (&writer->cache);
+  g_free (writer);
+}
@@ -0,0 +1,61 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <libeos-updater-util/refcounted.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EOS_TYPE_OBJECT_CACHE eos_object_cache_get_type ()
+EOS_DECLARE_REFCOUNTED (EosObjectCache, eos_object_cache, EOS, OBJECT_CACHE)
+
+EosObjectCache *eos_object_cache_new (GFile *directory,
+                                      guint64 max_size,
+                                      GCancellable *cancellable,
+                                      GError **error);
+
+GMappedFile *eos_object_cache_lookup (EosObjectCache *cache,
+                                      const gchar *object_name);
+
+typedef struct _EosObjectCacheWriter EosObjectCacheWriter;
+
+EosObjectCacheWriter *eos_object_cache_begin (EosObjectCache *cache,
+                                              const gchar *object_name,
+                                              GError **error);
+
+gboolean eos_object_cache_writer_append (EosObjectCacheWriter *writer,
+                                         gconstpointer data,
+                                         gsize len,
+                                         GError **error);
+
+const gchar *eos_object_cache_writer_get_path (EosObjectCacheWriter *writer);
+
+gboolean eos_object_cache_writer_commit (EosObjectCacheWriter *writer,
+                                         GError **error);
+
+void eos_object_cache_writer_free (EosObjectCacheWriter *writer);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EosObjectCacheWriter, eos_object_cache_writer_free)
+
+G_END_DECLS
@@ -20,11 +20,27 @@
  * Author: Krzesimir Nowak <krzesimir@kinvolk.io>
  */
 
+#include "eos-bandwidth-scheduler.h"
+#include "eos-buffer-pool.h"
+#include "eos-cache-warmer.h"
+#include "eos-compression-policy.h"
+#include "eos-delta-generator.h"
+#include "eos-object-cache.h"
 #include "eos-repo-server.h"
+#include "eos-server-metrics.h"
 
+#include <libeos-updater-util/pack.h>
+#include <libeos-updater-util/repo-path.h>
 #include <libeos-updater-util/util.h>
 
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
 /**
  * SECTION:repo-server
@@ -38,6 +54,30 @@
  *
  * It currently only supports version 1 of the repository format
  * (`repo_version=1` in the configuration file).
+ *
+ * An archive-z2 repository (such as a mirror on a dedicated cache machine)
+ * can be served too. Its file objects are already stored in the form clients
+ * want, so they are served straight from disk (passthrough), without any
+ * compression or caching.
+ *
+ * Compressing file objects on the fly is expensive, so if
+ * #EosUpdaterRepoServer:cache-size is non-zero, the compressed payloads are
+ * kept in a least-recently-used cache on disk (see
+ * #EosUpdaterRepoServer:cache-directory) and later requests for the same
+ * object are served straight from there.
+ *
+ * Compression is done in a pool of worker threads (see
+ * #EosUpdaterRepoServer:compression-threads), so it can use all the
+ * processors in the machine.
+ *
+ * If #EosUpdaterRepoServer:upstream-url is set, the server acts as a caching
+ * proxy: objects which are not in the repository are fetched from upstream,
+ * streamed to all the clients which ask for them while they arrive, checked,
+ * and kept in the cache.
+ *
+ * If #EosUpdaterRepoServer:collect-metrics is set, the server counts its
+ * requests, their latencies, its use of the cache and its compression, and
+ * serves the counts in the Prometheus text format at `/metrics`.
  */
 
 /**
@@ -51,13 +91,86 @@ struct _EosUpdaterRepoServer
   OstreeRepo *repo;
   gchar *remote_name;
   GCancellable *cancellable;
-  gchar *cached_repo_root;
   GBytes *cached_config;
 
+  /* Whether the repository is in archive-z2 mode, in which case its file
+   * objects are stored compressed already, and .filez objects are served
+   * straight from it rather than compressed on the fly. */
+  gboolean passthrough;
+
+  /* Directories files are served from, opened with O_PATH, so looking a file
+   * up is a single openat() rather than a walk from the root. The object
+   * directories are opened the first time they are needed, as the repository
+   * only creates them when it needs them. */
+  int repo_dfd;
+  GMutex objects_dfds_lock;
+  int objects_dfds[256];  /* (owned) -1 if not open yet */
+
+  GFile *cache_directory;
+  guint64 cache_size;
+  EosObjectCache *cache;
+  EosBufferPool *buffer_pool;
+  gchar *cached_config_etag;
+
+  /* Content hashes of the files served as they are, which are only
+   * recalculated when a file changes. Accessed from worker threads. */
+  GMutex file_etags_lock;
+  GHashTable *file_etags;  /* (owned) path → (owned) FileEtag */
+
+  guint max_object_streams;
+  guint max_compressions;
+  guint n_object_streams;
+  guint n_compressions;
+
+  guint64 max_upload_rate;
+  guint64 max_client_upload_rate;
+  gchar **client_weights;
+  EosBandwidthScheduler *scheduler;  /* NULL if the bandwidth is not limited */
+
+  gchar *advertised_commit;
+  gboolean generate_deltas;
+  gboolean warm_cache;
+  EosDeltaGenerator *delta_generator;  /* NULL if deltas are not generated */
+  EosCacheWarmer *cache_warmer;  /* NULL if the cache is not warmed */
+
+  /* Objects missing from the repository are fetched from here, if set. The
+   * session is only used synchronously, from worker threads. */
+  gchar *upstream_url;
+  SoupSession *upstream_session;  /* NULL if not proxying */
+
+  gboolean collect_metrics;
+  EosServerMetrics *metrics;  /* NULL if metrics are not collected */
+
+  /* Server whose cache, scheduler and metrics are used, if any. */
+  EosUpdaterRepoServer *shared_with;
+
+  guint compression_threads;
+  gint compression_level;  /* or EOS_COMPRESSION_LEVEL_ADAPTIVE */
+  EosCompressionPolicy *compression_policy;
+  GThreadPool *compression_pool;  /* (element-type FilezReadJob) */
+  GMainContext *context;
+  GHashTable *filez_streams;  /* (owned) object name → (owned) EosFilezStream */
+  GPtrArray *stalled_filez_streams;  /* (element-type EosFilezStream) */
+  gsize filez_buffered_bytes;
+
   guint pending_requests;
   gint64 last_request_time;
 };
 
+typedef struct
+{
+  guint64 size;
+  gint64 mtime;  /* microseconds */
+  gchar *etag;
+} FileEtag;
+
+static void
+file_etag_free (FileEtag *file_etag)
+{
+  g_free (file_etag->etag);
+  g_free (file_etag);
+}
+
 static void eos_updater_repo_server_initable_iface_init (GInitableIface *initable_iface);
 
 G_DEFINE_TYPE_WITH_CODE (EosUpdaterRepoServer, eos_updater_repo_server, SOUP_TYPE_SERVER,
@@ -71,6 +184,21 @@ enum
   PROP_SERVED_REMOTE,
   PROP_PENDING_REQUESTS,
   PROP_LAST_REQUEST_TIME,
+  PROP_CACHE_DIRECTORY,
+  PROP_CACHE_SIZE,
+  PROP_COMPRESSION_THREADS,
+  PROP_COMPRESSION_LEVEL,
+  PROP_MAX_OBJECT_STREAMS,
+  PROP_MAX_COMPRESSIONS,
+  PROP_MAX_UPLOAD_RATE,
+  PROP_MAX_CLIENT_UPLOAD_RATE,
+  PROP_CLIENT_WEIGHTS,
+  PROP_ADVERTISED_COMMIT,
+  PROP_GENERATE_DELTAS,
+  PROP_WARM_CACHE,
+  PROP_UPSTREAM_URL,
+  PROP_COLLECT_METRICS,
+  PROP_SHARED_WITH,
 
   PROP_N
 };
@@ -96,7 +224,9 @@ generate_faked_config (OstreeRepo *repo,
   parent_repo_version = g_key_file_get_integer (parent_config, "core",
                                                 "repo_version", NULL);
 
-  if (parent_mode != OSTREE_REPO_MODE_BARE || parent_repo_version != 1)
+  if ((parent_mode != OSTREE_REPO_MODE_BARE &&
+       parent_mode != OSTREE_REPO_MODE_ARCHIVE_Z2) ||
+      parent_repo_version != 1)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
                    "Repository is in the wrong mode (%u) or version (%u).",
@@ -112,6 +242,10 @@ generate_faked_config (OstreeRepo *repo,
   g_key_file_set_integer (config, "core", "repo_version", 1);
   g_key_file_set_string (config, "core", "mode", "archive-z2");
 
+  /* Tell eos-updater clients they can fetch objects in packs. OSTree ignores
+   * this group. */
+  g_key_file_set_string (config, "eos-updater", "pack-path", EOS_PACK_PATH);
+
   raw = g_key_file_to_data (config, &len, &local_error);
   if (raw == NULL)
     {
@@ -127,7 +261,20 @@ generate_faked_config (OstreeRepo *repo,
 
 static void
 eos_updater_repo_server_init (EosUpdaterRepoServer *server)
-{}
+{
+  gsize i;
+
+  g_mutex_init (&server->file_etags_lock);
+  server->file_etags = g_hash_table_new_full (g_str_hash,
+                                              g_str_equal,
+                                              g_free,
+                                              (GDestroyNotify) file_etag_free);
+
+  server->repo_dfd = -1;
+  g_mutex_init (&server->objects_dfds_lock);
+  for (i = 0; i < G_N_ELEMENTS (server->objects_dfds); i++)
+    server->objects_dfds[i] = -1;
+}
 
 static void
 eos_updater_repo_server_get_property (GObject *object,
@@ -155,6 +302,66 @@ eos_updater_repo_server_get_property (GObject *object,
       g_value_set_int64 (value, server->last_request_time);
       break;
 
+    case PROP_CACHE_DIRECTORY:
+      g_value_set_object (value, server->cache_directory);
+      break;
+
+    case PROP_CACHE_SIZE:
+      g_value_set_uint64 (value, server->cache_size);
+      break;
+
+    case PROP_COMPRESSION_THREADS:
+      g_value_set_uint (value, server->compression_threads);
+      break;
+
+    case PROP_COMPRESSION_LEVEL:
+      g_value_set_int (value, server->compression_level);
+      break;
+
+    case PROP_MAX_OBJECT_STREAMS:
+      g_value_set_uint (value, server->max_object_streams);
+      break;
+
+    case PROP_MAX_COMPRESSIONS:
+      g_value_set_uint (value, server->max_compressions);
+      break;
+
+    case PROP_MAX_UPLOAD_RATE:
+      g_value_set_uint64 (value, server->max_upload_rate);
+      break;
+
+    case PROP_MAX_CLIENT_UPLOAD_RATE:
+      g_value_set_uint64 (value, server->max_client_upload_rate);
+      break;
+
+    case PROP_CLIENT_WEIGHTS:
+      g_value_set_boxed (value, server->client_weights);
+      break;
+
+    case PROP_ADVERTISED_COMMIT:
+      g_value_set_string (value, server->advertised_commit);
+      break;
+
+    case PROP_GENERATE_DELTAS:
+      g_value_set_boolean (value, server->generate_deltas);
+      break;
+
+    case PROP_WARM_CACHE:
+      g_value_set_boolean (value, server->warm_cache);
+      break;
+
+    case PROP_UPSTREAM_URL:
+      g_value_set_string (value, server->upstream_url);
+      break;
+
+    case PROP_COLLECT_METRICS:
+      g_value_set_boolean (value, server->collect_metrics);
+      break;
+
+    case PROP_SHARED_WITH:
+      g_value_set_object (value, server->shared_with);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
       break;
@@ -179,6 +386,69 @@ eos_updater_repo_server_set_property (GObject *object,
       server->remote_name = g_value_dup_string (value);
       break;
 
+    case PROP_CACHE_DIRECTORY:
+      g_set_object (&server->cache_directory, g_value_get_object (value));
+      break;
+
+    case PROP_CACHE_SIZE:
+      server->cache_size = g_value_get_uint64 (value);
+      break;
+
+    case PROP_COMPRESSION_THREADS:
+      server->compression_threads = g_value_get_uint (value);
+      break;
+
+    case PROP_COMPRESSION_LEVEL:
+      server->compression_level = g_value_get_int (value);
+      break;
+
+    case PROP_MAX_OBJECT_STREAMS:
+      server->max_object_streams = g_value_get_uint (value);
+      break;
+
+    case PROP_MAX_COMPRESSIONS:
+      server->max_compressions = g_value_get_uint (value);
+      break;
+
+    case PROP_MAX_UPLOAD_RATE:
+      server->max_upload_rate = g_value_get_uint64 (value);
+      break;
+
+    case PROP_MAX_CLIENT_UPLOAD_RATE:
+      server->max_client_upload_rate = g_value_get_uint64 (value);
+      break;
+
+    case PROP_CLIENT_WEIGHTS:
+      g_strfreev (server->client_weights);
+      server->client_weights = g_value_dup_boxed (value);
+      break;
+
+    case PROP_ADVERTISED_COMMIT:
+      g_free (server->advertised_commit);
+      server->advertised_commit = g_value_dup_string (value);
+      break;
+
+    case PROP_GENERATE_DELTAS:
+      server->generate_deltas = g_value_get_boolean (value);
+      break;
+
+    case PROP_WARM_CACHE:
+      server->warm_cache = g_value_get_boolean (value);
+      break;
+
+    case PROP_UPSTREAM_URL:
+      g_free (server->upstream_url);
+      server->upstream_url = g_value_dup_string (value);
+      break;
+
+    case PROP_COLLECT_METRICS:
+      server->collect_metrics = g_value_get_boolean (value);
+      break;
+
+    case PROP_SHARED_WITH:
+      g_set_object (&server->shared_with, g_value_get_object (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
       break;
@@ -192,17 +462,66 @@ eos_updater_repo_server_dispose (GObject *object)
 
   server->pending_requests = 0;
   server->last_request_time = 0;
+
+  /* Let the queued compression jobs finish; they hold a reference to their
+   * stream, which holds one to us, so there are none left unless we are being
+   * disposed explicitly. */
+  if (server->compression_pool != NULL)
+    g_thread_pool_free (g_steal_pointer (&server->compression_pool), FALSE, TRUE);
+
+  /* The warmer thread uses the server, so must be stopped before anything is
+   * cleared. */
+  if (server->cache_warmer != NULL)
+    eos_cache_warmer_stop (server->cache_warmer);
+  g_clear_object (&server->cache_warmer);
+
+  g_clear_object (&server->shared_with);
   g_clear_object (&server->cancellable);
   g_clear_pointer (&server->cached_config, g_bytes_unref);
+  g_clear_pointer (&server->stalled_filez_streams, g_ptr_array_unref);
+  g_clear_pointer (&server->filez_streams, g_hash_table_unref);
+  g_clear_object (&server->buffer_pool);
+  g_clear_object (&server->scheduler);
+  g_clear_object (&server->delta_generator);
+  g_clear_object (&server->upstream_session);
+  g_clear_object (&server->cache);
+  g_clear_object (&server->cache_directory);
   g_clear_object (&server->repo);
+  g_clear_pointer (&server->context, g_main_context_unref);
 }
 
 static void
 eos_updater_repo_server_finalize (GObject *object)
 {
   EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (object);
+  gsize i;
+
+  /* Worker threads may use the policy and the metrics until the very end, so
+   * they are only dropped here. */
+  if (server->compression_policy != NULL)
+    {
+      g_autofree gchar *stats = eos_compression_policy_format_stats (server->compression_policy);
 
-  g_free (server->cached_repo_root);
+      if (*stats != '\0')
+        g_message ("Compression statistics:\n%s", stats);
+      g_clear_object (&server->compression_policy);
+    }
+  g_clear_object (&server->metrics);
+
+  g_clear_pointer (&server->file_etags, g_hash_table_unref);
+  g_mutex_clear (&server->file_etags_lock);
+
+  for (i = 0; i < G_N_ELEMENTS (server->objects_dfds); i++)
+    if (server->objects_dfds[i] >= 0)
+      g_close (server->objects_dfds[i], NULL);
+  g_mutex_clear (&server->objects_dfds_lock);
+  if (server->repo_dfd >= 0)
+    g_close (server->repo_dfd, NULL);
+
+  g_free (server->advertised_commit);
+  g_free (server->upstream_url);
+  g_strfreev (server->client_weights);
+  g_free (server->cached_config_etag);
   g_free (server->remote_name);
 }
 
@@ -274,60 +593,271 @@ eos_updater_repo_server_class_init (EosUpdaterRepoServerClass *repo_server_class
                                                       G_PARAM_EXPLICIT_NOTIFY |
                                                       G_PARAM_STATIC_STRINGS);
 
-  g_object_class_install_properties (gobject_class,
-                                     PROP_N,
-                                     props);
-}
+  /**
+   * EosUpdaterRepoServer:cache-directory:
+   *
+   * The directory to keep the cache of compressed file objects in. If %NULL,
+   * `tmp/cache/eos-update-server` inside the repository is used.
+   */
+  props[PROP_CACHE_DIRECTORY] = g_param_spec_object ("cache-directory",
+                                                     "Cache directory",
+                                                     "Directory to cache compressed file objects in",
+                                                     G_TYPE_FILE,
+                                                     G_PARAM_READWRITE |
+                                                     G_PARAM_CONSTRUCT_ONLY |
+                                                     G_PARAM_STATIC_STRINGS);
 
-#define HEX_CLASS "[a-fA-F0-9]"
+  /**
+   * EosUpdaterRepoServer:cache-size:
+   *
+   * The maximum size of the cache of compressed file objects, in bytes. Zero
+   * disables the cache.
+   */
+  props[PROP_CACHE_SIZE] = g_param_spec_uint64 ("cache-size",
+                                                "Cache size",
+                                                "Maximum size of the compressed file object cache, in bytes",
+                                                0,
+                                                G_MAXUINT64,
+                                                0,
+                                                G_PARAM_READWRITE |
+                                                G_PARAM_CONSTRUCT_ONLY |
+                                                G_PARAM_STATIC_STRINGS);
 
-static GRegex *
-get_filez_regex (void)
-{
-  static gsize regex_initialized;
-  static GRegex *regex;
+  /**
+   * EosUpdaterRepoServer:compression-threads:
+   *
+   * The number of worker threads to compress file objects in. Zero means one
+   * thread per processor.
+   */
+  props[PROP_COMPRESSION_THREADS] = g_param_spec_uint ("compression-threads",
+                                                       "Compression threads",
+                                                       "Number of threads to compress file objects in, or 0 for one per processor",
+                                                       0,
+                                                       G_MAXINT,
+                                                       0,
+                                                       G_PARAM_READWRITE |
+                                                       G_PARAM_CONSTRUCT_ONLY |
+                                                       G_PARAM_STATIC_STRINGS);
 
-  if (g_once_init_enter (&regex_initialized))
-    {
-      regex = g_regex_new ("^/objects/(" HEX_CLASS "{2})/(" HEX_CLASS "{62})\\.filez$", G_REGEX_OPTIMIZE, 0, NULL);
-      g_assert (regex);
-      g_once_init_leave (&regex_initialized, 1);
-    }
+  /**
+   * EosUpdaterRepoServer:compression-level:
+   *
+   * The zlib level to compress file objects with, from 0 to 9, or -1 to
+   * choose one for each object from the
+   * load on the server and the measured throughput to the client: lower when
+   * the server is busy or the client is on a fast link, higher when the
+   * server is idle or the client is on a slow link.
+   *
+   * Adaptive compression makes the ETags of .filez objects weak, since the
+   * same object may be compressed differently each time, so interrupted
+   * downloads of them cannot be resumed with If-Range. It is therefore not
+   * the default.
+   */
+  props[PROP_COMPRESSION_LEVEL] = g_param_spec_int ("compression-level",
+                                                    "Compression level",
+                                                    "zlib level to compress file objects with, or -1 to adapt it to the load",
+                                                    EOS_COMPRESSION_LEVEL_ADAPTIVE,
+                                                    EOS_COMPRESSION_LEVEL_MAX,
+                                                    EOS_COMPRESSION_LEVEL_DEFAULT,
+                                                    G_PARAM_READWRITE |
+                                                    G_PARAM_CONSTRUCT_ONLY |
+                                                    G_PARAM_STATIC_STRINGS);
 
-  return regex;
-}
+  /**
+   * EosUpdaterRepoServer:max-object-streams:
+   *
+   * The maximum number of .filez object requests to serve at once. Further
+   * requests for .filez objects are refused with 503 Service Unavailable and
+   * a Retry-After header. Requests for metadata are not limited. Zero means no
+   * limit.
+   */
+  props[PROP_MAX_OBJECT_STREAMS] = g_param_spec_uint ("max-object-streams",
+                                                      "Max object streams",
+                                                      "Maximum number of .filez object requests to serve at once, or 0 for no limit",
+                                                      0,
+                                                      G_MAXUINT,
+                                                      0,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY |
+                                                      G_PARAM_STATIC_STRINGS);
 
-#undef HEX_CLASS
+  /**
+   * EosUpdaterRepoServer:max-compressions:
+   *
+   * The maximum number of file objects to compress at once. Requests which
+   * would need a further object to be compressed are refused with 503 Service
+   * Unavailable and a Retry-After header; requests which can be served from
+   * the cache or from a running compression are not. Zero means no limit.
+   */
+  props[PROP_MAX_COMPRESSIONS] = g_param_spec_uint ("max-compressions",
+                                                    "Max compressions",
+                                                    "Maximum number of file objects to compress at once, or 0 for no limit",
+                                                    0,
+                                                    G_MAXUINT,
+                                                    0,
+                                                    G_PARAM_READWRITE |
+                                                    G_PARAM_CONSTRUCT_ONLY |
+                                                    G_PARAM_STATIC_STRINGS);
 
-static gchar *
-get_checksum_from_filez (const gchar *filez_path,
-                         GError **error)
-{
-  g_autoptr(GMatchInfo) match = NULL;
-  g_autofree gchar *first_two = NULL;
-  g_autofree gchar *rest = NULL;
-  g_autofree gchar *checksum = NULL;
+  /**
+   * EosUpdaterRepoServer:max-upload-rate:
+   *
+   * The maximum total rate to send data to clients at, in bytes per second.
+   * The bandwidth is shared fairly between the clients (see
+   * #EosUpdaterRepoServer:client-weights). Zero means no limit.
+   */
+  props[PROP_MAX_UPLOAD_RATE] = g_param_spec_uint64 ("max-upload-rate",
+                                                     "Max upload rate",
+                                                     "Maximum total rate to send data at, in bytes per second, or 0 for no limit",
+                                                     0,
+                                                     G_MAXUINT64,
+                                                     0,
+                                                     G_PARAM_READWRITE |
+                                                     G_PARAM_CONSTRUCT_ONLY |
+                                                     G_PARAM_STATIC_STRINGS);
 
-  if (!g_regex_match (get_filez_regex (), filez_path, 0, &match))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Invalid filez path %s", filez_path);
-      return NULL;
-    }
+  /**
+   * EosUpdaterRepoServer:max-client-upload-rate:
+   *
+   * The maximum rate to send data to each client at, in bytes per second.
+   * Zero means no limit.
+   */
+  props[PROP_MAX_CLIENT_UPLOAD_RATE] = g_param_spec_uint64 ("max-client-upload-rate",
+                                                            "Max client upload rate",
+                                                            "Maximum rate to send data to each client at, in bytes per second, or 0 for no limit",
+                                                            0,
+                                                            G_MAXUINT64,
+                                                            0,
+                                                            G_PARAM_READWRITE |
+                                                            G_PARAM_CONSTRUCT_ONLY |
+                                                            G_PARAM_STATIC_STRINGS);
 
-  first_two = g_match_info_fetch (match, 1);
-  rest = g_match_info_fetch (match, 2);
-  checksum = g_strdup_printf ("%s%s", first_two, rest);
+  /**
+   * EosUpdaterRepoServer:client-weights:
+   *
+   * Relative shares of the bandwidth for particular clients, as
+   * `ADDRESS=WEIGHT` strings. Clients which are not listed have a weight of
+   * 1. Only used if #EosUpdaterRepoServer:max-upload-rate or
+   * #EosUpdaterRepoServer:max-client-upload-rate is set.
+   */
+  props[PROP_CLIENT_WEIGHTS] = g_param_spec_boxed ("client-weights",
+                                                   "Client weights",
+                                                   "Relative bandwidth shares of clients, as ADDRESS=WEIGHT strings",
+                                                   G_TYPE_STRV,
+                                                   G_PARAM_READWRITE |
+                                                   G_PARAM_CONSTRUCT_ONLY |
+                                                   G_PARAM_STATIC_STRINGS);
 
-  if (!ostree_validate_structureof_checksum_string (checksum, error))
-    return NULL;
+  /**
+   * EosUpdaterRepoServer:advertised-commit:
+   *
+   * Checksum of the commit which clients are expected to pull from this
+   * server, or %NULL if it is not known. It is needed for
+   * #EosUpdaterRepoServer:generate-deltas and
+   * #EosUpdaterRepoServer:warm-cache.
+   */
+  props[PROP_ADVERTISED_COMMIT] = g_param_spec_string ("advertised-commit",
+                                                       "Advertised commit",
+                                                       "Checksum of the commit clients are expected to pull",
+                                                       NULL,
+                                                       G_PARAM_READWRITE |
+                                                       G_PARAM_CONSTRUCT_ONLY |
+                                                       G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EosUpdaterRepoServer:generate-deltas:
+   *
+   * Whether to generate static deltas to
+   * #EosUpdaterRepoServer:advertised-commit on demand. When a client asks for
+   * a delta to it which does not exist, it is generated in the background,
+   * and served to the clients which ask for it afterwards.
+   */
+  props[PROP_GENERATE_DELTAS] = g_param_spec_boolean ("generate-deltas",
+                                                      "Generate deltas",
+                                                      "Whether to generate static deltas to the advertised commit on demand",
+                                                      FALSE,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY |
+                                                      G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EosUpdaterRepoServer:warm-cache:
+   *
+   * Whether to warm up the server for
+   * #EosUpdaterRepoServer:advertised-commit in the background while it is
+   * idle: its metadata is read ahead, and its file objects are compressed
+   * into the cache (if #EosUpdaterRepoServer:cache-size is non-zero), so
+   * that the first client to pull it does not have to wait for that.
+   */
+  props[PROP_WARM_CACHE] = g_param_spec_boolean ("warm-cache",
+                                                 "Warm cache",
+                                                 "Whether to warm up the server for the advertised commit while idle",
+                                                 FALSE,
+                                                 G_PARAM_READWRITE |
+                                                 G_PARAM_CONSTRUCT_ONLY |
+                                                 G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EosUpdaterRepoServer:upstream-url:
+   *
+   * Base URL of the repository to fetch objects from when they are not in the
+   * local repository, like `https://example.com/ostree`. Fetched objects are
+   * sent to the clients as they arrive, and kept in the object cache (see
+   * #EosUpdaterRepoServer:cache-size). If %NULL, missing objects are not
+   * found.
+   */
+  props[PROP_UPSTREAM_URL] = g_param_spec_string ("upstream-url",
+                                                  "Upstream URL",
+                                                  "Base URL of the repository to fetch missing objects from",
+                                                  NULL,
+                                                  G_PARAM_READWRITE |
+                                                  G_PARAM_CONSTRUCT_ONLY |
+                                                  G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EosUpdaterRepoServer:collect-metrics:
+   *
+   * Whether to count the requests served, their latencies, the use of the
+   * object cache and the compression done, and serve the counts at
+   * `/metrics`. If %FALSE, `/metrics` is not found.
+   */
+  props[PROP_COLLECT_METRICS] = g_param_spec_boolean ("collect-metrics",
+                                                      "Collect metrics",
+                                                      "Whether to count what the server does and serve it at /metrics",
+                                                      FALSE,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY |
+                                                      G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EosUpdaterRepoServer:shared-with:
+   *
+   * Another server in the same process to share the object cache, the
+   * bandwidth limits and the metrics of, so that several servers can serve
+   * the same repository from different threads as if they were one. If set,
+   * #EosUpdaterRepoServer:cache-directory, #EosUpdaterRepoServer:cache-size,
+   * #EosUpdaterRepoServer:max-upload-rate,
+   * #EosUpdaterRepoServer:max-client-upload-rate,
+   * #EosUpdaterRepoServer:client-weights and
+   * #EosUpdaterRepoServer:collect-metrics are taken from it and ignored here.
+   */
+  props[PROP_SHARED_WITH] = g_param_spec_object ("shared-with",
+                                                 "Shared with",
+                                                 "Server to share the object cache, bandwidth limits and metrics of",
+                                                 EOS_UPDATER_TYPE_REPO_SERVER,
+                                                 G_PARAM_READWRITE |
+                                                 G_PARAM_CONSTRUCT_ONLY |
+                                                 G_PARAM_STATIC_STRINGS);
 
-  return g_steal_pointer (&checksum);
+  g_object_class_install_properties (gobject_class,
+                                     PROP_N,
+                                     props);
 }
 
 static gboolean
 load_compressed_file_stream (OstreeRepo *repo,
                              const gchar *checksum,
+                             gint level,
                              GCancellable *cancellable,
                              GInputStream **out_input,
                              guint64 *out_uncompressed_size,
@@ -349,13 +879,13 @@ load_compressed_file_stream (OstreeRepo *repo,
                               error))
     return FALSE;
 
-  /* Use compression level 2 (the maximum is 9) as a balance between CPU usage
-   * and compression attained. This gives fairly low CPU usage (a third of
-   * what’s needed for level 9) while halving the size of the uncompressed
+  /* The level comes from the EosCompressionPolicy. Level 2 (the maximum is 9)
+   * is a balance between CPU usage and compression attained: a third of the
+   * CPU needed for level 9 while halving the size of the uncompressed
    * files. */
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
   g_variant_builder_add (&builder, "{s@v}", "compression-level",
-                         g_variant_new_variant (g_variant_new_int32 (2)));
+                         g_variant_new_variant (g_variant_new_int32 (level)));
   options = g_variant_ref_sink (g_variant_builder_end (&builder));
 
   if (!ostree_raw_file_to_archive_z2_stream_with_options (bare,
@@ -372,25 +902,6 @@ load_compressed_file_stream (OstreeRepo *repo,
   return TRUE;
 }
 
-#define EOS_TYPE_FILEZ_READ_DATA eos_filez_read_data_get_type ()
-EOS_DECLARE_REFCOUNTED (EosFilezReadData,
-                        eos_filez_read_data,
-                        EOS,
-                        FILEZ_READ_DATA)
-
-struct _EosFilezReadData
-{
-  GObject parent_instance;
-
-  EosUpdaterRepoServer *server;
-  gpointer buffer;
-  gsize buflen;
-  SoupMessage *msg;
-  gchar *filez_path;
-
-  gulong finished_signal_id;
-};
-
 static void
 update_pending_requests (EosUpdaterRepoServer *server,
                          gint                  delta)
@@ -409,381 +920,2764 @@ update_pending_requests (EosUpdaterRepoServer *server,
   server->pending_requests += delta;
   server->last_request_time = g_get_monotonic_time ();
 
+  if (server->cache_warmer != NULL)
+    eos_cache_warmer_set_busy (server->cache_warmer, server->pending_requests > 0);
+
   g_object_freeze_notify (obj);
   g_object_notify_by_pspec (obj, props[PROP_PENDING_REQUESTS]);
   g_object_notify_by_pspec (obj, props[PROP_LAST_REQUEST_TIME]);
   g_object_thaw_notify (obj);
 }
 
-static void
-eos_filez_read_data_disconnect_and_clear_msg (EosFilezReadData *read_data)
+/* CPU time used by the calling thread, in microseconds. */
+static gint64
+get_thread_cpu_usecs (void)
 {
-  if (read_data->finished_signal_id > 0)
-    g_signal_handler_disconnect (read_data->msg, read_data->finished_signal_id);
-  read_data->finished_signal_id = 0;
-  g_clear_object (&read_data->msg);
-  g_clear_object (&read_data->server);
-}
+  struct timespec ts;
 
-static void
-eos_filez_read_data_dispose_impl (EosFilezReadData *read_data)
-{
-  eos_filez_read_data_disconnect_and_clear_msg (read_data);
-}
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return 0;
 
-static void
-eos_filez_read_data_finalize_impl (EosFilezReadData *read_data)
-{
-  g_free (read_data->buffer);
-  g_free (read_data->filez_path);
+  return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
 }
 
-EOS_DEFINE_REFCOUNTED (EOS_FILEZ_READ_DATA,
-                       EosFilezReadData,
-                       eos_filez_read_data,
-                       eos_filez_read_data_dispose_impl,
-                       eos_filez_read_data_finalize_impl)
-
+/* Counts an object which has been compressed, in the policy (which chooses
+ * later levels from it) and in the metrics. */
 static void
-filez_read_data_finished_cb (SoupMessage *msg,
-                             gpointer read_data_ptr)
+note_compression (EosUpdaterRepoServer *server,
+                  gint level,
+                  guint64 uncompressed_bytes,
+                  guint64 compressed_bytes)
 {
-  EosFilezReadData *read_data = EOS_FILEZ_READ_DATA (read_data_ptr);
-
-  g_debug ("Downloading %s cancelled by client", read_data->filez_path);
-  eos_filez_read_data_disconnect_and_clear_msg (read_data);
+  eos_compression_policy_note_compression (server->compression_policy, level,
+                                           uncompressed_bytes, compressed_bytes);
+  if (server->metrics != NULL)
+    eos_server_metrics_note_compression (server->metrics, level,
+                                         uncompressed_bytes, compressed_bytes);
 }
 
-static EosFilezReadData *
-filez_read_data_new (EosUpdaterRepoServer *server,
-                     gsize buflen,
-                     SoupMessage *msg,
-                     const gchar *filez_path)
+/* Looks @object_name up in the cache, counting the hit or miss. */
+static GMappedFile *
+lookup_cached_object (EosUpdaterRepoServer *server,
+                      const gchar *object_name)
 {
-  EosFilezReadData *read_data;
+  GMappedFile *mapping = eos_object_cache_lookup (server->cache, object_name);
 
-  /* Small buffer length may happen for empty/small files, but zipping
-   * empty/small files may produce larger files, presumably due to
-   * some zlib file header or something. Let's allocate a larger
-   * buffer, so we send the short data over the socket in an ideally
-   * single step. Also, ostree adds its own headers to the stream
-   * too. */
-  if (buflen < 1024)
-    buflen = 1024;
-  read_data = g_object_new (EOS_TYPE_FILEZ_READ_DATA, NULL);
-  read_data->server = g_object_ref (server);
-  read_data->buffer = g_malloc (buflen);
-  read_data->buflen = buflen;
-  read_data->msg = g_object_ref (msg);
-  read_data->filez_path = g_strdup (filez_path);
-  read_data->finished_signal_id = g_signal_connect (msg, "finished", G_CALLBACK (filez_read_data_finished_cb), read_data);
+  if (server->metrics != NULL)
+    eos_server_metrics_note_cache_lookup (server->metrics, mapping != NULL);
 
-  return read_data;
+  return mapping;
 }
 
-static void
-filez_stream_read_chunk_cb (GObject *stream_object,
-                            GAsyncResult *result,
-                            gpointer read_data_ptr)
+/* Objects are content-addressed, so their name (checksum and type suffix) is a
+ * strong validator which never changes for a given path. Returns %NULL if
+ * @requested_path is not an object path.
+ *
+ * If the compression level is adaptive, the same .filez object may be
+ * compressed differently each time, so its bytes are only equivalent, not
+ * identical; it gets a weak validator, so that clients do not try to combine
+ * ranges of different compressions. */
+static gchar *
+get_object_etag (EosUpdaterRepoServer *server,
+                 const gchar *requested_path)
 {
-  g_autoptr(GError) error = NULL;
-  g_autoptr(EosFilezReadData) read_data = EOS_FILEZ_READ_DATA (read_data_ptr);
-  GInputStream *stream = G_INPUT_STREAM (stream_object);
-  gssize bytes_read = g_input_stream_read_finish (stream,
-                                                  result,
-                                                  &error);
-  SoupServer *server;
-
-  if (read_data->msg == NULL)
-    /* got cancelled */
-    return;
+  EosRepoPath parsed;
 
-  server = SOUP_SERVER (read_data->server);
-  if (bytes_read < 0)
+  /* /objects/ab/cdef….filez → "abcdef….filez" */
+  switch (eos_repo_path_parse (requested_path, &parsed))
     {
-      g_warning ("Failed to read the file %s: %s", read_data->filez_path, error->message);
-      soup_message_set_status (read_data->msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
-      soup_message_body_complete (read_data->msg->response_body);
-      soup_server_unpause_message (server, read_data->msg);
-      return;
-    }
-  if (bytes_read > 0)
-    {
-      gpointer buffer;
-      gsize buflen;
-      GCancellable *cancellable;
-
-      g_debug ("Read %" G_GSSIZE_FORMAT " bytes of the file %s", bytes_read, read_data->filez_path);
-      soup_message_body_append (read_data->msg->response_body,
-                                SOUP_MEMORY_COPY,
-                                read_data->buffer,
-                                bytes_read);
-      soup_server_unpause_message (server, read_data->msg);
-
-      buffer = read_data->buffer;
-      buflen = read_data->buflen;
-      cancellable = read_data->server->cancellable;
-      g_input_stream_read_async (stream,
-                                 buffer,
-                                 buflen,
-                                 G_PRIORITY_DEFAULT,
-                                 cancellable,
-                                 filez_stream_read_chunk_cb,
-                                 g_steal_pointer (&read_data));
-      return;
+    case EOS_REPO_PATH_OBJECT_FILEZ:
+      if (!server->passthrough &&
+          eos_compression_policy_is_adaptive (server->compression_policy))
+        return g_strconcat ("W/\"", parsed.checksum, parsed.suffix, "\"", NULL);
+      /* fall through */
+    case EOS_REPO_PATH_OBJECT:
+      return g_strconcat ("\"", parsed.checksum, parsed.suffix, "\"", NULL);
+    default:
+      return NULL;
     }
-  g_debug ("Finished reading file %s", read_data->filez_path);
-  soup_message_body_complete (read_data->msg->response_body);
-  soup_server_unpause_message (server, read_data->msg);
 }
 
-static void
-handle_objects_filez (EosUpdaterRepoServer *server,
-                      SoupMessage *msg,
-                      const gchar *requested_path)
+static gchar *
+get_content_etag (gconstpointer data,
+                  gsize len)
 {
-  g_autoptr(GError) error = NULL;
-  g_autofree gchar *checksum = NULL;
-  g_autoptr(GInputStream) stream = NULL;
-  gpointer buffer;
-  guint64 uncompressed_size;
-  gsize buflen;
-  g_autoptr(EosFilezReadData) read_data = NULL;
-
-  checksum = get_checksum_from_filez (requested_path,
-                                      &error);
-  if (checksum == NULL)
-    {
-      g_warning ("Failed to get checksum of the filez object %s: %s", requested_path, error->message);
-      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
-      return;
-    }
-  g_debug ("Got checksum: %s", checksum);
-
-  if (!load_compressed_file_stream (server->repo,
-                                    checksum,
-                                    server->cancellable,
-                                    &stream,
-                                    &uncompressed_size,
-                                    &error))
-    {
-      g_warning ("Failed to get stream to the filez object %s: %s", requested_path, error->message);
-      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
-      return;
-    }
+  g_autofree gchar *checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                                            data,
+                                                            len);
 
-  g_debug ("Sending %s", requested_path);
-  soup_message_headers_set_encoding (msg->response_headers,
-                                     SOUP_ENCODING_CHUNKED);
-  soup_message_set_status (msg, SOUP_STATUS_OK);
-  read_data = filez_read_data_new (server,
-                                   MIN(2 * 1024 * 1024, uncompressed_size + 1),
-                                   msg,
-                                   requested_path);
-  buffer = read_data->buffer;
-  buflen = read_data->buflen;
-  g_input_stream_read_async (stream,
-                             buffer,
-                             buflen,
-                             G_PRIORITY_DEFAULT,
-                             server->cancellable,
-                             filez_stream_read_chunk_cb,
-                             g_steal_pointer (&read_data));
-  soup_server_pause_message (SOUP_SERVER (server),
-                             msg);
-  return;
+  return g_strdup_printf ("\"%s\"", checksum);
 }
 
-static const gchar *const as_is_allowed_object_suffices[] =
-  {
-    ".commit",
-    ".commitmeta",
-    ".dirmeta",
-    ".dirtree",
-    ".sig",
-    ".sizes2",
-    NULL
-  };
-
 static gboolean
-path_is_handled_as_is (const gchar *requested_path)
+etag_list_matches (const gchar *etag_list,
+                   const gchar *etag)
 {
-  guint idx;
+  g_auto(GStrv) etags = g_strsplit (etag_list, ",", -1);
+  gsize idx;
+
+  if (g_str_has_prefix (etag, "W/"))
+    etag += 2;
 
-  if (g_str_has_prefix (requested_path, "/objects/"))
+  for (idx = 0; etags[idx] != NULL; ++idx)
     {
-      for (idx = 0; as_is_allowed_object_suffices[idx]; ++idx)
-        if (g_str_has_suffix (requested_path,
-                              as_is_allowed_object_suffices[idx]))
-          return TRUE;
+      const gchar *candidate = g_strstrip (etags[idx]);
 
-      return FALSE;
-    }
+      /* If-None-Match uses the weak comparison. */
+      if (g_str_has_prefix (candidate, "W/"))
+        candidate += 2;
 
-  if (g_str_has_prefix (requested_path, "/deltas/") ||
-      g_str_has_prefix (requested_path, "/extensions/") ||
-      g_str_equal (requested_path, "/summary") ||
-      g_str_equal (requested_path, "/summary.sig"))
-    return TRUE;
+      if (g_str_equal (candidate, "*") || g_str_equal (candidate, etag))
+        return TRUE;
+    }
 
   return FALSE;
 }
 
+/* Objects never change, so caches may keep them for good; everything else has
+ * to be revalidated (cheaply, with its ETag) before being reused. */
+static void
+set_cache_headers (SoupMessage *msg,
+                   const gchar *etag,
+                   gboolean immutable)
+{
+  soup_message_headers_replace (msg->response_headers, "ETag", etag);
+  soup_message_headers_replace (msg->response_headers,
+                                "Cache-Control",
+                                immutable ? "public, max-age=31536000, immutable" : "no-cache");
+}
+
+/* Responds with 304 Not Modified if the client already has the representation
+ * identified by @etag. The response carries the same cache headers as the
+ * full one would, so the client's copy keeps its freshness lifetime. */
 static gboolean
-serve_file_if_exists (SoupMessage *msg,
-                      const gchar *root,
-                      const gchar *raw_path,
-                      GCancellable *cancellable,
-                      gboolean *served)
+handle_not_modified (SoupMessage *msg,
+                     const gchar *etag,
+                     gboolean immutable)
 {
-  g_autoptr(GFile) path = g_file_new_for_path (raw_path);
-  g_autoptr(GFile) root_path = g_file_new_for_path (root);
-  g_autoptr(GMappedFile) mapping = NULL;
-  g_autoptr(GError) error = NULL;
-  g_autoptr(SoupBuffer) buffer = NULL;
+  const gchar *if_none_match;
 
-  /* Security check to ensure we don’t get tricked into serving files which
-   * are outside the document root. This canonicalises the paths but does not
-   * follow symlinks.
-   *
-   * FIXME: Do we also want to resolve symlinks to ensure a malicious symlink
-   * inside the root can’t cause us to serve a file from outside the root
-   * (for example, /etc/shadow)? */
-  if (!g_file_has_prefix (path, root_path))
-    {
-      g_debug ("File ‘%s’ not within root ‘%s’", raw_path, root);
-      *served = FALSE;
-      return TRUE;
-    }
+  if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD)
+    return FALSE;
 
-  if (!g_file_query_exists (path, cancellable))
-    {
-      *served = FALSE;
-      return TRUE;
-    }
+  if_none_match = soup_message_headers_get_list (msg->request_headers,
+                                                 "If-None-Match");
+  if (if_none_match == NULL || !etag_list_matches (if_none_match, etag))
+    return FALSE;
 
-  mapping = g_mapped_file_new (raw_path, FALSE, &error);
-  if (mapping == NULL)
-    {
-      g_warning ("Failed to map %s: %s", raw_path, error->message);
-      soup_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+  g_debug ("Not modified: %s", etag);
+  set_cache_headers (msg, etag, immutable);
+  soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+  return TRUE;
+}
+
+/* Upper bound on the Retry-After sent to clients when the server is busy. */
+#define MAX_RETRY_AFTER_SECS 60
+
+/* Refuses a request because the server is busy. The client is told to retry
+ * after roughly as many seconds as there are queued requests per available
+ * slot. */
+static void
+reply_busy (EosUpdaterRepoServer *server,
+            SoupMessage *msg,
+            guint limit)
+{
+  guint retry_after;
+  g_autofree gchar *retry_after_str = NULL;
+
+  retry_after = 1 + server->pending_requests / MAX (limit, 1);
+  retry_after = MIN (retry_after, MAX_RETRY_AFTER_SECS);
+  retry_after_str = g_strdup_printf ("%u", retry_after);
+
+  soup_message_headers_replace (msg->response_headers, "Retry-After", retry_after_str);
+  soup_message_set_status (msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+}
+
+static GQuark
+client_address_quark (void)
+{
+  return g_quark_from_static_string ("eos-updater-client-address");
+}
+
+static SoupBuffer *
+buffer_from_bytes (GBytes *bytes)
+{
+  gconstpointer raw;
+  gsize len;
+
+  raw = g_bytes_get_data (bytes, &len);
+  return soup_buffer_new_with_owner (raw,
+                                     len,
+                                     g_bytes_ref (bytes),
+                                     (GDestroyNotify)g_bytes_unref);
+}
+
+static void
+send_bytes (SoupMessage *msg,
+            GBytes *bytes)
+{
+  g_autoptr(SoupBuffer) buffer = buffer_from_bytes (bytes);
+
+  if (buffer->length > 0)
+    soup_message_body_append_buffer (msg->response_body, buffer);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+static void
+send_mapped_file (SoupMessage *msg,
+                  GMappedFile *mapping)
+{
+  g_autoptr(SoupBuffer) buffer = NULL;
+
+  buffer = soup_buffer_new_with_owner (g_mapped_file_get_contents (mapping),
+                                       g_mapped_file_get_length (mapping),
+                                       g_mapped_file_ref (mapping),
+                                       (GDestroyNotify)g_mapped_file_unref);
+  if (buffer->length > 0)
+    soup_message_body_append_buffer (msg->response_body, buffer);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+
+  /* The response is complete, so if the request has a Range header, libsoup
+   * turns it into a 206 (or 416) response itself. */
+  soup_message_headers_replace (msg->response_headers, "Accept-Ranges", "bytes");
+}
+
+/* The address of the client which sent @msg. */
+static const gchar *
+get_message_client_address (SoupMessage *msg)
+{
+  return g_object_get_qdata (G_OBJECT (msg), client_address_quark ());
+}
+
+/* The address of the client which sent @msg, if the bandwidth is limited.
+ * Clients get their share of the bandwidth by address. */
+static const gchar *
+get_message_scheduled_address (EosUpdaterRepoServer *server,
+                               SoupMessage *msg)
+{
+  if (server->scheduler == NULL)
+    return NULL;
+
+  return get_message_client_address (msg);
+}
+
+#define EOS_TYPE_MAPPED_READER eos_mapped_reader_get_type ()
+EOS_DECLARE_REFCOUNTED (EosMappedReader,
+                        eos_mapped_reader,
+                        EOS,
+                        MAPPED_READER)
+
+/* A mapped file being sent to a client at the pace the bandwidth scheduler
+ * allows. It is appended to the response body one
+ * EOS_BANDWIDTH_SCHEDULER_QUANTUM-sized slice at a time, each once the
+ * scheduler grants it, with at most MAPPED_READER_BUFFER_MAX bytes waiting to
+ * be written to the socket. The reader is kept alive by its signal handlers
+ * until the message finishes. */
+struct _EosMappedReader
+{
+  GObject parent_instance;
+
+  EosUpdaterRepoServer *server;
+  SoupMessage *msg;
+  SoupBuffer *contents;
+  gchar *client_address;
+  gsize appended;  /* bytes appended to the response body so far */
+  gsize written;  /* bytes written to the socket so far */
+  guint grant_id;
+
+  gulong finished_signal_id;
+  gulong wrote_chunk_signal_id;
+};
+
+#define MAPPED_READER_BUFFER_MAX (4 * EOS_BANDWIDTH_SCHEDULER_QUANTUM)
+
+static void
+eos_mapped_reader_disconnect_and_clear_msg (EosMappedReader *reader)
+{
+  if (reader->grant_id > 0)
+    eos_bandwidth_scheduler_cancel (reader->server->scheduler, reader->grant_id);
+  reader->grant_id = 0;
+  if (reader->wrote_chunk_signal_id > 0)
+    g_signal_handler_disconnect (reader->msg, reader->wrote_chunk_signal_id);
+  reader->wrote_chunk_signal_id = 0;
+  if (reader->finished_signal_id > 0)
+    g_signal_handler_disconnect (reader->msg, reader->finished_signal_id);
+  reader->finished_signal_id = 0;
+  g_clear_object (&reader->msg);
+  g_clear_object (&reader->server);
+}
+
+static void
+eos_mapped_reader_dispose_impl (EosMappedReader *reader)
+{
+  eos_mapped_reader_disconnect_and_clear_msg (reader);
+}
+
+static void
+eos_mapped_reader_finalize_impl (EosMappedReader *reader)
+{
+  g_clear_pointer (&reader->contents, soup_buffer_free);
+  g_free (reader->client_address);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_MAPPED_READER,
+                       EosMappedReader,
+                       eos_mapped_reader,
+                       eos_mapped_reader_dispose_impl,
+                       eos_mapped_reader_finalize_impl)
+
+static gsize
+mapped_reader_get_slice_size (EosMappedReader *reader,
+                              gsize offset)
+{
+  return MIN (EOS_BANDWIDTH_SCHEDULER_QUANTUM, reader->contents->length - offset);
+}
+
+static void mapped_reader_granted_cb (gsize bytes,
+                                      gpointer reader_ptr);
+
+static void
+mapped_reader_request_next_slice (EosMappedReader *reader)
+{
+  if (reader->msg == NULL ||
+      reader->grant_id > 0 ||
+      reader->appended == reader->contents->length ||
+      reader->appended - reader->written >= MAPPED_READER_BUFFER_MAX)
+    return;
+
+  reader->grant_id = eos_bandwidth_scheduler_request (reader->server->scheduler,
+                                                      reader->client_address,
+                                                      mapped_reader_get_slice_size (reader, reader->appended),
+                                                      mapped_reader_granted_cb,
+                                                      reader);
+}
+
+static void
+mapped_reader_granted_cb (gsize bytes,
+                          gpointer reader_ptr)
+{
+  EosMappedReader *reader = EOS_MAPPED_READER (reader_ptr);
+  g_autoptr(SoupBuffer) slice = NULL;
+
+  reader->grant_id = 0;
+  slice = soup_buffer_new_subbuffer (reader->contents, reader->appended, bytes);
+  soup_message_body_append_buffer (reader->msg->response_body, slice);
+  reader->appended += bytes;
+  if (reader->appended == reader->contents->length)
+    soup_message_body_complete (reader->msg->response_body);
+  soup_server_unpause_message (SOUP_SERVER (reader->server), reader->msg);
+
+  mapped_reader_request_next_slice (reader);
+}
+
+static void
+mapped_reader_wrote_chunk_cb (SoupMessage *msg,
+                              gpointer reader_ptr)
+{
+  EosMappedReader *reader = EOS_MAPPED_READER (reader_ptr);
+
+  if (reader->written == reader->appended)
+    return;
+
+  reader->written += mapped_reader_get_slice_size (reader, reader->written);
+  mapped_reader_request_next_slice (reader);
+}
+
+static void
+mapped_reader_finished_cb (SoupMessage *msg,
+                           gpointer reader_ptr)
+{
+  EosMappedReader *reader = EOS_MAPPED_READER (reader_ptr);
+
+  if (reader->written < reader->contents->length)
+    g_debug ("Sending a file cancelled by client");
+
+  /* Drops the references held by the signal handlers, which may well be the
+   * last ones. */
+  eos_mapped_reader_disconnect_and_clear_msg (reader);
+}
+
+/* Sends the whole of @mapping as the response to @msg. If the bandwidth is
+ * limited, the file is paced by the bandwidth scheduler; otherwise (and for
+ * Range requests, which libsoup can only answer from a complete body) it is
+ * appended in one go. */
+static void
+serve_mapped_file (EosUpdaterRepoServer *server,
+                   SoupMessage *msg,
+                   GMappedFile *mapping)
+{
+  const gchar *client_address = get_message_scheduled_address (server, msg);
+  EosMappedReader *reader;
+
+  if (client_address == NULL ||
+      g_mapped_file_get_length (mapping) == 0 ||
+      soup_message_headers_get_one (msg->request_headers, "Range") != NULL)
+    {
+      send_mapped_file (msg, mapping);
+      return;
+    }
+
+  reader = g_object_new (EOS_TYPE_MAPPED_READER, NULL);
+  reader->server = g_object_ref (server);
+  reader->msg = g_object_ref (msg);
+  reader->contents = soup_buffer_new_with_owner (g_mapped_file_get_contents (mapping),
+                                                 g_mapped_file_get_length (mapping),
+                                                 g_mapped_file_ref (mapping),
+                                                 (GDestroyNotify)g_mapped_file_unref);
+  reader->client_address = g_strdup (client_address);
+  reader->finished_signal_id = g_signal_connect_data (msg,
+                                                      "finished",
+                                                      G_CALLBACK (mapped_reader_finished_cb),
+                                                      g_object_ref (reader),
+                                                      (GClosureNotify) g_object_unref,
+                                                      0);
+  reader->wrote_chunk_signal_id = g_signal_connect_data (msg,
+                                                         "wrote-chunk",
+                                                         G_CALLBACK (mapped_reader_wrote_chunk_cb),
+                                                         reader,
+                                                         NULL,
+                                                         0);
+
+  /* Slices are only referenced by the mapping from now on. */
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+  soup_message_headers_set_content_length (msg->response_headers,
+                                           reader->contents->length);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+  soup_server_pause_message (SOUP_SERVER (server), msg);
+
+  mapped_reader_request_next_slice (reader);
+  g_object_unref (reader);
+}
+
+/* A message which is paused while something is being looked up for it in a
+ * worker thread. The client may go away in the meantime, in which case the
+ * message must not be touched any more. */
+typedef struct
+{
+  EosUpdaterRepoServer *server;  /* (owned) */
+  SoupMessage *msg;  /* (owned) */
+  gulong finished_signal_id;
+  gboolean finished;
+} PausedMessage;
+
+static void
+paused_message_finished_cb (SoupMessage *msg,
+                            gpointer paused_ptr)
+{
+  PausedMessage *paused = paused_ptr;
+
+  g_debug ("Request cancelled by client while looking up the response");
+  paused->finished = TRUE;
+}
+
+static PausedMessage *
+paused_message_new (EosUpdaterRepoServer *server,
+                    SoupMessage *msg)
+{
+  PausedMessage *paused = g_new0 (PausedMessage, 1);
+
+  paused->server = g_object_ref (server);
+  paused->msg = g_object_ref (msg);
+  paused->finished_signal_id = g_signal_connect (msg, "finished", G_CALLBACK (paused_message_finished_cb), paused);
+  soup_server_pause_message (SOUP_SERVER (server), msg);
+
+  return paused;
+}
+
+static void
+paused_message_free (PausedMessage *paused)
+{
+  if (paused->finished_signal_id > 0)
+    g_signal_handler_disconnect (paused->msg, paused->finished_signal_id);
+  g_clear_object (&paused->msg);
+  g_clear_object (&paused->server);
+  g_free (paused);
+}
+
+/* Unpauses the message so a response can be set on it. Returns FALSE if the
+ * client has gone away in the meantime. */
+static gboolean
+paused_message_resume (PausedMessage *paused)
+{
+  g_signal_handler_disconnect (paused->msg, paused->finished_signal_id);
+  paused->finished_signal_id = 0;
+
+  if (paused->finished)
+    return FALSE;
+
+  soup_server_unpause_message (SOUP_SERVER (paused->server), paused->msg);
+  return TRUE;
+}
+
+static void
+set_lookup_error_status (SoupMessage *msg,
+                         const GError *error)
+{
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    soup_message_set_status (msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+  else
+    soup_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+}
+
+/* A request for a .filez object which is not being served yet: either its
+ * object is being looked up in a worker thread, or it is waiting for the
+ * compression of its object to finish so a range of it can be served from the
+ * cache. When proxying, requests for other objects are handled the same way,
+ * since they may have to be fetched from upstream. */
+typedef struct
+{
+  PausedMessage *paused;  /* (owned) */
+  gchar *requested_path;
+  gchar *checksum;
+  gchar *object_name;
+  gchar *raw_path;  /* (nullable) served as it is if it exists; otherwise the object is compressed */
+  gboolean allow_range_wait;
+
+  /* The state of the server when the request arrived, to choose the
+   * compression level from. */
+  gchar *client_address;
+  guint pending_requests;
+  guint n_compressions;
+
+  /* Results. */
+  GMappedFile *mapping;
+  GInputStream *input;
+  guint64 uncompressed_size;
+  gint level;
+  gboolean from_upstream;
+} FilezOpenData;
+
+static void
+filez_open_data_free (FilezOpenData *data)
+{
+  g_clear_pointer (&data->paused, paused_message_free);
+  g_clear_pointer (&data->mapping, g_mapped_file_unref);
+  g_clear_object (&data->input);
+  g_free (data->client_address);
+  g_free (data->raw_path);
+  g_free (data->object_name);
+  g_free (data->checksum);
+  g_free (data->requested_path);
+  g_free (data);
+}
+
+/* Moves the request out of @data, leaving the results behind. */
+static FilezOpenData *
+filez_open_data_steal (FilezOpenData *data)
+{
+  FilezOpenData *new_data = g_new0 (FilezOpenData, 1);
+
+  new_data->paused = g_steal_pointer (&data->paused);
+  new_data->requested_path = g_steal_pointer (&data->requested_path);
+  new_data->checksum = g_steal_pointer (&data->checksum);
+  new_data->object_name = g_steal_pointer (&data->object_name);
+  new_data->raw_path = g_steal_pointer (&data->raw_path);
+  new_data->allow_range_wait = data->allow_range_wait;
+  new_data->client_address = g_steal_pointer (&data->client_address);
+  new_data->pending_requests = data->pending_requests;
+  new_data->n_compressions = data->n_compressions;
+
+  return new_data;
+}
+
+#define EOS_TYPE_FILEZ_STREAM eos_filez_stream_get_type ()
+EOS_DECLARE_REFCOUNTED (EosFilezStream,
+                        eos_filez_stream,
+                        EOS,
+                        FILEZ_STREAM)
+
+/* The compression of a single file object (or, when proxying, the download
+ * of an object from upstream). All the requests for the object which arrive
+ * while it is being compressed share one EosFilezStream, so the object is only
+ * compressed (or downloaded) once.
+ *
+ * Compressed chunks are kept in @chunks until every reader has written them
+ * to its socket. While the stream is still registered in the server’s
+ * filez_streams table, it also keeps the chunks which have already been
+ * written, so readers which join late can catch up by replaying them; it
+ * stops being joinable as soon as it has to drop one of those. The next
+ * chunk is only read once some reader is ready for it, so a stream only
+ * goes as fast as its fastest reader, and the total amount of buffered
+ * chunks across all streams is bounded by FILEZ_SERVER_BUFFER_MAX. */
+struct _EosFilezStream
+{
+  GObject parent_instance;
+
+  EosUpdaterRepoServer *server;
+  gchar *object_name;
+  GInputStream *input;
+  gsize buflen;
+  gpointer buffer;  /* (owned) pooled buffer of the read in progress */
+  gsize buffer_size;
+  GPtrArray *chunks;  /* (element-type GBytes) */
+  GArray *chunk_footprints;  /* (element-type gsize) memory held by each chunk */
+  guint first_chunk;  /* index of the first element of @chunks in the stream */
+  gboolean reading;
+  gboolean stalled;
+  gboolean finished;
+  GPtrArray *readers;  /* (element-type EosFilezReader) */
+  GPtrArray *range_waiters;  /* (element-type FilezOpenData) */
+  /* Appended to by the read job, in the compression thread, so only changed
+   * in the main context while no read is in flight. */
+  EosObjectCacheWriter *cache_writer;
+  gboolean from_upstream;  /* checked before it is cached */
+
+  /* For the compression statistics. */
+  gint level;
+  guint64 uncompressed_size;
+  guint64 compressed_size;
+};
+
+#define EOS_TYPE_FILEZ_READER eos_filez_reader_get_type ()
+EOS_DECLARE_REFCOUNTED (EosFilezReader,
+                        eos_filez_reader,
+                        EOS,
+                        FILEZ_READER)
+
+/* A single request being sent the output of an EosFilezStream. Chunks from
+ * @written_chunk up to (but excluding) @next_chunk have been appended to the
+ * response body, but not written to the socket yet; they take
+ * @buffered_bytes. */
+struct _EosFilezReader
+{
+  GObject parent_instance;
+
+  EosFilezStream *stream;
+  SoupMessage *msg;
+  gchar *filez_path;
+  guint next_chunk;
+  guint written_chunk;
+  gsize buffered_bytes;
+  gboolean completed;
+
+  /* Throughput measurement: only the time during which the connection had
+   * data to write is counted, so that it measures the link rather than the
+   * compression. */
+  guint64 sent_bytes;
+  gint64 busy_since;  /* monotonic time, when @buffered_bytes became non-zero */
+  gint64 busy_usecs;
+
+  /* Only set if the bandwidth is limited. */
+  gchar *client_address;
+  gsize granted_bytes;
+  guint grant_id;
+
+  gulong finished_signal_id;
+  gulong wrote_chunk_signal_id;
+};
+
+/* How much of the compressed data may be appended to a single response body
+ * and not yet written to the socket. */
+#define FILEZ_CONNECTION_BUFFER_MAX (4 * 1024 * 1024)
+/* How much of the compressed data may be held in memory by all the streams
+ * together. Streams stall when this is reached, until the data is written
+ * out to the clients. */
+#define FILEZ_SERVER_BUFFER_MAX (64 * 1024 * 1024)
+/* How much memory the buffer pool keeps around for reuse between reads. */
+#define BUFFER_POOL_MAX_FREE (16 * 1024 * 1024)
+
+static void
+filez_stream_drop_chunks (EosFilezStream *stream,
+                          guint n_chunks)
+{
+  guint idx;
+
+  for (idx = 0; idx < n_chunks; ++idx)
+    stream->server->filez_buffered_bytes -= g_array_index (stream->chunk_footprints,
+                                                           gsize, idx);
+
+  g_ptr_array_remove_range (stream->chunks, 0, n_chunks);
+  g_array_remove_range (stream->chunk_footprints, 0, n_chunks);
+  stream->first_chunk += n_chunks;
+}
+
+/* Marks the stream as no longer compressing anything. */
+static void
+filez_stream_set_finished (EosFilezStream *stream)
+{
+  if (stream->finished)
+    return;
+
+  stream->finished = TRUE;
+  g_assert (stream->server->n_compressions > 0);
+  stream->server->n_compressions--;
+}
+
+static void
+eos_filez_stream_dispose_impl (EosFilezStream *stream)
+{
+  g_clear_pointer (&stream->readers, g_ptr_array_unref);
+  g_clear_pointer (&stream->range_waiters, g_ptr_array_unref);
+  if (stream->chunks != NULL)
+    filez_stream_drop_chunks (stream, stream->chunks->len);
+  g_clear_pointer (&stream->chunks, g_ptr_array_unref);
+  g_clear_pointer (&stream->chunk_footprints, g_array_unref);
+  g_clear_object (&stream->input);
+  if (stream->server != NULL)
+    filez_stream_set_finished (stream);
+  g_clear_object (&stream->server);
+}
+
+static void
+eos_filez_stream_finalize_impl (EosFilezStream *stream)
+{
+  g_clear_pointer (&stream->cache_writer, eos_object_cache_writer_free);
+  eos_buffer_pool_release (stream->buffer);
+  g_free (stream->object_name);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_FILEZ_STREAM,
+                       EosFilezStream,
+                       eos_filez_stream,
+                       eos_filez_stream_dispose_impl,
+                       eos_filez_stream_finalize_impl)
+
+static void
+eos_filez_reader_disconnect_and_clear_msg (EosFilezReader *reader)
+{
+  if (reader->grant_id > 0)
+    eos_bandwidth_scheduler_cancel (reader->stream->server->scheduler, reader->grant_id);
+  reader->grant_id = 0;
+  if (reader->finished_signal_id > 0)
+    g_signal_handler_disconnect (reader->msg, reader->finished_signal_id);
+  reader->finished_signal_id = 0;
+  if (reader->wrote_chunk_signal_id > 0)
+    g_signal_handler_disconnect (reader->msg, reader->wrote_chunk_signal_id);
+  reader->wrote_chunk_signal_id = 0;
+  g_clear_object (&reader->msg);
+  g_clear_object (&reader->stream);
+}
+
+static void
+eos_filez_reader_dispose_impl (EosFilezReader *reader)
+{
+  eos_filez_reader_disconnect_and_clear_msg (reader);
+}
+
+static void
+eos_filez_reader_finalize_impl (EosFilezReader *reader)
+{
+  g_free (reader->client_address);
+  g_free (reader->filez_path);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_FILEZ_READER,
+                       EosFilezReader,
+                       eos_filez_reader,
+                       eos_filez_reader_dispose_impl,
+                       eos_filez_reader_finalize_impl)
+
+static guint
+filez_stream_get_end (EosFilezStream *stream)
+{
+  return stream->first_chunk + stream->chunks->len;
+}
+
+static GBytes *
+filez_stream_get_chunk (EosFilezStream *stream,
+                        guint chunk_idx)
+{
+  g_assert (chunk_idx >= stream->first_chunk);
+  g_assert (chunk_idx < filez_stream_get_end (stream));
+
+  return g_ptr_array_index (stream->chunks, chunk_idx - stream->first_chunk);
+}
+
+static gboolean
+filez_stream_is_joinable (EosFilezStream *stream)
+{
+  return g_hash_table_lookup (stream->server->filez_streams,
+                              stream->object_name) == stream;
+}
+
+static void
+filez_stream_unregister (EosFilezStream *stream)
+{
+  if (filez_stream_is_joinable (stream))
+    g_hash_table_remove (stream->server->filez_streams, stream->object_name);
+}
+
+/* Drops the chunks which have been written out by all the readers. Joinable
+ * streams keep them for late joiners, unless @force is set. Returns whether
+ * anything was dropped. */
+static gboolean
+filez_stream_release_chunks (EosFilezStream *stream,
+                             gboolean force)
+{
+  guint limit = filez_stream_get_end (stream);
+  guint idx;
+
+  if (!force && filez_stream_is_joinable (stream))
+    return FALSE;
+
+  for (idx = 0; idx < stream->readers->len; ++idx)
+    {
+      EosFilezReader *reader = g_ptr_array_index (stream->readers, idx);
+
+      limit = MIN (limit, reader->written_chunk);
+    }
+
+  if (limit == stream->first_chunk)
+    return FALSE;
+
+  /* Late joiners would miss the start of the object now. */
+  filez_stream_unregister (stream);
+  filez_stream_drop_chunks (stream, limit - stream->first_chunk);
+
+  return TRUE;
+}
+
+static void filez_reader_granted_cb (gsize bytes,
+                                     gpointer reader_ptr);
+
+/* Appends the chunks the reader has not seen yet to its response, as long as
+ * its connection is not holding too much unwritten data already (and the
+ * bandwidth scheduler allows), and completes the response once the stream has
+ * finished and everything has been appended. */
+static void
+filez_reader_send_chunks (EosFilezReader *reader)
+{
+  EosFilezStream *stream = reader->stream;
+  SoupMessage *msg = reader->msg;
+  gboolean appended = FALSE;
+
+  while (reader->next_chunk < filez_stream_get_end (stream) &&
+         reader->buffered_bytes < FILEZ_CONNECTION_BUFFER_MAX)
+    {
+      GBytes *chunk = filez_stream_get_chunk (stream, reader->next_chunk);
+      gsize chunk_size = g_bytes_get_size (chunk);
+      g_autoptr(SoupBuffer) buffer = NULL;
+
+      /* Wait for our share of the bandwidth. */
+      if (reader->client_address != NULL)
+        {
+          if (reader->granted_bytes < chunk_size)
+            {
+              if (reader->grant_id == 0)
+                reader->grant_id = eos_bandwidth_scheduler_request (stream->server->scheduler,
+                                                                    reader->client_address,
+                                                                    chunk_size - reader->granted_bytes,
+                                                                    filez_reader_granted_cb,
+                                                                    reader);
+              break;
+            }
+
+          reader->granted_bytes -= chunk_size;
+        }
+
+      buffer = buffer_from_bytes (chunk);
+      soup_message_body_append_buffer (msg->response_body, buffer);
+      if (reader->buffered_bytes == 0)
+        reader->busy_since = g_get_monotonic_time ();
+      reader->buffered_bytes += buffer->length;
+      reader->next_chunk++;
+      appended = TRUE;
+    }
+
+  if (stream->finished &&
+      !reader->completed &&
+      reader->next_chunk == filez_stream_get_end (stream))
+    {
+      soup_message_body_complete (msg->response_body);
+      reader->completed = TRUE;
+      appended = TRUE;
+    }
+
+  if (appended)
+    soup_server_unpause_message (SOUP_SERVER (stream->server), msg);
+}
+
+static void filez_stream_maybe_read_next_chunk (EosFilezStream *stream);
+
+static void
+filez_reader_granted_cb (gsize bytes,
+                         gpointer reader_ptr)
+{
+  EosFilezReader *reader = EOS_FILEZ_READER (reader_ptr);
+  g_autoptr(EosFilezStream) stream = g_object_ref (reader->stream);
+
+  reader->grant_id = 0;
+  reader->granted_bytes += bytes;
+  filez_reader_send_chunks (reader);
+  filez_stream_maybe_read_next_chunk (stream);
+}
+
+static gboolean
+filez_reader_wants_data (EosFilezReader *reader)
+{
+  return reader->next_chunk == filez_stream_get_end (reader->stream) &&
+         reader->buffered_bytes < FILEZ_CONNECTION_BUFFER_MAX;
+}
+
+static void
+server_wake_stalled_filez_streams (EosUpdaterRepoServer *server)
+{
+  g_autoptr(GPtrArray) stalled = NULL;
+  guint idx;
+
+  if (server->stalled_filez_streams->len == 0)
+    return;
+
+  stalled = g_steal_pointer (&server->stalled_filez_streams);
+  server->stalled_filez_streams = object_array_new ();
+
+  for (idx = 0; idx < stalled->len; ++idx)
+    {
+      EosFilezStream *stream = g_ptr_array_index (stalled, idx);
+
+      stream->stalled = FALSE;
+      filez_stream_maybe_read_next_chunk (stream);
+    }
+}
+
+/* Tries to get under FILEZ_SERVER_BUFFER_MAX by dropping the chunks which are
+ * only kept around for late joiners. */
+static gboolean
+server_reclaim_filez_buffers (EosUpdaterRepoServer *server)
+{
+  g_autoptr(GList) streams = NULL;
+  GList *l;
+
+  streams = g_hash_table_get_values (server->filez_streams);
+  for (l = streams; l != NULL; l = l->next)
+    {
+      g_autoptr(EosFilezStream) stream = g_object_ref (l->data);
+
+      if (server->filez_buffered_bytes < FILEZ_SERVER_BUFFER_MAX)
+        break;
+      filez_stream_release_chunks (stream, TRUE);
+    }
+
+  return server->filez_buffered_bytes < FILEZ_SERVER_BUFFER_MAX;
+}
+
+static void
+filez_reader_wrote_chunk_cb (SoupMessage *msg,
+                             gpointer reader_ptr)
+{
+  EosFilezReader *reader = EOS_FILEZ_READER (reader_ptr);
+  g_autoptr(EosFilezStream) stream = g_object_ref (reader->stream);
+  GBytes *chunk;
+
+  /* The terminating chunk of the chunked encoding is not one of ours. */
+  if (reader->written_chunk == reader->next_chunk)
+    return;
+
+  chunk = filez_stream_get_chunk (stream, reader->written_chunk);
+  reader->buffered_bytes -= g_bytes_get_size (chunk);
+  reader->sent_bytes += g_bytes_get_size (chunk);
+  reader->written_chunk++;
+  if (reader->buffered_bytes == 0)
+    reader->busy_usecs += g_get_monotonic_time () - reader->busy_since;
+
+  if (filez_stream_release_chunks (stream, FALSE))
+    server_wake_stalled_filez_streams (stream->server);
+  filez_reader_send_chunks (reader);
+  filez_stream_maybe_read_next_chunk (stream);
+}
+
+/* Smaller responses mostly measure how fast the kernel buffers them, rather
+ * than the link. */
+#define MIN_MEASURED_BYTES (1024 * 1024)
+
+static void
+filez_reader_finished_cb (SoupMessage *msg,
+                          gpointer reader_ptr)
+{
+  g_autoptr(EosFilezReader) reader = g_object_ref (EOS_FILEZ_READER (reader_ptr));
+  g_autoptr(EosFilezStream) stream = g_object_ref (reader->stream);
+
+  if (!reader->completed)
+    g_debug ("Downloading %s cancelled by client", reader->filez_path);
+  else if (reader->sent_bytes >= MIN_MEASURED_BYTES &&
+           get_message_client_address (msg) != NULL)
+    eos_compression_policy_note_transfer (stream->server->compression_policy,
+                                          get_message_client_address (msg),
+                                          reader->sent_bytes,
+                                          reader->busy_usecs);
+  if (stream->readers != NULL)
+    g_ptr_array_remove (stream->readers, reader);
+  eos_filez_reader_disconnect_and_clear_msg (reader);
+
+  if (stream->readers == NULL)
+    return;
+
+  if (filez_stream_release_chunks (stream, FALSE))
+    server_wake_stalled_filez_streams (stream->server);
+  filez_stream_maybe_read_next_chunk (stream);
+}
+
+static EosFilezReader *
+filez_reader_new (EosFilezStream *stream,
+                  SoupMessage *msg,
+                  const gchar *filez_path)
+{
+  EosFilezReader *reader;
+
+  reader = g_object_new (EOS_TYPE_FILEZ_READER, NULL);
+  reader->stream = g_object_ref (stream);
+  reader->msg = g_object_ref (msg);
+  reader->filez_path = g_strdup (filez_path);
+  reader->next_chunk = stream->first_chunk;
+  reader->written_chunk = stream->first_chunk;
+  reader->client_address = g_strdup (get_message_scheduled_address (stream->server, msg));
+  reader->finished_signal_id = g_signal_connect (msg, "finished", G_CALLBACK (filez_reader_finished_cb), reader);
+  reader->wrote_chunk_signal_id = g_signal_connect (msg, "wrote-chunk", G_CALLBACK (filez_reader_wrote_chunk_cb), reader);
+
+  /* Written chunks are only referenced by the stream from now on. */
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+
+  return reader;
+}
+
+/* Checks that an object fetched from upstream, stored at @path, has the
+ * checksum it was requested by. Signatures and the other objects which are
+ * not named after their own contents are not checked; clients check them
+ * against the commit. */
+static gboolean
+verify_upstream_object (const gchar *path,
+                        const gchar *object_name,
+                        GCancellable *cancellable,
+                        GError **error)
+{
+  g_autofree gchar *checksum = g_strndup (object_name, 64);
+  const gchar *suffix = object_name + 64;
+  g_autofree gchar *actual = NULL;
+
+  if (g_str_equal (suffix, ".filez"))
+    {
+      g_autoptr(GFile) file = g_file_new_for_path (path);
+      g_autoptr(GInputStream) input = NULL;
+      g_autoptr(GFileInfo) info = NULL;
+      g_autoptr(GVariant) xattrs = NULL;
+      g_autofree guchar *csum = NULL;
+
+      if (!ostree_content_file_parse (TRUE, file, FALSE, &input, &info, &xattrs,
+                                      cancellable, error) ||
+          !ostree_checksum_file_from_input (info, xattrs, input,
+                                            OSTREE_OBJECT_TYPE_FILE, &csum,
+                                            cancellable, error))
+        return FALSE;
+
+      actual = ostree_checksum_from_bytes (csum);
+    }
+  else if (g_str_equal (suffix, ".dirtree") ||
+           g_str_equal (suffix, ".dirmeta") ||
+           g_str_equal (suffix, ".commit"))
+    {
+      g_autoptr(GMappedFile) mapping = g_mapped_file_new (path, FALSE, error);
+
+      if (mapping == NULL)
+        return FALSE;
+
+      actual = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                            (const guchar *) g_mapped_file_get_contents (mapping),
+                                            g_mapped_file_get_length (mapping));
+    }
+  else
+    return TRUE;
+
+  if (!g_str_equal (actual, checksum))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Checksum mismatch: expected %s, got %s", checksum, actual);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Runs in a worker thread, as committing syncs the payload to disk: caches
+ * the object, checking it first if it was fetched from upstream. */
+static void
+commit_cache_thread_func (GTask *task,
+                          gpointer source_object,
+                          gpointer task_data,
+                          GCancellable *cancellable)
+{
+  EosObjectCacheWriter *writer = task_data;
+  EosFilezStream *stream = EOS_FILEZ_STREAM (source_object);
+  g_autoptr(GError) error = NULL;
+
+  if (stream->from_upstream &&
+      !verify_upstream_object (eos_object_cache_writer_get_path (writer),
+                               stream->object_name, cancellable, &error))
+    g_warning ("Not caching %s from upstream: %s", stream->object_name, error->message);
+  else if (!eos_object_cache_writer_commit (writer, &error))
+    g_warning ("Failed to cache %s: %s", stream->object_name, error->message);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void filez_stream_retry_range_waiters (EosFilezStream *stream);
+
+static void
+commit_cache_ready_cb (GObject *source_object,
+                       GAsyncResult *result,
+                       gpointer user_data)
+{
+  EosFilezStream *stream = EOS_FILEZ_STREAM (source_object);
+
+  if (stream->range_waiters != NULL)
+    filez_stream_retry_range_waiters (stream);
+}
+
+/* Commits the compressed object to the cache in a worker thread, so that
+ * syncing it to a slow disk does not hold up the other connections. The
+ * requests waiting for a range of the object are retried once it is in the
+ * cache. */
+static void
+filez_stream_commit_cache (EosFilezStream *stream)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (stream, stream->server->cancellable, commit_cache_ready_cb, NULL);
+  g_task_set_source_tag (task, filez_stream_commit_cache);
+  g_task_set_task_data (task, g_steal_pointer (&stream->cache_writer),
+                        (GDestroyNotify) eos_object_cache_writer_free);
+  g_task_run_in_thread (task, commit_cache_thread_func);
+}
+
+/* Fails all the readers of the stream with an error and drops it. */
+static void
+filez_stream_fail (EosFilezStream *stream,
+                   const GError *error)
+{
+  g_autoptr(GPtrArray) readers = g_steal_pointer (&stream->readers);
+  g_autoptr(GPtrArray) waiters = g_steal_pointer (&stream->range_waiters);
+  guint idx;
+
+  g_warning ("Failed to read the file %s: %s", stream->object_name, error->message);
+
+  filez_stream_set_finished (stream);
+  g_clear_pointer (&stream->cache_writer, eos_object_cache_writer_free);
+  filez_stream_unregister (stream);
+  filez_stream_drop_chunks (stream, stream->chunks->len);
+
+  for (idx = 0; idx < readers->len; ++idx)
+    {
+      EosFilezReader *reader = g_ptr_array_index (readers, idx);
+      SoupMessage *msg = reader->msg;
+
+      if (msg == NULL)
+        continue;
+
+      soup_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+      soup_message_body_complete (msg->response_body);
+      soup_server_unpause_message (SOUP_SERVER (stream->server), msg);
+      eos_filez_reader_disconnect_and_clear_msg (reader);
+    }
+
+  for (idx = 0; idx < waiters->len; ++idx)
+    {
+      FilezOpenData *data = g_ptr_array_index (waiters, idx);
+
+      if (paused_message_resume (data->paused))
+        soup_message_set_status (data->paused->msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+  server_wake_stalled_filez_streams (stream->server);
+}
+
+static void filez_open_start (EosUpdaterRepoServer *server,
+                              FilezOpenData *data);
+
+/* Looks the requests waiting for a range of the object up again, now that it
+ * should be in the cache. If caching it failed, they get the whole object this
+ * time, rather than waiting again. */
+static void
+filez_stream_retry_range_waiters (EosFilezStream *stream)
+{
+  g_autoptr(GPtrArray) waiters = g_steal_pointer (&stream->range_waiters);
+  guint idx;
+
+  stream->range_waiters = g_ptr_array_new_with_free_func ((GDestroyNotify) filez_open_data_free);
+
+  /* filez_open_start() takes ownership of the waiters. */
+  g_ptr_array_set_free_func (waiters, NULL);
+  for (idx = 0; idx < waiters->len; ++idx)
+    {
+      FilezOpenData *data = g_ptr_array_index (waiters, idx);
+
+      data->allow_range_wait = FALSE;
+      filez_open_start (stream->server, data);
+    }
+}
+
+/* Marks the stream as finished, so its readers complete their responses once
+ * they have sent the remaining chunks. Further requests for the object start
+ * afresh (or are served from the cache). */
+static void
+filez_stream_finish (EosFilezStream *stream)
+{
+  guint idx;
+
+  g_debug ("Finished reading file %s", stream->object_name);
+
+  filez_stream_set_finished (stream);
+  filez_stream_unregister (stream);
+
+  if (!stream->from_upstream)
+    note_compression (stream->server,
+                      stream->level,
+                      stream->uncompressed_size,
+                      stream->compressed_size);
+
+  if (stream->cache_writer != NULL)
+    filez_stream_commit_cache (stream);
+  else
+    filez_stream_retry_range_waiters (stream);
+
+  for (idx = 0; idx < stream->readers->len; ++idx)
+    filez_reader_send_chunks (g_ptr_array_index (stream->readers, idx));
+
+  if (filez_stream_release_chunks (stream, FALSE))
+    server_wake_stalled_filez_streams (stream->server);
+}
+
+/* A read of the next chunk of a stream, run in the compression thread pool.
+ * Each stream has at most one read in flight, so its chunks come back in
+ * order. */
+typedef struct
+{
+  EosFilezStream *stream;  /* (owned) */
+  gssize bytes_read;
+  GError *error;
+  GError *cache_error;
+} FilezReadJob;
+
+static void
+filez_read_job_free (FilezReadJob *job)
+{
+  g_clear_error (&job->cache_error);
+  g_clear_error (&job->error);
+  g_clear_object (&job->stream);
+  g_free (job);
+}
+
+static gboolean filez_read_job_complete_cb (gpointer job_ptr);
+
+/* Runs in a compression thread: reading from the stream is what does the
+ * compression. The chunk is appended to the cache here too, so the main
+ * context never blocks on the disk. */
+static void
+filez_read_job_run (gpointer job_ptr,
+                    gpointer server_ptr)
+{
+  FilezReadJob *job = job_ptr;
+  EosFilezStream *stream = job->stream;
+  EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (server_ptr);
+  gboolean timed = (server->metrics != NULL && !stream->from_upstream);
+  gint64 start_cpu_usecs = timed ? get_thread_cpu_usecs () : 0;
+
+  job->bytes_read = g_input_stream_read (stream->input,
+                                         stream->buffer,
+                                         stream->buffer_size,
+                                         server->cancellable,
+                                         &job->error);
+
+  if (timed)
+    eos_server_metrics_note_compression_time (server->metrics,
+                                              get_thread_cpu_usecs () - start_cpu_usecs);
+
+  if (job->bytes_read > 0 && stream->cache_writer != NULL)
+    eos_object_cache_writer_append (stream->cache_writer,
+                                    stream->buffer,
+                                    job->bytes_read,
+                                    &job->cache_error);
+
+  g_main_context_invoke_full (server->context,
+                              G_PRIORITY_DEFAULT,
+                              filez_read_job_complete_cb,
+                              job,
+                              (GDestroyNotify) filez_read_job_free);
+}
+
+/* Reads the next chunk if any reader is waiting for it (or, if nobody is
+ * waiting, the result is going to be cached) and there is room in the
+ * server-wide buffer for it. */
+static void
+filez_stream_maybe_read_next_chunk (EosFilezStream *stream)
+{
+  EosUpdaterRepoServer *server = stream->server;
+  gboolean wanted = FALSE;
+  FilezReadJob *job;
+  guint idx;
+
+  if (stream->reading || stream->finished)
+    return;
+
+  if (stream->readers->len == 0 && stream->cache_writer == NULL)
+    {
+      g_debug ("Nobody is waiting for the file %s any more", stream->object_name);
+      filez_stream_set_finished (stream);
+      filez_stream_unregister (stream);
+      filez_stream_retry_range_waiters (stream);
+      return;
+    }
+
+  wanted = (stream->readers->len == 0);
+  for (idx = 0; idx < stream->readers->len && !wanted; ++idx)
+    wanted = filez_reader_wants_data (g_ptr_array_index (stream->readers, idx));
+
+  if (!wanted)
+    return;
+
+  if (server->filez_buffered_bytes >= FILEZ_SERVER_BUFFER_MAX &&
+      !server_reclaim_filez_buffers (server))
+    {
+      g_debug ("Stalling compression of %s, %" G_GSIZE_FORMAT " bytes buffered",
+               stream->object_name, server->filez_buffered_bytes);
+      if (!stream->stalled)
+        g_ptr_array_add (server->stalled_filez_streams, g_object_ref (stream));
+      stream->stalled = TRUE;
+      return;
+    }
+
+  /* Read straight into a pooled buffer, which is then handed over to the
+   * responses without copying it. The compression itself happens in the
+   * thread pool. */
+  stream->reading = TRUE;
+  stream->buffer = eos_buffer_pool_acquire (server->buffer_pool,
+                                            stream->buflen,
+                                            &stream->buffer_size);
+  job = g_new0 (FilezReadJob, 1);
+  job->stream = g_object_ref (stream);
+  g_thread_pool_push (server->compression_pool, job, NULL);
+}
+
+/* Back in the main context with the result of a FilezReadJob. */
+static gboolean
+filez_read_job_complete_cb (gpointer job_ptr)
+{
+  FilezReadJob *job = job_ptr;
+  g_autoptr(EosFilezStream) stream = g_object_ref (job->stream);
+  gssize bytes_read = job->bytes_read;
+  const GError *error = job->error;
+  g_autoptr(GBytes) chunk = NULL;
+  gsize footprint;
+  guint idx;
+
+  stream->reading = FALSE;
+
+  if (job->cache_error != NULL)
+    {
+      g_warning ("Failed to cache %s: %s", stream->object_name, job->cache_error->message);
+      g_clear_pointer (&stream->cache_writer, eos_object_cache_writer_free);
+    }
+
+  if (bytes_read <= 0)
+    g_clear_pointer (&stream->buffer, eos_buffer_pool_release);
+
+  if (bytes_read < 0)
+    {
+      filez_stream_fail (stream, error);
+      return G_SOURCE_REMOVE;
+    }
+
+  if (bytes_read == 0)
+    {
+      filez_stream_finish (stream);
+      return G_SOURCE_REMOVE;
+    }
+
+  g_debug ("Read %" G_GSSIZE_FORMAT " bytes of the file %s", bytes_read, stream->object_name);
+
+  /* Reads are often short: the first is just the ostree header, and later
+   * ones are whatever zlib has flushed. Copy those, rather than pinning a
+   * buffer of a much bigger size class for a few bytes. Either way, the
+   * memory really held is what counts against FILEZ_SERVER_BUFFER_MAX. */
+  if ((gsize) bytes_read < stream->buffer_size / 2)
+    {
+      chunk = g_bytes_new (stream->buffer, bytes_read);
+      g_clear_pointer (&stream->buffer, eos_buffer_pool_release);
+      footprint = bytes_read;
+    }
+  else
+    {
+      chunk = eos_buffer_pool_bytes_new (g_steal_pointer (&stream->buffer),
+                                         bytes_read);
+      footprint = stream->buffer_size;
+    }
+
+  g_ptr_array_add (stream->chunks, g_steal_pointer (&chunk));
+  g_array_append_val (stream->chunk_footprints, footprint);
+  stream->server->filez_buffered_bytes += footprint;
+  stream->compressed_size += bytes_read;
+
+  for (idx = 0; idx < stream->readers->len; ++idx)
+    filez_reader_send_chunks (g_ptr_array_index (stream->readers, idx));
+
+  if (filez_stream_release_chunks (stream, FALSE))
+    server_wake_stalled_filez_streams (stream->server);
+  filez_stream_maybe_read_next_chunk (stream);
+
+  return G_SOURCE_REMOVE;
+}
+
+static EosFilezStream *
+filez_stream_new (EosUpdaterRepoServer *server,
+                  const gchar *object_name,
+                  GInputStream *input,
+                  gsize buflen)
+{
+  EosFilezStream *stream;
+
+  /* Small buffer length may happen for empty/small files, but zipping
+   * empty/small files may produce larger files, presumably due to
+   * some zlib file header or something. Let's allocate a larger
+   * buffer, so we send the short data over the socket in an ideally
+   * single step. Also, ostree adds its own headers to the stream
+   * too. This is the smallest size class of the buffer pool anyway. */
+  if (buflen < 4096)
+    buflen = 4096;
+  /* Keep chunks to a size the bandwidth scheduler can share fairly. */
+  if (server->scheduler != NULL)
+    buflen = MIN (buflen, EOS_BANDWIDTH_SCHEDULER_QUANTUM);
+  stream = g_object_new (EOS_TYPE_FILEZ_STREAM, NULL);
+  stream->server = g_object_ref (server);
+  server->n_compressions++;
+  stream->object_name = g_strdup (object_name);
+  stream->input = g_object_ref (input);
+  stream->buflen = buflen;
+  stream->chunks = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+  stream->chunk_footprints = g_array_new (FALSE, FALSE, sizeof (gsize));
+  stream->readers = object_array_new ();
+  stream->range_waiters = g_ptr_array_new_with_free_func ((GDestroyNotify) filez_open_data_free);
+
+  return stream;
+}
+
+static void
+filez_stream_add_reader (EosFilezStream *stream,
+                         SoupMessage *msg,
+                         const gchar *requested_path)
+{
+  g_autoptr(EosFilezReader) reader = NULL;
+  g_autofree gchar *etag = get_object_etag (stream->server, requested_path);
+
+  g_debug ("Sending %s", requested_path);
+  set_cache_headers (msg, etag, TRUE);
+  soup_message_headers_set_encoding (msg->response_headers,
+                                     SOUP_ENCODING_CHUNKED);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+  reader = filez_reader_new (stream, msg, requested_path);
+  g_ptr_array_add (stream->readers, g_object_ref (reader));
+  soup_server_pause_message (SOUP_SERVER (stream->server),
+                             msg);
+
+  /* Replay whatever has been compressed already. */
+  filez_reader_send_chunks (reader);
+  filez_stream_maybe_read_next_chunk (stream);
+}
+
+static gboolean map_file_if_exists (EosUpdaterRepoServer *server,
+                                    const gchar *raw_path,
+                                    GCancellable *cancellable,
+                                    GMappedFile **out_mapping,
+                                    struct stat *out_stat,
+                                    GError **error);
+
+/* How long to wait for upstream before failing a request, in seconds. */
+#define UPSTREAM_TIMEOUT_SECONDS 60
+/* How many connections to upstream may be open at once, if the number of
+ * compressions is not limited. */
+#define UPSTREAM_MAX_CONNECTIONS 16
+
+/* How much to read from upstream at once if it does not say how big the
+ * object is. */
+#define UPSTREAM_READ_SIZE (64 * 1024)
+
+/* Runs in a worker thread: requests @requested_path from upstream. The body of
+ * the response is read later, as the clients are ready for it. @out_size is
+ * only used to size the reads. */
+static gboolean
+open_upstream_object (EosUpdaterRepoServer *server,
+                      const gchar *requested_path,
+                      GCancellable *cancellable,
+                      GInputStream **out_input,
+                      guint64 *out_size,
+                      GError **error)
+{
+  g_autofree gchar *url = g_strconcat (server->upstream_url, requested_path, NULL);
+  g_autoptr(SoupMessage) msg = NULL;
+  g_autoptr(GInputStream) input = NULL;
+
+  msg = soup_message_new (SOUP_METHOD_GET, url);
+  if (msg == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid upstream URL %s", url);
+      return FALSE;
+    }
+
+  g_debug ("Fetching %s from upstream", url);
+  input = soup_session_send (server->upstream_session, msg, cancellable, error);
+  if (input == NULL)
+    return FALSE;
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    {
+      g_set_error (error, G_IO_ERROR,
+                   (msg->status_code == SOUP_STATUS_NOT_FOUND) ? G_IO_ERROR_NOT_FOUND : G_IO_ERROR_FAILED,
+                   "Failed to fetch %s from upstream: %u %s",
+                   url, msg->status_code, msg->reason_phrase);
       return FALSE;
     }
 
-  g_debug ("Serving %s", raw_path);
-  buffer = soup_buffer_new_with_owner (g_mapped_file_get_contents (mapping),
-                                       g_mapped_file_get_length (mapping),
-                                       g_mapped_file_ref (mapping),
-                                       (GDestroyNotify)g_mapped_file_unref);
-  if (buffer->length > 0)
-    soup_message_body_append_buffer (msg->response_body, buffer);
+  *out_input = g_steal_pointer (&input);
+  if (soup_message_headers_get_encoding (msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH)
+    *out_size = soup_message_headers_get_content_length (msg->response_headers);
+  else
+    *out_size = UPSTREAM_READ_SIZE;
+  return TRUE;
+}
+
+/* Runs in a worker thread: looks the object up in the repository (if it is
+ * served as it is) and in the cache, or opens the file object so it can be
+ * compressed, or if it is missing, requests it from upstream. */
+static void
+filez_open_thread_func (GTask *task,
+                        gpointer source_object,
+                        gpointer task_data,
+                        GCancellable *cancellable)
+{
+  EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (source_object);
+  FilezOpenData *data = task_data;
+  g_autoptr(GError) local_error = NULL;
+
+  if (data->raw_path != NULL)
+    {
+      struct stat stat_buf;
+
+      if (!map_file_if_exists (server, data->raw_path, cancellable,
+                               &data->mapping, &stat_buf, &local_error))
+        {
+          g_task_return_error (task, g_steal_pointer (&local_error));
+          return;
+        }
+
+      if (data->mapping != NULL)
+        {
+          g_task_return_boolean (task, TRUE);
+          return;
+        }
+    }
+
+  if (server->cache != NULL)
+    {
+      data->mapping = lookup_cached_object (server, data->object_name);
+      if (data->mapping != NULL)
+        {
+          g_task_return_boolean (task, TRUE);
+          return;
+        }
+    }
+
+  if (data->raw_path == NULL)
+    {
+      data->level = eos_compression_policy_choose_level (server->compression_policy,
+                                                        data->client_address,
+                                                        data->pending_requests,
+                                                        data->n_compressions);
+      g_debug ("Compressing %s with level %d", data->object_name, data->level);
+
+      if (load_compressed_file_stream (server->repo,
+                                       data->checksum,
+                                       data->level,
+                                       cancellable,
+                                       &data->input,
+                                       &data->uncompressed_size,
+                                       &local_error))
+        {
+          g_task_return_boolean (task, TRUE);
+          return;
+        }
+
+      if (server->upstream_session == NULL ||
+          !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_task_return_error (task, g_steal_pointer (&local_error));
+          return;
+        }
+
+      g_clear_error (&local_error);
+    }
+
+  if (server->upstream_session == NULL)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                               "Object %s not found", data->object_name);
+      return;
+    }
+
+  if (!open_upstream_object (server, data->requested_path, cancellable,
+                             &data->input, &data->uncompressed_size,
+                             &local_error))
+    {
+      g_task_return_error (task, g_steal_pointer (&local_error));
+      return;
+    }
+
+  data->from_upstream = TRUE;
+  g_task_return_boolean (task, TRUE);
+}
+
+/* Adds the request to the stream. Usually it is sent the compressed data as it
+ * is produced. If it asks for a range of the object, though, the offsets are
+ * only stable once the whole object has been compressed, so if the object is
+ * going to be cached, the request waits for the compression to finish and is
+ * then served from the cache. Takes ownership of @data. */
+static void
+filez_stream_add_request (EosFilezStream *stream,
+                          FilezOpenData *data)
+{
+  SoupMessage *msg = data->paused->msg;
+
+  if (data->allow_range_wait &&
+      stream->cache_writer != NULL &&
+      soup_message_headers_get_one (msg->request_headers, "Range") != NULL)
+    {
+      g_debug ("Waiting for the compression of %s to finish to serve a range of it",
+               data->requested_path);
+      g_ptr_array_add (stream->range_waiters, data);
+      filez_stream_maybe_read_next_chunk (stream);
+      return;
+    }
+
+  if (paused_message_resume (data->paused))
+    filez_stream_add_reader (stream, msg, data->requested_path);
+  filez_open_data_free (data);
+}
+
+static void
+filez_open_ready_cb (GObject *source_object,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+  EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (source_object);
+  GTask *task = G_TASK (result);
+  FilezOpenData *data = g_task_get_task_data (task);
+  SoupMessage *msg = data->paused->msg;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EosFilezStream) new_stream = NULL;
+  EosFilezStream *stream;
+
+  if (!g_task_propagate_boolean (task, &error))
+    {
+      if (!paused_message_resume (data->paused))
+        return;
+
+      g_warning ("Failed to get stream to the object %s: %s", data->requested_path, error->message);
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        soup_message_set_status (msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+      else if (server->upstream_session != NULL &&
+               !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        soup_message_set_status (msg, SOUP_STATUS_BAD_GATEWAY);
+      else
+        soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      return;
+    }
+
+  if (data->mapping != NULL)
+    {
+      g_autofree gchar *etag = get_object_etag (server, data->requested_path);
+
+      if (!paused_message_resume (data->paused))
+        return;
+
+      /* libsoup serves any requested range of a complete response itself. */
+      g_debug ("Sending %s from disk", data->requested_path);
+      set_cache_headers (msg, etag, TRUE);
+      serve_mapped_file (server, msg, data->mapping);
+      return;
+    }
+
+  if (data->paused->finished)
+    return;
+
+  /* Somebody else may have started compressing the object while we were
+   * opening it. */
+  stream = g_hash_table_lookup (server->filez_streams, data->object_name);
+  if (stream != NULL)
+    {
+      g_debug ("Joining the running compression of %s", data->requested_path);
+      filez_stream_add_request (stream, filez_open_data_steal (data));
+      return;
+    }
+
+  if (server->max_compressions > 0 &&
+      server->n_compressions >= server->max_compressions)
+    {
+      g_debug ("Too many compressions running to start one for %s",
+               data->requested_path);
+      if (paused_message_resume (data->paused))
+        reply_busy (server, msg, server->max_compressions);
+      return;
+    }
+
+  new_stream = filez_stream_new (server,
+                                 data->object_name,
+                                 data->input,
+                                 MIN(2 * 1024 * 1024, data->uncompressed_size + 1));
+  new_stream->level = data->level;
+  new_stream->uncompressed_size = data->uncompressed_size;
+  new_stream->from_upstream = data->from_upstream;
+  if (server->cache != NULL)
+    {
+      new_stream->cache_writer = eos_object_cache_begin (server->cache,
+                                                         data->object_name,
+                                                         &error);
+      if (new_stream->cache_writer == NULL)
+        {
+          g_warning ("Failed to start caching %s: %s", data->requested_path, error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  g_hash_table_insert (server->filez_streams,
+                       new_stream->object_name,
+                       g_object_ref (new_stream));
+  filez_stream_add_request (new_stream, filez_open_data_steal (data));
+}
+
+/* Looking the object up in the cache or opening it may block on the disk, so
+ * do it in a worker thread to keep serving other requests meanwhile. Takes
+ * ownership of @data. */
+static void
+filez_open_start (EosUpdaterRepoServer *server,
+                  FilezOpenData *data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (server, server->cancellable, filez_open_ready_cb, NULL);
+  g_task_set_source_tag (task, filez_open_start);
+  g_task_set_task_data (task, data, (GDestroyNotify) filez_open_data_free);
+  g_task_run_in_thread (task, filez_open_thread_func);
+}
+
+static void
+object_stream_finished_cb (SoupMessage *msg,
+                           gpointer server_ptr)
+{
+  EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (server_ptr);
+
+  g_assert (server->n_object_streams > 0);
+  server->n_object_streams--;
+}
+
+static void
+handle_objects_filez (EosUpdaterRepoServer *server,
+                      SoupMessage *msg,
+                      const gchar *requested_path,
+                      const EosRepoPath *parsed)
+{
+  g_autofree gchar *etag = NULL;
+  EosFilezStream *stream;
+  FilezOpenData *data;
+
+  g_debug ("Got checksum: %s", parsed->checksum);
+
+  /* The ETag is derived from the checksum without compressing anything. It
+   * is strong when the bytes sent are always the same: for passed-through
+   * archive-z2 objects, and when compressing at a fixed level, which is
+   * deterministic. When the level is adaptive, it is weak, since each
+   * request may be compressed at a different level. See
+   * get_object_etag(). */
+  etag = get_object_etag (server, requested_path);
+  if (handle_not_modified (msg, etag, TRUE))
+    return;
+
+  /* Only bulk .filez requests are limited, so requests for metadata are
+   * always answered promptly. */
+  if (parsed->kind == EOS_REPO_PATH_OBJECT_FILEZ)
+    {
+      if (server->max_object_streams > 0 &&
+          server->n_object_streams >= server->max_object_streams)
+        {
+          g_debug ("Too many object streams to serve %s", requested_path);
+          reply_busy (server, msg, server->max_object_streams);
+          return;
+        }
+
+      server->n_object_streams++;
+      g_signal_connect_object (msg, "finished", G_CALLBACK (object_stream_finished_cb), server, 0);
+    }
+
+  data = g_new0 (FilezOpenData, 1);
+  data->paused = paused_message_new (server, msg);
+  data->requested_path = g_strdup (requested_path);
+  data->object_name = g_strconcat (parsed->checksum, parsed->suffix, NULL);
+  data->checksum = g_strdup (parsed->checksum);
+  /* Everything but the file objects of a bare repository is stored in the
+   * form it is served in. */
+  if (parsed->kind != EOS_REPO_PATH_OBJECT_FILEZ || server->passthrough)
+    data->raw_path = g_strdup (requested_path + 1);
+  data->allow_range_wait = TRUE;
+  data->client_address = g_strdup (get_message_client_address (msg));
+  data->pending_requests = server->pending_requests;
+  data->n_compressions = server->n_compressions;
+
+  stream = g_hash_table_lookup (server->filez_streams, data->object_name);
+  if (stream != NULL)
+    {
+      g_debug ("Joining the running compression of %s", requested_path);
+      filez_stream_add_request (stream, data);
+      return;
+    }
+
+  filez_open_start (server, data);
+}
+
+/* Files bigger than this (uncompressed, or compressed if they come from the
+ * cache) are skipped in packs: they are fetched on their own, where the
+ * per-request overhead does not matter, and where they can be streamed. */
+#define PACK_MAX_FILE_SIZE (1024 * 1024)
+
+/* Objects are loaded in batches of about this many bytes, so that small
+ * objects do not each need a round trip to a worker thread. */
+#define PACK_BATCH_SIZE (256 * 1024)
+
+/* How much of a pack may be waiting to be written to the socket. */
+#define PACK_BUFFER_MAX (1024 * 1024)
+
+#define EOS_TYPE_PACK_WRITER eos_pack_writer_get_type ()
+EOS_DECLARE_REFCOUNTED (EosPackWriter,
+                        eos_pack_writer,
+                        EOS,
+                        PACK_WRITER)
+
+/* A response to a pack request (see libeos-updater-util/pack.h). Batches of
+ * frames are built in worker threads, one at a time, and appended to the
+ * response as chunks while no more than PACK_BUFFER_MAX bytes are waiting to
+ * be written. The writer is kept alive by its signal handlers until the
+ * message finishes, and by the batch being built. */
+struct _EosPackWriter
+{
+  GObject parent_instance;
+
+  EosUpdaterRepoServer *server;
+  SoupMessage *msg;
+  GCancellable *cancellable;
+  GPtrArray *object_names;  /* (element-type utf8) */
+  guint next_object;
+  gboolean loading;
+
+  GQueue chunk_sizes;  /* sizes of the appended but unwritten chunks */
+  gsize buffered_bytes;
+
+  gint level;  /* to compress file objects with */
+
+  /* Only set if the bandwidth is limited. */
+  gchar *client_address;
+  GBytes *granting;  /* batch being sent a slice at a time */
+  gsize granting_offset;  /* start of the slice waiting for its grant */
+  guint grant_id;
+
+  gulong finished_signal_id;
+  gulong wrote_chunk_signal_id;
+};
+
+static void
+eos_pack_writer_disconnect_and_clear_msg (EosPackWriter *writer)
+{
+  if (writer->grant_id > 0)
+    eos_bandwidth_scheduler_cancel (writer->server->scheduler, writer->grant_id);
+  writer->grant_id = 0;
+  if (writer->wrote_chunk_signal_id > 0)
+    g_signal_handler_disconnect (writer->msg, writer->wrote_chunk_signal_id);
+  writer->wrote_chunk_signal_id = 0;
+  if (writer->finished_signal_id > 0)
+    g_signal_handler_disconnect (writer->msg, writer->finished_signal_id);
+  writer->finished_signal_id = 0;
+  g_clear_object (&writer->msg);
+}
+
+static void
+eos_pack_writer_dispose_impl (EosPackWriter *writer)
+{
+  eos_pack_writer_disconnect_and_clear_msg (writer);
+  g_clear_object (&writer->cancellable);
+  g_clear_object (&writer->server);
+}
+
+static void
+eos_pack_writer_finalize_impl (EosPackWriter *writer)
+{
+  g_clear_pointer (&writer->granting, g_bytes_unref);
+  g_queue_clear (&writer->chunk_sizes);
+  g_clear_pointer (&writer->object_names, g_ptr_array_unref);
+  g_free (writer->client_address);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_PACK_WRITER,
+                       EosPackWriter,
+                       eos_pack_writer,
+                       eos_pack_writer_dispose_impl,
+                       eos_pack_writer_finalize_impl)
+
+/* Loads the payload of a file object for a pack. This may block, so must
+ * only be called in a worker thread. */
+static gboolean
+load_pack_file_payload (EosUpdaterRepoServer *server,
+                        const gchar *checksum,
+                        gint level,
+                        GCancellable *cancellable,
+                        EosPackFrameStatus *out_status,
+                        GBytes **out_payload,
+                        GError **error)
+{
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GOutputStream) output = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint64 uncompressed_size;
+  gint64 start_cpu_usecs;
+
+  if (server->passthrough)
+    {
+      g_autofree gchar *raw_path = g_strdup_printf ("objects/%c%c/%s.filez",
+                                                    checksum[0], checksum[1],
+                                                    checksum + 2);
+      g_autoptr(GMappedFile) mapping = NULL;
+      struct stat stat_buf;
+
+      if (!map_file_if_exists (server, raw_path, cancellable,
+                               &mapping, &stat_buf, error))
+        return FALSE;
+
+      if (mapping != NULL)
+        {
+          if (g_mapped_file_get_length (mapping) > PACK_MAX_FILE_SIZE)
+            *out_status = EOS_PACK_FRAME_STATUS_SKIPPED;
+          else
+            *out_payload = g_mapped_file_get_bytes (mapping);
+          return TRUE;
+        }
+
+      /* It may have been fetched from upstream and cached, below. */
+    }
+
+  if (server->cache != NULL)
+    {
+      g_autofree gchar *object_name = g_strconcat (checksum, ".filez", NULL);
+      g_autoptr(GMappedFile) mapping = lookup_cached_object (server, object_name);
+
+      if (mapping != NULL)
+        {
+          if (g_mapped_file_get_length (mapping) > PACK_MAX_FILE_SIZE)
+            *out_status = EOS_PACK_FRAME_STATUS_SKIPPED;
+          else
+            *out_payload = g_mapped_file_get_bytes (mapping);
+          return TRUE;
+        }
+    }
+
+  if (server->passthrough)
+    {
+      *out_status = EOS_PACK_FRAME_STATUS_MISSING;
+      return TRUE;
+    }
+
+  if (!load_compressed_file_stream (server->repo,
+                                    checksum,
+                                    level,
+                                    cancellable,
+                                    &input,
+                                    &uncompressed_size,
+                                    &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      *out_status = EOS_PACK_FRAME_STATUS_MISSING;
+      return TRUE;
+    }
+
+  if (uncompressed_size > PACK_MAX_FILE_SIZE)
+    {
+      *out_status = EOS_PACK_FRAME_STATUS_SKIPPED;
+      return TRUE;
+    }
+
+  output = g_memory_output_stream_new_resizable ();
+  start_cpu_usecs = get_thread_cpu_usecs ();
+  if (g_output_stream_splice (output,
+                              input,
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                              cancellable,
+                              error) < 0)
+    return FALSE;
+
+  if (server->metrics != NULL)
+    eos_server_metrics_note_compression_time (server->metrics,
+                                              get_thread_cpu_usecs () - start_cpu_usecs);
+
+  *out_payload = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+  note_compression (server, level, uncompressed_size,
+                    g_bytes_get_size (*out_payload));
+  return TRUE;
+}
+
+/* Appends the frame for @object_name to @frames. This may block, so must
+ * only be called in a worker thread. */
+static gboolean
+append_pack_frame (EosUpdaterRepoServer *server,
+                   const gchar *object_name,
+                   gint level,
+                   GByteArray *frames,
+                   GCancellable *cancellable,
+                   GError **error)
+{
+  EosPackFrameHeader header = { EOS_PACK_FRAME_STATUS_PRESENT, };
+  guint8 header_data[EOS_PACK_FRAME_HEADER_SIZE];
+  g_autofree gchar *checksum = NULL;
+  g_autoptr(GBytes) payload = NULL;
+
+  /* The names have been validated when parsing the request. */
+  if (!eos_pack_object_name_parse (object_name, &checksum, &header.object_type, error))
+    return FALSE;
+  g_strlcpy (header.checksum, checksum, sizeof (header.checksum));
+
+  if (header.object_type == OSTREE_OBJECT_TYPE_FILE)
+    {
+      if (!load_pack_file_payload (server, checksum, level, cancellable,
+                                   &header.status, &payload, error))
+        return FALSE;
+    }
+  else
+    {
+      g_autoptr(GVariant) variant = NULL;
+
+      /* Metadata objects are stored the same way in bare and archive-z2
+       * repositories. */
+      if (!ostree_repo_load_variant_if_exists (server->repo,
+                                               header.object_type,
+                                               checksum,
+                                               &variant,
+                                               error))
+        return FALSE;
+
+      if (variant == NULL)
+        header.status = EOS_PACK_FRAME_STATUS_MISSING;
+      else
+        payload = g_variant_get_data_as_bytes (variant);
+    }
+
+  header.length = (payload != NULL) ? g_bytes_get_size (payload) : 0;
+  eos_pack_frame_header_serialize (&header, header_data);
+  g_byte_array_append (frames, header_data, sizeof (header_data));
+  if (payload != NULL)
+    g_byte_array_append (frames,
+                         g_bytes_get_data (payload, NULL),
+                         g_bytes_get_size (payload));
+
+  return TRUE;
+}
+
+typedef struct
+{
+  GPtrArray *object_names;  /* (element-type utf8) */
+  guint start;
+  guint end;  /* set by the thread */
+} PackBatch;
+
+static void
+pack_batch_free (PackBatch *batch)
+{
+  g_ptr_array_unref (batch->object_names);
+  g_free (batch);
+}
+
+static void
+pack_batch_thread_func (GTask *task,
+                        gpointer source_object,
+                        gpointer task_data,
+                        GCancellable *cancellable)
+{
+  EosPackWriter *writer = EOS_PACK_WRITER (source_object);
+  PackBatch *batch = task_data;
+  g_autoptr(GByteArray) frames = g_byte_array_new ();
+  g_autoptr(GError) local_error = NULL;
+  guint i;
+
+  for (i = batch->start;
+       i < batch->object_names->len && frames->len < PACK_BATCH_SIZE;
+       i++)
+    {
+      if (!append_pack_frame (writer->server,
+                              g_ptr_array_index (batch->object_names, i),
+                              writer->level,
+                              frames,
+                              cancellable,
+                              &local_error))
+        {
+          g_task_return_error (task, g_steal_pointer (&local_error));
+          return;
+        }
+    }
+
+  batch->end = i;
+  g_task_return_pointer (task,
+                         g_byte_array_free_to_bytes (g_steal_pointer (&frames)),
+                         (GDestroyNotify) g_bytes_unref);
+}
+
+static void
+pack_writer_append (EosPackWriter *writer,
+                    GBytes *frames)
+{
+  g_autoptr(SoupBuffer) buffer = buffer_from_bytes (frames);
+
+  soup_message_body_append_buffer (writer->msg->response_body, buffer);
+  writer->buffered_bytes += buffer->length;
+  g_queue_push_tail (&writer->chunk_sizes, GSIZE_TO_POINTER (buffer->length));
+
+  if (writer->next_object == writer->object_names->len &&
+      writer->granting == NULL)
+    soup_message_body_complete (writer->msg->response_body);
+  soup_server_unpause_message (SOUP_SERVER (writer->server), writer->msg);
+}
+
+static void pack_writer_load_next_batch (EosPackWriter *writer);
+
+static void pack_writer_granted_cb (gsize bytes,
+                                    gpointer writer_ptr);
+
+/* Asks for the next slice of the batch being granted. A batch can be over a
+ * megabyte, so it is sent in quantum-sized slices, like everything else the
+ * scheduler shares; otherwise an uncontended client would have to wait many
+ * scheduler ticks for each batch. */
+static void
+pack_writer_request_slice (EosPackWriter *writer)
+{
+  gsize remaining = g_bytes_get_size (writer->granting) - writer->granting_offset;
+
+  writer->grant_id = eos_bandwidth_scheduler_request (writer->server->scheduler,
+                                                      writer->client_address,
+                                                      MIN (remaining, EOS_BANDWIDTH_SCHEDULER_QUANTUM),
+                                                      pack_writer_granted_cb,
+                                                      writer);
+}
+
+static void
+pack_writer_granted_cb (gsize bytes,
+                        gpointer writer_ptr)
+{
+  EosPackWriter *writer = EOS_PACK_WRITER (writer_ptr);
+  g_autoptr(GBytes) slice = NULL;
+
+  writer->grant_id = 0;
+  slice = g_bytes_new_from_bytes (writer->granting, writer->granting_offset, bytes);
+  writer->granting_offset += bytes;
+
+  if (writer->granting_offset == g_bytes_get_size (writer->granting))
+    {
+      g_clear_pointer (&writer->granting, g_bytes_unref);
+      writer->granting_offset = 0;
+    }
+
+  pack_writer_append (writer, slice);
+
+  if (writer->granting != NULL)
+    pack_writer_request_slice (writer);
+  else
+    pack_writer_load_next_batch (writer);
+}
+
+static void
+pack_batch_ready_cb (GObject *source_object,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+  EosPackWriter *writer = EOS_PACK_WRITER (source_object);
+  PackBatch *batch = g_task_get_task_data (G_TASK (result));
+  g_autoptr(GBytes) frames = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  writer->loading = FALSE;
+  frames = g_task_propagate_pointer (G_TASK (result), &local_error);
+
+  /* Client has gone away. */
+  if (writer->msg == NULL)
+    return;
+
+  if (frames == NULL)
+    {
+      /* The status has been sent already, so all we can do is end the pack
+       * early. The client notices the missing frames. */
+      g_warning ("Failed to build pack: %s", local_error->message);
+      writer->next_object = writer->object_names->len;
+      soup_message_body_complete (writer->msg->response_body);
+      soup_server_unpause_message (SOUP_SERVER (writer->server), writer->msg);
+      return;
+    }
+
+  writer->next_object = batch->end;
+
+  if (writer->client_address != NULL)
+    {
+      writer->granting = g_steal_pointer (&frames);
+      writer->granting_offset = 0;
+      pack_writer_request_slice (writer);
+      return;
+    }
+
+  pack_writer_append (writer, frames);
+  pack_writer_load_next_batch (writer);
+}
+
+static void
+pack_writer_load_next_batch (EosPackWriter *writer)
+{
+  g_autoptr(GTask) task = NULL;
+  PackBatch *batch;
+
+  if (writer->msg == NULL ||
+      writer->loading ||
+      writer->granting != NULL ||
+      writer->next_object == writer->object_names->len ||
+      writer->buffered_bytes >= PACK_BUFFER_MAX)
+    return;
+
+  batch = g_new0 (PackBatch, 1);
+  batch->object_names = g_ptr_array_ref (writer->object_names);
+  batch->start = writer->next_object;
+
+  writer->loading = TRUE;
+  task = g_task_new (writer, writer->cancellable, pack_batch_ready_cb, NULL);
+  g_task_set_source_tag (task, pack_writer_load_next_batch);
+  g_task_set_task_data (task, batch, (GDestroyNotify) pack_batch_free);
+  g_task_run_in_thread (task, pack_batch_thread_func);
+}
+
+static void
+pack_writer_wrote_chunk_cb (SoupMessage *msg,
+                            gpointer writer_ptr)
+{
+  EosPackWriter *writer = EOS_PACK_WRITER (writer_ptr);
+
+  /* The terminating chunk of the chunked encoding is not one of ours. */
+  if (g_queue_is_empty (&writer->chunk_sizes))
+    return;
+
+  writer->buffered_bytes -= GPOINTER_TO_SIZE (g_queue_pop_head (&writer->chunk_sizes));
+  pack_writer_load_next_batch (writer);
+}
+
+static void
+pack_writer_finished_cb (SoupMessage *msg,
+                         gpointer writer_ptr)
+{
+  EosPackWriter *writer = EOS_PACK_WRITER (writer_ptr);
+
+  if (writer->next_object < writer->object_names->len)
+    g_debug ("Sending a pack cancelled by client");
+
+  g_cancellable_cancel (writer->cancellable);
+
+  /* Drops the reference held by the signal handler. */
+  eos_pack_writer_disconnect_and_clear_msg (writer);
+}
+
+static void
+handle_objects_pack (EosUpdaterRepoServer *server,
+                     SoupMessage *msg)
+{
+  g_autoptr(GPtrArray) object_names = NULL;
+  g_autoptr(GError) error = NULL;
+  EosPackWriter *writer;
+
+  if (msg->method != SOUP_METHOD_POST)
+    {
+      soup_message_headers_replace (msg->response_headers, "Allow", "POST");
+      soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+      return;
+    }
+
+  object_names = eos_pack_request_parse (msg->request_body->data,
+                                         msg->request_body->length,
+                                         &error);
+  if (object_names == NULL)
+    {
+      g_debug ("Invalid pack request: %s", error->message);
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+        soup_message_set_status (msg, SOUP_STATUS_REQUEST_ENTITY_TOO_LARGE);
+      else
+        soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+      return;
+    }
+
+  /* A pack is as much work as a .filez request, so it is limited the same
+   * way. */
+  if (server->max_object_streams > 0 &&
+      server->n_object_streams >= server->max_object_streams)
+    {
+      g_debug ("Too many object streams to serve a pack");
+      reply_busy (server, msg, server->max_object_streams);
+      return;
+    }
+
+  server->n_object_streams++;
+  g_signal_connect_object (msg, "finished", G_CALLBACK (object_stream_finished_cb), server, 0);
+
+  g_debug ("Sending a pack of %u objects", object_names->len);
+
+  writer = g_object_new (EOS_TYPE_PACK_WRITER, NULL);
+  writer->server = g_object_ref (server);
+  writer->msg = g_object_ref (msg);
+  writer->cancellable = g_cancellable_new ();
+  writer->object_names = g_steal_pointer (&object_names);
+  writer->client_address = g_strdup (get_message_scheduled_address (server, msg));
+  writer->level = eos_compression_policy_choose_level (server->compression_policy,
+                                                       get_message_client_address (msg),
+                                                       server->pending_requests,
+                                                       server->n_compressions);
+  g_queue_init (&writer->chunk_sizes);
+  writer->finished_signal_id = g_signal_connect_data (msg,
+                                                      "finished",
+                                                      G_CALLBACK (pack_writer_finished_cb),
+                                                      g_object_ref (writer),
+                                                      (GClosureNotify) g_object_unref,
+                                                      0);
+  writer->wrote_chunk_signal_id = g_signal_connect (msg,
+                                                    "wrote-chunk",
+                                                    G_CALLBACK (pack_writer_wrote_chunk_cb),
+                                                    writer);
+
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+  soup_message_headers_set_encoding (msg->response_headers,
+                                     SOUP_ENCODING_CHUNKED);
+  soup_message_headers_set_content_type (msg->response_headers,
+                                         EOS_PACK_CONTENT_TYPE, NULL);
   soup_message_set_status (msg, SOUP_STATUS_OK);
-  *served = TRUE;
+
+  if (writer->object_names->len == 0)
+    soup_message_body_complete (msg->response_body);
+  else
+    soup_server_pause_message (SOUP_SERVER (server), msg);
+
+  pack_writer_load_next_batch (writer);
+  g_object_unref (writer);
+}
+
+/* Returns %TRUE if @errno_value means that a file could not be opened because
+ * it, or one of its parent directories, does not exist, or is not what it was
+ * expected to be (such as a symlink when O_NOFOLLOW is used). */
+static gboolean
+errno_is_not_found (int errno_value)
+{
+  return (errno_value == ENOENT ||
+          errno_value == ENOTDIR ||
+          errno_value == ELOOP);
+}
+
+static inline gboolean
+is_lower_xdigit (gchar c)
+{
+  return g_ascii_isxdigit (c) && !g_ascii_isupper (c);
+}
+
+/* Gets the O_PATH fd of the objects/@prefix directory, where @prefix is two
+ * lower case hex digits, opening it if needed. Returns -1 and sets errno on
+ * error. The returned fd is owned by @server. Called in worker threads. */
+static int
+get_objects_dfd (EosUpdaterRepoServer *server,
+                 const gchar *prefix)
+{
+  gchar dir_path[] = "objects/XX";
+  gsize idx = g_ascii_xdigit_value (prefix[0]) * 16 + g_ascii_xdigit_value (prefix[1]);
+  int dfd;
+
+  dir_path[strlen ("objects/")] = prefix[0];
+  dir_path[strlen ("objects/") + 1] = prefix[1];
+
+  g_mutex_lock (&server->objects_dfds_lock);
+  dfd = server->objects_dfds[idx];
+  if (dfd < 0)
+    {
+      dfd = openat (server->repo_dfd, dir_path,
+                    O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (dfd >= 0)
+        server->objects_dfds[idx] = dfd;
+    }
+  g_mutex_unlock (&server->objects_dfds_lock);
+
+  return dfd;
+}
+
+/* Opens @raw_path, relative to the repository, without following any
+ * symlinks, so that a symlink in the repository cannot make us serve a file
+ * from outside it (for example, /etc/shadow). Object files are opened from
+ * the cached object directory; anything else is walked to one component at a
+ * time. Returns -1 and sets errno on error. Called in worker threads. */
+static int
+open_in_repo (EosUpdaterRepoServer *server,
+              const gchar *raw_path)
+{
+  const gchar *component = raw_path;
+  int dfd = server->repo_dfd;
+
+  /* objects/XX/YYYY….dirtree */
+  if (g_str_has_prefix (raw_path, "objects/") &&
+      is_lower_xdigit (raw_path[8]) && is_lower_xdigit (raw_path[9]) &&
+      raw_path[10] == '/' && strchr (raw_path + 11, '/') == NULL)
+    {
+      dfd = get_objects_dfd (server, raw_path + 8);
+      if (dfd < 0)
+        return -1;
+
+      return openat (dfd, raw_path + 11, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    }
+
+  while (TRUE)
+    {
+      const gchar *end = strchr (component, '/');
+      gsize len = (end != NULL) ? (gsize) (end - component) : strlen (component);
+      gchar name[NAME_MAX + 1];
+      int fd;
+
+      /* The path parser has already rejected `..`, but be safe. */
+      if (len == 0 || len > NAME_MAX ||
+          (component[0] == '.' && (len == 1 || (len == 2 && component[1] == '.'))))
+        {
+          fd = -1;
+          errno = ENOENT;
+        }
+      else
+        {
+          memcpy (name, component, len);
+          name[len] = '\0';
+          fd = openat (dfd, name,
+                       (end == NULL) ? (O_RDONLY | O_NOFOLLOW | O_CLOEXEC)
+                                     : (O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        }
+
+      if (dfd != server->repo_dfd)
+        {
+          int saved_errno = errno;
+
+          g_close (dfd, NULL);
+          errno = saved_errno;
+        }
+
+      if (fd < 0 || end == NULL)
+        return fd;
+
+      dfd = fd;
+      component = end + 1;
+    }
+}
+
+/* Maps @raw_path (relative to the repository) if it is a regular file, and
+ * gets its status. This may block, so must only be called in a worker thread.
+ * If the file does not exist, or is a symlink, %TRUE is returned and
+ * @out_mapping is set to %NULL. */
+static gboolean
+map_file_if_exists (EosUpdaterRepoServer *server,
+                    const gchar *raw_path,
+                    GCancellable *cancellable,
+                    GMappedFile **out_mapping,
+                    struct stat *out_stat,
+                    GError **error)
+{
+  int fd;
+
+  *out_mapping = NULL;
+
+  fd = open_in_repo (server, raw_path);
+  if (fd < 0 && errno_is_not_found (errno))
+    return TRUE;
+  else if (fd < 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to open %s: %s", raw_path, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  /* Map the file we have stat()ed, so the status matches the contents even if
+   * the file is being replaced. */
+  if (fstat (fd, out_stat) != 0 || !S_ISREG (out_stat->st_mode))
+    {
+      g_close (fd, NULL);
+      return TRUE;
+    }
+
+  *out_mapping = g_mapped_file_new_from_fd (fd, FALSE, error);
+  g_close (fd, NULL);
+  if (*out_mapping == NULL)
+    {
+      g_prefix_error (error, "Failed to map %s: ", raw_path);
+      return FALSE;
+    }
 
   return TRUE;
 }
 
+typedef struct
+{
+  PausedMessage *paused;  /* (owned) */
+  GPtrArray *raw_paths;  /* (element-type filename) relative to the repository */
+  gboolean immutable;
+
+  /* Results. */
+  GMappedFile *mapping;
+  const gchar *served_path;  /* (unowned) element of @raw_paths */
+  gchar *etag;  /* set in advance for immutable files */
+} FileOpenData;
+
+static void
+file_open_data_free (FileOpenData *data)
+{
+  g_clear_pointer (&data->paused, paused_message_free);
+  g_clear_pointer (&data->mapping, g_mapped_file_unref);
+  g_clear_pointer (&data->raw_paths, g_ptr_array_unref);
+  g_free (data->etag);
+  g_free (data);
+}
+
+/* Gets the content hash of a mapped file, from the cache if the file has not
+ * changed since it was last hashed. Called in worker threads. */
+static gchar *
+get_file_etag (EosUpdaterRepoServer *server,
+               const gchar *raw_path,
+               GMappedFile *mapping,
+               const struct stat *stat_buf)
+{
+  guint64 size = stat_buf->st_size;
+  gint64 mtime = (gint64) stat_buf->st_mtim.tv_sec * G_USEC_PER_SEC + stat_buf->st_mtim.tv_nsec / 1000;
+  FileEtag *file_etag;
+  gchar *etag = NULL;
+
+  g_mutex_lock (&server->file_etags_lock);
+  file_etag = g_hash_table_lookup (server->file_etags, raw_path);
+  if (file_etag != NULL && file_etag->size == size && file_etag->mtime == mtime)
+    etag = g_strdup (file_etag->etag);
+  g_mutex_unlock (&server->file_etags_lock);
+
+  if (etag != NULL)
+    return etag;
+
+  etag = get_content_etag (g_mapped_file_get_contents (mapping),
+                           g_mapped_file_get_length (mapping));
+
+  file_etag = g_new0 (FileEtag, 1);
+  file_etag->size = size;
+  file_etag->mtime = mtime;
+  file_etag->etag = g_strdup (etag);
+
+  g_mutex_lock (&server->file_etags_lock);
+  g_hash_table_replace (server->file_etags, g_strdup (raw_path), file_etag);
+  g_mutex_unlock (&server->file_etags_lock);
+
+  return etag;
+}
+
+/* Runs in a worker thread: maps the first of the candidate paths which
+ * exists. */
+static void
+file_open_thread_func (GTask *task,
+                       gpointer source_object,
+                       gpointer task_data,
+                       GCancellable *cancellable)
+{
+  EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (source_object);
+  FileOpenData *data = task_data;
+  g_autoptr(GError) local_error = NULL;
+  struct stat stat_buf;
+  guint idx;
+
+  for (idx = 0; idx < data->raw_paths->len; ++idx)
+    {
+      const gchar *raw_path = g_ptr_array_index (data->raw_paths, idx);
+
+      if (!map_file_if_exists (server,
+                               raw_path,
+                               cancellable,
+                               &data->mapping,
+                               &stat_buf,
+                               &local_error))
+        {
+          g_task_return_error (task, g_steal_pointer (&local_error));
+          return;
+        }
+
+      if (data->mapping != NULL)
+        {
+          data->served_path = raw_path;
+          if (data->etag == NULL)
+            data->etag = get_file_etag (server, raw_path, data->mapping, &stat_buf);
+          break;
+        }
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
 static void
-serve_file (SoupMessage *msg,
-            const gchar *root,
-            const gchar *raw_path,
-            GCancellable *cancellable)
+file_open_ready_cb (GObject *source_object,
+                    GAsyncResult *result,
+                    gpointer user_data)
 {
-  gboolean served = FALSE;
+  GTask *task = G_TASK (result);
+  FileOpenData *data = g_task_get_task_data (task);
+  SoupMessage *msg = data->paused->msg;
+  g_autoptr(GError) error = NULL;
 
-  if (!serve_file_if_exists (msg, root, raw_path, cancellable, &served))
+  if (!g_task_propagate_boolean (task, &error))
+    {
+      if (!paused_message_resume (data->paused))
+        return;
+
+      g_warning ("%s", error->message);
+      set_lookup_error_status (msg, error);
+      return;
+    }
+
+  if (!paused_message_resume (data->paused))
     return;
 
-  if (!served)
+  if (data->mapping == NULL)
     {
-      g_debug ("File %s not found", raw_path);
+      g_debug ("File %s not found",
+               (const gchar *) g_ptr_array_index (data->raw_paths,
+                                                  data->raw_paths->len - 1));
       soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      return;
     }
+
+  if (handle_not_modified (msg, data->etag, data->immutable))
+    return;
+
+  g_debug ("Serving %s", data->served_path);
+  set_cache_headers (msg, data->etag, data->immutable);
+  serve_mapped_file (EOS_UPDATER_REPO_SERVER (source_object), msg, data->mapping);
 }
 
+/* Serves the first of @raw_paths which exists, or returns 404 if none of them
+ * do. The lookup is done in a worker thread. If @object_etag is %NULL, the
+ * files are validated by their content hash. */
 static void
-handle_as_is (EosUpdaterRepoServer *server,
-              SoupMessage *msg,
-              const gchar *requested_path)
+serve_file (EosUpdaterRepoServer *server,
+            SoupMessage *msg,
+            GPtrArray *raw_paths,
+            const gchar *object_etag)
 {
-  g_autofree gchar *raw_path = g_build_filename (server->cached_repo_root, requested_path, NULL);
+  FileOpenData *data;
+  g_autoptr(GTask) task = NULL;
 
-  serve_file (msg, server->cached_repo_root, raw_path, server->cancellable);
+  if (object_etag != NULL && handle_not_modified (msg, object_etag, TRUE))
+    return;
+
+  data = g_new0 (FileOpenData, 1);
+  data->paused = paused_message_new (server, msg);
+  data->raw_paths = g_ptr_array_ref (raw_paths);
+  data->immutable = (object_etag != NULL);
+  data->etag = g_strdup (object_etag);
+
+  task = g_task_new (server, server->cancellable, file_open_ready_cb, NULL);
+  g_task_set_source_tag (task, serve_file);
+  g_task_set_task_data (task, data, (GDestroyNotify) file_open_data_free);
+  g_task_run_in_thread (task, file_open_thread_func);
 }
 
-static SoupBuffer *
-buffer_from_bytes (GBytes *bytes)
+static void
+handle_as_is (EosUpdaterRepoServer *server,
+              SoupMessage *msg,
+              const gchar *requested_path)
 {
-  gconstpointer raw;
-  gsize len;
+  g_autoptr(GPtrArray) raw_paths = g_ptr_array_new_with_free_func (g_free);
 
-  raw = g_bytes_get_data (bytes, &len);
-  return soup_buffer_new_with_owner (raw,
-                                     len,
-                                     g_bytes_ref (bytes),
-                                     (GDestroyNotify)g_bytes_unref);
+  g_autofree gchar *object_etag = get_object_etag (server, requested_path);
+
+  /* @requested_path is absolute, and has been checked not to contain `..`. */
+  g_ptr_array_add (raw_paths, g_strdup (requested_path + 1));
+  serve_file (server, msg, raw_paths, object_etag);
 }
 
 static void
-send_bytes (SoupMessage *msg,
-            GBytes *bytes)
+handle_deltas (EosUpdaterRepoServer *server,
+               SoupMessage *msg,
+               const gchar *requested_path)
 {
-  g_autoptr(SoupBuffer) buffer = buffer_from_bytes (bytes);
+  /* Clients ask for the superblock of the delta from their commit before
+   * falling back to pulling objects, so that tells us which deltas are worth
+   * generating. */
+  if (server->delta_generator != NULL)
+    eos_delta_generator_note_request (server->delta_generator, requested_path);
 
-  if (buffer->length > 0)
-    soup_message_body_append_buffer (msg->response_body, buffer);
-  soup_message_set_status (msg, SOUP_STATUS_OK);
+  handle_as_is (server, msg, requested_path);
 }
 
 static void
 handle_config (EosUpdaterRepoServer *server,
                SoupMessage *msg)
 {
+  if (handle_not_modified (msg, server->cached_config_etag, FALSE))
+    return;
+
+  set_cache_headers (msg, server->cached_config_etag, FALSE);
   send_bytes (msg, server->cached_config);
 }
 
 static void
 handle_refs_heads (EosUpdaterRepoServer *server,
                    SoupMessage *msg,
-                   const gchar *requested_path)
+                   const gchar *requested_path,
+                   const EosRepoPath *parsed)
 {
-  gsize prefix_len = strlen ("/refs/heads/");
-  size_t len = strlen (requested_path);
-  g_autofree gchar *raw_path = NULL;
-  gboolean served = FALSE;
-  const gchar *head;
+  g_autoptr(GPtrArray) raw_paths = NULL;
+  const gchar *head = parsed->tail;  /* e.g eos2/i386 */
 
-  if (len <= prefix_len)
+  if (*head == '\0')
     {
       g_debug ("Invalid request for /refs/heads/");
       soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
       return;
     }
 
+  raw_paths = g_ptr_array_new_with_free_func (g_free);
+
   /* Pass through requests to things like /refs/heads/ostree/1/1/0 if they
    * exist. */
-  raw_path = g_build_filename (server->cached_repo_root, requested_path, NULL);
-  if (!serve_file_if_exists (msg, server->cached_repo_root, raw_path, server->cancellable, &served))
-    return;
-
-  if (served)
-    return;
+  g_ptr_array_add (raw_paths, g_strdup (requested_path + 1));
 
   /* If not, this is probably a request for a head which is only available on
    * the server — and hence available in our repository as a remote ref.
    * Transparently redirect to /refs/remotes/$remote_name. For example, map
    * /refs/heads/os/eos/amd64/master to
    * /refs/remotes/eos/os/eos/amd64/master. */
-  head = requested_path + prefix_len; /* e.g eos2/i386 */
-  g_clear_pointer (&raw_path, g_free);
-  raw_path = g_build_filename (server->cached_repo_root,
-                               "refs",
-                               "remotes",
-                               server->remote_name,
-                               head,
-                               NULL);
+  g_ptr_array_add (raw_paths, g_strconcat ("refs/remotes/",
+                                           server->remote_name,
+                                           "/",
+                                           head,
+                                           NULL));
+
+  serve_file (server, msg, raw_paths, NULL);
+}
+
+static void
+handle_metrics (EosUpdaterRepoServer *server,
+                SoupMessage *msg)
+{
+  gchar *text;
+
+  if (server->metrics == NULL)
+    {
+      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      return;
+    }
 
-  serve_file (msg, server->cached_repo_root, raw_path, server->cancellable);
+  text = eos_server_metrics_format (server->metrics);
+  soup_message_set_response (msg, "text/plain; version=0.0.4",
+                             SOUP_MEMORY_TAKE, text, strlen (text));
+  soup_message_headers_replace (msg->response_headers, "Cache-Control", "no-store");
+  soup_message_set_status (msg, SOUP_STATUS_OK);
 }
 
 static void
@@ -791,6 +3685,8 @@ handle_path (EosUpdaterRepoServer *server,
              SoupMessage *msg,
              const gchar *path)
 {
+  EosRepoPath parsed;
+
   if (g_cancellable_is_cancelled (server->cancellable))
     {
       soup_message_set_status (msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
@@ -799,20 +3695,52 @@ handle_path (EosUpdaterRepoServer *server,
 
   g_debug ("Requested %s", path);
 
-  if (strstr (path, "..") != NULL)
-    soup_message_set_status (msg, SOUP_STATUS_FORBIDDEN);
-  else if (g_str_has_prefix (path, "/objects/") && g_str_has_suffix (path, ".filez"))
-    handle_objects_filez (server, msg, path);
-  else if (path_is_handled_as_is (path))
-    handle_as_is (server, msg, path);
-  else if (g_strcmp0 (path, "/config") == 0)
-    handle_config (server, msg);
-  else if (g_str_has_prefix (path, "/refs/heads/"))
-    handle_refs_heads (server, msg, path);
-  else
-    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+  switch (eos_repo_path_parse (path, &parsed))
+    {
+    case EOS_REPO_PATH_FORBIDDEN:
+      soup_message_set_status (msg, SOUP_STATUS_FORBIDDEN);
+      break;
+    case EOS_REPO_PATH_OBJECTS_PACK:
+      handle_objects_pack (server, msg);
+      break;
+    case EOS_REPO_PATH_OBJECT_FILEZ:
+      if (server->passthrough && server->upstream_session == NULL)
+        handle_as_is (server, msg, path);
+      else
+        handle_objects_filez (server, msg, path, &parsed);
+      break;
+    case EOS_REPO_PATH_DELTA:
+      handle_deltas (server, msg, path);
+      break;
+    case EOS_REPO_PATH_OBJECT:
+      /* Objects missing locally are fetched from upstream. */
+      if (server->upstream_session != NULL)
+        handle_objects_filez (server, msg, path, &parsed);
+      else
+        handle_as_is (server, msg, path);
+      break;
+    case EOS_REPO_PATH_EXTENSION:
+    case EOS_REPO_PATH_SUMMARY:
+      handle_as_is (server, msg, path);
+      break;
+    case EOS_REPO_PATH_CONFIG:
+      handle_config (server, msg);
+      break;
+    case EOS_REPO_PATH_REFS_HEADS:
+      handle_refs_heads (server, msg, path, &parsed);
+      break;
+    case EOS_REPO_PATH_METRICS:
+      handle_metrics (server, msg);
+      break;
+    case EOS_REPO_PATH_NOT_FOUND:
+    default:
+      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      break;
+    }
 
-  g_debug ("Returning status %u (%s)", msg->status_code, msg->reason_phrase);
+  /* Some responses are looked up in a worker thread and set later. */
+  if (msg->status_code != SOUP_STATUS_NONE)
+    g_debug ("Returning status %u (%s)", msg->status_code, msg->reason_phrase);
 }
 
 static void
@@ -825,9 +3753,85 @@ server_cb (SoupServer *soup_server,
 {
   EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (soup_server);
 
+  /* The address is needed for the bandwidth scheduler and the compression
+   * policy, after this callback has returned. */
+  g_object_set_qdata_full (G_OBJECT (msg),
+                           client_address_quark (),
+                           g_strdup (soup_client_context_get_host (context)),
+                           g_free);
+
   handle_path (server, msg, path);
 }
 
+/* Timing and size of a request, for the metrics. It is only touched from the
+ * server’s main context, so is updated without atomics or locks; the metrics
+ * are updated once, when the request is done. */
+typedef struct
+{
+  gint64 start_time;
+  gint64 first_byte_time;  /* 0 until the response headers are written */
+  guint64 bytes_sent;
+} RequestTiming;
+
+static GQuark
+request_timing_quark (void)
+{
+  return g_quark_from_static_string ("eos-updater-request-timing");
+}
+
+static void
+request_wrote_headers_cb (SoupMessage *msg,
+                          gpointer user_data)
+{
+  RequestTiming *timing = user_data;
+
+  if (timing->first_byte_time == 0)
+    timing->first_byte_time = g_get_monotonic_time ();
+}
+
+static void
+request_wrote_body_data_cb (SoupMessage *msg,
+                            SoupBuffer *chunk,
+                            gpointer user_data)
+{
+  RequestTiming *timing = user_data;
+
+  timing->bytes_sent += chunk->length;
+}
+
+static void
+note_request_done (EosUpdaterRepoServer *server,
+                   SoupMessage *msg,
+                   gboolean aborted)
+{
+  RequestTiming *timing = g_object_get_qdata (G_OBJECT (msg), request_timing_quark ());
+  SoupURI *uri = soup_message_get_uri (msg);
+  EosRepoPath parsed;
+  EosRepoPathKind kind = EOS_REPO_PATH_NOT_FOUND;
+  gint64 now = g_get_monotonic_time ();
+
+  if (timing == NULL)
+    return;
+
+  /* The URI is not known if the request could not be read. */
+  if (uri != NULL && uri->path != NULL)
+    kind = eos_repo_path_parse (uri->path, &parsed);
+
+  if (aborted)
+    eos_server_metrics_request_aborted (server->metrics, kind,
+                                        get_message_client_address (msg),
+                                        timing->bytes_sent,
+                                        now - timing->start_time);
+  else
+    eos_server_metrics_request_finished (server->metrics, kind,
+                                         msg->status_code,
+                                         get_message_client_address (msg),
+                                         timing->bytes_sent,
+                                         (timing->first_byte_time != 0) ?
+                                         timing->first_byte_time - timing->start_time : -1,
+                                         now - timing->start_time);
+}
+
 static void
 request_started_cb (SoupServer        *soup_server,
                     SoupMessage       *message,
@@ -837,6 +3841,20 @@ request_started_cb (SoupServer        *soup_server,
   EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (soup_server);
 
   update_pending_requests (server, 1);
+
+  if (server->metrics != NULL)
+    {
+      RequestTiming *timing = g_new0 (RequestTiming, 1);
+
+      timing->start_time = g_get_monotonic_time ();
+      g_object_set_qdata_full (G_OBJECT (message), request_timing_quark (),
+                               timing, g_free);
+      g_signal_connect (message, "wrote-headers",
+                        (GCallback) request_wrote_headers_cb, timing);
+      g_signal_connect (message, "wrote-body-data",
+                        (GCallback) request_wrote_body_data_cb, timing);
+      eos_server_metrics_request_started (server->metrics);
+    }
 }
 
 static void
@@ -848,6 +3866,9 @@ request_finished_cb (SoupServer        *soup_server,
   EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (soup_server);
 
   update_pending_requests (server, -1);
+
+  if (server->metrics != NULL)
+    note_request_done (server, message, FALSE);
 }
 
 static void
@@ -859,6 +3880,146 @@ request_aborted_cb (SoupServer        *soup_server,
   EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (soup_server);
 
   update_pending_requests (server, -1);
+
+  if (server->metrics != NULL)
+    note_request_done (server, message, TRUE);
+}
+
+/* Only warm up to this share of the cache, so that warming leaves room for
+ * whatever else clients ask for. */
+#define CACHE_WARM_PERCENT 75
+#define WARM_BUFFER_SIZE (64 * 1024)
+
+/* Compresses a file object into the cache, for the cache warmer. Runs in the
+ * warmer’s thread. */
+static gboolean
+warm_cache_for_file (const gchar *checksum,
+                     guint64 *out_cached_bytes,
+                     gpointer user_data,
+                     GCancellable *cancellable,
+                     GError **error)
+{
+  EosUpdaterRepoServer *server = EOS_UPDATER_REPO_SERVER (user_data);
+  g_autofree gchar *object_name = g_strconcat (checksum, ".filez", NULL);
+  g_autoptr(GMappedFile) mapping = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(EosObjectCacheWriter) writer = NULL;
+  guint64 uncompressed_size;
+  guint64 cached_bytes = 0;
+  g_autofree guint8 *buffer = NULL;
+  gint level;
+  gint64 start_cpu_usecs;
+
+  /* In passthrough mode, the file is served as it is, so it only needs to be
+   * read ahead. */
+  if (server->passthrough)
+    {
+      g_autofree gchar *raw_path = g_strdup_printf ("objects/%c%c/%s.filez",
+                                                    checksum[0], checksum[1],
+                                                    checksum + 2);
+      int fd = open_in_repo (server, raw_path);
+      struct stat stat_buf;
+
+      *out_cached_bytes = 0;
+      if (fd < 0)
+        return TRUE;
+
+      if (fstat (fd, &stat_buf) == 0 && S_ISREG (stat_buf.st_mode))
+        {
+          (void) posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+          *out_cached_bytes = stat_buf.st_size;
+        }
+      g_close (fd, NULL);
+      return TRUE;
+    }
+
+  /* Without a cache, only the reading ahead of the metadata is done. */
+  if (server->cache == NULL)
+    {
+      *out_cached_bytes = 0;
+      return TRUE;
+    }
+
+  mapping = eos_object_cache_lookup (server->cache, object_name);
+  if (mapping != NULL)
+    {
+      *out_cached_bytes = g_mapped_file_get_length (mapping);
+      return TRUE;
+    }
+
+  /* The warmer only runs while the server is idle. */
+  level = eos_compression_policy_choose_level (server->compression_policy,
+                                               NULL, 0, 0);
+  if (!load_compressed_file_stream (server->repo, checksum, level, cancellable,
+                                    &input, &uncompressed_size, error))
+    return FALSE;
+
+  writer = eos_object_cache_begin (server->cache, object_name, error);
+  if (writer == NULL)
+    return FALSE;
+
+  buffer = g_malloc (WARM_BUFFER_SIZE);
+  start_cpu_usecs = get_thread_cpu_usecs ();
+  while (TRUE)
+    {
+      gssize n_read = g_input_stream_read (input, buffer, WARM_BUFFER_SIZE,
+                                           cancellable, error);
+
+      if (n_read < 0)
+        return FALSE;
+      if (n_read == 0)
+        break;
+      if (!eos_object_cache_writer_append (writer, buffer, n_read, error))
+        return FALSE;
+      cached_bytes += n_read;
+    }
+
+  if (!eos_object_cache_writer_commit (writer, error))
+    return FALSE;
+
+  if (server->metrics != NULL)
+    eos_server_metrics_note_compression_time (server->metrics,
+                                              get_thread_cpu_usecs () - start_cpu_usecs);
+  note_compression (server, level, uncompressed_size, cached_bytes);
+  *out_cached_bytes = cached_bytes;
+  return TRUE;
+}
+
+/* Parses @client_weights, a list of ADDRESS=WEIGHT strings, into
+ * @scheduler. */
+static gboolean
+apply_client_weights (EosBandwidthScheduler *scheduler,
+                      const gchar * const *client_weights,
+                      GError **error)
+{
+  gsize i;
+
+  for (i = 0; client_weights != NULL && client_weights[i] != NULL; i++)
+    {
+      const gchar *entry = client_weights[i];
+      const gchar *separator = strrchr (entry, '=');
+      g_autofree gchar *address = NULL;
+      guint64 weight = 0;
+      gchar *end = NULL;
+
+      if (separator != NULL)
+        weight = g_ascii_strtoull (separator + 1, &end, 10);
+
+      if (separator == NULL || separator == entry ||
+          end == separator + 1 || end == NULL || *end != '\0' ||
+          weight == 0 || weight > G_MAXUINT)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid client weight ‘%s’; expected ADDRESS=WEIGHT "
+                       "with a positive integer weight", entry);
+          return FALSE;
+        }
+
+      address = g_strndup (entry, separator - entry);
+      eos_bandwidth_scheduler_set_client_weight (scheduler, g_strstrip (address), (guint) weight);
+    }
+
+  return TRUE;
 }
 
 static gboolean
@@ -874,7 +4035,114 @@ eos_updater_repo_server_initable_init (GInitable     *initable,
     return FALSE;
 
   g_set_object (&server->cancellable, cancellable);
-  server->cached_repo_root = g_file_get_path (ostree_repo_get_path (server->repo));
+  server->passthrough = (ostree_repo_get_mode (server->repo) == OSTREE_REPO_MODE_ARCHIVE_Z2);
+  server->repo_dfd = openat (ostree_repo_get_dfd (server->repo), ".",
+                             O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (server->repo_dfd < 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to open repository directory: %s",
+                   g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  server->cached_config_etag = get_content_etag (g_bytes_get_data (server->cached_config, NULL),
+                                                 g_bytes_get_size (server->cached_config));
+  server->filez_streams = g_hash_table_new_full (g_str_hash,
+                                                 g_str_equal,
+                                                 NULL,
+                                                 g_object_unref);
+  server->stalled_filez_streams = object_array_new ();
+  server->buffer_pool = eos_buffer_pool_new (BUFFER_POOL_MAX_FREE);
+  server->context = g_main_context_ref_thread_default ();
+
+  if (server->compression_threads == 0)
+    server->compression_threads = g_get_num_processors ();
+  server->compression_policy = eos_compression_policy_new (server->compression_level,
+                                                           server->compression_threads);
+  server->compression_pool = g_thread_pool_new (filez_read_job_run,
+                                                server,
+                                                (gint) server->compression_threads,
+                                                FALSE,
+                                                error);
+  if (server->compression_pool == NULL)
+    return FALSE;
+
+  if (server->advertised_commit != NULL &&
+      !ostree_validate_checksum_string (server->advertised_commit, error))
+    return FALSE;
+
+  if (server->generate_deltas && server->advertised_commit != NULL)
+    server->delta_generator = eos_delta_generator_new (server->repo,
+                                                       server->advertised_commit);
+
+  if (server->shared_with != NULL)
+    {
+      EosUpdaterRepoServer *shared_with = server->shared_with;
+
+      if (shared_with->cache != NULL)
+        server->cache = g_object_ref (shared_with->cache);
+      if (shared_with->scheduler != NULL)
+        server->scheduler = g_object_ref (shared_with->scheduler);
+      if (shared_with->metrics != NULL)
+        server->metrics = g_object_ref (shared_with->metrics);
+      server->collect_metrics = shared_with->collect_metrics;
+    }
+  else if (server->collect_metrics)
+    server->metrics = eos_server_metrics_new ();
+
+  if (server->shared_with == NULL &&
+      (server->max_upload_rate > 0 || server->max_client_upload_rate > 0))
+    {
+      server->scheduler = eos_bandwidth_scheduler_new (server->max_upload_rate,
+                                                       server->max_client_upload_rate);
+      if (!apply_client_weights (server->scheduler,
+                                 (const gchar * const *) server->client_weights,
+                                 error))
+        return FALSE;
+    }
+
+  if (server->upstream_url != NULL)
+    {
+      guint max_conns = (server->max_compressions > 0) ? server->max_compressions : UPSTREAM_MAX_CONNECTIONS;
+
+      server->upstream_session = soup_session_new_with_options (SOUP_SESSION_TIMEOUT, UPSTREAM_TIMEOUT_SECONDS,
+                                                                SOUP_SESSION_MAX_CONNS, max_conns,
+                                                                SOUP_SESSION_MAX_CONNS_PER_HOST, max_conns,
+                                                                NULL);
+    }
+
+  /* Nothing needs compressing in passthrough mode, and only objects fetched
+   * from upstream need caching. */
+  if (server->passthrough && server->upstream_session == NULL)
+    g_clear_object (&server->cache);
+  else if (server->shared_with == NULL && server->cache_size > 0)
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      if (server->cache_directory == NULL)
+        server->cache_directory = g_file_resolve_relative_path (ostree_repo_get_path (server->repo),
+                                                                "tmp/cache/eos-update-server");
+
+      /* Not being able to cache is not fatal; we can still serve everything,
+       * just with more CPU usage. */
+      server->cache = eos_object_cache_new (server->cache_directory,
+                                            server->cache_size,
+                                            cancellable,
+                                            &local_error);
+      if (server->cache == NULL)
+        g_warning ("Failed to set up the compressed object cache: %s",
+                   local_error->message);
+    }
+
+  if (server->warm_cache && server->advertised_commit != NULL)
+    server->cache_warmer = eos_cache_warmer_new (server->repo,
+                                                 server->advertised_commit,
+                                                 server->cache_size * CACHE_WARM_PERCENT / 100,
+                                                 warm_cache_for_file,
+                                                 server);
   soup_server_add_handler (SOUP_SERVER (server),
                            NULL,
                            server_cb,
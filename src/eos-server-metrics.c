@@ -0,0 +1,660 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-compression-policy.h"
+#include "eos-server-metrics.h"
+
+/* Counts what the update server does, for monitoring, and formats it in the
+ * Prometheus text exposition format.
+ *
+ * The metrics are shared by all the servers in the process, and updated from
+ * their main contexts and from the compression threads. The counters are
+ * updated with relaxed atomic operations, so recording never waits for a
+ * lock; only the per-client table is locked, once at the end of each
+ * request. The counters are read one at a time, so a scrape may see a
+ * request counted in one metric and not yet in another, which Prometheus
+ * copes with. */
+
+/* Upper bounds (in seconds) of the latency histogram buckets; there is an
+ * implicit +Inf bucket after them. */
+static const gdouble latency_buckets[] =
+  { 0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0 };
+#define N_LATENCY_BUCKETS (G_N_ELEMENTS (latency_buckets) + 1)
+
+/* Clients beyond this many are counted together, so that a scan of the
+ * network cannot grow the table (or the scrapes) without bound. */
+#define MAX_CLIENTS 256
+
+/* Requests are counted by the kind of path they are for. */
+typedef enum
+{
+  CLASS_OTHER = 0,
+  CLASS_CONFIG,
+  CLASS_SUMMARY,
+  CLASS_PACK,
+  CLASS_FILEZ,
+  CLASS_OBJECT,
+  CLASS_DELTA,
+  CLASS_EXTENSION,
+  CLASS_REF,
+  CLASS_METRICS,
+} RequestClass;
+#define N_CLASSES (CLASS_METRICS + 1)
+
+static const gchar * const class_names[N_CLASSES] =
+  {
+    "other",
+    "config",
+    "summary",
+    "pack",
+    "filez",
+    "object",
+    "delta",
+    "extension",
+    "ref",
+    "metrics",
+  };
+
+/* Responses are counted by the first digit of their status code; index 0
+ * collects anything else. */
+#define N_STATUS_CLASSES 6
+
+typedef struct
+{
+  guint64 buckets[N_LATENCY_BUCKETS];  /* not cumulative */
+  guint64 sum_usecs;
+} Histogram;
+
+typedef struct
+{
+  guint64 requests;
+  guint64 bytes;
+  guint64 send_usecs;
+  guint64 responses_4xx;
+  guint64 responses_5xx;
+  guint64 aborted;
+} ClientStats;
+
+struct _EosServerMetrics
+{
+  GObject parent_instance;
+
+  gint in_flight;  /* (atomic) */
+  guint64 requests[N_CLASSES];
+  guint64 aborted[N_CLASSES];
+  guint64 bytes[N_CLASSES];
+  guint64 responses[N_STATUS_CLASSES];
+  Histogram time_to_first_byte[N_CLASSES];
+  Histogram duration[N_CLASSES];
+
+  guint64 cache_hits;
+  guint64 cache_misses;
+
+  guint64 compression_cpu_usecs;
+  guint64 compressed_objects[EOS_COMPRESSION_LEVEL_MAX + 1];
+  guint64 compression_input_bytes[EOS_COMPRESSION_LEVEL_MAX + 1];
+  guint64 compression_output_bytes[EOS_COMPRESSION_LEVEL_MAX + 1];
+
+  GMutex clients_lock;
+  GHashTable *clients;  /* (owned) address → (owned) ClientStats */
+  ClientStats other_clients;
+};
+
+static void
+eos_server_metrics_finalize_impl (EosServerMetrics *metrics)
+{
+  g_clear_pointer (&metrics->clients, g_hash_table_unref);
+  g_mutex_clear (&metrics->clients_lock);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_SERVER_METRICS,
+                       EosServerMetrics,
+                       eos_server_metrics,
+                       NULL,
+                       eos_server_metrics_finalize_impl)
+
+/* GLib only has atomic operations on ints and pointers, and byte counts need
+ * 64 bits everywhere, so the compiler builtins are used directly. */
+static inline void
+counter_add (guint64 *counter,
+             guint64 value)
+{
+  __atomic_fetch_add (counter, value, __ATOMIC_RELAXED);
+}
+
+static inline guint64
+counter_get (const guint64 *counter)
+{
+  return __atomic_load_n (counter, __ATOMIC_RELAXED);
+}
+
+static RequestClass
+class_from_kind (EosRepoPathKind kind)
+{
+  switch (kind)
+    {
+    case EOS_REPO_PATH_CONFIG:
+      return CLASS_CONFIG;
+    case EOS_REPO_PATH_SUMMARY:
+      return CLASS_SUMMARY;
+    case EOS_REPO_PATH_OBJECTS_PACK:
+      return CLASS_PACK;
+    case EOS_REPO_PATH_OBJECT_FILEZ:
+      return CLASS_FILEZ;
+    case EOS_REPO_PATH_OBJECT:
+      return CLASS_OBJECT;
+    case EOS_REPO_PATH_DELTA:
+      return CLASS_DELTA;
+    case EOS_REPO_PATH_EXTENSION:
+      return CLASS_EXTENSION;
+    case EOS_REPO_PATH_REFS_HEADS:
+      return CLASS_REF;
+    case EOS_REPO_PATH_METRICS:
+      return CLASS_METRICS;
+    case EOS_REPO_PATH_NOT_FOUND:
+    case EOS_REPO_PATH_FORBIDDEN:
+    default:
+      return CLASS_OTHER;
+    }
+}
+
+static void
+histogram_observe (Histogram *histogram,
+                   gint64 usecs)
+{
+  gsize i;
+
+  usecs = MAX (usecs, 0);
+  for (i = 0; i < G_N_ELEMENTS (latency_buckets); i++)
+    if (usecs <= latency_buckets[i] * G_USEC_PER_SEC)
+      break;
+
+  counter_add (&histogram->buckets[i], 1);
+  counter_add (&histogram->sum_usecs, usecs);
+}
+
+/**
+ * eos_server_metrics_new:
+ *
+ * Creates a new, empty set of metrics.
+ *
+ * Returns: (transfer full): a new #EosServerMetrics
+ */
+EosServerMetrics *
+eos_server_metrics_new (void)
+{
+  EosServerMetrics *metrics = g_object_new (EOS_TYPE_SERVER_METRICS, NULL);
+
+  g_mutex_init (&metrics->clients_lock);
+  metrics->clients = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free);
+
+  return metrics;
+}
+
+/**
+ * eos_server_metrics_request_started:
+ * @metrics: an #EosServerMetrics
+ *
+ * Counts a request as in flight, until
+ * eos_server_metrics_request_finished() or
+ * eos_server_metrics_request_aborted() is called for it.
+ */
+void
+eos_server_metrics_request_started (EosServerMetrics *metrics)
+{
+  g_return_if_fail (EOS_IS_SERVER_METRICS (metrics));
+
+  g_atomic_int_inc (&metrics->in_flight);
+}
+
+/* Returns the stats for @client_address, adding them if needed. Must be
+ * called with the clients lock held. */
+static ClientStats *
+lookup_client (EosServerMetrics *metrics,
+               const gchar *client_address)
+{
+  ClientStats *stats;
+
+  if (client_address == NULL)
+    return &metrics->other_clients;
+
+  stats = g_hash_table_lookup (metrics->clients, client_address);
+  if (stats != NULL)
+    return stats;
+
+  if (g_hash_table_size (metrics->clients) >= MAX_CLIENTS)
+    return &metrics->other_clients;
+
+  stats = g_new0 (ClientStats, 1);
+  g_hash_table_insert (metrics->clients, g_strdup (client_address), stats);
+  return stats;
+}
+
+/**
+ * eos_server_metrics_request_finished:
+ * @metrics: an #EosServerMetrics
+ * @kind: the kind of path which was requested
+ * @status_code: the status of the response
+ * @client_address: (nullable): address of the client, or %NULL if unknown
+ * @bytes_sent: number of bytes of the response body which were sent
+ * @first_byte_usecs: time from the start of the request until the response
+ *    headers were sent, or -1 if that is not known
+ * @total_usecs: time from the start of the request until the response was
+ *    sent
+ *
+ * Counts a request whose response was sent completely.
+ */
+void
+eos_server_metrics_request_finished (EosServerMetrics *metrics,
+                                     EosRepoPathKind kind,
+                                     guint status_code,
+                                     const gchar *client_address,
+                                     guint64 bytes_sent,
+                                     gint64 first_byte_usecs,
+                                     gint64 total_usecs)
+{
+  RequestClass class = class_from_kind (kind);
+  guint status_class = status_code / 100;
+  ClientStats *client;
+
+  g_return_if_fail (EOS_IS_SERVER_METRICS (metrics));
+
+  if (status_class >= N_STATUS_CLASSES)
+    status_class = 0;
+
+  g_atomic_int_add (&metrics->in_flight, -1);
+  counter_add (&metrics->requests[class], 1);
+  counter_add (&metrics->bytes[class], bytes_sent);
+  counter_add (&metrics->responses[status_class], 1);
+  if (first_byte_usecs >= 0)
+    histogram_observe (&metrics->time_to_first_byte[class], first_byte_usecs);
+  histogram_observe (&metrics->duration[class], total_usecs);
+
+  g_mutex_lock (&metrics->clients_lock);
+  client = lookup_client (metrics, client_address);
+  client->requests++;
+  client->bytes += bytes_sent;
+  client->send_usecs += MAX (total_usecs, 0);
+  if (status_class == 4)
+    client->responses_4xx++;
+  else if (status_class == 5)
+    client->responses_5xx++;
+  g_mutex_unlock (&metrics->clients_lock);
+}
+
+/**
+ * eos_server_metrics_request_aborted:
+ * @metrics: an #EosServerMetrics
+ * @kind: the kind of path which was requested, or %EOS_REPO_PATH_NOT_FOUND
+ *    if the request was not read
+ * @client_address: (nullable): address of the client, or %NULL if unknown
+ * @bytes_sent: number of bytes of the response body which were sent
+ * @total_usecs: time from the start of the request until it was aborted
+ *
+ * Counts a request which failed before its response was sent completely,
+ * usually because the client went away. It is not counted in the latency
+ * histograms.
+ */
+void
+eos_server_metrics_request_aborted (EosServerMetrics *metrics,
+                                    EosRepoPathKind kind,
+                                    const gchar *client_address,
+                                    guint64 bytes_sent,
+                                    gint64 total_usecs)
+{
+  RequestClass class = class_from_kind (kind);
+  ClientStats *client;
+
+  g_return_if_fail (EOS_IS_SERVER_METRICS (metrics));
+
+  g_atomic_int_add (&metrics->in_flight, -1);
+  counter_add (&metrics->aborted[class], 1);
+  counter_add (&metrics->bytes[class], bytes_sent);
+
+  g_mutex_lock (&metrics->clients_lock);
+  client = lookup_client (metrics, client_address);
+  client->aborted++;
+  client->bytes += bytes_sent;
+  client->send_usecs += MAX (total_usecs, 0);
+  g_mutex_unlock (&metrics->clients_lock);
+}
+
+/**
+ * eos_server_metrics_note_cache_lookup:
+ * @metrics: an #EosServerMetrics
+ * @hit: whether the object was found in the cache
+ *
+ * Counts a lookup in the compressed object cache.
+ */
+void
+eos_server_metrics_note_cache_lookup (EosServerMetrics *metrics,
+                                      gboolean hit)
+{
+  g_return_if_fail (EOS_IS_SERVER_METRICS (metrics));
+
+  counter_add (hit ? &metrics->cache_hits : &metrics->cache_misses, 1);
+}
+
+/**
+ * eos_server_metrics_note_compression:
+ * @metrics: an #EosServerMetrics
+ * @level: the zlib level the object was compressed with
+ * @uncompressed_bytes: size of the object before compression
+ * @compressed_bytes: size of the object after compression
+ *
+ * Counts a file object which has been compressed.
+ */
+void
+eos_server_metrics_note_compression (EosServerMetrics *metrics,
+                                     gint level,
+                                     guint64 uncompressed_bytes,
+                                     guint64 compressed_bytes)
+{
+  g_return_if_fail (EOS_IS_SERVER_METRICS (metrics));
+  g_return_if_fail (level >= 0 && level <= EOS_COMPRESSION_LEVEL_MAX);
+
+  counter_add (&metrics->compressed_objects[level], 1);
+  counter_add (&metrics->compression_input_bytes[level], uncompressed_bytes);
+  counter_add (&metrics->compression_output_bytes[level], compressed_bytes);
+}
+
+/**
+ * eos_server_metrics_note_compression_time:
+ * @metrics: an #EosServerMetrics
+ * @cpu_usecs: CPU time spent compressing, in microseconds
+ *
+ * Adds to the CPU time spent compressing file objects. This is called for
+ * each chunk compressed, so is kept cheap.
+ */
+void
+eos_server_metrics_note_compression_time (EosServerMetrics *metrics,
+                                          gint64 cpu_usecs)
+{
+  g_return_if_fail (EOS_IS_SERVER_METRICS (metrics));
+
+  if (cpu_usecs > 0)
+    counter_add (&metrics->compression_cpu_usecs, cpu_usecs);
+}
+
+static void
+append_header (GString *str,
+               const gchar *name,
+               const gchar *type,
+               const gchar *help)
+{
+  g_string_append_printf (str, "# HELP %s %s\n# TYPE %s %s\n",
+                          name, help, name, type);
+}
+
+/* Label values are quoted; backslashes, quotes and newlines in them must be
+ * escaped. */
+static void
+append_label_value (GString *str,
+                    const gchar *value)
+{
+  const gchar *p;
+
+  g_string_append_c (str, '"');
+  for (p = value; *p != '\0'; p++)
+    {
+      if (*p == '\\' || *p == '"')
+        g_string_append_c (str, '\\');
+      if (*p == '\n')
+        g_string_append (str, "\\n");
+      else
+        g_string_append_c (str, *p);
+    }
+  g_string_append_c (str, '"');
+}
+
+/* The output must not depend on the locale’s decimal separator. */
+static void
+append_seconds (GString *str,
+                guint64 usecs)
+{
+  gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+  g_string_append (str, g_ascii_formatd (buffer, sizeof (buffer), "%.6f",
+                                         (gdouble) usecs / G_USEC_PER_SEC));
+}
+
+static void
+append_class_counter (GString *str,
+                      const gchar *name,
+                      const gchar *help,
+                      const guint64 *counters)
+{
+  gsize class;
+
+  append_header (str, name, "counter", help);
+  for (class = 0; class < N_CLASSES; class++)
+    g_string_append_printf (str, "%s{class=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                            name, class_names[class], counter_get (&counters[class]));
+}
+
+static void
+append_histograms (GString *str,
+                   const gchar *name,
+                   const gchar *help,
+                   const Histogram *histograms)
+{
+  gsize class, i;
+
+  append_header (str, name, "histogram", help);
+  for (class = 0; class < N_CLASSES; class++)
+    {
+      const Histogram *histogram = &histograms[class];
+      guint64 cumulative = 0;
+
+      for (i = 0; i < N_LATENCY_BUCKETS; i++)
+        {
+          gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+          cumulative += counter_get (&histogram->buckets[i]);
+          g_string_append_printf (str, "%s_bucket{class=\"%s\",le=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                                  name, class_names[class],
+                                  (i < G_N_ELEMENTS (latency_buckets)) ?
+                                  g_ascii_formatd (buffer, sizeof (buffer), "%g", latency_buckets[i]) :
+                                  "+Inf",
+                                  cumulative);
+        }
+
+      /* The count is the +Inf bucket, so that the two always agree. */
+      g_string_append_printf (str, "%s_sum{class=\"%s\"} ", name, class_names[class]);
+      append_seconds (str, counter_get (&histogram->sum_usecs));
+      g_string_append_printf (str, "\n%s_count{class=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                              name, class_names[class], cumulative);
+    }
+}
+
+static void
+append_level_counter (GString *str,
+                      const gchar *name,
+                      const gchar *help,
+                      const guint64 *counters)
+{
+  gint level;
+
+  append_header (str, name, "counter", help);
+  for (level = 0; level <= EOS_COMPRESSION_LEVEL_MAX; level++)
+    {
+      guint64 value = counter_get (&counters[level]);
+
+      if (value > 0)
+        g_string_append_printf (str, "%s{level=\"%d\"} %" G_GUINT64_FORMAT "\n",
+                                name, level, value);
+    }
+}
+
+/* Appends one sample per client of the counter at @offset in #ClientStats.
+ * Must be called with the clients lock held. */
+static void
+append_client_counter (GString *str,
+                       EosServerMetrics *metrics,
+                       const gchar *name,
+                       const gchar *code,
+                       gsize offset,
+                       gboolean is_usecs)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  gboolean done_other = FALSE;
+
+  g_hash_table_iter_init (&iter, metrics->clients);
+  while (TRUE)
+    {
+      const gchar *address;
+      ClientStats *stats;
+      guint64 counter;
+
+      if (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          address = key;
+          stats = value;
+        }
+      else if (!done_other &&
+               (metrics->other_clients.requests > 0 || metrics->other_clients.aborted > 0))
+        {
+          address = "other";
+          stats = &metrics->other_clients;
+          done_other = TRUE;
+        }
+      else
+        break;
+
+      counter = G_STRUCT_MEMBER (guint64, stats, offset);
+
+      g_string_append_printf (str, "%s{client=", name);
+      append_label_value (str, address);
+      if (code != NULL)
+        g_string_append_printf (str, ",code=\"%s\"", code);
+      g_string_append (str, "} ");
+      if (is_usecs)
+        append_seconds (str, counter);
+      else
+        g_string_append_printf (str, "%" G_GUINT64_FORMAT, counter);
+      g_string_append_c (str, '\n');
+    }
+}
+
+/**
+ * eos_server_metrics_format:
+ * @metrics: an #EosServerMetrics
+ *
+ * Formats the metrics in the Prometheus text exposition format (version
+ * 0.0.4), to be served as `text/plain; version=0.0.4`.
+ *
+ * Throughput to a client is its
+ * `eos_update_server_client_sent_bytes_total` divided by its
+ * `eos_update_server_client_send_seconds_total`; the compression ratio is
+ * `eos_update_server_compression_output_bytes_total` divided by
+ * `eos_update_server_compression_input_bytes_total`.
+ *
+ * Returns: (transfer full): the formatted metrics
+ */
+gchar *
+eos_server_metrics_format (EosServerMetrics *metrics)
+{
+  g_autoptr(GString) str = g_string_new ("");
+  gsize i;
+
+  g_return_val_if_fail (EOS_IS_SERVER_METRICS (metrics), NULL);
+
+  append_header (str, "eos_update_server_requests_in_flight", "gauge",
+                 "Requests being handled.");
+  g_string_append_printf (str, "eos_update_server_requests_in_flight %d\n",
+                          g_atomic_int_get (&metrics->in_flight));
+
+  append_class_counter (str, "eos_update_server_requests_total",
+                        "Requests whose response was sent, by kind of path.",
+                        metrics->requests);
+  append_class_counter (str, "eos_update_server_aborted_requests_total",
+                        "Requests which failed before their response was sent, by kind of path.",
+                        metrics->aborted);
+  append_class_counter (str, "eos_update_server_sent_bytes_total",
+                        "Bytes of response bodies sent, by kind of path.",
+                        metrics->bytes);
+
+  append_header (str, "eos_update_server_responses_total", "counter",
+                 "Responses sent, by status class.");
+  for (i = 1; i < N_STATUS_CLASSES; i++)
+    g_string_append_printf (str, "eos_update_server_responses_total{code=\"%" G_GSIZE_FORMAT "xx\"} %" G_GUINT64_FORMAT "\n",
+                            i, counter_get (&metrics->responses[i]));
+
+  append_histograms (str, "eos_update_server_time_to_first_byte_seconds",
+                     "Time from the start of a request until its response headers were sent.",
+                     metrics->time_to_first_byte);
+  append_histograms (str, "eos_update_server_request_duration_seconds",
+                     "Time from the start of a request until its response was sent.",
+                     metrics->duration);
+
+  append_header (str, "eos_update_server_cache_lookups_total", "counter",
+                 "Lookups in the compressed object cache, by result.");
+  g_string_append_printf (str, "eos_update_server_cache_lookups_total{result=\"hit\"} %" G_GUINT64_FORMAT "\n",
+                          counter_get (&metrics->cache_hits));
+  g_string_append_printf (str, "eos_update_server_cache_lookups_total{result=\"miss\"} %" G_GUINT64_FORMAT "\n",
+                          counter_get (&metrics->cache_misses));
+
+  append_header (str, "eos_update_server_compression_cpu_seconds_total", "counter",
+                 "CPU time spent compressing file objects.");
+  g_string_append (str, "eos_update_server_compression_cpu_seconds_total ");
+  append_seconds (str, counter_get (&metrics->compression_cpu_usecs));
+  g_string_append_c (str, '\n');
+
+  append_level_counter (str, "eos_update_server_compressed_objects_total",
+                        "File objects compressed, by zlib level.",
+                        metrics->compressed_objects);
+  append_level_counter (str, "eos_update_server_compression_input_bytes_total",
+                        "Bytes of file objects before compression, by zlib level.",
+                        metrics->compression_input_bytes);
+  append_level_counter (str, "eos_update_server_compression_output_bytes_total",
+                        "Bytes of file objects after compression, by zlib level.",
+                        metrics->compression_output_bytes);
+
+  g_mutex_lock (&metrics->clients_lock);
+
+  append_header (str, "eos_update_server_client_requests_total", "counter",
+                 "Requests whose response was sent, by client.");
+  append_client_counter (str, metrics, "eos_update_server_client_requests_total",
+                         NULL, G_STRUCT_OFFSET (ClientStats, requests), FALSE);
+  append_header (str, "eos_update_server_client_aborted_requests_total", "counter",
+                 "Requests which failed before their response was sent, by client.");
+  append_client_counter (str, metrics, "eos_update_server_client_aborted_requests_total",
+                         NULL, G_STRUCT_OFFSET (ClientStats, aborted), FALSE);
+  append_header (str, "eos_update_server_client_sent_bytes_total", "counter",
+                 "Bytes of response bodies sent, by client.");
+  append_client_counter (str, metrics, "eos_update_server_client_sent_bytes_total",
+                         NULL, G_STRUCT_OFFSET (ClientStats, bytes), FALSE);
+  append_header (str, "eos_update_server_client_send_seconds_total", "counter",
+                 "Time spent handling requests, by client.");
+  append_client_counter (str, metrics, "eos_update_server_client_send_seconds_total",
+                         NULL, G_STRUCT_OFFSET (ClientStats, send_usecs), TRUE);
+  append_header (str, "eos_update_server_client_responses_total", "counter",
+                 "Error responses sent, by client and status class.");
+  append_client_counter (str, metrics, "eos_update_server_client_responses_total",
+                         "4xx", G_STRUCT_OFFSET (ClientStats, responses_4xx), FALSE);
+  append_client_counter (str, metrics, "eos_update_server_client_responses_total",
+                         "5xx", G_STRUCT_OFFSET (ClientStats, responses_5xx), FALSE);
+
+  g_mutex_unlock (&metrics->clients_lock);
+
+  return g_string_free (g_steal_pointer (&str), FALSE);
+}
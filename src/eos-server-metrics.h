@@ -0,0 +1,64 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <libeos-updater-util/refcounted.h>
+#include <libeos-updater-util/repo-path.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EOS_TYPE_SERVER_METRICS eos_server_metrics_get_type ()
+EOS_DECLARE_REFCOUNTED (EosServerMetrics, eos_server_metrics, EOS, SERVER_METRICS)
+
+EosServerMetrics *eos_server_metrics_new (void);
+
+void eos_server_metrics_request_started (EosServerMetrics *metrics);
+
+void eos_server_metrics_request_finished (EosServerMetrics *metrics,
+                                          EosRepoPathKind kind,
+                                          guint status_code,
+                                          const gchar *client_address,
+                                          guint64 bytes_sent,
+                                          gint64 first_byte_usecs,
+                                          gint64 total_usecs);
+
+void eos_server_metrics_request_aborted (EosServerMetrics *metrics,
+                                         EosRepoPathKind kind,
+                                         const gchar *client_address,
+                                         guint64 bytes_sent,
+                                         gint64 total_usecs);
+
+void eos_server_metrics_note_cache_lookup (EosServerMetrics *metrics,
+                                           gboolean hit);
+
+void eos_server_metrics_note_compression (EosServerMetrics *metrics,
+                                          gint level,
+                                          guint64 uncompressed_bytes,
+                                          guint64 compressed_bytes);
+
+void eos_server_metrics_note_compression_time (EosServerMetrics *metrics,
+                                               gint64 cpu_usecs);
+
+gchar *eos_server_metrics_format (EosServerMetrics *metrics);
+
+G_END_DECLS
@@ -20,9 +20,11 @@
  * Author: Krzesimir Nowak <krzesimir@kinvolk.io>
  */
 
+#include "eos-compression-policy.h"
 #include "eos-repo-server.h"
 
 #include <libeos-updater-util/config.h>
+#include <libeos-updater-util/ostree.h>
 #include <libeos-updater-util/refcounted.h>
 #include <libeos-updater-util/util.h>
 
@@ -37,7 +39,10 @@
 #include <systemd/sd-daemon.h>
 
 #include <errno.h>
+#include <netinet/in.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 /* FIXME: The configuration code is shared with eos-updater-avahi and should be
  * split out into a helper library. */
@@ -49,10 +54,257 @@ static const char *LOCAL_CONFIG_FILE_PATH = PREFIX "/local/share/" PACKAGE "/eos
 /* Configuration file keys. */
 static const char *LOCAL_NETWORK_UPDATES_GROUP = "Local Network Updates";
 static const char *ADVERTISE_UPDATES_KEY = "AdvertiseUpdates";
+static const char *CACHE_SIZE_KEY = "CompressedObjectCacheSize";
+static const char *COMPRESSION_THREADS_KEY = "CompressionThreads";
+static const char *COMPRESSION_LEVEL_KEY = "CompressionLevel";
+static const char *MAX_OBJECT_STREAMS_KEY = "MaxObjectStreams";
+static const char *MAX_COMPRESSIONS_KEY = "MaxCompressions";
+static const char *MAX_UPLOAD_RATE_KEY = "MaxUploadRate";
+static const char *MAX_CLIENT_UPLOAD_RATE_KEY = "MaxClientUploadRate";
+static const char *CLIENT_WEIGHTS_KEY = "ClientWeights";
+static const char *GENERATE_DELTAS_KEY = "GenerateDeltas";
+static const char *WARM_CACHE_KEY = "WarmCache";
+static const char *WORKERS_KEY = "Workers";
+static const char *PROXY_UPSTREAM_KEY = "ProxyUpstream";
+static const char *METRICS_KEY = "Metrics";
+
+/* Default values for optional configuration file keys. */
+static const guint64 DEFAULT_CACHE_SIZE_MIB = 256;
+static const guint64 DEFAULT_COMPRESSION_THREADS = 0;  /* one per processor */
+static const gint DEFAULT_COMPRESSION_LEVEL = EOS_COMPRESSION_LEVEL_DEFAULT;
+static const guint64 DEFAULT_MAX_OBJECT_STREAMS = 64;
+static const guint64 DEFAULT_MAX_COMPRESSIONS = 16;
+static const guint64 DEFAULT_MAX_UPLOAD_RATE_KIB = 0;
+static const guint64 DEFAULT_MAX_CLIENT_UPLOAD_RATE_KIB = 0;
+static const gboolean DEFAULT_GENERATE_DELTAS = FALSE;
+static const gboolean DEFAULT_WARM_CACHE = FALSE;
+static const guint64 DEFAULT_WORKERS = 1;  /* 0 means one per processor */
+static const gboolean DEFAULT_PROXY_UPSTREAM = FALSE;
+static const gboolean DEFAULT_METRICS = FALSE;
+
+typedef struct
+{
+  gboolean advertise_updates;
+  guint64 cache_size;  /* bytes */
+  guint compression_threads;
+  gint compression_level;  /* or EOS_COMPRESSION_LEVEL_ADAPTIVE */
+  guint max_object_streams;
+  guint max_compressions;
+  guint64 max_upload_rate;  /* bytes per second */
+  guint64 max_client_upload_rate;  /* bytes per second */
+  gchar **client_weights;
+  gboolean generate_deltas;
+  gboolean warm_cache;
+  guint workers;
+  gboolean proxy_upstream;
+  gboolean metrics;
+} Config;
+
+#define CONFIG_CLEARED { FALSE, 0, 0, EOS_COMPRESSION_LEVEL_ADAPTIVE, 0, 0, 0, 0, NULL, FALSE, FALSE, 0, FALSE, FALSE }
+
+static void
+config_clear (Config *config)
+{
+  g_clear_pointer (&config->client_weights, g_strfreev);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (Config, config_clear)
+
+/* Keys added after AdvertiseUpdates are optional, so that configuration files
+ * written for older versions keep working. */
+static gboolean
+get_optional_uint64 (GKeyFile     *config,
+                     const gchar  *group_name,
+                     const gchar  *key,
+                     guint64       default_value,
+                     guint64      *out_value,
+                     GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  guint64 value;
+
+  value = g_key_file_get_uint64 (config, group_name, key, &local_error);
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+      g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_GROUP_NOT_FOUND))
+    {
+      *out_value = default_value;
+      return TRUE;
+    }
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  *out_value = value;
+  return TRUE;
+}
+
+static gboolean
+get_optional_uint (GKeyFile     *config,
+                   const gchar  *group_name,
+                   const gchar  *key,
+                   guint64       default_value,
+                   guint        *out_value,
+                   GError      **error)
+{
+  guint64 value;
+
+  if (!get_optional_uint64 (config, group_name, key, default_value,
+                            &value, error))
+    return FALSE;
+
+  if (value > G_MAXINT)
+    {
+      g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                   "Invalid %s value %" G_GUINT64_FORMAT, key, value);
+      return FALSE;
+    }
+
+  *out_value = (guint) value;
+  return TRUE;
+}
+
+/* Reads a rate in KiB/s and returns it in bytes per second. */
+static gboolean
+get_optional_rate (GKeyFile     *config,
+                   const gchar  *group_name,
+                   const gchar  *key,
+                   guint64       default_value_kib,
+                   guint64      *out_value,
+                   GError      **error)
+{
+  guint64 value_kib;
+
+  if (!get_optional_uint64 (config, group_name, key, default_value_kib,
+                            &value_kib, error))
+    return FALSE;
+
+  if (value_kib > G_MAXUINT64 / 1024)
+    {
+      g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                   "Invalid %s value %" G_GUINT64_FORMAT, key, value_kib);
+      return FALSE;
+    }
+
+  *out_value = value_kib * 1024;
+  return TRUE;
+}
+
+static gboolean
+get_optional_boolean (GKeyFile     *config,
+                      const gchar  *group_name,
+                      const gchar  *key,
+                      gboolean      default_value,
+                      gboolean     *out_value,
+                      GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  gboolean value;
+
+  value = g_key_file_get_boolean (config, group_name, key, &local_error);
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+      g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_GROUP_NOT_FOUND))
+    {
+      *out_value = default_value;
+      return TRUE;
+    }
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  *out_value = value;
+  return TRUE;
+}
+
+/* Reads a zlib compression level from 0 to 9, or `adaptive`. */
+static gboolean
+get_optional_compression_level (GKeyFile     *config,
+                                const gchar  *group_name,
+                                const gchar  *key,
+                                gint          default_value,
+                                gint         *out_value,
+                                GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *value = NULL;
+  guint64 level;
+  gchar *end = NULL;
+
+  value = g_key_file_get_string (config, group_name, key, &local_error);
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+      g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_GROUP_NOT_FOUND))
+    {
+      *out_value = default_value;
+      return TRUE;
+    }
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  g_strstrip (value);
+  if (g_str_equal (value, "adaptive"))
+    {
+      *out_value = EOS_COMPRESSION_LEVEL_ADAPTIVE;
+      return TRUE;
+    }
+
+  level = g_ascii_strtoull (value, &end, 10);
+  if (*value == '\0' || end == NULL || *end != '\0' ||
+      level > EOS_COMPRESSION_LEVEL_MAX)
+    {
+      g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                   "Invalid %s value ‘%s’; expected ‘adaptive’ or 0 to %d",
+                   key, value, EOS_COMPRESSION_LEVEL_MAX);
+      return FALSE;
+    }
+
+  *out_value = (gint) level;
+  return TRUE;
+}
+
+static gboolean
+get_optional_string_list (GKeyFile     *config,
+                          const gchar  *group_name,
+                          const gchar  *key,
+                          gchar      ***out_value,
+                          GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_auto(GStrv) value = NULL;
+
+  value = g_key_file_get_string_list (config, group_name, key, NULL, &local_error);
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+      g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_GROUP_NOT_FOUND))
+    {
+      *out_value = NULL;
+      return TRUE;
+    }
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  *out_value = g_steal_pointer (&value);
+  return TRUE;
+}
 
 static gboolean
 read_config_file (const gchar  *config_file_path,
-                  gboolean     *advertise_updates,
+                  Config       *out_config,
                   GError      **error)
 {
   g_autoptr(GKeyFile) config = NULL;
@@ -70,7 +322,9 @@ read_config_file (const gchar  *config_file_path,
       NULL
     };
 
-  g_return_val_if_fail (advertise_updates != NULL, FALSE);
+  guint64 cache_size_mib;
+
+  g_return_val_if_fail (out_config != NULL, FALSE);
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
   /* Try loading the files in order. If the user specified a configuration file
@@ -81,16 +335,70 @@ read_config_file (const gchar  *config_file_path,
     return FALSE;
 
   /* Successfully loaded a file. Parse it. */
-  *advertise_updates = g_key_file_get_boolean (config,
-                                               LOCAL_NETWORK_UPDATES_GROUP,
-                                               ADVERTISE_UPDATES_KEY,
-                                               &local_error);
+  out_config->advertise_updates = g_key_file_get_boolean (config,
+                                                          LOCAL_NETWORK_UPDATES_GROUP,
+                                                          ADVERTISE_UPDATES_KEY,
+                                                          &local_error);
   if (local_error != NULL)
     {
       g_propagate_error (error, g_steal_pointer (&local_error));
       return FALSE;
     }
 
+  if (!get_optional_uint64 (config, LOCAL_NETWORK_UPDATES_GROUP,
+                            CACHE_SIZE_KEY, DEFAULT_CACHE_SIZE_MIB,
+                            &cache_size_mib, error))
+    return FALSE;
+
+  if (cache_size_mib > G_MAXUINT64 / (1024 * 1024))
+    {
+      g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                   "Invalid %s value %" G_GUINT64_FORMAT,
+                   CACHE_SIZE_KEY, cache_size_mib);
+      return FALSE;
+    }
+  out_config->cache_size = cache_size_mib * 1024 * 1024;
+
+  if (!get_optional_uint (config, LOCAL_NETWORK_UPDATES_GROUP,
+                          COMPRESSION_THREADS_KEY, DEFAULT_COMPRESSION_THREADS,
+                          &out_config->compression_threads, error) ||
+      !get_optional_compression_level (config, LOCAL_NETWORK_UPDATES_GROUP,
+                                       COMPRESSION_LEVEL_KEY,
+                                       DEFAULT_COMPRESSION_LEVEL,
+                                       &out_config->compression_level, error) ||
+      !get_optional_uint (config, LOCAL_NETWORK_UPDATES_GROUP,
+                          MAX_OBJECT_STREAMS_KEY, DEFAULT_MAX_OBJECT_STREAMS,
+                          &out_config->max_object_streams, error) ||
+      !get_optional_uint (config, LOCAL_NETWORK_UPDATES_GROUP,
+                          MAX_COMPRESSIONS_KEY, DEFAULT_MAX_COMPRESSIONS,
+                          &out_config->max_compressions, error) ||
+      !get_optional_rate (config, LOCAL_NETWORK_UPDATES_GROUP,
+                          MAX_UPLOAD_RATE_KEY, DEFAULT_MAX_UPLOAD_RATE_KIB,
+                          &out_config->max_upload_rate, error) ||
+      !get_optional_rate (config, LOCAL_NETWORK_UPDATES_GROUP,
+                          MAX_CLIENT_UPLOAD_RATE_KEY,
+                          DEFAULT_MAX_CLIENT_UPLOAD_RATE_KIB,
+                          &out_config->max_client_upload_rate, error) ||
+      !get_optional_string_list (config, LOCAL_NETWORK_UPDATES_GROUP,
+                                 CLIENT_WEIGHTS_KEY,
+                                 &out_config->client_weights, error) ||
+      !get_optional_boolean (config, LOCAL_NETWORK_UPDATES_GROUP,
+                             GENERATE_DELTAS_KEY, DEFAULT_GENERATE_DELTAS,
+                             &out_config->generate_deltas, error) ||
+      !get_optional_boolean (config, LOCAL_NETWORK_UPDATES_GROUP,
+                             WARM_CACHE_KEY, DEFAULT_WARM_CACHE,
+                             &out_config->warm_cache, error) ||
+      !get_optional_uint (config, LOCAL_NETWORK_UPDATES_GROUP,
+                          WORKERS_KEY, DEFAULT_WORKERS,
+                          &out_config->workers, error) ||
+      !get_optional_boolean (config, LOCAL_NETWORK_UPDATES_GROUP,
+                             PROXY_UPSTREAM_KEY, DEFAULT_PROXY_UPSTREAM,
+                             &out_config->proxy_upstream, error) ||
+      !get_optional_boolean (config, LOCAL_NETWORK_UPDATES_GROUP,
+                             METRICS_KEY, DEFAULT_METRICS,
+                             &out_config->metrics, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -235,10 +543,241 @@ clear_source (guint *id)
   *id = 0;
 }
 
+/* One #EosUpdaterRepoServer and the main context it runs in. Worker 0 runs in
+ * the main thread, in the global default main context; the others each run
+ * in a thread of their own. */
+typedef struct
+{
+  struct _WorkerPool *pool;  /* (unowned) */
+  GMainContext *context;  /* (owned) */
+  GThread *thread;  /* (owned) (nullable) NULL for worker 0 */
+  gint quit;  /* atomic */
+  EosUpdaterRepoServer *server;  /* (owned) */
+  gulong notify_id;
+  guint pending_requests;  /* protected by pool->lock */
+} Worker;
+
+typedef struct _WorkerPool
+{
+  GPtrArray *workers;  /* (owned) (element-type Worker) */
+
+  /* Activity of all the workers, updated from their threads, so that the idle
+   * timeout can be checked in the main thread. */
+  GMutex lock;
+  guint pending_requests;  /* total over all workers */
+  gint64 last_request_time;  /* latest over all workers */
+} WorkerPool;
+
+#define WORKER_POOL_CLEARED { NULL, { NULL }, 0, 0 }
+
+static void
+worker_free (Worker *worker)
+{
+  g_assert (worker->thread == NULL);
+
+  if (worker->notify_id != 0)
+    g_signal_handler_disconnect (worker->server, worker->notify_id);
+  g_clear_object (&worker->server);
+  g_clear_pointer (&worker->context, g_main_context_unref);
+  g_free (worker);
+}
+
+static gpointer
+worker_thread_cb (gpointer user_data)
+{
+  Worker *worker = user_data;
+
+  g_main_context_push_thread_default (worker->context);
+  while (!g_atomic_int_get (&worker->quit))
+    g_main_context_iteration (worker->context, TRUE);
+  g_main_context_pop_thread_default (worker->context);
+
+  return NULL;
+}
+
+/* Called in the worker’s thread whenever its server starts or finishes a
+ * request. */
+static void
+worker_activity_cb (GObject    *object,
+                    GParamSpec *pspec,
+                    gpointer    user_data)
+{
+  Worker *worker = user_data;
+  WorkerPool *pool = worker->pool;
+  guint pending_requests = eos_updater_repo_server_get_pending_requests (worker->server);
+  gint64 last_request_time = eos_updater_repo_server_get_last_request_time (worker->server);
+
+  g_mutex_lock (&pool->lock);
+  pool->pending_requests -= worker->pending_requests;
+  pool->pending_requests += pending_requests;
+  worker->pending_requests = pending_requests;
+  pool->last_request_time = MAX (pool->last_request_time, last_request_time);
+  g_mutex_unlock (&pool->lock);
+}
+
+static void
+worker_pool_init (WorkerPool *pool)
+{
+  memset (pool, 0, sizeof (*pool));
+  pool->workers = g_ptr_array_new_with_free_func ((GDestroyNotify) worker_free);
+  g_mutex_init (&pool->lock);
+}
+
+/* Splits a limit on the whole server evenly between @n_workers workers. Zero
+ * means no limit. */
+static guint64
+split_limit (guint64 limit,
+             guint   n_workers)
+{
+  if (limit == 0)
+    return 0;
+
+  return MAX (1, limit / n_workers);
+}
+
+/* Creates @n_workers servers. Limits on the whole server are split between
+ * them, except for the upload rates: they share one bandwidth scheduler, so
+ * that the rate limits and client weights hold across all of them. They also
+ * share one object cache and one set of metrics. Deltas are generated and the
+ * cache is warmed by worker 0 only. */
+static gboolean
+worker_pool_add_workers (WorkerPool   *pool,
+                         OstreeRepo   *repo,
+                         Options      *options,
+                         Config       *config,
+                         const gchar  *advertised_commit,
+                         const gchar  *upstream_url,
+                         guint         n_workers,
+                         GError      **error)
+{
+  EosUpdaterRepoServer *first_server = NULL;  /* (unowned) */
+  guint compression_threads = config->compression_threads;
+  guint i;
+
+  if (compression_threads == 0 && n_workers > 1)
+    compression_threads = g_get_num_processors ();
+
+  for (i = 0; i < n_workers; i++)
+    {
+      g_autoptr(OstreeRepo) worker_repo = NULL;
+      Worker *worker = g_new0 (Worker, 1);
+
+      worker->pool = pool;
+      worker->context = (i == 0) ? g_main_context_ref (g_main_context_default ()) : g_main_context_new ();
+      g_ptr_array_add (pool->workers, worker);
+
+      /* OstreeRepo is not thread-safe, so each worker opens its own. */
+      if (i == 0)
+        worker_repo = g_object_ref (repo);
+      else
+        {
+          worker_repo = ostree_repo_new (ostree_repo_get_path (repo));
+          if (!ostree_repo_open (worker_repo, NULL, error))
+            return FALSE;
+        }
+
+      /* The server attaches its sources to the thread-default main context
+       * when it is created. */
+      g_main_context_push_thread_default (worker->context);
+      worker->server = g_initable_new (EOS_UPDATER_TYPE_REPO_SERVER,
+                                       NULL,
+                                       error,
+                                       "repo", worker_repo,
+                                       "served-remote", options->served_remote,
+                                       "cache-size", config->cache_size,
+                                       "compression-threads", (guint) split_limit (compression_threads, n_workers),
+                                       "compression-level", config->compression_level,
+                                       "max-object-streams", (guint) split_limit (config->max_object_streams, n_workers),
+                                       "max-compressions", (guint) split_limit (config->max_compressions, n_workers),
+                                       "max-upload-rate", config->max_upload_rate,
+                                       "max-client-upload-rate", config->max_client_upload_rate,
+                                       "client-weights", config->client_weights,
+                                       "advertised-commit", advertised_commit,
+                                       "generate-deltas", (i == 0) ? config->generate_deltas : FALSE,
+                                       "warm-cache", (i == 0) ? config->warm_cache : FALSE,
+                                       "upstream-url", upstream_url,
+                                       "collect-metrics", config->metrics,
+                                       "shared-with", first_server,
+                                       NULL);
+      g_main_context_pop_thread_default (worker->context);
+
+      if (worker->server == NULL)
+        return FALSE;
+
+      if (i == 0)
+        first_server = worker->server;
+
+      worker->notify_id = g_signal_connect (worker->server,
+                                            "notify::last-request-time",
+                                            (GCallback) worker_activity_cb,
+                                            worker);
+    }
+
+  return TRUE;
+}
+
+static void
+worker_pool_start_threads (WorkerPool *pool)
+{
+  guint i;
+
+  for (i = 1; i < pool->workers->len; i++)
+    {
+      Worker *worker = g_ptr_array_index (pool->workers, i);
+
+      worker->thread = g_thread_new ("worker", worker_thread_cb, worker);
+    }
+}
+
+static void
+worker_pool_get_activity (WorkerPool *pool,
+                          guint      *out_pending_requests,
+                          gint64     *out_last_request_time)
+{
+  g_mutex_lock (&pool->lock);
+  *out_pending_requests = pool->pending_requests;
+  *out_last_request_time = pool->last_request_time;
+  g_mutex_unlock (&pool->lock);
+}
+
+/* Stops the worker threads. Worker 0 stops when the main loop does. */
+static void
+worker_pool_stop (WorkerPool *pool)
+{
+  guint i;
+
+  for (i = 1; i < pool->workers->len; i++)
+    {
+      Worker *worker = g_ptr_array_index (pool->workers, i);
+
+      if (worker->thread == NULL)
+        continue;
+
+      g_atomic_int_set (&worker->quit, TRUE);
+      g_main_context_wakeup (worker->context);
+      g_thread_join (g_steal_pointer (&worker->thread));
+    }
+}
+
+static void
+worker_pool_clear (WorkerPool *pool)
+{
+  if (pool->workers == NULL)
+    return;
+
+  worker_pool_stop (pool);
+  g_clear_pointer (&pool->workers, g_ptr_array_unref);
+  g_mutex_clear (&pool->lock);
+  pool->pending_requests = 0;
+  pool->last_request_time = 0;
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (WorkerPool, worker_pool_clear)
+
 typedef struct
 {
   GMainLoop *loop;
-  EosUpdaterRepoServer *server;
+  WorkerPool *pool;  /* (unowned) */
 
   gint timeout_seconds;
   guint timeout_id;
@@ -253,18 +792,18 @@ static void
 timeout_data_setup_timeout (TimeoutData *data);
 
 static gboolean
-no_requests_timeout (EosUpdaterRepoServer *server,
+no_requests_timeout (WorkerPool *pool,
                      gint seconds)
 {
-  guint pending_requests = eos_updater_repo_server_get_pending_requests (server);
+  guint pending_requests;
   gint64 last_request_time;
   gint64 monotonic_now;
   gint64 diff;
 
+  worker_pool_get_activity (pool, &pending_requests, &last_request_time);
   if (pending_requests > 0)
     return FALSE;
 
-  last_request_time = eos_updater_repo_server_get_last_request_time (server);
   monotonic_now = g_get_monotonic_time ();
   diff = monotonic_now - last_request_time;
 
@@ -276,7 +815,7 @@ timeout_cb (gpointer timeout_data_ptr)
 {
   TimeoutData *data = timeout_data_ptr;
 
-  if (!no_requests_timeout (data->server, data->timeout_seconds))
+  if (!no_requests_timeout (data->pool, data->timeout_seconds))
     {
       message ("Resetting timeout");
       timeout_data_setup_timeout (data);
@@ -310,7 +849,7 @@ check_and_quit (gpointer timeout_data_ptr)
 {
   TimeoutData *data = timeout_data_ptr;
 
-  if (!no_requests_timeout (data->server, data->quit_file_timeout_seconds))
+  if (!no_requests_timeout (data->pool, data->quit_file_timeout_seconds))
     return EOS_QUIT_FILE_KEEP_CHECKING;
 
   g_main_loop_quit (data->loop);
@@ -345,12 +884,12 @@ timeout_data_maybe_setup_quit_file (TimeoutData *data,
 static gboolean
 timeout_data_init (TimeoutData *data,
                    Options *options,
-                   EosUpdaterRepoServer *server,
+                   WorkerPool *pool,
                    GError **error)
 {
   memset (data, 0, sizeof (*data));
   data->loop = g_main_loop_new (NULL, FALSE);
-  data->server = g_object_ref (server);
+  data->pool = pool;
   data->timeout_seconds = options->timeout_seconds;
 
   timeout_data_setup_timeout (data);
@@ -367,12 +906,37 @@ timeout_data_clear (TimeoutData *data)
   g_clear_object (&data->quit_file);
   clear_source (&data->timeout_id);
   data->timeout_seconds = 0;
-  g_clear_object (&data->server);
+  data->pool = NULL;
   g_clear_pointer (&data->loop, g_main_loop_unref);
 }
 
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (TimeoutData, timeout_data_clear)
 
+static gboolean
+write_port_file (SoupServer *server,
+                 const gchar *raw_port_path,
+                 GError **error)
+{
+  g_autoptr(SoupURI) uri = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree gchar *contents = NULL;
+
+  if (!get_first_uri_from_server (server, &uri, error))
+    return FALSE;
+
+  file = g_file_new_for_path (raw_port_path);
+  contents = g_strdup_printf ("%u", soup_uri_get_port (uri));
+  return g_file_replace_contents (file,
+                                  contents,
+                                  strlen (contents),
+                                  NULL, /* no etag */
+                                  FALSE, /* no backup */
+                                  G_FILE_CREATE_NONE,
+                                  NULL, /* no new etag */
+                                  NULL, /* no cancellable */
+                                  error);
+}
+
 static gboolean
 listen_local (SoupServer *server,
               Options *options,
@@ -385,41 +949,17 @@ listen_local (SoupServer *server,
     return FALSE;
 
   if (options->raw_port_path != NULL)
-    {
-      g_autoptr(SoupURI) uri = NULL;
-      g_autoptr(GFile) file = NULL;
-      g_autofree gchar *contents = NULL;
-
-      if (!get_first_uri_from_server (server, &uri, error))
-        return FALSE;
-
-      file = g_file_new_for_path (options->raw_port_path);
-      contents = g_strdup_printf ("%u", soup_uri_get_port (uri));
-      if (!g_file_replace_contents (file,
-                                    contents,
-                                    strlen (contents),
-                                    NULL, /* no etag */
-                                    FALSE, /* no backup */
-                                    G_FILE_CREATE_NONE,
-                                    NULL, /* no new etag */
-                                    NULL, /* no cancellable */
-                                    error))
-        return FALSE;
-    }
+    return write_port_file (server, options->raw_port_path, error);
 
   return TRUE;
 }
 
 static gboolean
-start_listening (SoupServer *server,
-                 Options *options,
-                 GError **error)
+get_systemd_socket (int *out_fd,
+                    GError **error)
 {
   int result;
 
-  if (options->local_port > 0 || options->raw_port_path)
-    return listen_local (server, options, error);
-
   result = sd_listen_fds (1);
   if (result < 0)
     {
@@ -442,7 +982,174 @@ start_listening (SoupServer *server,
       return FALSE;
     }
 
-  return soup_server_listen_fd (server, SD_LISTEN_FDS_START, 0, error);
+  *out_fd = SD_LISTEN_FDS_START;
+  return TRUE;
+}
+
+static void
+set_error_from_errno (GError **error,
+                      int saved_errno,
+                      const gchar *message)
+{
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+               "%s: %s", message, g_strerror (saved_errno));
+}
+
+/* Opens a listening socket on the loopback interface, which other sockets can
+ * be bound to the same port as. */
+static int
+open_local_socket (guint16 port,
+                   GError **error)
+{
+  struct sockaddr_in address;
+  int one = 1;
+  int fd;
+
+  fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    {
+      set_error_from_errno (error, errno, "Failed to create socket");
+      return -1;
+    }
+
+  memset (&address, 0, sizeof (address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons (port);
+  address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) != 0 ||
+      bind (fd, (struct sockaddr *) &address, sizeof (address)) != 0 ||
+      listen (fd, SOMAXCONN) != 0)
+    {
+      int saved_errno = errno;
+
+      close (fd);
+      set_error_from_errno (error, saved_errno, "Failed to listen on loopback interface");
+      return -1;
+    }
+
+  return fd;
+}
+
+/* Opens another listening socket bound to the same address as @fd, which must
+ * have SO_REUSEPORT set. */
+static int
+open_reuseport_socket (int fd,
+                       GError **error)
+{
+  struct sockaddr_storage address;
+  socklen_t address_len = sizeof (address);
+  int v6only = 0;
+  socklen_t v6only_len = sizeof (v6only);
+  int one = 1;
+  int new_fd;
+
+  if (getsockname (fd, (struct sockaddr *) &address, &address_len) != 0)
+    {
+      set_error_from_errno (error, errno, "Failed to get listening address");
+      return -1;
+    }
+
+  new_fd = socket (address.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (new_fd < 0)
+    {
+      set_error_from_errno (error, errno, "Failed to create socket");
+      return -1;
+    }
+
+  /* A dual-stack socket from systemd must stay dual-stack. */
+  if (setsockopt (new_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) != 0 ||
+      (address.ss_family == AF_INET6 &&
+       (getsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, &v6only_len) != 0 ||
+        setsockopt (new_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof (v6only)) != 0)) ||
+      bind (new_fd, (struct sockaddr *) &address, address_len) != 0 ||
+      listen (new_fd, SOMAXCONN) != 0)
+    {
+      int saved_errno = errno;
+
+      close (new_fd);
+      set_error_from_errno (error, saved_errno,
+                            "Failed to open another socket on the listening address");
+      return -1;
+    }
+
+  return new_fd;
+}
+
+/* Listens on @fd, which the worker’s server then owns. */
+static gboolean
+worker_listen_fd (Worker *worker,
+                  int fd,
+                  GError **error)
+{
+  gboolean ret;
+
+  g_main_context_push_thread_default (worker->context);
+  ret = soup_server_listen_fd (SOUP_SERVER (worker->server), fd, 0, error);
+  g_main_context_pop_thread_default (worker->context);
+
+  return ret;
+}
+
+static gboolean
+start_listening (WorkerPool *pool,
+                 Options *options,
+                 GError **error)
+{
+  Worker *first = g_ptr_array_index (pool->workers, 0);
+  gboolean local = (options->local_port > 0 || options->raw_port_path);
+  int fd;
+  guint i;
+
+  if (pool->workers->len == 1)
+    {
+      if (local)
+        return listen_local (SOUP_SERVER (first->server), options, error);
+
+      return (get_systemd_socket (&fd, error) &&
+              worker_listen_fd (first, fd, error));
+    }
+
+  /* Each worker listens on a socket of its own, bound to the same address
+   * with SO_REUSEPORT, and the kernel spreads incoming connections between
+   * them. Sharing one socket would wake all the workers for each
+   * connection. */
+  if (local)
+    {
+      fd = open_local_socket (options->local_port, error);
+      if (fd < 0)
+        return FALSE;
+    }
+  else
+    {
+      int one = 1;
+
+      /* The socket unit sets ReusePort=, but older units might not. */
+      if (!get_systemd_socket (&fd, error))
+        return FALSE;
+      if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) != 0)
+        {
+          set_error_from_errno (error, errno, "Failed to set SO_REUSEPORT on listen socket");
+          return FALSE;
+        }
+    }
+
+  for (i = 1; i < pool->workers->len; i++)
+    {
+      int worker_fd = open_reuseport_socket (fd, error);
+
+      if (worker_fd < 0 ||
+          !worker_listen_fd (g_ptr_array_index (pool->workers, i), worker_fd, error))
+        return FALSE;
+    }
+
+  if (!worker_listen_fd (first, fd, error))
+    return FALSE;
+
+  if (local && options->raw_port_path != NULL)
+    return write_port_file (SOUP_SERVER (first->server), options->raw_port_path, error);
+
+  return TRUE;
 }
 
 /* main() exit codes. */
@@ -456,15 +1163,60 @@ enum
   EXIT_NO_SOCKETS = 5,
 };
 
+/* Gets the URL of the served remote, to fetch objects missing from the local
+ * repository from. Only HTTP is supported. The URL is returned without a
+ * trailing slash, so request paths can be appended to it. */
+static gchar *
+get_upstream_url (OstreeRepo *repo,
+                  const gchar *remote_name,
+                  GError **error)
+{
+  g_autofree gchar *url = NULL;
+
+  if (!ostree_repo_remote_get_url (repo, remote_name, &url, error))
+    return NULL;
+
+  if (!g_str_has_prefix (url, "http://") && !g_str_has_prefix (url, "https://"))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Remote %s has unsupported URL %s", remote_name, url);
+      return NULL;
+    }
+
+  while (g_str_has_suffix (url, "/"))
+    url[strlen (url) - 1] = '\0';
+
+  return g_steal_pointer (&url);
+}
+
+/* Gets the commit which eos-updater-avahi advertises, which is the one
+ * clients will be pulling, and hence the one to generate deltas to. */
+static gchar *
+get_advertised_commit (GError **error)
+{
+  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
+  g_autofree gchar *commit_checksum = NULL;
+
+  if (!ostree_sysroot_load (sysroot, NULL, error) ||
+      !eos_sysroot_get_advertisable_commit (sysroot, &commit_checksum, NULL,
+                                            NULL, error))
+    return NULL;
+
+  return g_steal_pointer (&commit_checksum);
+}
+
 int
 main (int argc, char **argv)
 {
   g_autoptr(GError) error = NULL;
   g_auto(Options) options = OPTIONS_CLEARED;
-  g_autoptr(EosUpdaterRepoServer) server = NULL;
+  g_auto(WorkerPool) pool = WORKER_POOL_CLEARED;
   g_auto(TimeoutData) data = TIMEOUT_DATA_CLEARED;
   g_autoptr(OstreeRepo) repo = NULL;
-  gboolean advertise_updates = FALSE;
+  g_auto(Config) config = CONFIG_CLEARED;
+  g_autofree gchar *advertised_commit = NULL;
+  g_autofree gchar *upstream_url = NULL;
+  guint n_workers;
 
   setlocale (LC_ALL, "");
 
@@ -475,14 +1227,14 @@ main (int argc, char **argv)
     }
 
   /* Load our configuration. */
-  if (!read_config_file (options.config_file, &advertise_updates, &error))
+  if (!read_config_file (options.config_file, &config, &error))
     {
       message ("Failed to load configuration file: %s", error->message);
       return EXIT_BAD_CONFIGURATION;
     }
 
   /* Should we actually run? */
-  if (!advertise_updates)
+  if (!config.advertise_updates)
     {
       message ("Advertising updates is disabled in the configuration file. "
                "Exiting.");
@@ -490,29 +1242,55 @@ main (int argc, char **argv)
     }
 
   repo = eos_updater_local_repo ();
-  server = eos_updater_repo_server_new (repo,
-                                        options.served_remote,
-                                        NULL,
-                                        &error);
-  if (server == NULL)
+
+  if (config.generate_deltas || config.warm_cache)
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      /* Not fatal: the repository is still served as it is. */
+      advertised_commit = get_advertised_commit (&local_error);
+      if (advertised_commit == NULL)
+        message ("Not generating static deltas or warming the cache: %s",
+                 local_error->message);
+    }
+
+  if (config.proxy_upstream)
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      /* Not fatal: what is in the local repository can still be served. */
+      upstream_url = get_upstream_url (repo, options.served_remote, &local_error);
+      if (upstream_url == NULL)
+        message ("Not fetching missing objects from upstream: %s",
+                 local_error->message);
+    }
+
+  n_workers = (config.workers > 0) ? config.workers : g_get_num_processors ();
+  if (n_workers > 1)
+    message ("Serving with %u workers", n_workers);
+
+  worker_pool_init (&pool);
+  if (!worker_pool_add_workers (&pool, repo, &options, &config,
+                                advertised_commit, upstream_url, n_workers,
+                                &error))
     {
       message ("Failed to create a server: %s", error->message);
       return EXIT_FAILED;
     }
 
-
-  if (!timeout_data_init (&data, &options, server, &error))
+  if (!timeout_data_init (&data, &options, &pool, &error))
     {
       message ("Failed to initialize timeout data: %s", error->message);
       return EXIT_FAILED;
     }
 
-  if (!start_listening (SOUP_SERVER (server), &options, &error))
+  if (!start_listening (&pool, &options, &error))
     {
       message ("Failed to listen: %s", error->message);
       return EXIT_NO_SOCKETS;
     }
 
+  worker_pool_start_threads (&pool);
   g_main_loop_run (data.loop);
 
   return EXIT_OK;
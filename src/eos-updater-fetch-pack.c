@@ -0,0 +1,578 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-updater-fetch-pack.h"
+
+#include <libeos-updater-util/pack.h>
+
+#include <libsoup/soup.h>
+#include <string.h>
+
+/* Fetching objects from an eos-update-server peer in packs.
+ *
+ * Pulling a commit from a peer normally takes one request per object, and
+ * for the many small objects in an OS tree the per-request overhead dominates
+ * (especially over Wi-Fi). If the peer supports packs (it says so in its
+ * /config), the metadata of the commit is fetched level by level, and the
+ * file objects after it, EOS_PACK_MAX_OBJECTS objects per request, and written
+ * into the repository. The normal pull which follows then only has to fetch
+ * whatever the packs did not contain (typically big files, which the server
+ * skips).
+ *
+ * The commit itself must already have been pulled (and hence verified), but
+ * marked as partial, so that the pull after the prefetch still checks every
+ * object is there. Every object is written with its expected checksum, so a
+ * misbehaving peer can only make us store objects which are not used. */
+
+/* Sanity limit on the size of a single object in a pack. */
+#define MAX_PAYLOAD_SIZE (64 * 1024 * 1024)
+
+/* Sanity limit on the size of the peer’s /config. */
+#define MAX_CONFIG_SIZE (64 * 1024)
+
+/* Timeouts, in seconds, for the requests to the peer: how long to wait for
+ * it to respond, and how long to keep an unused connection open for the next
+ * pack. A peer which stalls is given up on, and the pull afterwards fetches
+ * whatever is left. */
+#define PACK_SESSION_TIMEOUT_SECONDS 60
+#define PACK_SESSION_IDLE_TIMEOUT_SECONDS 60
+
+static gchar *
+build_url (const gchar *base_url,
+           const gchar *path)
+{
+  if (g_str_has_suffix (base_url, "/"))
+    path++;
+  return g_strconcat (base_url, path, NULL);
+}
+
+/* Gets the path of the pack endpoint of the peer at @url from its /config,
+ * or %NULL if it does not support packs. */
+static gchar *
+get_pack_path (SoupSession *session,
+               const gchar *url,
+               GCancellable *cancellable,
+               GError **error)
+{
+  g_autofree gchar *config_url = build_url (url, "/config");
+  g_autoptr(SoupMessage) msg = NULL;
+  g_autoptr(GInputStream) response = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize n_read;
+  g_autoptr(GKeyFile) config = g_key_file_new ();
+
+  msg = soup_message_new ("GET", config_url);
+  if (msg == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid URL %s", url);
+      return NULL;
+    }
+
+  response = soup_session_send (session, msg, cancellable, error);
+  if (response == NULL)
+    return NULL;
+  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to fetch %s: %s", config_url, msg->reason_phrase);
+      return NULL;
+    }
+
+  contents = g_malloc (MAX_CONFIG_SIZE);
+  if (!g_input_stream_read_all (response, contents, MAX_CONFIG_SIZE, &n_read,
+                                cancellable, error) ||
+      !g_input_stream_close (response, cancellable, error))
+    return NULL;
+  if (n_read == MAX_CONFIG_SIZE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is too big", config_url);
+      return NULL;
+    }
+
+  if (!g_key_file_load_from_data (config, contents, n_read, G_KEY_FILE_NONE,
+                                  error))
+    return NULL;
+
+  return g_key_file_get_string (config, "eos-updater", "pack-path", NULL);
+}
+
+static gboolean
+write_metadata_object (OstreeRepo *repo,
+                       OstreeObjectType object_type,
+                       const gchar *checksum,
+                       GBytes *payload,
+                       GCancellable *cancellable,
+                       GError **error)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autofree guchar *csum = NULL;
+
+  variant = g_variant_ref_sink (g_variant_new_from_bytes (ostree_metadata_variant_type (object_type),
+                                                          payload,
+                                                          FALSE));
+
+  return ostree_repo_write_metadata (repo, object_type, checksum, variant,
+                                     &csum, cancellable, error);
+}
+
+static gboolean
+write_file_object (OstreeRepo *repo,
+                   const gchar *checksum,
+                   GBytes *payload,
+                   GCancellable *cancellable,
+                   GError **error)
+{
+  g_autoptr(GInputStream) filez = g_memory_input_stream_new_from_bytes (payload);
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GInputStream) content = NULL;
+  guint64 content_length;
+  g_autofree guchar *csum = NULL;
+
+  if (!ostree_content_stream_parse (TRUE, filez, g_bytes_get_size (payload),
+                                    FALSE, &input, &info, &xattrs,
+                                    cancellable, error) ||
+      !ostree_raw_file_to_content_stream (input, info, xattrs,
+                                          &content, &content_length,
+                                          cancellable, error))
+    return FALSE;
+
+  return ostree_repo_write_content (repo, checksum, content, content_length,
+                                    &csum, cancellable, error);
+}
+
+/* Counts @n_bytes more as downloaded in @progress, and lets its callback run:
+ * nothing else iterates the thread-default main context while packs are
+ * being fetched. */
+static void
+add_progress_bytes (OstreeAsyncProgress *progress,
+                    guint64 n_bytes)
+{
+  guint64 total;
+
+  if (progress == NULL)
+    return;
+
+  total = ostree_async_progress_get_uint64 (progress, EOS_PACK_PROGRESS_BYTES_KEY);
+  ostree_async_progress_set_uint64 (progress, EOS_PACK_PROGRESS_BYTES_KEY,
+                                    total + n_bytes);
+  g_main_context_iteration (NULL, FALSE);
+}
+
+/* Per-object callback for fetch_pack(). */
+typedef gboolean (*PackObjectFunc) (const EosPackFrameHeader *header,
+                                    GBytes *payload,
+                                    gpointer user_data,
+                                    GCancellable *cancellable,
+                                    GError **error);
+
+/* Fetches a pack of @object_names (at most EOS_PACK_MAX_OBJECTS of them) and
+ * calls @func for every object which it contains. */
+static gboolean
+fetch_pack (SoupSession *session,
+            const gchar *pack_url,
+            GPtrArray *object_names,
+            PackObjectFunc func,
+            gpointer user_data,
+            OstreeAsyncProgress *progress,
+            GCancellable *cancellable,
+            GError **error)
+{
+  g_autoptr(SoupMessage) msg = NULL;
+  g_autoptr(GBytes) request = NULL;
+  g_autoptr(GInputStream) response = NULL;
+  guint i;
+
+  g_ptr_array_add (object_names, NULL);
+  request = eos_pack_request_new ((const gchar * const *) object_names->pdata);
+  g_ptr_array_set_size (object_names, object_names->len - 1);
+
+  msg = soup_message_new ("POST", pack_url);
+  soup_message_set_request (msg, "text/plain", SOUP_MEMORY_COPY,
+                            g_bytes_get_data (request, NULL),
+                            g_bytes_get_size (request));
+
+  response = soup_session_send (session, msg, cancellable, error);
+  if (response == NULL)
+    return FALSE;
+  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to fetch pack from %s: %s", pack_url,
+                   msg->reason_phrase);
+      return FALSE;
+    }
+
+  for (i = 0; i < object_names->len; i++)
+    {
+      const gchar *object_name = g_ptr_array_index (object_names, i);
+      guint8 header_data[EOS_PACK_FRAME_HEADER_SIZE];
+      EosPackFrameHeader header;
+      g_autofree gchar *checksum = NULL;
+      OstreeObjectType object_type;
+      g_autofree guint8 *payload_data = NULL;
+      g_autoptr(GBytes) payload = NULL;
+      gsize n_read;
+
+      if (!g_input_stream_read_all (response, header_data, sizeof (header_data),
+                                    &n_read, cancellable, error))
+        return FALSE;
+      if (n_read < sizeof (header_data))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                       "Pack ended after %u of %u objects", i, object_names->len);
+          return FALSE;
+        }
+
+      if (!eos_pack_frame_header_parse (header_data, &header, error) ||
+          !eos_pack_object_name_parse (object_name, &checksum, &object_type,
+                                       error))
+        return FALSE;
+
+      if (object_type != header.object_type ||
+          !g_str_equal (checksum, header.checksum) ||
+          header.length > MAX_PAYLOAD_SIZE)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Unexpected frame for object %s in pack", object_name);
+          return FALSE;
+        }
+
+      if (header.status != EOS_PACK_FRAME_STATUS_PRESENT)
+        {
+          add_progress_bytes (progress, sizeof (header_data));
+          continue;
+        }
+
+      payload_data = g_malloc (header.length);
+      if (!g_input_stream_read_all (response, payload_data, header.length,
+                                    &n_read, cancellable, error))
+        return FALSE;
+      if (n_read < header.length)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                       "Pack ended in the middle of object %s", object_name);
+          return FALSE;
+        }
+      payload = g_bytes_new_take (g_steal_pointer (&payload_data), header.length);
+      add_progress_bytes (progress, sizeof (header_data) + header.length);
+
+      if (!func (&header, payload, user_data, cancellable, error))
+        return FALSE;
+    }
+
+  return g_input_stream_close (response, cancellable, error);
+}
+
+typedef struct
+{
+  OstreeRepo *repo;
+  GPtrArray *next_level;  /* (element-type utf8) metadata object names */
+  GPtrArray *files;  /* (element-type utf8) file object names */
+  GHashTable *seen;  /* (element-type utf8) object names */
+} PrefetchData;
+
+/* Queues the object for fetching if it is not in the repository yet. */
+static gboolean
+prefetch_data_want (PrefetchData *data,
+                    OstreeObjectType object_type,
+                    const gchar *checksum,
+                    GPtrArray *queue,
+                    GCancellable *cancellable,
+                    GError **error)
+{
+  g_autofree gchar *object_name = ostree_object_to_string (checksum, object_type);
+  gboolean have_object;
+
+  if (g_hash_table_contains (data->seen, object_name))
+    return TRUE;
+
+  if (!ostree_repo_has_object (data->repo, object_type, checksum, &have_object,
+                               cancellable, error))
+    return FALSE;
+
+  /* Stored trees still need scanning, as their children may be missing. */
+  if (have_object && object_type != OSTREE_OBJECT_TYPE_DIR_TREE)
+    return TRUE;
+
+  g_hash_table_add (data->seen, g_strdup (object_name));
+  g_ptr_array_add (queue, g_steal_pointer (&object_name));
+  return TRUE;
+}
+
+/* Queues the children of a dirtree. */
+static gboolean
+prefetch_data_scan_dirtree (PrefetchData *data,
+                            GVariant *dirtree,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+  g_autoptr(GVariant) files = g_variant_get_child_value (dirtree, 0);
+  g_autoptr(GVariant) dirs = g_variant_get_child_value (dirtree, 1);
+  gsize i;
+
+  for (i = 0; i < g_variant_n_children (files); i++)
+    {
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree gchar *checksum = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", NULL, &csum_v);
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+      if (!prefetch_data_want (data, OSTREE_OBJECT_TYPE_FILE, checksum,
+                               data->files, cancellable, error))
+        return FALSE;
+    }
+
+  for (i = 0; i < g_variant_n_children (dirs); i++)
+    {
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree gchar *tree_checksum = NULL;
+      g_autofree gchar *meta_checksum = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", NULL, &tree_csum_v, &meta_csum_v);
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      meta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+      if (!prefetch_data_want (data, OSTREE_OBJECT_TYPE_DIR_TREE, tree_checksum,
+                               data->next_level, cancellable, error) ||
+          !prefetch_data_want (data, OSTREE_OBJECT_TYPE_DIR_META, meta_checksum,
+                               data->next_level, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_pack_object_cb (const EosPackFrameHeader *header,
+                      GBytes *payload,
+                      gpointer user_data,
+                      GCancellable *cancellable,
+                      GError **error)
+{
+  PrefetchData *data = user_data;
+
+  if (header->object_type == OSTREE_OBJECT_TYPE_FILE)
+    return write_file_object (data->repo, header->checksum, payload,
+                              cancellable, error);
+
+  if (!write_metadata_object (data->repo, header->object_type,
+                              header->checksum, payload, cancellable, error))
+    return FALSE;
+
+  if (header->object_type == OSTREE_OBJECT_TYPE_DIR_TREE)
+    {
+      g_autoptr(GVariant) dirtree = NULL;
+
+      dirtree = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_TREE_GVARIANT_FORMAT,
+                                                              payload,
+                                                              FALSE));
+      return prefetch_data_scan_dirtree (data, dirtree, cancellable, error);
+    }
+
+  return TRUE;
+}
+
+/* Fetches @object_names in as many packs as needed. Trees which are in the
+ * repository already are scanned rather than fetched. */
+static gboolean
+fetch_packs (SoupSession *session,
+             const gchar *pack_url,
+             PrefetchData *data,
+             GPtrArray *object_names,
+             OstreeAsyncProgress *progress,
+             GCancellable *cancellable,
+             GError **error)
+{
+  g_autoptr(GPtrArray) batch = g_ptr_array_new ();
+  guint i;
+
+  for (i = 0; i < object_names->len; i++)
+    {
+      const gchar *object_name = g_ptr_array_index (object_names, i);
+      g_autofree gchar *checksum = NULL;
+      OstreeObjectType object_type;
+      gboolean have_object = FALSE;
+
+      if (!eos_pack_object_name_parse (object_name, &checksum, &object_type,
+                                       error))
+        return FALSE;
+
+      if (object_type == OSTREE_OBJECT_TYPE_DIR_TREE &&
+          !ostree_repo_has_object (data->repo, object_type, checksum,
+                                   &have_object, cancellable, error))
+        return FALSE;
+
+      if (have_object)
+        {
+          g_autoptr(GVariant) dirtree = NULL;
+
+          if (!ostree_repo_load_variant (data->repo, object_type, checksum,
+                                         &dirtree, error) ||
+              !prefetch_data_scan_dirtree (data, dirtree, cancellable, error))
+            return FALSE;
+          continue;
+        }
+
+      g_ptr_array_add (batch, (gpointer) object_name);
+      if (batch->len == EOS_PACK_MAX_OBJECTS)
+        {
+          if (!fetch_pack (session, pack_url, batch, write_pack_object_cb,
+                           data, progress, cancellable, error))
+            return FALSE;
+          g_ptr_array_set_size (batch, 0);
+        }
+    }
+
+  if (batch->len > 0)
+    return fetch_pack (session, pack_url, batch, write_pack_object_cb,
+                       data, progress, cancellable, error);
+
+  return TRUE;
+}
+
+static gboolean
+prefetch_commit (SoupSession *session,
+                 const gchar *pack_url,
+                 OstreeRepo *repo,
+                 const gchar *commit_checksum,
+                 OstreeAsyncProgress *progress,
+                 GCancellable *cancellable,
+                 GError **error)
+{
+  g_autoptr(GVariant) commit = NULL;
+  g_autoptr(GVariant) tree_csum_v = NULL;
+  g_autoptr(GVariant) meta_csum_v = NULL;
+  g_autofree gchar *tree_checksum = NULL;
+  g_autofree gchar *meta_checksum = NULL;
+  g_autoptr(GPtrArray) level = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) files = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  PrefetchData data = { repo, level, files, seen };
+  guint n_metadata = 0;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT,
+                                 commit_checksum, &commit, error))
+    return FALSE;
+
+  g_variant_get_child (commit, 6, "@ay", &tree_csum_v);
+  g_variant_get_child (commit, 7, "@ay", &meta_csum_v);
+  tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+  meta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+
+  if (!prefetch_data_want (&data, OSTREE_OBJECT_TYPE_DIR_TREE, tree_checksum,
+                           level, cancellable, error) ||
+      !prefetch_data_want (&data, OSTREE_OBJECT_TYPE_DIR_META, meta_checksum,
+                           level, cancellable, error))
+    return FALSE;
+
+  /* Fetch the metadata a level of the tree at a time, since each level is
+   * only known once the one above it has been fetched. */
+  while (level->len > 0)
+    {
+      g_autoptr(GPtrArray) current = g_steal_pointer (&level);
+
+      level = g_ptr_array_new_with_free_func (g_free);
+      data.next_level = level;
+      n_metadata += current->len;
+
+      if (!fetch_packs (session, pack_url, &data, current, progress,
+                        cancellable, error))
+        return FALSE;
+    }
+
+  g_debug ("Fetched up to %u metadata objects in packs; fetching %u files",
+           n_metadata, files->len);
+
+  return fetch_packs (session, pack_url, &data, files, progress, cancellable,
+                      error);
+}
+
+/**
+ * eos_updater_prefetch_objects_from_pack:
+ * @repo: the repository to write objects to
+ * @url: base URL of an eos-update-server peer
+ * @commit_checksum: checksum of a commit which is in @repo, but only
+ *    partially
+ * @progress: (nullable): an #OstreeAsyncProgress to count the bytes
+ *    downloaded in, under %EOS_PACK_PROGRESS_BYTES_KEY
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Fetches as many of the objects of the commit as possible from the peer in
+ * packs. If the peer does not support packs, %G_IO_ERROR_NOT_SUPPORTED is
+ * returned. The commit still needs pulling afterwards to fetch the objects
+ * which could not be packed.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ */
+gboolean
+eos_updater_prefetch_objects_from_pack (OstreeRepo *repo,
+                                        const gchar *url,
+                                        const gchar *commit_checksum,
+                                        OstreeAsyncProgress *progress,
+                                        GCancellable *cancellable,
+                                        GError **error)
+{
+  g_autoptr(SoupSession) session = NULL;
+  g_autofree gchar *pack_path = NULL;
+  g_autofree gchar *pack_url = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  g_return_val_if_fail (OSTREE_IS_REPO (repo), FALSE);
+  g_return_val_if_fail (url != NULL, FALSE);
+  g_return_val_if_fail (commit_checksum != NULL, FALSE);
+  g_return_val_if_fail (progress == NULL || OSTREE_IS_ASYNC_PROGRESS (progress), FALSE);
+  g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  session = soup_session_new_with_options (SOUP_SESSION_TIMEOUT, PACK_SESSION_TIMEOUT_SECONDS,
+                                           SOUP_SESSION_IDLE_TIMEOUT, PACK_SESSION_IDLE_TIMEOUT_SECONDS,
+                                           NULL);
+
+  pack_path = get_pack_path (session, url, cancellable, &local_error);
+  if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+  if (pack_path == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Peer %s does not support packs", url);
+      return FALSE;
+    }
+  pack_url = build_url (url, pack_path);
+
+  if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
+    return FALSE;
+
+  if (!prefetch_commit (session, pack_url, repo, commit_checksum, progress,
+                        cancellable, error))
+    {
+      ostree_repo_abort_transaction (repo, NULL, NULL);
+      return FALSE;
+    }
+
+  return ostree_repo_commit_transaction (repo, NULL, cancellable, error);
+}
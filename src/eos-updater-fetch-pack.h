@@ -0,0 +1,40 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+/* Key of the #OstreeAsyncProgress value counting the bytes downloaded in
+ * packs, which a pull afterwards does not include in its bytes-transferred. */
+#define EOS_PACK_PROGRESS_BYTES_KEY "pack-bytes-transferred"
+
+gboolean eos_updater_prefetch_objects_from_pack (OstreeRepo *repo,
+                                                 const gchar *url,
+                                                 const gchar *commit_checksum,
+                                                 OstreeAsyncProgress *progress,
+                                                 GCancellable *cancellable,
+                                                 GError **error);
+
+G_END_DECLS
@@ -22,6 +22,7 @@
 
 #include "eos-updater-data.h"
 #include "eos-updater-fetch.h"
+#include "eos-updater-fetch-pack.h"
 #include "eos-updater-object.h"
 
 #include <libeos-updater-util/util.h>
@@ -69,6 +70,10 @@ update_progress (OstreeAsyncProgress *progress,
   guint64 bytes = ostree_async_progress_get_uint64 (progress,
                                                     "bytes-transferred");
 
+  /* Add what was downloaded before the pull, in packs. */
+  bytes += ostree_async_progress_get_uint64 (progress,
+                                             EOS_PACK_PROGRESS_BYTES_KEY);
+
   /* Idle could have been scheduled after the fetch completed, make sure we
    * don't override the downloaded bytes */
   if (eos_updater_get_state (updater) == EOS_UPDATER_STATE_FETCHING)
@@ -80,6 +85,7 @@ repo_pull (OstreeRepo *self,
            const gchar *remote_name,
            const gchar *ref,
            const gchar *url_override,
+           OstreeRepoPullFlags flags,
            OstreeAsyncProgress *progress,
            GCancellable *cancellable,
            GError **error)
@@ -90,6 +96,8 @@ repo_pull (OstreeRepo *self,
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
   g_variant_builder_add (&builder, "{s@v}", "refs",
                          g_variant_new_variant (g_variant_new_strv (&ref, 1)));
+  g_variant_builder_add (&builder, "{s@v}", "flags",
+                         g_variant_new_variant (g_variant_new_int32 (flags)));
   if (url_override != NULL)
     g_variant_builder_add (&builder, "{s@v}", "override-url",
                            g_variant_new_variant (g_variant_new_string (url_override)));
@@ -100,6 +108,49 @@ repo_pull (OstreeRepo *self,
 
 }
 
+/* Peers running eos-update-server can send objects in packs, which is much
+ * faster than pulling them one by one. The commit is pulled (and verified)
+ * on its own first, which leaves it marked as partial, then the packs are
+ * fetched; the pull afterwards fetches whatever they did not contain. Any
+ * failure here just leaves more for that pull to do.
+ *
+ * Everything downloaded here is counted in @progress under
+ * %EOS_PACK_PROGRESS_BYTES_KEY, since the pull afterwards counts its
+ * bytes-transferred from zero again. */
+static void
+prefetch_from_pack (OstreeRepo *repo,
+                    const gchar *remote_name,
+                    const gchar *commit_id,
+                    const gchar *url,
+                    OstreeAsyncProgress *progress,
+                    GCancellable *cancellable)
+{
+  g_autoptr(GError) error = NULL;
+  gboolean pulled_commit;
+
+  if (!g_str_has_prefix (url, "http://") && !g_str_has_prefix (url, "https://"))
+    return;
+
+  pulled_commit = repo_pull (repo, remote_name, commit_id, url,
+                             OSTREE_REPO_PULL_FLAGS_COMMIT_ONLY, progress,
+                             cancellable, &error);
+
+  ostree_async_progress_set_uint64 (progress, EOS_PACK_PROGRESS_BYTES_KEY,
+                                    ostree_async_progress_get_uint64 (progress,
+                                                                      "bytes-transferred"));
+  ostree_async_progress_set_uint64 (progress, "bytes-transferred", 0);
+
+  if (!pulled_commit ||
+      !eos_updater_prefetch_objects_from_pack (repo, url, commit_id, progress,
+                                               cancellable, &error))
+    {
+      message ("Fetch: not fetching objects in packs: %s", error->message);
+      return;
+    }
+
+  message ("Fetch: fetched objects in packs from %s", url);
+}
+
 static void
 content_fetch (GTask *task,
                gpointer object,
@@ -148,13 +199,19 @@ content_fetch (GTask *task,
 
       url_override = data->overridden_urls[idx];
     }
+
+  if (url_override != NULL)
+    prefetch_from_pack (repo, remote, commit_id, url_override, progress,
+                        cancel);
+
   /* rather than re-resolving the update, we get the last ID that the
    * user Poll()ed. We do this because that is the last update for which
    * we had size data: If there's been a new update since, then the
    * system hasn;t seen the download/unpack sizes for that so it cannot
    * be considered to have been approved.
    */
-  if (!repo_pull (repo, remote, commit_id, url_override, progress, cancel, &error))
+  if (!repo_pull (repo, remote, commit_id, url_override,
+                  OSTREE_REPO_PULL_FLAGS_NONE, progress, cancel, &error))
     goto error;
 
   message ("Fetch: pull() completed");
@@ -25,7 +25,10 @@
 #include "eos-updater-object.h"
 #include "eos-updater-poll-common.h"
 
+#include <libeos-updater-util/download-cache.h>
+#include <libeos-updater-util/lookup-preferences.h>
 #include <libeos-updater-util/util.h>
+#include <libeos-updater-util/verified-digests.h>
 
 #ifdef HAS_EOSMETRICS_0
 
@@ -203,6 +206,8 @@ eos_metadata_fetch_data_dispose_impl (EosMetadataFetchData *fetch_data)
 {
   g_main_context_pop_thread_default (fetch_data->context);
   g_clear_pointer (&fetch_data->context, g_main_context_unref);
+  g_clear_object (&fetch_data->cancellable);
+  g_clear_object (&fetch_data->repo);
   g_clear_object (&fetch_data->task);
 }
 
@@ -227,6 +232,9 @@ eos_metadata_fetch_data_new (GTask *task,
   fetch_data->task = g_object_ref (task);
   fetch_data->data = data;
   fetch_data->context = g_main_context_ref (context);
+  fetch_data->repo = g_object_ref (data->repo);
+  if (g_task_get_cancellable (task) != NULL)
+    fetch_data->cancellable = g_object_ref (g_task_get_cancellable (task));
 
   g_main_context_push_thread_default (context);
   return fetch_data;
@@ -321,69 +329,129 @@ get_repo_pull_options (const gchar *url_override,
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 };
 
-static gboolean
-get_extensions_url (OstreeRepo *repo,
-                    const gchar *remote_name,
-                    const gchar *url_override,
-                    gchar **extensions_url,
-                    GError **error)
+/* The directory of the keyrings libostree trusts for all remotes. */
+static GFile *
+get_global_keyring_directory (void)
 {
-  g_autofree gchar *url = g_strdup (url_override);
-
-  if (url == NULL &&
-      !ostree_repo_remote_get_url (repo, remote_name, &url, error))
-    return FALSE;
+  const gchar *gpg_home = g_getenv ("OSTREE_GPG_HOME");
 
-  *extensions_url = g_build_path ("/", url, "extensions", "eos", NULL);
-  return TRUE;
+  return g_file_new_for_path ((gpg_home != NULL) ? gpg_home : DATADIR "/ostree/trusted.gpg.d");
 }
 
-static gboolean
-must_download_file_and_signature (const gchar *url,
-                                  GBytes **contents,
-                                  GBytes **signature,
-                                  GError **error)
+/* Verification results are remembered for as long as the daemon runs. */
+static EosVerifiedDigests *
+get_verified_digests (void)
 {
-  g_autoptr(GBytes) bytes = NULL;
-  g_autoptr(GBytes) sig_bytes = NULL;
+  static gsize digests_ptr = 0;
 
-  if (!download_file_and_signature (url, &bytes, &sig_bytes, error))
-    return FALSE;
+  if (g_once_init_enter (&digests_ptr))
+    g_once_init_leave (&digests_ptr, (gsize) eos_verified_digests_new ());
+
+  return (EosVerifiedDigests *) digests_ptr;
+}
 
-  if (bytes == NULL)
+static gchar *
+get_valid_signature_fingerprint (OstreeGpgVerifyResult *gpg_result)
+{
+  OstreeGpgSignatureAttr attrs[] =
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Failed to download the file at %s", url);
-      return FALSE;
+      OSTREE_GPG_SIGNATURE_ATTR_VALID,
+      OSTREE_GPG_SIGNATURE_ATTR_FINGERPRINT,
+    };
+  guint i, n_signatures;
+
+  n_signatures = ostree_gpg_verify_result_count_all (gpg_result);
+  for (i = 0; i < n_signatures; i++)
+    {
+      g_autoptr(GVariant) signature = NULL;
+      gboolean valid;
+      const gchar *fingerprint;
+
+      signature = ostree_gpg_verify_result_get (gpg_result, i, attrs,
+                                                G_N_ELEMENTS (attrs));
+      g_variant_get (signature, "(b&s)", &valid, &fingerprint);
+      if (valid)
+        return g_strdup (fingerprint);
     }
 
-  if (sig_bytes == NULL)
+  return g_strdup ("");
+}
+
+/* Checks @signature is a valid signature for @contents by one of the keys
+ * trusted for @remote_name, using ostree_repo_verify_summary() if
+ * @is_summary is %TRUE, and ostree_repo_gpg_verify_data() otherwise.
+ * Verification is skipped if the same data and signature were verified
+ * against the same keyrings before. Failures are not remembered. */
+static gboolean
+verify_signature (OstreeRepo *repo,
+                  const gchar *remote_name,
+                  gboolean is_summary,
+                  GBytes *contents,
+                  GBytes *signature,
+                  GCancellable *cancellable,
+                  GError **error)
+{
+  g_autofree gchar *key = NULL;
+  g_autofree gchar *keyring_stamp = NULL;
+  g_autofree gchar *fingerprint = NULL;
+  g_autoptr(GFile) global_keyring_directory = NULL;
+  g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
+
+  key = eos_verified_digests_compute_key (remote_name, is_summary, contents, signature);
+  global_keyring_directory = get_global_keyring_directory ();
+  keyring_stamp = eos_verified_digests_get_keyring_stamp (ostree_repo_get_path (repo),
+                                                          remote_name,
+                                                          global_keyring_directory);
+
+  if (eos_verified_digests_lookup (get_verified_digests (), key, keyring_stamp,
+                                   &fingerprint))
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Failed to download the signature for the file at %s", url);
-      return FALSE;
+      g_debug ("Skipping verification of data from remote %s, already "
+               "verified as signed by %s", remote_name, fingerprint);
+      return TRUE;
     }
 
-  *contents = g_steal_pointer (&bytes);
-  *signature = g_steal_pointer (&sig_bytes);
+  if (is_summary)
+    gpg_result = ostree_repo_verify_summary (repo,
+                                             remote_name,
+                                             contents,
+                                             signature,
+                                             cancellable,
+                                             error);
+  else
+    gpg_result = ostree_repo_gpg_verify_data (repo,
+                                              remote_name,
+                                              contents,
+                                              signature,
+                                              NULL,
+                                              NULL,
+                                              cancellable,
+                                              error);
+  if (!ostree_gpg_verify_result_require_valid_signature (gpg_result, error))
+    return FALSE;
+
+  fingerprint = get_valid_signature_fingerprint (gpg_result);
+  eos_verified_digests_insert (get_verified_digests (), key, keyring_stamp,
+                               fingerprint);
+
   return TRUE;
 }
 
+/* Gets the checksum of @ref from the extensions ref file downloaded from
+ * @url, after checking its signature. */
 static gboolean
 commit_checksum_from_extensions_ref (OstreeRepo *repo,
-                                     GCancellable *cancellable,
                                      const gchar *remote_name,
                                      const gchar *ref,
-                                     const gchar *url_override,
+                                     const gchar *url,
+                                     GFile *cache_directory,
+                                     GBytes *contents,
+                                     GBytes *signature,
+                                     GCancellable *cancellable,
                                      gchar **out_checksum,
                                      EosExtensions **out_extensions,
                                      GError **error)
 {
-  g_autofree gchar *extensions_url = NULL;
-  g_autofree gchar *eos_ref_url = NULL;
-  g_autoptr(GBytes) contents = NULL;
-  g_autoptr(GBytes) signature = NULL;
-  g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
   g_autofree gchar *checksum = NULL;
   gconstpointer raw_data;
   gsize raw_len;
@@ -392,22 +460,8 @@ commit_checksum_from_extensions_ref (OstreeRepo *repo,
   g_autoptr(GKeyFile) ref_keyfile = NULL;
   g_autofree gchar *actual_ref = NULL;
 
-  if (!get_extensions_url (repo, remote_name, url_override, &extensions_url, error))
-    return FALSE;
-
-  eos_ref_url = g_build_path ("/", extensions_url, "refs.d", ref, NULL);
-  if (!must_download_file_and_signature (eos_ref_url, &contents, &signature, error))
-    return FALSE;
-
-  gpg_result = ostree_repo_gpg_verify_data (repo,
-                                            remote_name,
-                                            contents,
-                                            signature,
-                                            NULL,
-                                            NULL,
-                                            cancellable,
-                                            error);
-  if (!ostree_gpg_verify_result_require_valid_signature (gpg_result, error))
+  if (!verify_signature (repo, remote_name, FALSE, contents, signature,
+                         cancellable, error))
     return FALSE;
 
   ref_keyfile = g_key_file_new ();
@@ -430,7 +484,7 @@ commit_checksum_from_extensions_ref (OstreeRepo *repo,
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    "The file under %s contains data about ref %s, instead of %s",
-                   eos_ref_url, actual_ref, ref);
+                   url, actual_ref, ref);
       return FALSE;
     }
 
@@ -446,8 +500,8 @@ commit_checksum_from_extensions_ref (OstreeRepo *repo,
     return FALSE;
 
   ext_ref = eos_ref_new_empty ();
-  ext_ref->contents = g_steal_pointer (&contents);
-  ext_ref->signature = g_steal_pointer (&signature);
+  ext_ref->contents = g_bytes_ref (contents);
+  ext_ref->signature = g_bytes_ref (signature);
   ext_ref->name = g_strdup (ref);
 
   extensions = eos_extensions_new_empty ();
@@ -541,34 +595,40 @@ get_commit_checksum_from_summary (GVariant *summary,
   return ostree_checksum_from_bytes_v (checksum_v);
 };
 
+/* Summaries are only cached for the remote's own URL: the URLs of peers on
+ * the LAN come and go, and downloading from them costs nothing. */
+static GFile *
+get_summary_cache_directory (OstreeRepo *repo)
+{
+  return g_file_resolve_relative_path (ostree_repo_get_path (repo),
+                                       "tmp/cache/eos-updater/summaries");
+}
+
+/* Gets the checksum of @ref from the summary or eos-summary downloaded from
+ * @summary_url, after checking its signature. */
 static gboolean
 commit_checksum_from_any_summary (OstreeRepo *repo,
                                   const gchar *remote_name,
                                   const gchar *ref,
                                   const gchar *summary_url,
+                                  GFile *cache_directory,
+                                  GBytes *contents,
+                                  GBytes *signature,
                                   GCancellable *cancellable,
                                   gchar **out_checksum,
                                   EosExtensions **out_extensions,
                                   GError **error)
 {
-  g_autoptr(GBytes) contents = NULL;
-  g_autoptr(GBytes) signature = NULL;
-  g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
   g_autoptr(GVariant) summary = NULL;
   g_autofree gchar *checksum = NULL;
   g_autoptr(EosExtensions) extensions = NULL;
 
-  if (!must_download_file_and_signature (summary_url, &contents, &signature, error))
-    return FALSE;
-
-  gpg_result = ostree_repo_verify_summary (repo,
-                                           remote_name,
-                                           contents,
-                                           signature,
-                                           cancellable,
-                                           error);
-  if (!ostree_gpg_verify_result_require_valid_signature (gpg_result, error))
-    return FALSE;
+  if (!verify_signature (repo, remote_name, TRUE, contents, signature,
+                         cancellable, error))
+    {
+      forget_cached_file_and_signature (cache_directory, summary_url);
+      return FALSE;
+    }
 
   summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
                                                           contents,
@@ -578,123 +638,653 @@ commit_checksum_from_any_summary (OstreeRepo *repo,
     return FALSE;
 
   extensions = eos_extensions_new_empty ();
-  extensions->summary = g_steal_pointer (&contents);
-  extensions->summary_sig = g_steal_pointer (&signature);
+  extensions->summary = g_bytes_ref (contents);
+  extensions->summary_sig = g_bytes_ref (signature);
 
   *out_checksum = g_steal_pointer (&checksum);
   *out_extensions = g_steal_pointer (&extensions);
   return TRUE;
 }
 
+static SoupURI *
+get_uri_to_sig (SoupURI *uri)
+{
+  g_autofree gchar *sig_path = NULL;
+  SoupURI *sig_uri = soup_uri_copy (uri);
+
+  sig_path = g_strconcat (soup_uri_get_path (uri), ".sig", NULL);
+  soup_uri_set_path (sig_uri, sig_path);
+
+  return sig_uri;
+}
+
+/* Timeouts, in seconds, for the HTTP requests made while polling: how long
+ * to wait for a server to respond, and how long to keep an unused
+ * connection open for the next request. */
+#define POLL_SESSION_TIMEOUT_SECONDS 60
+#define POLL_SESSION_IDLE_TIMEOUT_SECONDS 60
+
+/* All the HTTP requests made while polling go through one session, which
+ * lives as long as the process, so that connections are kept alive and
+ * reused: the ref file, summaries and signatures of a source all come from
+ * the same server. A plain #SoupSession may be used from the threads the
+ * fetchers run in. */
+static SoupSession *
+get_poll_session (void)
+{
+  static gsize session_ptr = 0;
+
+  if (g_once_init_enter (&session_ptr))
+    {
+      SoupSession *session;
+
+      session = soup_session_new_with_options (SOUP_SESSION_TIMEOUT, POLL_SESSION_TIMEOUT_SECONDS,
+                                               SOUP_SESSION_IDLE_TIMEOUT, POLL_SESSION_IDLE_TIMEOUT_SECONDS,
+                                               NULL);
+      g_once_init_leave (&session_ptr, (gsize) session);
+    }
+
+  return (SoupSession *) session_ptr;
+}
+
+/* A file being downloaded by download_file_and_signature(). */
+typedef struct
+{
+  SoupMessage *msg;  /* (owned) (nullable) NULL for local files */
+  gboolean done;
+  gboolean missing;  /* whether the file does not exist, as opposed to failing */
+  GBytes *contents;  /* (owned) (nullable) NULL if it could not be got */
+  GFile *cache_file;  /* (owned) (nullable) NULL if not cached */
+  GBytes *cached_contents;  /* (owned) (nullable) */
+} Download;
+
+static void
+download_clear (Download *download)
+{
+  g_clear_object (&download->msg);
+  g_clear_pointer (&download->contents, g_bytes_unref);
+  g_clear_object (&download->cache_file);
+  g_clear_pointer (&download->cached_contents, g_bytes_unref);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (Download, download_clear)
+
+static void
+download_finished_cb (SoupSession *session,
+                      SoupMessage *msg,
+                      gpointer user_data)
+{
+  Download *download = user_data;
+
+  if (msg->status_code == SOUP_STATUS_NOT_MODIFIED &&
+      download->cached_contents != NULL)
+    {
+      g_debug ("Reusing cached copy of %s", soup_uri_get_path (soup_message_get_uri (msg)));
+      download->contents = g_steal_pointer (&download->cached_contents);
+    }
+  else if (msg->status_code == SOUP_STATUS_NOT_FOUND ||
+           msg->status_code == SOUP_STATUS_GONE)
+    {
+      download->missing = TRUE;
+    }
+  else if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    {
+      g_object_get (msg,
+                    SOUP_MESSAGE_RESPONSE_BODY_DATA, &download->contents,
+                    NULL);
+
+      if (download->cache_file != NULL && download->contents != NULL)
+        eos_download_cache_save (download->cache_file,
+                                 soup_message_headers_get_one (msg->response_headers, "ETag"),
+                                 soup_message_headers_get_one (msg->response_headers, "Last-Modified"),
+                                 download->contents);
+    }
+
+  download->done = TRUE;
+}
+
+/* Starts downloading @uri, on the thread-default main context. Local files
+ * are read straight away. If @cache_directory is non-%NULL, the download is
+ * made conditional on a cached copy there, and the cache is updated. */
+static void
+download_start (SoupURI *uri,
+                GFile *cache_directory,
+                Download *download)
+{
+  g_autofree gchar *etag = NULL;
+  g_autofree gchar *last_modified = NULL;
+
+  if (soup_uri_get_scheme (uri) == SOUP_URI_SCHEME_FILE)
+    {
+      g_autoptr(GFile) file = g_file_new_for_path (soup_uri_get_path (uri));
+      g_autoptr(GError) local_error = NULL;
+
+      if (!eos_updater_read_file_to_bytes (file, NULL, &download->contents, &local_error))
+        download->missing = g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+      download->done = TRUE;
+      return;
+    }
+
+  download->msg = soup_message_new_from_uri ("GET", uri);
+
+  if (cache_directory != NULL)
+    {
+      g_autofree gchar *url = soup_uri_to_string (uri, FALSE);
+
+      download->cache_file = eos_download_cache_get_file (cache_directory, url);
+
+      if (eos_download_cache_load (download->cache_file,
+                                   &download->cached_contents,
+                                   &etag,
+                                   &last_modified))
+        {
+          if (*etag != '\0')
+            soup_message_headers_replace (download->msg->request_headers,
+                                          "If-None-Match", etag);
+          if (*last_modified != '\0')
+            soup_message_headers_replace (download->msg->request_headers,
+                                          "If-Modified-Since", last_modified);
+        }
+    }
+
+  /* The session takes a reference. */
+  soup_session_queue_message (get_poll_session (),
+                              g_object_ref (download->msg),
+                              download_finished_cb,
+                              download);
+}
+
+static void
+download_cancel (Download *download)
+{
+  if (!download->done && download->msg != NULL)
+    soup_session_cancel_message (get_poll_session (),
+                                 download->msg,
+                                 SOUP_STATUS_CANCELLED);
+}
+
+/* A file and its signature, downloaded at the same time. */
+typedef struct
+{
+  Download file;
+  Download signature;
+} DownloadPair;
+
+#define DOWNLOAD_PAIR_CLEARED { { NULL, FALSE, FALSE, NULL, NULL, NULL }, { NULL, FALSE, FALSE, NULL, NULL, NULL } }
+
+static void
+download_pair_clear (DownloadPair *pair)
+{
+  download_clear (&pair->file);
+  download_clear (&pair->signature);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (DownloadPair, download_pair_clear)
+
+static gboolean
+download_pair_start (DownloadPair *pair,
+                     const gchar *url,
+                     GFile *cache_directory,
+                     GError **error)
+{
+  g_autoptr(SoupURI) uri = soup_uri_new (url);
+  g_autoptr(SoupURI) sig_uri = NULL;
+
+  if (uri == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid URL %s", url);
+      return FALSE;
+    }
+
+  sig_uri = get_uri_to_sig (uri);
+  download_start (uri, cache_directory, &pair->file);
+  download_start (sig_uri, cache_directory, &pair->signature);
+
+  return TRUE;
+}
+
 static gboolean
-commit_checksum_from_extensions_summary (OstreeRepo *repo,
-                                         GCancellable *cancellable,
-                                         const gchar *remote_name,
-                                         const gchar *ref,
-                                         const gchar *url_override,
-                                         gchar **out_checksum,
-                                         EosExtensions **out_extensions,
-                                         GError **error)
-{
-  g_autofree gchar *eos_summary_url = NULL;
-  g_autofree gchar *extensions_url = NULL;
-
-  if (!get_extensions_url (repo, remote_name, url_override, &extensions_url, error))
-    return FALSE;
+download_pair_is_done (DownloadPair *pair)
+{
+  return pair->file.done && pair->signature.done;
+}
 
-  eos_summary_url = g_build_path ("/", extensions_url, "eos-summary", NULL);
-  return commit_checksum_from_any_summary (repo,
-                                           remote_name,
-                                           ref,
-                                           eos_summary_url,
-                                           cancellable,
-                                           out_checksum,
-                                           out_extensions,
-                                           error);
+static void
+download_pair_cancel (DownloadPair *pair)
+{
+  download_cancel (&pair->file);
+  download_cancel (&pair->signature);
 }
 
+/* Gets the file and signature downloaded by @pair from @url, or an error if
+ * either of them could not be downloaded: %G_IO_ERROR_NOT_FOUND if it does
+ * not exist, and %G_IO_ERROR_FAILED otherwise. */
 static gboolean
-commit_checksum_from_summary (OstreeRepo *repo,
-                              GCancellable *cancellable,
-                              const gchar *remote_name,
-                              const gchar *ref,
-                              const gchar *url_override,
-                              gchar **out_checksum,
-                              EosExtensions **out_extensions,
-                              GError **error)
-{
-  g_autofree gchar *url = NULL;
-  g_autofree gchar *summary_url = NULL;
+download_pair_get_results (DownloadPair *pair,
+                           const gchar *url,
+                           GBytes **contents,
+                           GBytes **signature,
+                           GError **error)
+{
+  if (pair->file.contents == NULL)
+    {
+      g_set_error (error, G_IO_ERROR,
+                   pair->file.missing ? G_IO_ERROR_NOT_FOUND : G_IO_ERROR_FAILED,
+                   "Failed to download the file at %s", url);
+      return FALSE;
+    }
 
-  if (url_override != NULL)
-    url = g_strdup (url_override);
-  else if (!ostree_repo_remote_get_url (repo, remote_name, &url, error))
+  if (pair->signature.contents == NULL)
+    {
+      g_set_error (error, G_IO_ERROR,
+                   pair->signature.missing ? G_IO_ERROR_NOT_FOUND : G_IO_ERROR_FAILED,
+                   "Failed to download the signature for the file at %s", url);
+      return FALSE;
+    }
+
+  *contents = g_bytes_ref (pair->file.contents);
+  *signature = g_bytes_ref (pair->signature.contents);
+  return TRUE;
+}
+
+typedef struct
+{
+  DownloadPair *pairs;  /* (array length=n_pairs) */
+  gsize n_pairs;
+} DownloadPairs;
+
+static gboolean
+downloads_cancelled_cb (GCancellable *cancellable,
+                        gpointer user_data)
+{
+  DownloadPairs *pairs = user_data;
+  gsize i;
+
+  for (i = 0; i < pairs->n_pairs; i++)
+    download_pair_cancel (&pairs->pairs[i]);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Cancels @pairs when @cancellable is cancelled. The messages must be
+ * cancelled on the context they run on, which is @context. Returns %NULL if
+ * @cancellable is %NULL; otherwise the source must be destroyed once @pairs
+ * are finished with. */
+static GSource *
+download_pairs_watch_cancellable (DownloadPairs *pairs,
+                                  GCancellable *cancellable,
+                                  GMainContext *context)
+{
+  GSource *cancel_source;
+
+  if (cancellable == NULL)
+    return NULL;
+
+  cancel_source = g_cancellable_source_new (cancellable);
+  g_source_set_callback (cancel_source,
+                         (GSourceFunc) downloads_cancelled_cb,
+                         pairs,
+                         NULL);
+  g_source_attach (cancel_source, context);
+
+  return cancel_source;
+}
+
+/* Downloads the file at @url and its signature at the same time. A file
+ * which cannot be downloaded is returned as %NULL; only a bad URL or
+ * cancellation is an error. If @cache_directory is non-%NULL, copies of
+ * both are kept there and only downloaded again if they have changed. */
+gboolean
+download_file_and_signature (const gchar *url,
+                             GFile *cache_directory,
+                             GCancellable *cancellable,
+                             GBytes **contents,
+                             GBytes **signature,
+                             GError **error)
+{
+  g_autoptr(GMainContext) context = NULL;
+  g_autoptr(GSource) cancel_source = NULL;
+  g_auto(DownloadPair) pair = DOWNLOAD_PAIR_CLEARED;
+  DownloadPairs pairs = { &pair, 1 };
+
+  if (!download_pair_start (&pair, url, cache_directory, error))
     return FALSE;
 
-  summary_url = g_build_path ("/", url, "summary", NULL);
-  return commit_checksum_from_any_summary (repo,
-                                           remote_name,
-                                           ref,
-                                           summary_url,
-                                           cancellable,
-                                           out_checksum,
-                                           out_extensions,
-                                           error);
+  context = g_main_context_ref_thread_default ();
+  cancel_source = download_pairs_watch_cancellable (&pairs, cancellable, context);
+
+  while (!download_pair_is_done (&pair))
+    g_main_context_iteration (context, TRUE);
+
+  if (cancel_source != NULL)
+    g_source_destroy (cancel_source);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  *contents = g_steal_pointer (&pair.file.contents);
+  *signature = g_steal_pointer (&pair.signature.contents);
+  return TRUE;
+}
+
+/* Drops the copies of the file at @url and its signature cached by
+ * download_file_and_signature(), so that they are downloaded in full next
+ * time. Used when they fail verification, so that a bad copy is not
+ * revalidated and reused on every poll. */
+void
+forget_cached_file_and_signature (GFile *cache_directory,
+                                  const gchar *url)
+{
+  g_autoptr(SoupURI) uri = NULL;
+  g_autoptr(SoupURI) sig_uri = NULL;
+  g_autofree gchar *uri_str = NULL;
+  g_autofree gchar *sig_uri_str = NULL;
+
+  if (cache_directory == NULL)
+    return;
+
+  uri = soup_uri_new (url);
+  if (uri == NULL)
+    return;
+
+  sig_uri = get_uri_to_sig (uri);
+  uri_str = soup_uri_to_string (uri, FALSE);
+  sig_uri_str = soup_uri_to_string (sig_uri, FALSE);
+
+  eos_download_cache_remove (cache_directory, uri_str);
+  eos_download_cache_remove (cache_directory, sig_uri_str);
 }
 
+static gchar *
+get_extensions_ref_url (const gchar *remote_url,
+                        const gchar *ref)
+{
+  return g_build_path ("/", remote_url, "extensions", "eos", "refs.d", ref, NULL);
+}
+
+static gchar *
+get_extensions_summary_url (const gchar *remote_url,
+                            const gchar *ref)
+{
+  return g_build_path ("/", remote_url, "extensions", "eos", "eos-summary", NULL);
+}
+
+static gchar *
+get_summary_url (const gchar *remote_url,
+                 const gchar *ref)
+{
+  return g_build_path ("/", remote_url, "summary", NULL);
+}
+
+/* The ways of finding the checksum of the latest commit on a ref, each of
+ * which downloads one file and its signature from the remote. They are
+ * tried in this order until one works, skipping those which were found not
+ * to exist at the remote's URL before. */
+typedef struct
+{
+  const gchar *description;
+  gboolean cached;  /* whether downloads from the remote's URL are cached */
+  gchar *(*get_url) (const gchar *remote_url,
+                     const gchar *ref);
+  gboolean (*get_checksum) (OstreeRepo *repo,
+                            const gchar *remote_name,
+                            const gchar *ref,
+                            const gchar *url,
+                            GFile *cache_directory,
+                            GBytes *contents,
+                            GBytes *signature,
+                            GCancellable *cancellable,
+                            gchar **out_checksum,
+                            EosExtensions **out_extensions,
+                            GError **error);
+} ChecksumLookupMethod;
+
+static const ChecksumLookupMethod checksum_lookup_methods[] =
+  {
+    { "extensions refs", FALSE, get_extensions_ref_url, commit_checksum_from_extensions_ref },
+    { "extensions summary", TRUE, get_extensions_summary_url, commit_checksum_from_any_summary },
+    { "ostree summary", TRUE, get_summary_url, commit_checksum_from_any_summary },
+  };
+
+#define N_CHECKSUM_LOOKUP_METHODS 3
+G_STATIC_ASSERT (G_N_ELEMENTS (checksum_lookup_methods) == N_CHECKSUM_LOOKUP_METHODS);
+
+/* Methods found not to exist at a remote's URL are skipped for this long.
+ * See #EosLookupPreferences. */
+#define PREFERRED_LOOKUP_RETRY_USECS (24 * G_TIME_SPAN_HOUR)
+
+static EosLookupPreferences *
+get_lookup_preferences (void)
+{
+  static gsize preferences_ptr = 0;
+
+  if (g_once_init_enter (&preferences_ptr))
+    g_once_init_leave (&preferences_ptr,
+                       (gsize) eos_lookup_preferences_new (PREFERRED_LOOKUP_RETRY_USECS));
+
+  return (EosLookupPreferences *) preferences_ptr;
+}
+
+/* The state of each method being tried. Most fields are indexed in the order
+ * the methods are tried; @missing is indexed like checksum_lookup_methods. */
+typedef struct
+{
+  gsize methods[N_CHECKSUM_LOOKUP_METHODS];
+  gchar *urls[N_CHECKSUM_LOOKUP_METHODS];
+  DownloadPair downloads[N_CHECKSUM_LOOKUP_METHODS];
+  gboolean running[N_CHECKSUM_LOOKUP_METHODS];
+  gboolean missing[N_CHECKSUM_LOOKUP_METHODS];
+
+  /* The answer from the earliest method in checksum_lookup_methods which has
+   * given one so far. */
+  gsize best_method;  /* N_CHECKSUM_LOOKUP_METHODS if there is no answer yet */
+  gchar *best_checksum;
+  EosExtensions *best_extensions;
+} ChecksumLookups;
+
+static void
+checksum_lookups_clear (ChecksumLookups *lookups)
+{
+  gsize i;
+
+  for (i = 0; i < N_CHECKSUM_LOOKUP_METHODS; i++)
+    {
+      g_clear_pointer (&lookups->urls[i], g_free);
+      download_pair_clear (&lookups->downloads[i]);
+    }
+
+  g_clear_pointer (&lookups->best_checksum, g_free);
+  g_clear_object (&lookups->best_extensions);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (ChecksumLookups, checksum_lookups_clear)
+
+/* Finds the checksum of the latest commit on @ref in @remote_name, at
+ * @url_override if that is non-%NULL, trying each method in
+ * checksum_lookup_methods. By default they are tried one at a time; if
+ * @race_lookups is %TRUE, they are all started at once. Either way, the
+ * answer is the one from the earliest method in checksum_lookup_methods
+ * which gives one, rather than from whichever method is fastest, since the
+ * earlier methods give more information. */
 static gboolean
 fetch_commit_checksum (OstreeRepo *repo,
                        GCancellable *cancellable,
                        const gchar *remote_name,
                        const gchar *ref,
                        const gchar *url_override,
+                       gboolean race_lookups,
                        gchar **out_checksum,
                        EosExtensions **out_extensions,
                        GError **error)
 {
+  g_autofree gchar *remote_url = NULL;
+  g_autoptr(GFile) cache_directory = NULL;
+  g_auto(ChecksumLookups) lookups = { { 0, }, };
+  DownloadPairs pairs = { lookups.downloads, N_CHECKSUM_LOOKUP_METHODS };
+  g_autoptr(GMainContext) context = NULL;
+  g_autoptr(GSource) cancel_source = NULL;
   g_autoptr(GPtrArray) failures = NULL;
   g_autofree gchar *failures_str = NULL;
-  g_autoptr(GError) local_error = NULL;
-
-  if (commit_checksum_from_extensions_ref (repo,
-                                           cancellable,
-                                           remote_name,
-                                           ref,
-                                           url_override,
-                                           out_checksum,
-                                           out_extensions,
-                                           &local_error))
-    return TRUE;
+  gsize preferred, n_started = 0, n_running = 0;
+  gsize i, j;
+  gboolean found = FALSE;
+
+  if (url_override != NULL)
+    remote_url = g_strdup (url_override);
+  else if (!ostree_repo_remote_get_url (repo, remote_name, &remote_url, error))
+    return FALSE;
+
+  if (url_override == NULL)
+    cache_directory = get_summary_cache_directory (repo);
+
+  /* Try the preferred method first, then the rest in order, in case one
+   * which was skipped has started working. */
+  preferred = eos_lookup_preferences_get (get_lookup_preferences (), remote_url);
+  lookups.methods[0] = preferred;
+  for (i = 0, j = 1; i < N_CHECKSUM_LOOKUP_METHODS; i++)
+    if (i != preferred)
+      lookups.methods[j++] = i;
+  lookups.best_method = N_CHECKSUM_LOOKUP_METHODS;
 
   failures = g_ptr_array_new_with_free_func (g_free);
-  g_ptr_array_add (failures, g_strdup_printf ("Failed to get extensions refs: %s", local_error->message));
-  g_clear_error (&local_error);
-  if (commit_checksum_from_extensions_summary (repo,
-                                               cancellable,
-                                               remote_name,
-                                               ref,
-                                               url_override,
-                                               out_checksum,
-                                               out_extensions,
-                                               &local_error))
-    return TRUE;
-
-  g_ptr_array_add (failures, g_strdup_printf ("Failed to get extensions summary: %s", local_error->message));
-  g_clear_error (&local_error);
-  if (commit_checksum_from_summary (repo,
-                                    cancellable,
-                                    remote_name,
-                                    ref,
-                                    url_override,
-                                    out_checksum,
-                                    out_extensions,
-                                    &local_error))
-    return TRUE;
-
-  g_ptr_array_add (failures, g_strdup_printf ("Failed to get ostree summary: %s", local_error->message));
+  context = g_main_context_ref_thread_default ();
+  cancel_source = download_pairs_watch_cancellable (&pairs, cancellable, context);
+
+  while (TRUE)
+    {
+      /* Start the next method, or all of them if racing. */
+      while (!found && n_started < N_CHECKSUM_LOOKUP_METHODS &&
+             (race_lookups || n_running == 0) &&
+             !g_cancellable_is_cancelled (cancellable))
+        {
+          const ChecksumLookupMethod *method = &checksum_lookup_methods[lookups.methods[n_started]];
+          g_autoptr(GError) local_error = NULL;
+
+          lookups.urls[n_started] = method->get_url (remote_url, ref);
+          if (download_pair_start (&lookups.downloads[n_started],
+                                   lookups.urls[n_started],
+                                   method->cached ? cache_directory : NULL,
+                                   &local_error))
+            {
+              lookups.running[n_started] = TRUE;
+              n_running++;
+            }
+          else
+            {
+              g_ptr_array_add (failures, g_strdup_printf ("Failed to get %s: %s",
+                                                          method->description,
+                                                          local_error->message));
+            }
+
+          n_started++;
+        }
+
+      /* Check the downloads which have finished. Once the answer is known,
+       * the rest are cancelled, and only waited for. */
+      for (i = 0; i < n_started; i++)
+        {
+          gsize method_index = lookups.methods[i];
+          const ChecksumLookupMethod *method = &checksum_lookup_methods[method_index];
+          GFile *method_cache_directory = method->cached ? cache_directory : NULL;
+          g_autoptr(GBytes) contents = NULL;
+          g_autoptr(GBytes) signature = NULL;
+          g_autofree gchar *checksum = NULL;
+          g_autoptr(EosExtensions) extensions = NULL;
+          g_autoptr(GError) local_error = NULL;
+
+          if (!lookups.running[i] || !download_pair_is_done (&lookups.downloads[i]))
+            continue;
+
+          lookups.running[i] = FALSE;
+          n_running--;
+
+          if (found || method_index > lookups.best_method)
+            continue;
+
+          if (!download_pair_get_results (&lookups.downloads[i],
+                                          lookups.urls[i],
+                                          &contents,
+                                          &signature,
+                                          &local_error))
+            {
+              lookups.missing[method_index] = g_error_matches (local_error, G_IO_ERROR,
+                                                               G_IO_ERROR_NOT_FOUND);
+              g_ptr_array_add (failures, g_strdup_printf ("Failed to get %s: %s",
+                                                          method->description,
+                                                          local_error->message));
+            }
+          else if (!method->get_checksum (repo,
+                                          remote_name,
+                                          ref,
+                                          lookups.urls[i],
+                                          method_cache_directory,
+                                          contents,
+                                          signature,
+                                          cancellable,
+                                          &checksum,
+                                          &extensions,
+                                          &local_error))
+            {
+              g_ptr_array_add (failures, g_strdup_printf ("Failed to get %s: %s",
+                                                          method->description,
+                                                          local_error->message));
+            }
+          else
+            {
+              lookups.best_method = method_index;
+              g_free (lookups.best_checksum);
+              lookups.best_checksum = g_steal_pointer (&checksum);
+              g_clear_object (&lookups.best_extensions);
+              lookups.best_extensions = g_steal_pointer (&extensions);
+            }
+        }
+
+      if (!found &&
+          lookups.best_method != N_CHECKSUM_LOOKUP_METHODS &&
+          eos_lookup_preferences_answer_is_final (preferred,
+                                                  lookups.best_method,
+                                                  lookups.methods,
+                                                  lookups.running,
+                                                  n_started))
+        {
+          found = TRUE;
+          eos_lookup_preferences_update (get_lookup_preferences (),
+                                         remote_url,
+                                         preferred,
+                                         lookups.best_method,
+                                         lookups.missing);
+
+          for (j = 0; j < n_started; j++)
+            download_pair_cancel (&lookups.downloads[j]);
+        }
+
+      if (n_running == 0)
+        {
+          if (found || n_started == N_CHECKSUM_LOOKUP_METHODS ||
+              g_cancellable_is_cancelled (cancellable))
+            break;
+          continue;
+        }
+
+      g_main_context_iteration (context, TRUE);
+    }
+
+  if (cancel_source != NULL)
+    g_source_destroy (cancel_source);
+
+  if (found)
+    {
+      *out_checksum = g_steal_pointer (&lookups.best_checksum);
+      *out_extensions = g_steal_pointer (&lookups.best_extensions);
+      return TRUE;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
   g_ptr_array_add (failures, NULL);
   failures_str = g_strjoinv ("; ", (gchar **)failures->pdata);
-  g_clear_error (&local_error);
   if (url_override != NULL)
     g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                  "Failed to get the checksum of the latest commit in ref %s from remote %s with URL %s, reasons: %s",
@@ -717,13 +1307,11 @@ fetch_latest_commit (OstreeRepo *repo,
                      const gchar *remote_name,
                      const gchar *ref,
                      const gchar *url_override,
+                     gboolean race_lookups,
                      gchar **out_checksum,
                      EosExtensions **out_extensions,
                      GError **error)
 {
-  g_autoptr(GBytes) summary_bytes = NULL;
-  g_autoptr(GVariant) summary = NULL;
-  g_autofree gchar *checksum = NULL;
   g_autoptr(GVariant) options = NULL;
 
   g_return_val_if_fail (OSTREE_IS_REPO (repo), FALSE);
@@ -747,71 +1335,12 @@ fetch_latest_commit (OstreeRepo *repo,
                                 remote_name,
                                 ref,
                                 url_override,
+                                race_lookups,
                                 out_checksum,
                                 out_extensions,
                                 error);
 }
 
-static SoupURI *
-get_uri_to_sig (SoupURI *uri)
-{
-  g_autofree gchar *sig_path = NULL;
-  SoupURI *sig_uri = soup_uri_copy (uri);
-
-  sig_path = g_strconcat (soup_uri_get_path (uri), ".sig", NULL);
-  soup_uri_set_path (sig_uri, sig_path);
-
-  return sig_uri;
-}
-
-static GBytes *
-download_file (SoupURI *uri)
-{
-  g_autoptr(GBytes) contents = NULL;
-
-  if (soup_uri_get_scheme (uri) == SOUP_URI_SCHEME_FILE)
-    {
-      g_autoptr(GFile) file = g_file_new_for_path (soup_uri_get_path (uri));
-
-      eos_updater_read_file_to_bytes (file, NULL, &contents, NULL);
-    }
-  else
-    {
-      g_autoptr(SoupSession) soup = soup_session_new ();
-      g_autoptr(SoupMessage) msg = soup_message_new_from_uri ("GET", uri);
-      guint status = soup_session_send_message (soup, msg);
-
-      if (SOUP_STATUS_IS_SUCCESSFUL (status))
-        g_object_get (msg,
-                      SOUP_MESSAGE_RESPONSE_BODY_DATA, &contents,
-                      NULL);
-    }
-
-  return g_steal_pointer (&contents);
-}
-
-gboolean
-download_file_and_signature (const gchar *url,
-                             GBytes **contents,
-                             GBytes **signature,
-                             GError **error)
-{
-  g_autoptr(SoupURI) uri = soup_uri_new (url);
-  g_autoptr(SoupURI) sig_uri = NULL;
-
-  if (uri == NULL)
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Invalid URL %s", url);
-      return FALSE;
-    }
-
-  sig_uri = get_uri_to_sig (uri);
-  *contents = download_file (uri);
-  *signature = download_file (sig_uri);
-  return TRUE;
-}
-
 gboolean
 get_origin_refspec (OstreeDeployment *booted_deployment,
                     gchar **out_refspec,
@@ -1066,6 +1595,229 @@ get_latest_update (GArray *sources,
   return NULL;
 }
 
+/* How long each source is given to answer, counted from when it is started.
+ * A source which has not answered by then is cancelled and ignored, so one
+ * unreachable source cannot hold up the others. */
+static const guint fetcher_timeout_seconds[] =
+  {
+    300,  /* main: pulls a commit, possibly over a slow link */
+    60,  /* lan: browses with Avahi, then pulls from the peers found */
+    120,  /* volume: reads from a possibly slow USB stick */
+  };
+
+G_STATIC_ASSERT (G_N_ELEMENTS (fetcher_timeout_seconds) == EOS_UPDATER_DOWNLOAD_LAST + 1);
+
+/* The tests shorten the timeouts, to check that a source which never answers
+ * does not hold up the others. */
+static guint
+get_fetcher_timeout_seconds (EosUpdaterDownloadSource source)
+{
+  const gchar *value = g_getenv ("EOS_UPDATER_TEST_UPDATER_FETCHER_TIMEOUT");
+  guint64 timeout;
+  gchar *str_end = NULL;
+
+  if (value == NULL || value[0] == '\0')
+    return fetcher_timeout_seconds[source];
+
+  timeout = g_ascii_strtoull (value, &str_end, 10);
+  if (*str_end != '\0' || timeout == 0 || timeout > G_MAXUINT)
+    return fetcher_timeout_seconds[source];
+
+  return (guint) timeout;
+}
+
+/* What run_fetchers() is waiting for. Only used from the thread running
+ * it. */
+typedef struct
+{
+  guint n_pending;
+  GHashTable *source_to_update;  /* (element-type utf8 EosUpdateInfo) */
+} FetchersWait;
+
+/* A fetcher run in its own thread, so that all the sources are polled at
+ * the same time. The thread owns a reference, and so does run_fetchers()
+ * until it stops waiting, which may be before the thread finishes. Each run
+ * has a repository of its own, since OstreeRepo is not thread-safe and a
+ * thread which has timed out may still be using it after the poll, while
+ * the daemon fetches or applies with its own repository.
+ *
+ * The thread hands its result back in a source attached to the context of
+ * run_fetchers(), but only while run_fetchers() is still waiting for it:
+ * nothing iterates that context afterwards, so a source attached then would
+ * never be dispatched, and would keep the run alive forever. If it stops
+ * waiting with the source attached but not dispatched yet, the source is
+ * destroyed. */
+EOS_DECLARE_REFCOUNTED (EosFetcherRun,
+                        eos_fetcher_run,
+                        EOS,
+                        FETCHER_RUN)
+
+struct _EosFetcherRun
+{
+  GObject parent_instance;
+
+  MetadataFetcher fetcher;
+  GTask *task;
+  EosUpdaterData *data;
+  OstreeRepo *repo;  /* (owned) only used by the thread */
+  GVariant *source_variant;
+  const gchar *name;
+  GCancellable *cancellable;
+  GCancellable *poll_cancellable;  /* (nullable) */
+  gulong poll_cancelled_id;
+  GMainContext *result_context;
+
+  /* Set by the thread. */
+  EosUpdateInfo *info;
+  GError *error;
+
+  /* Shared between the thread and the one running run_fetchers(). */
+  GMutex lock;
+  gboolean waiting;  /* (locked-by lock) */
+  GSource *result_source;  /* (locked-by lock) (nullable) (owned) */
+
+  /* Only used from the thread running run_fetchers(). */
+  FetchersWait *wait;  /* NULL once it stops waiting */
+  GSource *timeout_source;
+};
+
+static void
+eos_fetcher_run_dispose_impl (EosFetcherRun *run)
+{
+  if (run->poll_cancelled_id != 0)
+    g_cancellable_disconnect (run->poll_cancellable, run->poll_cancelled_id);
+  run->poll_cancelled_id = 0;
+  g_clear_object (&run->poll_cancellable);
+  g_clear_object (&run->info);
+  g_clear_object (&run->cancellable);
+  g_clear_object (&run->repo);
+  g_clear_object (&run->task);
+}
+
+static void
+eos_fetcher_run_finalize_impl (EosFetcherRun *run)
+{
+  g_clear_error (&run->error);
+  g_clear_pointer (&run->source_variant, g_variant_unref);
+  g_clear_pointer (&run->result_context, g_main_context_unref);
+  g_mutex_clear (&run->lock);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_FETCHER_RUN,
+                       EosFetcherRun,
+                       eos_fetcher_run,
+                       eos_fetcher_run_dispose_impl,
+                       eos_fetcher_run_finalize_impl)
+
+static void
+poll_cancelled_cb (GCancellable *poll_cancellable,
+                   gpointer user_data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (user_data));
+}
+
+/* Stops waiting for @run. */
+static void
+fetcher_run_stop_waiting (EosFetcherRun *run)
+{
+  if (run->timeout_source != NULL)
+    {
+      g_source_destroy (run->timeout_source);
+      g_clear_pointer (&run->timeout_source, g_source_unref);
+    }
+
+  g_mutex_lock (&run->lock);
+  run->waiting = FALSE;
+  if (run->result_source != NULL)
+    {
+      g_source_destroy (run->result_source);
+      g_clear_pointer (&run->result_source, g_source_unref);
+    }
+  g_mutex_unlock (&run->lock);
+
+  run->wait->n_pending--;
+  run->wait = NULL;
+}
+
+/* Merges the result of @run, in the thread running run_fetchers(). */
+static gboolean
+fetcher_run_done_cb (gpointer user_data)
+{
+  EosFetcherRun *run = EOS_FETCHER_RUN (user_data);
+
+  /* The source is destroyed if it times out first. */
+  g_assert (run->wait != NULL);
+
+  if (run->error != NULL)
+    message ("Failed to poll metadata from source %s: %s",
+             run->name, run->error->message);
+  else if (run->info != NULL)
+    g_hash_table_insert (run->wait->source_to_update,
+                         (gpointer) run->name, g_object_ref (run->info));
+
+  fetcher_run_stop_waiting (run);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+fetcher_run_timeout_cb (gpointer user_data)
+{
+  EosFetcherRun *run = EOS_FETCHER_RUN (user_data);
+
+  message ("Timed out polling metadata from source %s", run->name);
+  g_cancellable_cancel (run->cancellable);
+
+  /* The source is destroyed by returning. */
+  g_clear_pointer (&run->timeout_source, g_source_unref);
+  fetcher_run_stop_waiting (run);
+  return G_SOURCE_REMOVE;
+}
+
+static gpointer
+fetcher_run_thread_cb (gpointer user_data)
+{
+  g_autoptr(EosFetcherRun) run = EOS_FETCHER_RUN (user_data);
+  g_autoptr(GMainContext) context = g_main_context_new ();
+  g_autoptr(EosMetadataFetchData) fetch_data = NULL;
+
+  /* This pushes @context as the thread-default one, for the fetchers which
+   * need a main loop. */
+  fetch_data = eos_metadata_fetch_data_new (run->task, run->data, context);
+  g_set_object (&fetch_data->repo, run->repo);
+  g_set_object (&fetch_data->cancellable, run->cancellable);
+
+  if (!run->fetcher (fetch_data, run->source_variant, &run->info, &run->error))
+    g_assert (run->error != NULL);
+
+  /* If it timed out, no one is waiting for the result any more, and it is
+   * dropped along with the thread’s reference. */
+  g_mutex_lock (&run->lock);
+  if (run->waiting)
+    {
+      run->result_source = g_idle_source_new ();
+      g_source_set_priority (run->result_source, G_PRIORITY_DEFAULT);
+      g_source_set_callback (run->result_source, fetcher_run_done_cb,
+                             g_object_ref (run), g_object_unref);
+      g_source_attach (run->result_source, run->result_context);
+    }
+  g_mutex_unlock (&run->lock);
+
+  return NULL;
+}
+
+/* Opens another #OstreeRepo on the same repository as @repo. */
+static OstreeRepo *
+open_repo_copy (OstreeRepo  *repo,
+                GError     **error)
+{
+  g_autoptr(OstreeRepo) copy = ostree_repo_new (ostree_repo_get_path (repo));
+
+  if (!ostree_repo_open (copy, NULL, error))
+    return NULL;
+
+  return g_steal_pointer (&copy);
+}
+
 EosUpdateInfo *
 run_fetchers (EosMetadataFetchData *fetch_data,
               GPtrArray *fetchers,
@@ -1077,6 +1829,8 @@ run_fetchers (EosMetadataFetchData *fetch_data,
                                                                   NULL,
                                                                   NULL,
                                                                   (GDestroyNotify) g_object_unref);
+  g_autoptr(GPtrArray) runs = NULL;
+  FetchersWait wait = { 0, NULL };
 
   g_return_val_if_fail (EOS_IS_METADATA_FETCH_DATA (fetch_data), NULL);
   g_return_val_if_fail (fetchers != NULL, NULL);
@@ -1085,17 +1839,21 @@ run_fetchers (EosMetadataFetchData *fetch_data,
   g_return_val_if_fail (fetchers->len == source_variants->len, NULL);
   g_return_val_if_fail (source_variants->len == sources->len, NULL);
 
+  wait.source_to_update = source_to_update;
+  runs = g_ptr_array_new_with_free_func (g_object_unref);
+
   for (idx = 0; idx < fetchers->len; ++idx)
     {
       MetadataFetcher fetcher = g_ptr_array_index (fetchers, idx);
       GVariant *source_variant = g_ptr_array_index (source_variants, idx);
-      g_autoptr(EosUpdateInfo) info = NULL;
       EosUpdaterDownloadSource source = g_array_index (sources,
                                                        EosUpdaterDownloadSource,
                                                        idx);
       const gchar *name = download_source_to_string (source);
-      g_autoptr(GError) local_error = NULL;
       const GVariantType *source_variant_type = g_variant_get_type (source_variant);
+      g_autoptr(EosFetcherRun) run = NULL;
+      g_autoptr(GError) local_error = NULL;
+      GThread *thread;
 
       if (!g_variant_type_equal (source_variant_type, G_VARIANT_TYPE_VARDICT))
         {
@@ -1109,20 +1867,60 @@ run_fetchers (EosMetadataFetchData *fetch_data,
           continue;
         }
 
-      if (!fetcher (fetch_data, source_variant, &info, &local_error))
+      run = g_object_new (EOS_TYPE_FETCHER_RUN, NULL);
+      g_mutex_init (&run->lock);
+      run->repo = open_repo_copy (fetch_data->repo, &local_error);
+      if (run->repo == NULL)
         {
           message ("Failed to poll metadata from source %s: %s",
                    name, local_error->message);
           continue;
         }
 
-      if (info != NULL)
+      run->fetcher = fetcher;
+      run->task = g_object_ref (fetch_data->task);
+      run->data = fetch_data->data;
+      run->source_variant = g_variant_ref (source_variant);
+      run->name = name;
+      run->cancellable = g_cancellable_new ();
+      run->result_context = g_main_context_ref (fetch_data->context);
+      run->wait = &wait;
+      run->waiting = TRUE;
+
+      /* Cancelling the poll cancels all the fetchers. */
+      if (fetch_data->cancellable != NULL)
+        {
+          run->poll_cancellable = g_object_ref (fetch_data->cancellable);
+          run->poll_cancelled_id = g_cancellable_connect (run->poll_cancellable,
+                                                          G_CALLBACK (poll_cancelled_cb),
+                                                          run->cancellable,
+                                                          NULL);
+        }
+
+      thread = g_thread_try_new (name, fetcher_run_thread_cb, g_object_ref (run),
+                                 &local_error);
+      if (thread == NULL)
         {
-          g_hash_table_insert (source_to_update,
-                               (gpointer) name, g_object_ref (info));
+          message ("Failed to poll metadata from source %s: %s",
+                   name, local_error->message);
+          g_object_unref (run);  /* the thread’s reference */
+          continue;
         }
+      g_thread_unref (thread);
+
+      run->timeout_source = g_timeout_source_new_seconds (get_fetcher_timeout_seconds (source));
+      g_source_set_callback (run->timeout_source, fetcher_run_timeout_cb, run, NULL);
+      g_source_attach (run->timeout_source, fetch_data->context);
+
+      wait.n_pending++;
+      g_ptr_array_add (runs, g_steal_pointer (&run));
     }
 
+  /* The results are merged as they arrive; the order of the sources only
+   * matters to break ties, in get_latest_update(). */
+  while (wait.n_pending > 0)
+    g_main_context_iteration (fetch_data->context, TRUE);
+
   if (g_hash_table_size (source_to_update) > 0)
     {
       EosUpdateInfo *latest_update = NULL;
@@ -100,6 +100,11 @@ struct _EosMetadataFetchData
   GTask *task;
   EosUpdaterData *data;
   GMainContext *context;
+
+  /* Fetchers use these rather than the ones in @data and @task, as each
+   * fetcher run concurrently has its own. */
+  OstreeRepo *repo;
+  GCancellable *cancellable;  /* (nullable) */
 };
 
 EosMetadataFetchData *
@@ -122,15 +127,21 @@ gboolean fetch_latest_commit (OstreeRepo *repo,
                               const gchar *remote_name,
                               const gchar *ref,
                               const gchar *url_override,
+                              gboolean race_lookups,
                               gchar **out_checksum,
                               EosExtensions **out_extensions,
                               GError **error);
 
 gboolean download_file_and_signature (const gchar *url,
+                                      GFile *cache_directory,
+                                      GCancellable *cancellable,
                                       GBytes **contents,
                                       GBytes **signature,
                                       GError **error);
 
+void forget_cached_file_and_signature (GFile *cache_directory,
+                                       const gchar *url);
+
 gboolean get_origin_refspec (OstreeDeployment *booted_deployment,
                              gchar **out_refspec,
                              GError **error);
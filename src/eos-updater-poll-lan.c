@@ -68,7 +68,7 @@ lan_data_init (LanData *lan_data,
   if (deployment == NULL)
     return FALSE;
 
-  if (!eos_updater_get_ostree_path (fetch_data->data->repo,
+  if (!eos_updater_get_ostree_path (fetch_data->repo,
                                     ostree_deployment_get_osname (deployment),
                                     &lan_data->cached_ostree_path,
                                     error))
@@ -425,7 +425,7 @@ get_update_info_from_swms (LanData *lan_data,
   g_autoptr(GVariant) latest_commit = NULL;
   g_autoptr(GPtrArray) urls = NULL;
   g_autoptr(EosExtensions) latest_extensions = NULL;
-  OstreeRepo *repo = lan_data->fetch_data->data->repo;
+  OstreeRepo *repo = lan_data->fetch_data->repo;
 
   if (!get_booted_refspec (&refspec, &remote, &ref, error))
     return FALSE;
@@ -444,7 +444,7 @@ get_update_info_from_swms (LanData *lan_data,
       g_autoptr(GVariant) commit = NULL;
       guint64 timestamp;
       g_autoptr(EosExtensions) extensions = NULL;
-      GCancellable *cancellable = g_task_get_cancellable (lan_data->fetch_data->task);
+      GCancellable *cancellable = lan_data->fetch_data->cancellable;
 
       /* Build the URI. */
       _url_override = soup_uri_new (NULL);
@@ -459,6 +459,7 @@ get_update_info_from_swms (LanData *lan_data,
                                 remote,
                                 ref,
                                 url_override,
+                                FALSE,
                                 &checksum,
                                 &extensions,
                                 &local_error))
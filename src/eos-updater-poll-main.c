@@ -32,7 +32,7 @@ metadata_fetch_from_main (EosMetadataFetchData *fetch_data,
                           EosUpdateInfo **out_info,
                           GError **error)
 {
-  OstreeRepo *repo = fetch_data->data->repo;
+  OstreeRepo *repo = fetch_data->repo;
   g_autofree gchar *refspec = NULL;
   g_autoptr(EosUpdateInfo) info = NULL;
   g_autofree gchar *checksum = NULL;
@@ -40,6 +40,7 @@ metadata_fetch_from_main (EosMetadataFetchData *fetch_data,
   g_autofree gchar *remote = NULL;
   g_autofree gchar *ref = NULL;
   g_autoptr(EosExtensions) extensions = NULL;
+  gboolean race_lookups = FALSE;
 
   g_return_val_if_fail (out_info != NULL, FALSE);
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
@@ -47,11 +48,15 @@ metadata_fetch_from_main (EosMetadataFetchData *fetch_data,
   if (!get_booted_refspec (&refspec, &remote, &ref, error))
     return FALSE;
 
+  g_variant_lookup (source_variant, MAIN_FETCHER_RACE_LOOKUPS_KEY, "b",
+                    &race_lookups);
+
   if (!fetch_latest_commit (repo,
-                            g_task_get_cancellable (fetch_data->task),
+                            fetch_data->cancellable,
                             remote,
                             ref,
                             NULL,
+                            race_lookups,
                             &checksum,
                             &extensions,
                             error))
@@ -28,6 +28,8 @@
 
 G_BEGIN_DECLS
 
+#define MAIN_FETCHER_RACE_LOOKUPS_KEY "race-checksum-lookups"
+
 gboolean
 metadata_fetch_from_main (EosMetadataFetchData *fetch_data,
                           GVariant *source_variant,
@@ -79,8 +79,8 @@ metadata_fetch_from_volume (EosMetadataFetchData *fetch_data,
                             EosUpdateInfo **out_info,
                             GError **error)
 {
-  OstreeRepo *repo = fetch_data->data->repo;
-  GCancellable *cancellable = g_task_get_cancellable (fetch_data->task);
+  OstreeRepo *repo = fetch_data->repo;
+  GCancellable *cancellable = fetch_data->cancellable;
   g_autoptr(OstreeRepo) volume_repo = NULL;
   g_autofree gchar *refspec = NULL;
   g_autofree gchar *raw_volume_path = NULL;
@@ -116,6 +116,7 @@ metadata_fetch_from_volume (EosMetadataFetchData *fetch_data,
                             remote,
                             ref,
                             repo_url,
+                            FALSE,
                             &checksum,
                             &extensions,
                             error))
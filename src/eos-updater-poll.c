@@ -38,6 +38,7 @@ static const gchar *const LOCAL_CONFIG_FILE_PATH = PREFIX "/local/share/" PACKAG
 static const gchar *const STATIC_CONFIG_FILE_PATH = PKGDATADIR "/eos-updater.conf";
 static const gchar *const DOWNLOAD_GROUP = "Download";
 static const gchar *const ORDER_KEY = "Order";
+static const gchar *const RACE_CHECKSUM_LOOKUPS_KEY = "RaceChecksumLookups";
 
 static gboolean
 strv_to_download_order (gchar **sources,
@@ -90,10 +91,11 @@ typedef struct
 {
   GArray *download_order;
 
+  gboolean race_checksum_lookups;
   gchar *volume_path;
 } SourcesConfig;
 
-#define SOURCES_CONFIG_CLEARED { NULL, NULL }
+#define SOURCES_CONFIG_CLEARED { NULL, FALSE, NULL }
 
 static void
 sources_config_clear (SourcesConfig *config)
@@ -164,6 +166,29 @@ read_config (const gchar *config_file_path,
                                error))
     return FALSE;
 
+  if (sources_config_has_source (sources_config,
+                                 EOS_UPDATER_DOWNLOAD_MAIN,
+                                 &group_name))
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      sources_config->race_checksum_lookups = g_key_file_get_boolean (config,
+                                                                      group_name,
+                                                                      RACE_CHECKSUM_LOOKUPS_KEY,
+                                                                      &local_error);
+
+      if (local_error != NULL &&
+          !g_error_matches (local_error, G_KEY_FILE_ERROR,
+                            G_KEY_FILE_ERROR_KEY_NOT_FOUND) &&
+          !g_error_matches (local_error, G_KEY_FILE_ERROR,
+                            G_KEY_FILE_ERROR_GROUP_NOT_FOUND))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+    }
+  g_clear_pointer (&group_name, g_free);
+
   if (sources_config_has_source (sources_config,
                                  EOS_UPDATER_DOWNLOAD_VOLUME,
                                  &group_name))
@@ -223,6 +248,9 @@ get_fetchers (SourcesConfig *config,
         {
         case EOS_UPDATER_DOWNLOAD_MAIN:
           add_fetcher (fetchers, metadata_fetch_from_main);
+          g_variant_dict_insert_value (&dict_builder,
+                                       MAIN_FETCHER_RACE_LOOKUPS_KEY,
+                                       g_variant_new_boolean (config->race_checksum_lookups));
           break;
 
         case EOS_UPDATER_DOWNLOAD_LAN:
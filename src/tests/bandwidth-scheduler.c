@@ -0,0 +1,321 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-bandwidth-scheduler.h"
+
+#include <glib.h>
+#include <locale.h>
+#include <string.h>
+
+#define QUANTUM EOS_BANDWIDTH_SCHEDULER_QUANTUM
+#define MIB (1024 * 1024)
+
+/* The order requests were granted in, as one letter per client. */
+typedef struct
+{
+  EosBandwidthScheduler *scheduler;  /* (unowned) */
+  GString *order;
+  guint max_grants;  /* stop making more requests after this many */
+} GrantLog;
+
+/* A client sending data one quantum at a time. */
+typedef struct
+{
+  GrantLog *log;  /* (unowned) */
+  const gchar *address;
+  gchar letter;
+  gboolean repeat;  /* whether to make another request once one is granted */
+} Sender;
+
+static void sender_request (Sender *sender);
+
+static void
+sender_granted_cb (gsize    bytes,
+                   gpointer user_data)
+{
+  Sender *sender = user_data;
+
+  g_assert_cmpuint (bytes, ==, QUANTUM);
+  g_string_append_c (sender->log->order, sender->letter);
+
+  if (sender->repeat && sender->log->order->len < sender->log->max_grants)
+    sender_request (sender);
+}
+
+static void
+sender_request (Sender *sender)
+{
+  guint id = eos_bandwidth_scheduler_request (sender->log->scheduler,
+                                              sender->address,
+                                              QUANTUM,
+                                              sender_granted_cb,
+                                              sender);
+
+  g_assert_cmpuint (id, !=, 0);
+}
+
+static void
+run_until_granted (GrantLog *log)
+{
+  while (log->order->len < log->max_grants)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static gboolean
+set_true_cb (gpointer user_data)
+{
+  gboolean *flag = user_data;
+
+  *flag = TRUE;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+run_for (guint milliseconds)
+{
+  gboolean done = FALSE;
+
+  g_timeout_add (milliseconds, set_true_cb, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+/* Test that requests are granted from the main context, never from
+ * eos_bandwidth_scheduler_request() itself. */
+static void
+test_bandwidth_scheduler_async (void)
+{
+  g_autoptr(EosBandwidthScheduler) scheduler = eos_bandwidth_scheduler_new (100 * MIB, 0);
+  g_autoptr(GString) order = g_string_new ("");
+  GrantLog log = { scheduler, order, 2 };
+  Sender sender = { &log, "10.0.0.1", 'A', FALSE };
+
+  sender_request (&sender);
+  sender_request (&sender);
+  g_assert_cmpstr (order->str, ==, "");
+
+  run_until_granted (&log);
+  g_assert_cmpstr (order->str, ==, "AA");
+}
+
+/* Test that clients with the same weight take turns, even when the rate
+ * only allows about one request per tick; the client first in the round
+ * robin must not be served first on every tick. */
+static void
+test_bandwidth_scheduler_round_robin (void)
+{
+  g_autoptr(EosBandwidthScheduler) scheduler = eos_bandwidth_scheduler_new (3 * MIB, 0);
+  g_autoptr(GString) order = g_string_new ("");
+  GrantLog log = { scheduler, order, 12 };
+  Sender senders[] =
+    {
+      { &log, "10.0.0.1", 'A', TRUE },
+      { &log, "10.0.0.2", 'B', TRUE },
+      { &log, "10.0.0.3", 'C', TRUE },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (senders); i++)
+    {
+      sender_request (&senders[i]);
+      sender_request (&senders[i]);
+    }
+
+  run_until_granted (&log);
+  g_string_truncate (order, log.max_grants);
+  g_assert_cmpstr (order->str, ==, "ABCABCABCABC");
+}
+
+/* Test that the bandwidth is shared in proportion to the client weights,
+ * including when a turn is split across ticks by the total rate. */
+static void
+test_bandwidth_scheduler_weights (void)
+{
+  g_autoptr(EosBandwidthScheduler) scheduler = eos_bandwidth_scheduler_new (8 * MIB, 0);
+  g_autoptr(GString) order = g_string_new ("");
+  GrantLog log = { scheduler, order, 16 };
+  Sender sender_a = { &log, "10.0.0.1", 'A', TRUE };
+  Sender sender_b = { &log, "10.0.0.2", 'B', TRUE };
+  gsize i;
+
+  eos_bandwidth_scheduler_set_client_weight (scheduler, "10.0.0.2", 3);
+
+  /* Keep more requests queued than a turn can grant, so neither client ever
+   * runs out. */
+  for (i = 0; i < 4; i++)
+    {
+      sender_request (&sender_a);
+      sender_request (&sender_b);
+    }
+
+  run_until_granted (&log);
+  g_string_truncate (order, log.max_grants);
+  g_assert_cmpstr (order->str, ==, "ABBBABBBABBBABBB");
+}
+
+/* Test that the total rate is limited, allowing a burst of 100ms worth and
+ * one request of debt. */
+static void
+test_bandwidth_scheduler_total_rate (void)
+{
+  g_autoptr(EosBandwidthScheduler) scheduler = eos_bandwidth_scheduler_new (MIB, 0);
+  g_autoptr(GString) order = g_string_new ("");
+  GrantLog log = { scheduler, order, 4 };
+  Sender sender = { &log, "10.0.0.1", 'A', FALSE };
+  gint64 start_time = g_get_monotonic_time ();
+  gsize i;
+
+  for (i = 0; i < log.max_grants; i++)
+    sender_request (&sender);
+
+  /* 4 quanta at 1 MiB/s, less the burst and the debt, take at least 85ms. */
+  run_until_granted (&log);
+  g_assert_cmpint (g_get_monotonic_time () - start_time, >=, 50 * 1000);
+}
+
+/* Test that the rate for each client is limited, without holding up other
+ * clients. */
+static void
+test_bandwidth_scheduler_client_rate (void)
+{
+  g_autoptr(EosBandwidthScheduler) scheduler = eos_bandwidth_scheduler_new (0, MIB);
+  g_autoptr(GString) order = g_string_new ("");
+  GrantLog log = { scheduler, order, 5 };
+  Sender sender_a = { &log, "10.0.0.1", 'A', FALSE };
+  Sender sender_b = { &log, "10.0.0.2", 'B', FALSE };
+  gint64 start_time = g_get_monotonic_time ();
+  gsize i;
+
+  for (i = 0; i < 4; i++)
+    sender_request (&sender_a);
+  sender_request (&sender_b);
+
+  /* A and B take turns until A has used up its burst and gone into debt;
+   * B has a burst of its own, so it is not held up. A then has to wait for
+   * its rate, at least 85ms for 4 quanta. */
+  run_until_granted (&log);
+  g_assert_cmpstr (order->str, ==, "ABAAA");
+  g_assert_cmpint (g_get_monotonic_time () - start_time, >=, 50 * 1000);
+}
+
+/* Test that cancelled requests are never granted, and that cancelling a
+ * granted or unknown request does nothing. */
+static void
+test_bandwidth_scheduler_cancel (void)
+{
+  g_autoptr(EosBandwidthScheduler) scheduler = eos_bandwidth_scheduler_new (100 * MIB, 0);
+  g_autoptr(GString) order = g_string_new ("");
+  GrantLog log = { scheduler, order, 1 };
+  Sender sender_a = { &log, "10.0.0.1", 'A', FALSE };
+  Sender sender_b = { &log, "10.0.0.2", 'B', FALSE };
+  guint id_a, id_b;
+
+  id_a = eos_bandwidth_scheduler_request (scheduler, sender_a.address, QUANTUM,
+                                          sender_granted_cb, &sender_a);
+  id_b = eos_bandwidth_scheduler_request (scheduler, sender_b.address, QUANTUM,
+                                          sender_granted_cb, &sender_b);
+  g_assert_cmpuint (id_a, !=, id_b);
+
+  eos_bandwidth_scheduler_cancel (scheduler, id_a);
+  run_until_granted (&log);
+  run_for (100);
+  g_assert_cmpstr (order->str, ==, "B");
+
+  eos_bandwidth_scheduler_cancel (scheduler, id_a);
+  eos_bandwidth_scheduler_cancel (scheduler, id_b);
+  eos_bandwidth_scheduler_cancel (scheduler, G_MAXUINT);
+}
+
+typedef struct
+{
+  EosBandwidthScheduler *scheduler;  /* (unowned) */
+  GThread *granted_thread;  /* (unowned) */
+  gint done;  /* atomic */
+} ThreadData;
+
+static void
+thread_granted_cb (gsize    bytes G_GNUC_UNUSED,
+                   gpointer user_data)
+{
+  ThreadData *data = user_data;
+
+  data->granted_thread = g_thread_self ();
+}
+
+static gpointer
+request_thread_cb (gpointer user_data)
+{
+  ThreadData *data = user_data;
+  g_autoptr(GMainContext) context = g_main_context_new ();
+
+  g_main_context_push_thread_default (context);
+  eos_bandwidth_scheduler_request (data->scheduler, "10.0.0.1", QUANTUM,
+                                   thread_granted_cb, data);
+  while (data->granted_thread == NULL)
+    g_main_context_iteration (context, TRUE);
+  g_main_context_pop_thread_default (context);
+
+  g_atomic_int_set (&data->done, TRUE);
+  g_main_context_wakeup (NULL);
+
+  return NULL;
+}
+
+/* Test that a request made from another thread is granted in that thread’s
+ * thread-default main context. */
+static void
+test_bandwidth_scheduler_other_thread (void)
+{
+  g_autoptr(EosBandwidthScheduler) scheduler = eos_bandwidth_scheduler_new (100 * MIB, 0);
+  ThreadData data = { scheduler, NULL, FALSE };
+  GThread *thread;
+
+  thread = g_thread_new ("requester", request_thread_cb, &data);
+
+  /* The scheduler’s timer runs in this thread. */
+  while (!g_atomic_int_get (&data.done))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (data.granted_thread == thread);
+  g_thread_join (thread);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/bandwidth-scheduler/async", test_bandwidth_scheduler_async);
+  g_test_add_func ("/bandwidth-scheduler/round-robin",
+                   test_bandwidth_scheduler_round_robin);
+  g_test_add_func ("/bandwidth-scheduler/weights", test_bandwidth_scheduler_weights);
+  g_test_add_func ("/bandwidth-scheduler/total-rate",
+                   test_bandwidth_scheduler_total_rate);
+  g_test_add_func ("/bandwidth-scheduler/client-rate",
+                   test_bandwidth_scheduler_client_rate);
+  g_test_add_func ("/bandwidth-scheduler/cancel", test_bandwidth_scheduler_cancel);
+  g_test_add_func ("/bandwidth-scheduler/other-thread",
+                   test_bandwidth_scheduler_other_thread);
+
+  return g_test_run ();
+}
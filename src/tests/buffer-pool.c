@@ -0,0 +1,176 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-buffer-pool.h"
+
+#include <glib.h>
+#include <locale.h>
+#include <string.h>
+
+/* Test that requested sizes are rounded up to their size class, and that
+ * sizes beyond the biggest class are allocated as asked. */
+static void
+test_buffer_pool_size_classes (void)
+{
+  const struct
+    {
+      gsize size;
+      gsize expected_allocated_size;
+    }
+  vectors[] =
+    {
+      { 0, 4 * 1024 },
+      { 1, 4 * 1024 },
+      { 4 * 1024, 4 * 1024 },
+      { 4 * 1024 + 1, 16 * 1024 },
+      { 64 * 1024, 64 * 1024 },
+      { 100 * 1024, 256 * 1024 },
+      { 1024 * 1024, 1024 * 1024 },
+      { 1024 * 1024 + 1, 2 * 1024 * 1024 },
+      { 2 * 1024 * 1024, 2 * 1024 * 1024 },
+      { 2 * 1024 * 1024 + 1, 2 * 1024 * 1024 + 1 },
+    };
+  g_autoptr(EosBufferPool) pool = eos_buffer_pool_new (0);
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      gsize allocated_size = 0;
+      gpointer buffer;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT ": %" G_GSIZE_FORMAT " bytes",
+                      i, vectors[i].size);
+
+      buffer = eos_buffer_pool_acquire (pool, vectors[i].size, &allocated_size);
+      g_assert_nonnull (buffer);
+      g_assert_cmpuint (allocated_size, ==, vectors[i].expected_allocated_size);
+
+      /* The whole buffer must be usable. */
+      memset (buffer, 0xaa, allocated_size);
+
+      eos_buffer_pool_release (buffer);
+    }
+}
+
+/* Test that released buffers are reused, most recently released first, and
+ * only for the same size class. */
+static void
+test_buffer_pool_reuse (void)
+{
+  g_autoptr(EosBufferPool) pool = eos_buffer_pool_new (1024 * 1024);
+  gpointer small1, small2, large, buffer;
+
+  small1 = eos_buffer_pool_acquire (pool, 100, NULL);
+  small2 = eos_buffer_pool_acquire (pool, 200, NULL);
+  large = eos_buffer_pool_acquire (pool, 10 * 1024, NULL);
+  g_assert_true (small1 != small2);
+
+  eos_buffer_pool_release (small1);
+  eos_buffer_pool_release (small2);
+  eos_buffer_pool_release (large);
+
+  buffer = eos_buffer_pool_acquire (pool, 4 * 1024, NULL);
+  g_assert_true (buffer == small2);
+  eos_buffer_pool_release (buffer);
+
+  buffer = eos_buffer_pool_acquire (pool, 16 * 1024, NULL);
+  g_assert_true (buffer == large);
+  eos_buffer_pool_release (buffer);
+}
+
+/* Test that the pool keeps no more than its limit of released buffers. */
+static void
+test_buffer_pool_free_limit (void)
+{
+  g_autoptr(EosBufferPool) pool = eos_buffer_pool_new (4 * 1024);
+  gpointer buffer1, buffer2, buffer;
+
+  buffer1 = eos_buffer_pool_acquire (pool, 4 * 1024, NULL);
+  buffer2 = eos_buffer_pool_acquire (pool, 4 * 1024, NULL);
+
+  /* Only @buffer1 fits in the pool; @buffer2 is freed. Reuse is most
+   * recently released first, so getting @buffer1 back shows @buffer2 was
+   * not kept. */
+  eos_buffer_pool_release (buffer1);
+  eos_buffer_pool_release (buffer2);
+
+  buffer = eos_buffer_pool_acquire (pool, 4 * 1024, NULL);
+  g_assert_true (buffer == buffer1);
+
+  /* A buffer bigger than the limit is never kept. */
+  buffer2 = eos_buffer_pool_acquire (pool, 16 * 1024, NULL);
+  eos_buffer_pool_release (buffer2);
+
+  eos_buffer_pool_release (buffer);
+}
+
+/* Test that a #GBytes wraps the buffer without copying it, and gives it back
+ * to the pool when freed. */
+static void
+test_buffer_pool_bytes (void)
+{
+  g_autoptr(EosBufferPool) pool = eos_buffer_pool_new (1024 * 1024);
+  g_autoptr(GBytes) bytes = NULL;
+  gpointer buffer;
+
+  buffer = eos_buffer_pool_acquire (pool, 100, NULL);
+  memcpy (buffer, "hello", 5);
+
+  bytes = eos_buffer_pool_bytes_new (buffer, 5);
+  g_assert_true (g_bytes_get_data (bytes, NULL) == buffer);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 5);
+
+  g_clear_pointer (&bytes, g_bytes_unref);
+
+  g_assert_true (eos_buffer_pool_acquire (pool, 100, NULL) == buffer);
+  eos_buffer_pool_release (buffer);
+}
+
+/* Test that buffers keep their pool alive until they are released. */
+static void
+test_buffer_pool_outlives_owner (void)
+{
+  EosBufferPool *pool = eos_buffer_pool_new (1024 * 1024);
+  gpointer pooled, unpooled;
+
+  pooled = eos_buffer_pool_acquire (pool, 100, NULL);
+  unpooled = eos_buffer_pool_acquire (pool, 4 * 1024 * 1024, NULL);
+  g_object_unref (pool);
+
+  eos_buffer_pool_release (pooled);
+  eos_buffer_pool_release (unpooled);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/buffer-pool/size-classes", test_buffer_pool_size_classes);
+  g_test_add_func ("/buffer-pool/reuse", test_buffer_pool_reuse);
+  g_test_add_func ("/buffer-pool/free-limit", test_buffer_pool_free_limit);
+  g_test_add_func ("/buffer-pool/bytes", test_buffer_pool_bytes);
+  g_test_add_func ("/buffer-pool/outlives-owner", test_buffer_pool_outlives_owner);
+
+  return g_test_run ();
+}
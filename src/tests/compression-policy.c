@@ -0,0 +1,195 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-compression-policy.h"
+
+#include <glib.h>
+#include <locale.h>
+#include <string.h>
+
+#define CLIENT_ADDRESS "192.0.2.1"
+
+/* Test that a fixed level is always chosen, whatever the load. */
+static void
+test_compression_policy_fixed (void)
+{
+  g_autoptr(EosCompressionPolicy) policy = eos_compression_policy_new (7, 4);
+  guint64 n_chosen;
+
+  g_assert_false (eos_compression_policy_is_adaptive (policy));
+
+  eos_compression_policy_note_transfer (policy, CLIENT_ADDRESS,
+                                        100 * 1000 * 1000, G_USEC_PER_SEC);
+
+  g_assert_cmpint (eos_compression_policy_choose_level (policy, NULL, 0, 0), ==, 7);
+  g_assert_cmpint (eos_compression_policy_choose_level (policy, CLIENT_ADDRESS, 0, 0), ==, 7);
+  g_assert_cmpint (eos_compression_policy_choose_level (policy, CLIENT_ADDRESS, 100, 4), ==, 7);
+
+  eos_compression_policy_get_stats (policy, 7, &n_chosen, NULL, NULL, NULL);
+  g_assert_cmpuint (n_chosen, ==, 3);
+}
+
+/* Test the adaptive level chosen for clients on links of different speeds,
+ * with the server idle, busy or saturated. Each vector uses a new policy, so
+ * that the CPU usage is not sampled and only the given load counts. */
+static void
+test_compression_policy_adaptive (void)
+{
+  const struct
+    {
+      guint64 client_rate;  /* bytes per second, or 0 if unknown */
+      guint pending_requests;
+      guint n_compressions;  /* out of 4 threads */
+      gint expected_level;
+    }
+  vectors[] =
+    {
+      /* Unknown client. */
+      { 0, 2, 0, EOS_COMPRESSION_LEVEL_DEFAULT },
+      { 0, 0, 0, EOS_COMPRESSION_LEVEL_DEFAULT + 1 },
+
+      /* Faster links get lower levels. */
+      { 100 * 1000 * 1000, 2, 0, 1 },
+      { 20 * 1000 * 1000, 2, 0, 2 },
+      { 5 * 1000 * 1000, 2, 0, 4 },
+      { 100 * 1000, 2, 0, 6 },
+
+      /* An idle server compresses one level harder, up to a limit. */
+      { 5 * 1000 * 1000, 1, 0, 5 },
+      { 100 * 1000, 0, 0, 6 },
+      { 20 * 1000 * 1000, 0, 1, 2 },
+
+      /* A busy server compresses no harder than the default. */
+      { 5 * 1000 * 1000, 2, 3, EOS_COMPRESSION_LEVEL_DEFAULT },
+      { 100 * 1000, 0, 3, EOS_COMPRESSION_LEVEL_DEFAULT },
+
+      /* A saturated server compresses as little as it can. */
+      { 5 * 1000 * 1000, 2, 4, 1 },
+      { 100 * 1000, 16, 0, 1 },
+      { 100 * 1000 * 1000, 2, 4, 0 },
+      { 100 * 1000 * 1000, 16, 0, 0 },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(EosCompressionPolicy) policy = eos_compression_policy_new (EOS_COMPRESSION_LEVEL_ADAPTIVE, 4);
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT ": %" G_GUINT64_FORMAT " B/s, "
+                      "%u pending, %u compressing",
+                      i, vectors[i].client_rate, vectors[i].pending_requests,
+                      vectors[i].n_compressions);
+
+      g_assert_true (eos_compression_policy_is_adaptive (policy));
+
+      if (vectors[i].client_rate > 0)
+        eos_compression_policy_note_transfer (policy, CLIENT_ADDRESS,
+                                              vectors[i].client_rate,
+                                              G_USEC_PER_SEC);
+
+      g_assert_cmpint (eos_compression_policy_choose_level (policy,
+                                                            CLIENT_ADDRESS,
+                                                            vectors[i].pending_requests,
+                                                            vectors[i].n_compressions),
+                       ==, vectors[i].expected_level);
+    }
+}
+
+/* Test that a client’s throughput is averaged over its transfers, rather
+ * than taken from the last one, and that transfers of no duration are
+ * ignored. */
+static void
+test_compression_policy_smoothing (void)
+{
+  g_autoptr(EosCompressionPolicy) policy = eos_compression_policy_new (EOS_COMPRESSION_LEVEL_ADAPTIVE, 4);
+
+  /* 100 kB/s: a slow link. */
+  eos_compression_policy_note_transfer (policy, CLIENT_ADDRESS,
+                                        100 * 1000, G_USEC_PER_SEC);
+  g_assert_cmpint (eos_compression_policy_choose_level (policy, CLIENT_ADDRESS, 2, 0), ==, 6);
+
+  eos_compression_policy_note_transfer (policy, CLIENT_ADDRESS,
+                                        100 * 1000 * 1000, 0);
+  g_assert_cmpint (eos_compression_policy_choose_level (policy, CLIENT_ADDRESS, 2, 0), ==, 6);
+
+  /* One transfer at 100 MB/s brings the average to about 30 MB/s: a fast
+   * link, but not a gigabit one. */
+  eos_compression_policy_note_transfer (policy, CLIENT_ADDRESS,
+                                        100 * 1000 * 1000, G_USEC_PER_SEC);
+  g_assert_cmpint (eos_compression_policy_choose_level (policy, CLIENT_ADDRESS, 2, 0), ==, 2);
+
+  /* Other clients are unaffected. */
+  g_assert_cmpint (eos_compression_policy_choose_level (policy, "192.0.2.2", 2, 0),
+                   ==, EOS_COMPRESSION_LEVEL_DEFAULT);
+}
+
+/* Test that the statistics count the levels chosen and the objects
+ * compressed with each, and are formatted only for the levels used. */
+static void
+test_compression_policy_stats (void)
+{
+  g_autoptr(EosCompressionPolicy) policy = eos_compression_policy_new (1, 1);
+  g_autofree gchar *empty_stats = NULL;
+  g_autofree gchar *stats = NULL;
+  guint64 n_chosen, n_objects, uncompressed_bytes, compressed_bytes;
+
+  empty_stats = eos_compression_policy_format_stats (policy);
+  g_assert_cmpstr (empty_stats, ==, "");
+
+  eos_compression_policy_choose_level (policy, NULL, 0, 0);
+  eos_compression_policy_choose_level (policy, NULL, 0, 0);
+  eos_compression_policy_note_compression (policy, 1, 100, 50);
+
+  eos_compression_policy_get_stats (policy, 1, &n_chosen, &n_objects,
+                                    &uncompressed_bytes, &compressed_bytes);
+  g_assert_cmpuint (n_chosen, ==, 2);
+  g_assert_cmpuint (n_objects, ==, 1);
+  g_assert_cmpuint (uncompressed_bytes, ==, 100);
+  g_assert_cmpuint (compressed_bytes, ==, 50);
+
+  eos_compression_policy_get_stats (policy, 0, &n_chosen, &n_objects,
+                                    &uncompressed_bytes, &compressed_bytes);
+  g_assert_cmpuint (n_chosen, ==, 0);
+  g_assert_cmpuint (n_objects, ==, 0);
+  g_assert_cmpuint (uncompressed_bytes, ==, 0);
+  g_assert_cmpuint (compressed_bytes, ==, 0);
+
+  /* The percentage is formatted in the current locale, so leave it out. */
+  stats = eos_compression_policy_format_stats (policy);
+  g_assert_true (g_str_has_prefix (stats, "level 1: chosen 2 times, 1 objects, 100 → 50 bytes ("));
+  g_assert_true (g_str_has_suffix (stats, "%)\n"));
+  g_assert_true (strchr (stats, '\n') == stats + strlen (stats) - 1);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/compression-policy/fixed", test_compression_policy_fixed);
+  g_test_add_func ("/compression-policy/adaptive", test_compression_policy_adaptive);
+  g_test_add_func ("/compression-policy/smoothing", test_compression_policy_smoothing);
+  g_test_add_func ("/compression-policy/stats", test_compression_policy_stats);
+
+  return g_test_run ();
+}
@@ -0,0 +1,346 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-object-cache.h"
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <locale.h>
+#include <string.h>
+#include <utime.h>
+
+typedef struct
+{
+  gchar *tmp_dir;
+  gchar *cache_dir;  /* inside @tmp_dir, not created by setup() */
+  GFile *cache_file;
+} Fixture;
+
+/* Set up a temporary directory to keep the cache in. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-updater-tests-object-cache-XXXXXX",
+                                     &error);
+  g_assert_no_error (error);
+
+  fixture->cache_dir = g_build_filename (fixture->tmp_dir, "cache", NULL);
+  fixture->cache_file = g_file_new_for_path (fixture->cache_dir);
+}
+
+static void
+remove_recursively (const gchar *path)
+{
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir != NULL)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          g_autofree gchar *child = g_build_filename (path, name, NULL);
+
+          remove_recursively (child);
+        }
+    }
+
+  g_assert_cmpint (g_remove (path), ==, 0);
+}
+
+/* Inverse of setup(). */
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  remove_recursively (fixture->tmp_dir);
+
+  g_clear_object (&fixture->cache_file);
+  g_free (fixture->cache_dir);
+  g_free (fixture->tmp_dir);
+}
+
+static EosObjectCache *
+create_cache (Fixture *fixture,
+              guint64  max_size)
+{
+  g_autoptr(EosObjectCache) cache = NULL;
+  g_autoptr(GError) error = NULL;
+
+  cache = eos_object_cache_new (fixture->cache_file, max_size, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (cache);
+
+  return g_steal_pointer (&cache);
+}
+
+/* Write @contents to the cache as the payload of @object_name. */
+static void
+add_object (EosObjectCache *cache,
+            const gchar    *object_name,
+            const gchar    *contents)
+{
+  g_autoptr(EosObjectCacheWriter) writer = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean retval;
+
+  writer = eos_object_cache_begin (cache, object_name, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (writer);
+
+  retval = eos_object_cache_writer_append (writer, contents, strlen (contents), &error);
+  g_assert_no_error (error);
+  g_assert_true (retval);
+
+  retval = eos_object_cache_writer_commit (writer, &error);
+  g_assert_no_error (error);
+  g_assert_true (retval);
+}
+
+/* Check the cached payload of @object_name is @expected, or that there is
+ * none if @expected is %NULL. This marks the object as the most recently
+ * used. */
+static void
+assert_cached (EosObjectCache *cache,
+               const gchar    *object_name,
+               const gchar    *expected)
+{
+  g_autoptr(GMappedFile) mapping = eos_object_cache_lookup (cache, object_name);
+
+  if (expected == NULL)
+    {
+      g_assert_null (mapping);
+      return;
+    }
+
+  g_assert_nonnull (mapping);
+  g_assert_cmpuint (g_mapped_file_get_length (mapping), ==, strlen (expected));
+  g_assert_cmpint (memcmp (g_mapped_file_get_contents (mapping), expected,
+                           strlen (expected)), ==, 0);
+}
+
+static gchar *
+get_object_path (Fixture     *fixture,
+                 const gchar *object_name)
+{
+  const gchar prefix[] = { object_name[0], object_name[1], '\0' };
+
+  return g_build_filename (fixture->cache_dir, prefix, object_name + 2, NULL);
+}
+
+/* Test that a committed payload can be looked up, and only that. */
+static void
+test_object_cache_round_trip (Fixture       *fixture,
+                              gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(EosObjectCache) cache = create_cache (fixture, 1024);
+  g_autofree gchar *path = NULL;
+
+  assert_cached (cache, "aa01.filez", NULL);
+  add_object (cache, "aa01.filez", "hello");
+  assert_cached (cache, "aa01.filez", "hello");
+  assert_cached (cache, "bb02.filez", NULL);
+
+  /* The layout mirrors an objects directory. */
+  path = get_object_path (fixture, "aa01.filez");
+  g_assert_true (g_file_test (path, G_FILE_TEST_IS_REGULAR));
+}
+
+/* Test that freeing a writer without committing it leaves nothing behind. */
+static void
+test_object_cache_abandoned (Fixture       *fixture,
+                             gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(EosObjectCache) cache = create_cache (fixture, 1024);
+  g_autoptr(EosObjectCacheWriter) writer = NULL;
+  g_autofree gchar *tmp_path = NULL;
+  g_autoptr(GError) error = NULL;
+
+  writer = eos_object_cache_begin (cache, "aa01.filez", &error);
+  g_assert_no_error (error);
+  eos_object_cache_writer_append (writer, "partial", 7, &error);
+  g_assert_no_error (error);
+
+  /* It is not visible until it is committed. */
+  tmp_path = g_strdup (eos_object_cache_writer_get_path (writer));
+  g_assert_true (g_file_test (tmp_path, G_FILE_TEST_IS_REGULAR));
+  assert_cached (cache, "aa01.filez", NULL);
+
+  g_clear_pointer (&writer, eos_object_cache_writer_free);
+  g_assert_false (g_file_test (tmp_path, G_FILE_TEST_EXISTS));
+  assert_cached (cache, "aa01.filez", NULL);
+}
+
+/* Test that the least recently used payloads are evicted once the cache is
+ * full, counting lookups as uses. */
+static void
+test_object_cache_lru (Fixture       *fixture,
+                       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(EosObjectCache) cache = create_cache (fixture, 12);
+  g_autofree gchar *evicted_path = NULL;
+
+  add_object (cache, "aa01.filez", "aaaa");
+  add_object (cache, "bb02.filez", "bbbb");
+  add_object (cache, "cc03.filez", "cccc");
+
+  /* Make bb02 the least recently used, then overflow the cache. */
+  assert_cached (cache, "aa01.filez", "aaaa");
+  add_object (cache, "dd04.filez", "dddd");
+
+  assert_cached (cache, "bb02.filez", NULL);
+  evicted_path = get_object_path (fixture, "bb02.filez");
+  g_assert_false (g_file_test (evicted_path, G_FILE_TEST_EXISTS));
+
+  assert_cached (cache, "aa01.filez", "aaaa");
+  assert_cached (cache, "cc03.filez", "cccc");
+  assert_cached (cache, "dd04.filez", "dddd");
+}
+
+/* Test that replacing a payload only counts the new one against the size
+ * limit. */
+static void
+test_object_cache_replace (Fixture       *fixture,
+                           gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(EosObjectCache) cache = create_cache (fixture, 10);
+
+  add_object (cache, "aa01.filez", "12345");
+  add_object (cache, "aa01.filez", "67890");
+  add_object (cache, "bb02.filez", "abcde");
+
+  assert_cached (cache, "aa01.filez", "67890");
+  assert_cached (cache, "bb02.filez", "abcde");
+}
+
+/* Test that a payload bigger than the whole cache is dropped without
+ * evicting anything else. */
+static void
+test_object_cache_too_big (Fixture       *fixture,
+                           gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(EosObjectCache) cache = create_cache (fixture, 4);
+
+  add_object (cache, "aa01.filez", "aa");
+  add_object (cache, "bb02.filez", "too big");
+
+  assert_cached (cache, "aa01.filez", "aa");
+  assert_cached (cache, "bb02.filez", NULL);
+}
+
+/* Test that an entry whose file has gone is forgotten, and can be added
+ * again. */
+static void
+test_object_cache_removed_file (Fixture       *fixture,
+                                gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(EosObjectCache) cache = create_cache (fixture, 1024);
+  g_autofree gchar *path = get_object_path (fixture, "aa01.filez");
+
+  add_object (cache, "aa01.filez", "hello");
+  g_assert_cmpint (g_unlink (path), ==, 0);
+  assert_cached (cache, "aa01.filez", NULL);
+
+  add_object (cache, "aa01.filez", "again");
+  assert_cached (cache, "aa01.filez", "again");
+}
+
+/* Create a file containing @contents, last used at @timestamp. */
+static void
+create_file (const gchar *path,
+             const gchar *contents,
+             time_t       timestamp)
+{
+  g_autofree gchar *parent = g_path_get_dirname (path);
+  g_autoptr(GError) error = NULL;
+  struct utimbuf times = { timestamp, timestamp };
+
+  g_assert_cmpint (g_mkdir_with_parents (parent, 0755), ==, 0);
+  g_file_set_contents (path, contents, -1, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (g_utime (path, &times), ==, 0);
+}
+
+/* Test that the payloads already in the directory are indexed at startup,
+ * oldest first for eviction, and that leftovers are cleaned up. */
+static void
+test_object_cache_startup_scan (Fixture       *fixture,
+                                gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(EosObjectCache) cache = NULL;
+  g_autofree gchar *path1 = get_object_path (fixture, "aa01.filez");
+  g_autofree gchar *path2 = get_object_path (fixture, "bb02.filez");
+  g_autofree gchar *path3 = get_object_path (fixture, "cc03.filez");
+  g_autofree gchar *tmp_path = g_build_filename (fixture->cache_dir, "tmp-abcdef", NULL);
+  g_autofree gchar *other_path = g_build_filename (fixture->cache_dir, "other", "file", NULL);
+
+  create_file (path1, "1111", 1000);
+  create_file (path2, "2222", 3000);
+  create_file (path3, "3333", 2000);
+  create_file (tmp_path, "partial", 4000);
+  create_file (other_path, "not an object", 4000);
+
+  /* Only two of the objects fit; the oldest is evicted straight away. */
+  cache = create_cache (fixture, 8);
+
+  g_assert_false (g_file_test (path1, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (tmp_path, G_FILE_TEST_EXISTS));
+  g_assert_true (g_file_test (other_path, G_FILE_TEST_EXISTS));
+
+  assert_cached (cache, "aa01.filez", NULL);
+  assert_cached (cache, "bb02.filez", "2222");
+  assert_cached (cache, "cc03.filez", "3333");
+
+  /* cc03 was looked up after bb02, so bb02 goes first now. */
+  add_object (cache, "dd04.filez", "4444");
+  assert_cached (cache, "bb02.filez", NULL);
+  assert_cached (cache, "cc03.filez", "3333");
+  assert_cached (cache, "dd04.filez", "4444");
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/object-cache/round-trip", Fixture, NULL, setup,
+              test_object_cache_round_trip, teardown);
+  g_test_add ("/object-cache/abandoned", Fixture, NULL, setup,
+              test_object_cache_abandoned, teardown);
+  g_test_add ("/object-cache/lru", Fixture, NULL, setup,
+              test_object_cache_lru, teardown);
+  g_test_add ("/object-cache/replace", Fixture, NULL, setup,
+              test_object_cache_replace, teardown);
+  g_test_add ("/object-cache/too-big", Fixture, NULL, setup,
+              test_object_cache_too_big, teardown);
+  g_test_add ("/object-cache/removed-file", Fixture, NULL, setup,
+              test_object_cache_removed_file, teardown);
+  g_test_add ("/object-cache/startup-scan", Fixture, NULL, setup,
+              test_object_cache_startup_scan, teardown);
+
+  return g_test_run ();
+}
@@ -0,0 +1,272 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "eos-server-metrics.h"
+
+#include <glib.h>
+#include <locale.h>
+#include <string.h>
+
+#define CLIENT_A "192.0.2.1"
+#define CLIENT_B "192.0.2.2"
+
+/* Format @metrics, and check that every line is a comment or a sample, as
+ * the exposition format requires. */
+static gchar *
+format_metrics (EosServerMetrics *metrics)
+{
+  g_autofree gchar *text = eos_server_metrics_format (metrics);
+  g_auto(GStrv) lines = NULL;
+  g_autoptr(GRegex) sample_regex = NULL;
+  gsize i;
+
+  g_assert_nonnull (text);
+  g_assert_true (g_str_has_suffix (text, "\n"));
+
+  sample_regex = g_regex_new ("^[a-zA-Z_:][a-zA-Z0-9_:]*(\\{.*\\})? [0-9.]+$",
+                              0, 0, NULL);
+  g_assert_nonnull (sample_regex);
+
+  lines = g_strsplit (text, "\n", -1);
+  for (i = 0; lines[i] != NULL && lines[i + 1] != NULL; i++)
+    {
+      if (g_str_has_prefix (lines[i], "# HELP ") ||
+          g_str_has_prefix (lines[i], "# TYPE "))
+        continue;
+
+      if (!g_regex_match (sample_regex, lines[i], 0, NULL))
+        g_error ("Malformed line: %s", lines[i]);
+    }
+
+  return g_steal_pointer (&text);
+}
+
+/* Assert that @text contains @line as a whole line. */
+static void
+assert_has_line (const gchar *text,
+                 const gchar *line)
+{
+  g_autofree gchar *haystack = g_strconcat ("\n", text, NULL);
+  g_autofree gchar *needle = g_strdup_printf ("\n%s\n", line);
+
+  if (strstr (haystack, needle) == NULL)
+    g_error ("Line ‘%s’ not found in:\n%s", line, text);
+}
+
+static void
+assert_lacks_line_prefix (const gchar *text,
+                          const gchar *prefix)
+{
+  g_autofree gchar *needle = g_strdup_printf ("\n%s", prefix);
+
+  if (strstr (text, needle) != NULL)
+    g_error ("Unexpected line starting ‘%s’ in:\n%s", prefix, text);
+}
+
+/* Test that new metrics have all their counters at zero, and no samples for
+ * compression levels or clients. */
+static void
+test_server_metrics_empty (void)
+{
+  g_autoptr(EosServerMetrics) metrics = eos_server_metrics_new ();
+  g_autofree gchar *text = format_metrics (metrics);
+
+  assert_has_line (text, "# HELP eos_update_server_requests_in_flight Requests being handled.");
+  assert_has_line (text, "# TYPE eos_update_server_requests_in_flight gauge");
+  assert_has_line (text, "eos_update_server_requests_in_flight 0");
+  assert_has_line (text, "eos_update_server_requests_total{class=\"summary\"} 0");
+  assert_has_line (text, "eos_update_server_responses_total{code=\"2xx\"} 0");
+  assert_has_line (text, "eos_update_server_time_to_first_byte_seconds_bucket{class=\"pack\",le=\"+Inf\"} 0");
+  assert_has_line (text, "eos_update_server_time_to_first_byte_seconds_sum{class=\"pack\"} 0.000000");
+  assert_has_line (text, "eos_update_server_cache_lookups_total{result=\"hit\"} 0");
+  assert_has_line (text, "eos_update_server_compression_cpu_seconds_total 0.000000");
+  assert_has_line (text, "# TYPE eos_update_server_compressed_objects_total counter");
+  assert_has_line (text, "# TYPE eos_update_server_client_requests_total counter");
+
+  assert_lacks_line_prefix (text, "eos_update_server_compressed_objects_total{");
+  assert_lacks_line_prefix (text, "eos_update_server_client_requests_total{");
+}
+
+/* Test that finished and aborted requests are counted by kind of path, by
+ * status class and by client, and in the right latency buckets. */
+static void
+test_server_metrics_requests (void)
+{
+  g_autoptr(EosServerMetrics) metrics = eos_server_metrics_new ();
+  g_autofree gchar *in_flight_text = NULL;
+  g_autofree gchar *text = NULL;
+
+  eos_server_metrics_request_started (metrics);
+  eos_server_metrics_request_started (metrics);
+  eos_server_metrics_request_started (metrics);
+
+  in_flight_text = format_metrics (metrics);
+  assert_has_line (in_flight_text, "eos_update_server_requests_in_flight 3");
+
+  eos_server_metrics_request_finished (metrics, EOS_REPO_PATH_SUMMARY, 200,
+                                       CLIENT_A, 1000, 2000, 20000);
+  eos_server_metrics_request_finished (metrics, EOS_REPO_PATH_OBJECT, 404,
+                                       CLIENT_A, 0, -1, 100);
+  eos_server_metrics_request_aborted (metrics, EOS_REPO_PATH_OBJECTS_PACK,
+                                      CLIENT_B, 500, 1500000);
+
+  text = format_metrics (metrics);
+
+  assert_has_line (text, "eos_update_server_requests_in_flight 0");
+  assert_has_line (text, "eos_update_server_requests_total{class=\"summary\"} 1");
+  assert_has_line (text, "eos_update_server_requests_total{class=\"object\"} 1");
+  assert_has_line (text, "eos_update_server_requests_total{class=\"pack\"} 0");
+  assert_has_line (text, "eos_update_server_aborted_requests_total{class=\"pack\"} 1");
+  assert_has_line (text, "eos_update_server_sent_bytes_total{class=\"summary\"} 1000");
+  assert_has_line (text, "eos_update_server_sent_bytes_total{class=\"pack\"} 500");
+  assert_has_line (text, "eos_update_server_responses_total{code=\"2xx\"} 1");
+  assert_has_line (text, "eos_update_server_responses_total{code=\"4xx\"} 1");
+  assert_has_line (text, "eos_update_server_responses_total{code=\"5xx\"} 0");
+
+  /* The buckets are cumulative. */
+  assert_has_line (text, "eos_update_server_time_to_first_byte_seconds_bucket{class=\"summary\",le=\"0.001\"} 0");
+  assert_has_line (text, "eos_update_server_time_to_first_byte_seconds_bucket{class=\"summary\",le=\"0.005\"} 1");
+  assert_has_line (text, "eos_update_server_time_to_first_byte_seconds_bucket{class=\"summary\",le=\"60\"} 1");
+  assert_has_line (text, "eos_update_server_time_to_first_byte_seconds_bucket{class=\"summary\",le=\"+Inf\"} 1");
+  assert_has_line (text, "eos_update_server_time_to_first_byte_seconds_sum{class=\"summary\"} 0.002000");
+  assert_has_line (text, "eos_update_server_time_to_first_byte_seconds_count{class=\"summary\"} 1");
+  assert_has_line (text, "eos_update_server_request_duration_seconds_bucket{class=\"summary\",le=\"0.01\"} 0");
+  assert_has_line (text, "eos_update_server_request_duration_seconds_bucket{class=\"summary\",le=\"0.025\"} 1");
+  assert_has_line (text, "eos_update_server_request_duration_seconds_sum{class=\"summary\"} 0.020000");
+
+  /* An unknown time to first byte is not observed; aborted requests are not
+   * observed at all. */
+  assert_has_line (text, "eos_update_server_time_to_first_byte_seconds_count{class=\"object\"} 0");
+  assert_has_line (text, "eos_update_server_request_duration_seconds_count{class=\"object\"} 1");
+  assert_has_line (text, "eos_update_server_request_duration_seconds_count{class=\"pack\"} 0");
+
+  assert_has_line (text, "eos_update_server_client_requests_total{client=\"" CLIENT_A "\"} 2");
+  assert_has_line (text, "eos_update_server_client_requests_total{client=\"" CLIENT_B "\"} 0");
+  assert_has_line (text, "eos_update_server_client_aborted_requests_total{client=\"" CLIENT_B "\"} 1");
+  assert_has_line (text, "eos_update_server_client_sent_bytes_total{client=\"" CLIENT_A "\"} 1000");
+  assert_has_line (text, "eos_update_server_client_sent_bytes_total{client=\"" CLIENT_B "\"} 500");
+  assert_has_line (text, "eos_update_server_client_send_seconds_total{client=\"" CLIENT_A "\"} 0.020100");
+  assert_has_line (text, "eos_update_server_client_send_seconds_total{client=\"" CLIENT_B "\"} 1.500000");
+  assert_has_line (text, "eos_update_server_client_responses_total{client=\"" CLIENT_A "\",code=\"4xx\"} 1");
+  assert_has_line (text, "eos_update_server_client_responses_total{client=\"" CLIENT_A "\",code=\"5xx\"} 0");
+}
+
+/* Test that cache lookups and compression are counted, the latter only for
+ * the levels used. */
+static void
+test_server_metrics_compression (void)
+{
+  g_autoptr(EosServerMetrics) metrics = eos_server_metrics_new ();
+  g_autofree gchar *text = NULL;
+
+  eos_server_metrics_note_cache_lookup (metrics, TRUE);
+  eos_server_metrics_note_cache_lookup (metrics, TRUE);
+  eos_server_metrics_note_cache_lookup (metrics, FALSE);
+  eos_server_metrics_note_compression (metrics, 2, 100, 40);
+  eos_server_metrics_note_compression (metrics, 2, 200, 60);
+  eos_server_metrics_note_compression_time (metrics, 1000000);
+  eos_server_metrics_note_compression_time (metrics, 500000);
+  eos_server_metrics_note_compression_time (metrics, -1);
+
+  text = format_metrics (metrics);
+
+  assert_has_line (text, "eos_update_server_cache_lookups_total{result=\"hit\"} 2");
+  assert_has_line (text, "eos_update_server_cache_lookups_total{result=\"miss\"} 1");
+  assert_has_line (text, "eos_update_server_compression_cpu_seconds_total 1.500000");
+  assert_has_line (text, "eos_update_server_compressed_objects_total{level=\"2\"} 2");
+  assert_has_line (text, "eos_update_server_compression_input_bytes_total{level=\"2\"} 300");
+  assert_has_line (text, "eos_update_server_compression_output_bytes_total{level=\"2\"} 100");
+  assert_lacks_line_prefix (text, "eos_update_server_compressed_objects_total{level=\"1\"}");
+  assert_lacks_line_prefix (text, "eos_update_server_compressed_objects_total{level=\"3\"}");
+}
+
+/* Test that quotes, backslashes and newlines in client addresses are
+ * escaped in the label values. */
+static void
+test_server_metrics_escaping (void)
+{
+  g_autoptr(EosServerMetrics) metrics = eos_server_metrics_new ();
+  g_autofree gchar *text = NULL;
+
+  eos_server_metrics_request_started (metrics);
+  eos_server_metrics_request_finished (metrics, EOS_REPO_PATH_CONFIG, 200,
+                                       "a\"b\\c\nd", 10, 10, 10);
+
+  text = format_metrics (metrics);
+
+  assert_has_line (text, "eos_update_server_client_requests_total{client=\"a\\\"b\\\\c\\nd\"} 1");
+}
+
+/* Test that requests from unknown clients, and from clients beyond the
+ * limit, are counted together. */
+static void
+test_server_metrics_other_clients (void)
+{
+  g_autoptr(EosServerMetrics) metrics = eos_server_metrics_new ();
+  g_autofree gchar *text = NULL;
+  guint i;
+
+  for (i = 0; i < 256; i++)
+    {
+      g_autofree gchar *address = g_strdup_printf ("10.0.%u.%u", i / 256, i % 256);
+
+      eos_server_metrics_request_started (metrics);
+      eos_server_metrics_request_finished (metrics, EOS_REPO_PATH_OBJECT, 200,
+                                           address, 1, 1, 1);
+    }
+
+  eos_server_metrics_request_started (metrics);
+  eos_server_metrics_request_finished (metrics, EOS_REPO_PATH_OBJECT, 200,
+                                       "10.0.1.0", 1, 1, 1);
+  eos_server_metrics_request_started (metrics);
+  eos_server_metrics_request_finished (metrics, EOS_REPO_PATH_OBJECT, 500,
+                                       NULL, 1, 1, 1);
+
+  /* Clients already in the table are still counted separately. */
+  eos_server_metrics_request_started (metrics);
+  eos_server_metrics_request_finished (metrics, EOS_REPO_PATH_OBJECT, 200,
+                                       "10.0.0.0", 1, 1, 1);
+
+  text = format_metrics (metrics);
+
+  assert_has_line (text, "eos_update_server_requests_total{class=\"object\"} 259");
+  assert_has_line (text, "eos_update_server_client_requests_total{client=\"10.0.0.0\"} 2");
+  assert_has_line (text, "eos_update_server_client_requests_total{client=\"10.0.0.255\"} 1");
+  assert_has_line (text, "eos_update_server_client_requests_total{client=\"other\"} 2");
+  assert_has_line (text, "eos_update_server_client_responses_total{client=\"other\",code=\"5xx\"} 1");
+  assert_lacks_line_prefix (text, "eos_update_server_client_requests_total{client=\"10.0.1.0\"}");
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/server-metrics/empty", test_server_metrics_empty);
+  g_test_add_func ("/server-metrics/requests", test_server_metrics_requests);
+  g_test_add_func ("/server-metrics/compression", test_server_metrics_compression);
+  g_test_add_func ("/server-metrics/escaping", test_server_metrics_escaping);
+  g_test_add_func ("/server-metrics/other-clients", test_server_metrics_other_clients);
+
+  return g_test_run ();
+}
@@ -1573,7 +1573,8 @@ get_bash_script_descriptor_from_port_file (GFile *port_file)
 }
 
 static gboolean
-run_update_server (GFile *repo,
+run_update_server (GFile *sysroot,
+                   GFile *repo,
                    GFile *quit_file,
                    GFile *port_file,
                    GFile *config_file,
@@ -1593,7 +1594,9 @@ run_update_server (GFile *repo,
   g_autofree gchar *raw_config_file_path = g_file_get_path (config_file);
   CmdEnvVar envv[] =
     {
+      { "EOS_UPDATER_TEST_UPDATER_DEPLOYMENT_FALLBACK", "yes", NULL },
       { "OSTREE_REPO", NULL, repo },
+      { "OSTREE_SYSROOT", NULL, sysroot },
       { "OSTREE_SYSROOT_DEBUG", "mutable-deployments", NULL },
       { "EOS_UPDATER_TEST_UPDATE_SERVER_QUIT_FILE", NULL, quit_file },
       { NULL, NULL, NULL }
@@ -1707,14 +1710,16 @@ get_head_commit_timestamp (GFile *sysroot_path,
   return TRUE;
 }
 
-static GKeyFile *
-generate_definition (GFile *client_root,
-                     guint16 port,
-                     GDateTime *timestamp,
-                     const gchar *ostree_path)
+/* Describes a peer serving updates from @ostree_path on @port of localhost, to
+ * the avahi emulator. The peer is named after @root. */
+GKeyFile *
+eos_test_generate_avahi_definition (GFile *root,
+                                    guint16 port,
+                                    GDateTime *timestamp,
+                                    const gchar *ostree_path)
 {
   GKeyFile *definition = g_key_file_new ();
-  g_autofree gchar *basename = g_file_get_basename (client_root);
+  g_autofree gchar *basename = g_file_get_basename (root);
   g_autofree gchar *service_name = g_strdup_printf ("Test Update Server at %s",
                                                     basename);
   g_autofree gchar *domain_name = g_strdup_printf ("%s.local", basename);
@@ -1757,6 +1762,57 @@ generate_definition (GFile *client_root,
   return definition;
 }
 
+/* Serves the subserver’s repository at the root of a plain HTTP server, like
+ * a peer on the local network which is not running eos-update-server (and so
+ * cannot send objects in packs), and describes it as such a peer advertising
+ * @ref. */
+gboolean
+eos_test_subserver_run_httpd (EosTestSubserver *subserver,
+                              const gchar *ref,
+                              GFile *httpd_dir,
+                              GKeyFile **out_avahi_definition,
+                              GError **error)
+{
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (subserver->repo);
+  g_autofree gchar *checksum = NULL;
+  g_autoptr(GVariant) commit = NULL;
+  g_autoptr(GDateTime) timestamp = NULL;
+  g_autofree gchar *url = NULL;
+  g_autoptr(GFile) port_file = NULL;
+  guint16 port;
+
+  if (!ostree_repo_open (repo, NULL, error))
+    return FALSE;
+
+  if (!ostree_repo_resolve_rev (repo, ref, FALSE, &checksum, error))
+    return FALSE;
+
+  if (!ostree_repo_load_commit (repo, checksum, &commit, NULL, error))
+    return FALSE;
+
+  if (!create_directory (httpd_dir, error))
+    return FALSE;
+
+  if (!run_httpd (subserver->repo,
+                  httpd_dir,
+                  &url,
+                  error))
+    return FALSE;
+
+  port_file = g_file_get_child (httpd_dir, "port-file");
+  if (!read_port_file (port_file,
+                       &port,
+                       error))
+    return FALSE;
+
+  timestamp = g_date_time_new_from_unix_utc (ostree_commit_get_timestamp (commit));
+  *out_avahi_definition = eos_test_generate_avahi_definition (httpd_dir,
+                                                              port,
+                                                              timestamp,
+                                                              subserver->ostree_path);
+  return TRUE;
+}
+
 static GFile *
 get_update_server_quit_file (GFile *update_server_dir)
 {
@@ -1777,12 +1833,15 @@ get_update_server_config_file (GFile *update_server_dir)
 
 static gboolean
 prepare_update_server_dir (GFile *update_server_dir,
+                           const gchar *extra_config,
                            GError **error)
 {
   g_autoptr(GFile) quit_file = NULL;
   g_autoptr(GFile) config_file = NULL;
   g_autofree gchar *config_file_path = NULL;
-  const gchar *config = "[Local Network Updates]\nAdvertiseUpdates=true";
+  g_autofree gchar *config = g_strconcat ("[Local Network Updates]\nAdvertiseUpdates=true\n",
+                                          (extra_config != NULL) ? extra_config : "",
+                                          NULL);
 
   if (!create_directory (update_server_dir, error))
     return FALSE;
@@ -1810,6 +1869,23 @@ eos_test_client_run_update_server (EosTestClient *client,
                                    CmdAsyncResult *cmd,
                                    GKeyFile **out_avahi_definition,
                                    GError **error)
+{
+  return eos_test_client_run_update_server_with_config (client,
+                                                        NULL,
+                                                        cmd,
+                                                        out_avahi_definition,
+                                                        error);
+}
+
+/* Like eos_test_client_run_update_server(), but with @extra_config (if
+ * non-%NULL) appended to the Local Network Updates group of the server’s
+ * configuration file; for example, "GenerateDeltas=true\n". */
+gboolean
+eos_test_client_run_update_server_with_config (EosTestClient *client,
+                                               const gchar *extra_config,
+                                               CmdAsyncResult *cmd,
+                                               GKeyFile **out_avahi_definition,
+                                               GError **error)
 {
   g_autoptr(GFile) update_server_dir = get_update_server_dir (client->root);
   g_autoptr(GFile) sysroot = NULL;
@@ -1820,7 +1896,7 @@ eos_test_client_run_update_server (EosTestClient *client,
   g_autoptr(GDateTime) timestamp = NULL;
   guint16 port;
 
-  if (!prepare_update_server_dir (update_server_dir, error))
+  if (!prepare_update_server_dir (update_server_dir, extra_config, error))
     return FALSE;
 
   sysroot = get_sysroot_for_client (client->root);
@@ -1828,7 +1904,8 @@ eos_test_client_run_update_server (EosTestClient *client,
   quit_file = get_update_server_quit_file (update_server_dir);
   port_file = get_update_server_port_file (update_server_dir);
   config_file = get_update_server_config_file (update_server_dir);
-  if (!run_update_server (repo,
+  if (!run_update_server (sysroot,
+                          repo,
                           quit_file,
                           port_file,
                           config_file,
@@ -1841,10 +1918,10 @@ eos_test_client_run_update_server (EosTestClient *client,
   if (!get_head_commit_timestamp (sysroot, &timestamp, error))
     return FALSE;
 
-  *out_avahi_definition = generate_definition (client->root,
-                                               port,
-                                               timestamp,
-                                               client->ostree_path);
+  *out_avahi_definition = eos_test_generate_avahi_definition (client->root,
+                                                              port,
+                                                              timestamp,
+                                                              client->ostree_path);
   return TRUE;
 }
 
@@ -1990,6 +2067,89 @@ eos_test_client_has_commit (EosTestClient *client,
   return TRUE;
 }
 
+gboolean
+eos_test_client_has_static_delta (EosTestClient *client,
+                                  gboolean *out_result,
+                                  GError **error)
+{
+  g_autoptr(GFile) sysroot = get_sysroot_for_client (client->root);
+  g_autoptr(GFile) repo_path = get_repo_for_sysroot (sysroot);
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (repo_path);
+  g_autoptr(GPtrArray) delta_names = NULL;
+
+  if (!ostree_repo_open (repo, NULL, error) ||
+      !ostree_repo_list_static_delta_names (repo, &delta_names, NULL, error))
+    return FALSE;
+
+  *out_result = (delta_names->len > 0);
+  return TRUE;
+}
+
+/* Whether eos-update-server has cached any compressed objects in the
+ * client’s repository. Entries are in subdirectories of the cache named
+ * after the first two characters of their checksum; temporary files are not
+ * in subdirectories. */
+gboolean
+eos_test_client_has_cached_objects (EosTestClient *client,
+                                    gboolean *out_result,
+                                    GError **error)
+{
+  g_autoptr(GFile) sysroot = get_sysroot_for_client (client->root);
+  g_autoptr(GFile) repo = get_repo_for_sysroot (sysroot);
+  g_autofree gchar *rel_path = g_build_filename ("tmp", "cache", "eos-update-server", NULL);
+  g_autoptr(GFile) cache_dir = g_file_get_child (repo, rel_path);
+  g_autoptr(GFileEnumerator) enumerator = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  *out_result = FALSE;
+
+  enumerator = g_file_enumerate_children (cache_dir,
+                                          G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                          G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                          G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                          NULL,
+                                          &local_error);
+  if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    return TRUE;
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  while (TRUE)
+    {
+      GFileInfo *info;  /* unowned */
+      GFile *child;  /* unowned */
+      g_autoptr(GFileEnumerator) entries = NULL;
+      GFileInfo *entry_info;  /* unowned */
+
+      if (!g_file_enumerator_iterate (enumerator, &info, &child, NULL, error))
+        return FALSE;
+      if (info == NULL)
+        break;
+      if (g_file_info_get_file_type (info) != G_FILE_TYPE_DIRECTORY)
+        continue;
+
+      entries = g_file_enumerate_children (child,
+                                           G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                           G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                           NULL,
+                                           error);
+      if (entries == NULL ||
+          !g_file_enumerator_iterate (entries, &entry_info, NULL, NULL, error))
+        return FALSE;
+
+      if (entry_info != NULL)
+        {
+          *out_result = TRUE;
+          return TRUE;
+        }
+    }
+
+  return TRUE;
+}
+
 gboolean
 eos_test_client_prepare_volume (EosTestClient *client,
                                 GFile *volume_path,
@@ -108,6 +108,12 @@ EosTestSubserver *eos_test_subserver_new (GFile *gpg_home,
 gboolean eos_test_subserver_update (EosTestSubserver *subserver,
                                     GError **error);
 
+gboolean eos_test_subserver_run_httpd (EosTestSubserver *subserver,
+                                       const gchar *ref,
+                                       GFile *httpd_dir,
+                                       GKeyFile **out_avahi_definition,
+                                       GError **error);
+
 #define EOS_TEST_TYPE_SERVER eos_test_server_get_type ()
 EOS_DECLARE_REFCOUNTED (EosTestServer,
                         eos_test_server,
@@ -186,6 +192,12 @@ gboolean eos_test_client_run_update_server (EosTestClient *client,
                                             GKeyFile **out_avahi_definition,
                                             GError **error);
 
+gboolean eos_test_client_run_update_server_with_config (EosTestClient *client,
+                                                        const gchar *extra_config,
+                                                        CmdAsyncResult *cmd,
+                                                        GKeyFile **out_avahi_definition,
+                                                        GError **error);
+
 
 gboolean eos_test_client_remove_update_server_quit_file (EosTestClient *client,
                                                          GError **error);
@@ -211,10 +223,23 @@ gboolean eos_test_client_has_commit (EosTestClient *client,
                                      gboolean *out_has_commit,
                                      GError **error);
 
+gboolean eos_test_client_has_static_delta (EosTestClient *client,
+                                           gboolean *out_result,
+                                           GError **error);
+
+gboolean eos_test_client_has_cached_objects (EosTestClient *client,
+                                             gboolean *out_result,
+                                             GError **error);
+
 gboolean eos_test_client_prepare_volume (EosTestClient *client,
                                          GFile *volume_path,
                                          GError **error);
 
+GKeyFile *eos_test_generate_avahi_definition (GFile *root,
+                                              guint16 port,
+                                              GDateTime *timestamp,
+                                              const gchar *ostree_path);
+
 typedef enum _UpdateStep {
   UPDATE_STEP_NONE,
   UPDATE_STEP_POLL,
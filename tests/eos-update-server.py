@@ -20,11 +20,22 @@
 
 """Integration tests for eos-update-server."""
 
+import concurrent.futures
+import contextlib
+import http.server
 import os
+import shutil
+import socketserver
+import struct
 import subprocess
 import tempfile
+import threading
 import time
 import unittest
+import urllib.error
+import urllib.parse
+import urllib.request
+import zlib
 
 import taptestrunner
 
@@ -42,8 +53,17 @@ class TestEosUpdateServer(unittest.TestCase):
     def setUp(self):
         self.timeout_seconds = 10  # seconds per test
         self.__config_file = '/etc/eos-updater/eos-update-server.conf'
+        self.__files = None
+
+        # Not in /tmp, which may be a tmpfs too small for the repositories.
+        self.__tmp_dir = tempfile.TemporaryDirectory(
+            prefix='eos-update-server-test', dir='/var/tmp')
+        self.__server_log = os.path.join(self.__tmp_dir.name,
+                                         'eos-update-server.log')
 
     def tearDown(self):
+        self.__tmp_dir.cleanup()
+
         try:
             os.unlink(self.__config_file)
         except OSError:
@@ -58,6 +78,26 @@ class TestEosUpdateServer(unittest.TestCase):
         # for start requests.
         time.sleep(1)
 
+    def __write_config(self, extra_lines=''):
+        """Write a configuration file enabling the server, with extra_lines
+        appended to the Local Network Updates group."""
+        os.makedirs('/etc/eos-updater/', mode=0o755, exist_ok=True)
+        with open(self.__config_file, 'w') as conf_file:
+            conf_file.write(
+                '[Local Network Updates]\n'
+                'AdvertiseUpdates=true\n' +
+                extra_lines
+            )
+
+    def __run_server(self):
+        """Run the server on a local port until it times out, and return its
+        exit status."""
+        port_file = tempfile.NamedTemporaryFile(
+            prefix='eos-update-server-test')
+        return subprocess.call(['/lib/x86_64-linux-gnu/eos-update-server',
+                                '--port-file=' + port_file.name,
+                                '--timeout=1'])
+
     @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
     def test_enable_via_configuration_file(self):
         """Test enabling the configuration file allows the server to run."""
@@ -93,6 +133,805 @@ class TestEosUpdateServer(unittest.TestCase):
                                   '--timeout=1'])
         self.assertEqual(status, 4)  # EXIT_DISABLED
 
+    def __make_repo(self, mode='bare', name='repo'):
+        """Create an OSTree repository in the given mode, with the files in
+        self.__files committed to the ref test, and return its path."""
+        tree = os.path.join(self.__tmp_dir.name, 'tree')
+        if self.__files is None:
+            self.__files = {
+                'small': b'Hello, world!\n' * 1024,
+                # Incompressible, and big enough that the server is still
+                # compressing it when several requests for it have arrived.
+                'big': os.urandom(32 * 1024 * 1024),
+            }
+            for i in range(8):
+                self.__files['file%d' % i] = os.urandom(1024 * 1024)
+
+            os.mkdir(tree)
+            for file_name, contents in self.__files.items():
+                with open(os.path.join(tree, file_name), 'wb') as f:
+                    f.write(contents)
+
+        repo = os.path.join(self.__tmp_dir.name, name)
+        subprocess.check_call(['ostree', 'init', '--repo=' + repo,
+                               '--mode=' + mode])
+        subprocess.check_call(['ostree', 'commit', '--repo=' + repo,
+                               '--branch=test', '--subject=Test',
+                               '--tree=dir=' + tree],
+                              stdout=subprocess.DEVNULL)
+        return repo
+
+    def __object_path(self, repo, file_name):
+        """Return the path on the server of the .filez object for file_name
+        in the commit made by __make_repo()."""
+        output = subprocess.check_output(['ostree', 'ls', '--repo=' + repo,
+                                          '-C', 'test', '/' + file_name])
+        checksum = output.decode('utf-8').split()[-2]
+        return '/objects/' + checksum[:2] + '/' + checksum[2:] + '.filez'
+
+    def __commit_path(self, repo):
+        """Return the path on the server of the commit object made by
+        __make_repo(), which is served as it is stored."""
+        output = subprocess.check_output(['ostree', 'rev-parse',
+                                          '--repo=' + repo, 'test'])
+        checksum = output.decode('utf-8').strip()
+        return '/objects/' + checksum[:2] + '/' + checksum[2:] + '.commit'
+
+    def __cache_entry_path(self, repo, object_path):
+        """Return the path of the compressed object cache entry for the
+        object at object_path on the server."""
+        return os.path.join(repo, 'tmp', 'cache', 'eos-update-server',
+                            object_path[len('/objects/'):])
+
+    def __wait_for_port(self, port_file):
+        """Wait for the server to write its port to port_file, and return
+        it."""
+        port = ''
+        deadline = time.monotonic() + self.timeout_seconds
+        while port == '' and time.monotonic() < deadline:
+            time.sleep(0.1)
+            with open(port_file, 'r') as f:
+                port = f.read().strip()
+        self.assertNotEqual(port, '')
+        return port
+
+    def __wait_for(self, predicate):
+        """Wait for predicate() to become true."""
+        deadline = time.monotonic() + self.timeout_seconds
+        while not predicate():
+            self.assertLess(time.monotonic(), deadline)
+            time.sleep(0.1)
+
+    @contextlib.contextmanager
+    def __serve(self, repo, extra_lines=''):
+        """Run the server on a local port, serving repo with extra_lines
+        appended to the Local Network Updates group of its configuration, and
+        yield its base URL."""
+        config_file = os.path.join(self.__tmp_dir.name,
+                                   'eos-update-server.conf')
+        with open(config_file, 'w') as conf_file:
+            conf_file.write(
+                '[Local Network Updates]\n'
+                'AdvertiseUpdates=true\n' +
+                extra_lines
+            )
+
+        port_file = os.path.join(self.__tmp_dir.name, 'port')
+        open(port_file, 'w').close()
+
+        with open(self.__server_log, 'wb') as log:
+            proc = subprocess.Popen(['/lib/x86_64-linux-gnu/eos-update-server',
+                                     '--config-file=' + config_file,
+                                     '--port-file=' + port_file,
+                                     '--timeout=' +
+                                     str(self.timeout_seconds * 6)],
+                                    env=dict(os.environ, OSTREE_REPO=repo),
+                                    stderr=log)
+
+        try:
+            yield 'http://127.0.0.1:' + self.__wait_for_port(port_file)
+        finally:
+            proc.terminate()
+            proc.wait(timeout=self.timeout_seconds)
+
+    def __read_server_log(self):
+        """Return what the server run by __serve() has written to stderr."""
+        with open(self.__server_log, 'r') as log:
+            return log.read()
+
+    def __get(self, url, headers=None):
+        """Fetch url, and return the status, headers and body of the
+        response, whether or not it is an error."""
+        request = urllib.request.Request(url, headers=headers or {})
+        try:
+            with urllib.request.urlopen(request,
+                                        timeout=self.timeout_seconds) as r:
+                return r.status, r.headers, r.read()
+        except urllib.error.HTTPError as e:
+            return e.code, e.headers, e.read()
+
+    @staticmethod
+    def __decode_filez(body):
+        """Return the contents of the file in the .filez object body: a
+        big-endian header size, four bytes of padding, the header, and then
+        the raw deflated contents."""
+        header_size, = struct.unpack('>I', body[:4])
+        return zlib.decompress(body[8 + header_size:], -15)
+
+    def __get_metrics(self, url):
+        """Fetch the metrics from the server at url, and return them as a
+        dictionary mapping each sample (name and labels) to its value."""
+        status, _, body = self.__get(url + '/metrics')
+        self.assertEqual(status, 200)
+
+        samples = {}
+        for line in body.decode('utf-8').splitlines():
+            if line != '' and not line.startswith('#'):
+                sample, value = line.rsplit(' ', 1)
+                samples[sample] = float(value)
+        return samples
+
+    def __count_compressions(self, metrics):
+        """Return how many file objects the server has compressed, at any
+        level."""
+        return sum(value for sample, value in metrics.items()
+                   if sample.startswith(
+                       'eos_update_server_compressed_objects_total{'))
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_cache(self):
+        """Test a compressed object is cached, is then served from the cache
+        rather than being compressed again, and can be revalidated with its
+        ETag."""
+        repo = self.__make_repo()
+        path = self.__object_path(repo, 'small')
+        entry = self.__cache_entry_path(repo, path)
+
+        with self.__serve(repo, 'Metrics=true\n') as url:
+            status, headers, body = self.__get(url + path)
+            self.assertEqual(status, 200)
+            self.assertEqual(self.__decode_filez(body), self.__files['small'])
+
+            # The entry is committed just after the last chunk is sent.
+            self.__wait_for(lambda: os.path.exists(entry))
+
+            status, cached_headers, cached_body = self.__get(url + path)
+            self.assertEqual(status, 200)
+            self.assertEqual(cached_body, body)
+            self.assertEqual(cached_headers['ETag'], headers['ETag'])
+
+            status, _, body = self.__get(url + path,
+                                         {'If-None-Match': headers['ETag']})
+            self.assertEqual(status, 304)
+            self.assertEqual(body, b'')
+
+            metrics = self.__get_metrics(url)
+            self.assertEqual(metrics['eos_update_server_cache_lookups_total'
+                                     '{result="miss"}'], 1)
+            self.assertEqual(metrics['eos_update_server_cache_lookups_total'
+                                     '{result="hit"}'], 1)
+            self.assertEqual(self.__count_compressions(metrics), 1)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_cache_disabled(self):
+        """Test nothing is cached if the cache size is zero, so an object is
+        compressed each time it is requested."""
+        repo = self.__make_repo()
+        path = self.__object_path(repo, 'small')
+
+        with self.__serve(repo, 'CompressedObjectCacheSize=0\n'
+                                'Metrics=true\n') as url:
+            for i in range(2):
+                status, _, body = self.__get(url + path)
+                self.assertEqual(status, 200)
+                self.assertEqual(self.__decode_filez(body),
+                                 self.__files['small'])
+
+            metrics = self.__get_metrics(url)
+            self.assertEqual(self.__count_compressions(metrics), 2)
+
+        self.assertFalse(os.path.exists(self.__cache_entry_path(repo, path)))
+
+    def __open_all(self, url, n_requests):
+        """Send n_requests requests for url, and return the responses once
+        all their headers have been received, without reading any body."""
+        responses = []
+        try:
+            for i in range(n_requests):
+                responses.append(urllib.request.urlopen(
+                    url, timeout=self.timeout_seconds))
+        except Exception:
+            for response in responses:
+                response.close()
+            raise
+        return responses
+
+    @staticmethod
+    def __read_all(responses):
+        """Read the bodies of responses concurrently, close them, and return
+        the bodies."""
+        try:
+            with concurrent.futures.ThreadPoolExecutor(len(responses)) as e:
+                return list(e.map(lambda r: r.read(), responses))
+        finally:
+            for response in responses:
+                response.close()
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_coalesce_requests(self):
+        """Test concurrent requests for an object which is being compressed
+        share one compression of it, and all get the whole object."""
+        repo = self.__make_repo()
+        path = self.__object_path(repo, 'big')
+
+        # Without the cache, the requests can only share the compression.
+        with self.__serve(repo, 'CompressedObjectCacheSize=0\n'
+                                'Metrics=true\n') as url:
+            # None of the bodies is read until all the requests have been
+            # answered, so the compression cannot finish before then.
+            responses = self.__open_all(url + path, 4)
+            bodies = self.__read_all(responses)
+
+            for body in bodies:
+                self.assertEqual(body, bodies[0])
+            self.assertEqual(self.__decode_filez(bodies[0]),
+                             self.__files['big'])
+
+            metrics = self.__get_metrics(url)
+            self.assertEqual(self.__count_compressions(metrics), 1)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_stalled_reader(self):
+        """Test a client which stops reading an object does not hold up
+        another client getting the same object, and can carry on reading it
+        later."""
+        repo = self.__make_repo()
+        path = self.__object_path(repo, 'big')
+
+        with self.__serve(repo, 'CompressedObjectCacheSize=0\n'
+                                'Metrics=true\n') as url:
+            stalled, reading = self.__open_all(url + path, 2)
+
+            try:
+                # The object is much bigger than the socket buffers, so this
+                # would time out if the compression waited for the stalled
+                # reader.
+                body = reading.read()
+                self.assertEqual(self.__decode_filez(body),
+                                 self.__files['big'])
+
+                self.assertEqual(stalled.read(), body)
+            finally:
+                stalled.close()
+                reading.close()
+
+            metrics = self.__get_metrics(url)
+            self.assertEqual(self.__count_compressions(metrics), 1)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_concurrent_requests(self):
+        """Test many objects and files requested at once are all served
+        correctly, while another object is being sent to a client."""
+        repo = self.__make_repo()
+        commit_path = self.__commit_path(repo)
+        with open(os.path.join(repo, commit_path[1:]), 'rb') as f:
+            commit = f.read()
+        file_names = [name for name in self.__files if name != 'big']
+        paths = [self.__object_path(repo, name) for name in file_names]
+
+        with self.__serve(repo) as url:
+            stalled, = self.__open_all(url + self.__object_path(repo, 'big'),
+                                       1)
+
+            try:
+                with concurrent.futures.ThreadPoolExecutor(16) as e:
+                    objects = e.map(lambda path: self.__get(url + path),
+                                    paths)
+                    commits = e.map(lambda i: self.__get(url + commit_path),
+                                    range(16))
+
+                    for name, (status, _, body) in zip(file_names, objects):
+                        self.assertEqual(status, 200)
+                        self.assertEqual(self.__decode_filez(body),
+                                         self.__files[name])
+                    for status, _, body in commits:
+                        self.assertEqual(status, 200)
+                        self.assertEqual(body, commit)
+            finally:
+                stalled.close()
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_range(self):
+        """Test a range of a file served as it is stored, or of an object
+        which has not been compressed yet, is served as a partial
+        response."""
+        repo = self.__make_repo()
+        commit_path = self.__commit_path(repo)
+        with open(os.path.join(repo, commit_path[1:]), 'rb') as f:
+            commit = f.read()
+        path = self.__object_path(repo, 'small')
+
+        with self.__serve(repo) as url:
+            status, headers, body = self.__get(url + commit_path,
+                                               {'Range': 'bytes=0-9'})
+            self.assertEqual(status, 206)
+            self.assertEqual(headers['Content-Range'],
+                             'bytes 0-9/%d' % len(commit))
+            self.assertEqual(body, commit[:10])
+
+            # Resume a download of the object before it has been compressed
+            # by anyone; the request waits for the compression to finish.
+            status, headers, partial_body = self.__get(url + path,
+                                                       {'Range': 'bytes=10-'})
+            self.assertEqual(status, 206)
+
+            status, _, body = self.__get(url + path)
+            self.assertEqual(status, 200)
+            self.assertEqual(headers['Content-Range'],
+                             'bytes 10-%d/%d' % (len(body) - 1, len(body)))
+            self.assertEqual(partial_body, body[10:])
+            self.assertEqual(self.__decode_filez(body), self.__files['small'])
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_symlinks(self):
+        """Test symlinks in the repository are not followed, so they cannot
+        be used to serve files from outside it."""
+        repo = self.__make_repo()
+        outside = os.path.join(self.__tmp_dir.name, 'outside')
+        object_name = '0' * 62 + '.commit'
+        os.mkdir(outside)
+        with open(os.path.join(outside, object_name), 'wb') as f:
+            f.write(b'secret')
+
+        os.makedirs(os.path.join(repo, 'objects', '00'), exist_ok=True)
+        os.symlink(os.path.join(outside, object_name),
+                   os.path.join(repo, 'objects', '00', object_name))
+
+        # Replace an unused object directory with a symlink.
+        for i in range(255, 0, -1):
+            link_prefix = '%02x' % i
+            link_path = os.path.join(repo, 'objects', link_prefix)
+            if not os.path.exists(link_path) or not os.listdir(link_path):
+                break
+        if os.path.exists(link_path):
+            os.rmdir(link_path)
+        os.symlink(outside, link_path)
+
+        os.symlink(os.path.join(outside, object_name),
+                   os.path.join(repo, 'refs', 'heads', 'file-link'))
+        os.symlink(outside, os.path.join(repo, 'refs', 'heads', 'dir-link'))
+
+        with self.__serve(repo) as url:
+            for path in ['/objects/00/' + object_name,
+                         '/objects/' + link_prefix + '/' + object_name,
+                         '/refs/heads/file-link',
+                         '/refs/heads/dir-link/' + object_name]:
+                with self.subTest(path=path):
+                    status, _, body = self.__get(url + path)
+                    self.assertEqual(status, 404)
+                    self.assertNotIn(b'secret', body)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_archive_passthrough(self):
+        """Test objects in an archive-z2 repository are served as they are
+        stored, without being compressed again or cached."""
+        repo = self.__make_repo(mode='archive-z2')
+
+        with self.__serve(repo, 'Metrics=true\n') as url:
+            for file_name in ['small', 'big']:
+                with self.subTest(file_name=file_name):
+                    path = self.__object_path(repo, file_name)
+                    with open(os.path.join(repo, path[1:]), 'rb') as f:
+                        stored = f.read()
+
+                    status, _, body = self.__get(url + path)
+                    self.assertEqual(status, 200)
+                    self.assertEqual(body, stored)
+                    self.assertEqual(self.__decode_filez(body),
+                                     self.__files[file_name])
+                    self.assertFalse(os.path.exists(
+                        self.__cache_entry_path(repo, path)))
+
+            metrics = self.__get_metrics(url)
+            self.assertEqual(self.__count_compressions(metrics), 0)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_cache_size_configuration(self):
+        """Test an invalid cache size causes the server to not start."""
+        for value in ['lots', '-1', '18446744073709551615']:
+            with self.subTest(value=value):
+                self.__write_config('CompressedObjectCacheSize=' + value +
+                                    '\n')
+                status = self.__run_server()
+                self.assertEqual(status, 3)  # EXIT_BAD_CONFIGURATION
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_compression_threads(self):
+        """Test objects requested at once are all compressed correctly,
+        whether in the request thread or in a pool of threads."""
+        repo = self.__make_repo()
+        file_names = ['file%d' % i for i in range(8)]
+        paths = [self.__object_path(repo, name) for name in file_names]
+
+        for value in ['0', '4']:
+            with self.subTest(value=value), \
+                 self.__serve(repo, 'CompressionThreads=' + value + '\n'
+                                    'CompressedObjectCacheSize=0\n'
+                                    'Metrics=true\n') as url:
+                with concurrent.futures.ThreadPoolExecutor(len(paths)) as e:
+                    responses = list(e.map(lambda path: self.__get(url + path),
+                                           paths))
+
+                for name, (status, _, body) in zip(file_names, responses):
+                    self.assertEqual(status, 200)
+                    self.assertEqual(self.__decode_filez(body),
+                                     self.__files[name])
+
+                metrics = self.__get_metrics(url)
+                self.assertEqual(self.__count_compressions(metrics),
+                                 len(paths))
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_compression_threads_configuration(self):
+        """Test an invalid number of compression threads causes the server
+        to not start."""
+        for value in ['many', '2147483648']:
+            with self.subTest(value=value):
+                self.__write_config('CompressionThreads=' + value + '\n')
+                status = self.__run_server()
+                self.assertEqual(status, 3)  # EXIT_BAD_CONFIGURATION
+
+    def __assert_busy(self, status, headers):
+        """Assert a response is 503 Service Unavailable, telling the client
+        when to retry."""
+        self.assertEqual(status, 503)
+        self.assertIn(int(headers['Retry-After']), range(1, 61))
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_max_object_streams(self):
+        """Test requests for objects beyond the limit on object streams are
+        refused with 503 and a Retry-After header, while requests for
+        metadata are still served."""
+        repo = self.__make_repo()
+        commit_path = self.__commit_path(repo)
+        path = self.__object_path(repo, 'small')
+
+        with self.__serve(repo, 'MaxObjectStreams=1\n') as url:
+            stalled, = self.__open_all(url + self.__object_path(repo, 'big'),
+                                       1)
+
+            try:
+                status, headers, _ = self.__get(url + path)
+                self.__assert_busy(status, headers)
+
+                status, _, _ = self.__get(url + commit_path)
+                self.assertEqual(status, 200)
+            finally:
+                stalled.close()
+
+            # The stream is released once the stalled client has gone.
+            def not_busy():
+                status, _, _ = self.__get(url + path)
+                return status == 200
+            self.__wait_for(not_busy)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_max_compressions(self):
+        """Test requests which would start a compression beyond the limit are
+        refused with 503 and a Retry-After header, while requests which can
+        join a running compression are still served."""
+        repo = self.__make_repo()
+        big_path = self.__object_path(repo, 'big')
+
+        with self.__serve(repo, 'MaxCompressions=1\n') as url:
+            responses = self.__open_all(url + big_path, 2)
+
+            try:
+                status, headers, _ = self.__get(
+                    url + self.__object_path(repo, 'small'))
+                self.__assert_busy(status, headers)
+            finally:
+                bodies = self.__read_all(responses)
+
+            self.assertEqual(bodies[0], bodies[1])
+            self.assertEqual(self.__decode_filez(bodies[0]),
+                             self.__files['big'])
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_admission_control_configuration(self):
+        """Test invalid limits on concurrent object streams and compressions
+        cause the server to not start."""
+        for key in ['MaxObjectStreams', 'MaxCompressions']:
+            for value in ['unlimited', '2147483648']:
+                with self.subTest(key=key, value=value):
+                    self.__write_config(key + '=' + value + '\n')
+                    status = self.__run_server()
+                    self.assertEqual(status, 3)  # EXIT_BAD_CONFIGURATION
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_upload_rate(self):
+        """Test objects are sent no faster than the overall or per-client
+        upload rate, including to clients given a weight."""
+        repo = self.__make_repo()
+        path = self.__object_path(repo, 'file0')
+
+        # 1MiB of incompressible data should take 4s at 256KiB/s; allow for
+        # the initial burst.
+        for key in ['MaxUploadRate', 'MaxClientUploadRate']:
+            with self.subTest(key=key), \
+                 self.__serve(repo, key + '=256\n'
+                                    'ClientWeights=127.0.0.1=2\n'
+                                    'CompressedObjectCacheSize=0\n') as url:
+                start = time.monotonic()
+                status, _, body = self.__get(url + path)
+                duration = time.monotonic() - start
+
+                self.assertEqual(status, 200)
+                self.assertEqual(self.__decode_filez(body),
+                                 self.__files['file0'])
+                self.assertGreaterEqual(duration, 3)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_upload_rate_configuration(self):
+        """Test invalid upload rates cause the server to not start."""
+        for key in ['MaxUploadRate', 'MaxClientUploadRate']:
+            for value in ['fast', '18014398509481984']:
+                with self.subTest(key=key, value=value):
+                    self.__write_config(key + '=' + value + '\n')
+                    status = self.__run_server()
+                    self.assertEqual(status, 3)  # EXIT_BAD_CONFIGURATION
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_client_weights_configuration(self):
+        """Test invalid client weights cause the server to fail to start.
+
+        They are only checked when the server is created, rather than when
+        the configuration file is loaded."""
+        for value in ['192.0.2.1', '=2', '192.0.2.1=0', '192.0.2.1=heavy']:
+            with self.subTest(value=value):
+                self.__write_config('MaxUploadRate=1024\n'
+                                    'ClientWeights=' + value + '\n')
+                status = self.__run_server()
+                self.assertEqual(status, 1)  # EXIT_FAILED
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_generate_deltas_configuration(self):
+        """Test an invalid GenerateDeltas value causes the server to not
+        start."""
+        self.__write_config('GenerateDeltas=sometimes\n')
+        status = self.__run_server()
+        self.assertEqual(status, 3)  # EXIT_BAD_CONFIGURATION
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_warm_cache_configuration(self):
+        """Test an invalid WarmCache value causes the server to not start."""
+        self.__write_config('WarmCache=sometimes\n')
+        status = self.__run_server()
+        self.assertEqual(status, 3)  # EXIT_BAD_CONFIGURATION
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_compression_level(self):
+        """Test objects are compressed at the configured level, or at a level
+        chosen for each request if it is adaptive."""
+        repo = self.__make_repo()
+        path = self.__object_path(repo, 'small')
+        sizes = {}
+
+        for value in ['0', '9', 'adaptive']:
+            with self.subTest(value=value), \
+                 self.__serve(repo, 'CompressionLevel=' + value + '\n'
+                                    'CompressedObjectCacheSize=0\n'
+                                    'Metrics=true\n') as url:
+                status, _, body = self.__get(url + path)
+                self.assertEqual(status, 200)
+                self.assertEqual(self.__decode_filez(body),
+                                 self.__files['small'])
+                sizes[value] = len(body)
+
+                metrics = self.__get_metrics(url)
+                self.assertEqual(self.__count_compressions(metrics), 1)
+                if value != 'adaptive':
+                    self.assertEqual(
+                        metrics['eos_update_server_compressed_objects_total'
+                                '{level="' + value + '"}'], 1)
+
+        # Level 0 only stores the repetitive contents; level 9 deflates them.
+        self.assertGreater(sizes['0'], len(self.__files['small']))
+        self.assertLess(sizes['9'], len(self.__files['small']) / 10)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_compression_level_configuration(self):
+        """Test an invalid compression level causes the server to not
+        start."""
+        for value in ['', '10', '-1', 'best', '5x']:
+            with self.subTest(value=value):
+                self.__write_config('CompressionLevel=' + value + '\n')
+                status = self.__run_server()
+                self.assertEqual(status, 3)  # EXIT_BAD_CONFIGURATION
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_workers(self):
+        """Test requests on many connections are all served, whichever worker
+        they go to, and counted in the metrics shared by the workers."""
+        repo = self.__make_repo()
+        file_names = ['file%d' % i for i in range(8)] * 4
+        paths = [self.__object_path(repo, name) for name in file_names]
+
+        for value in ['4', '0']:
+            with self.subTest(value=value), \
+                 self.__serve(repo, 'Workers=' + value + '\n'
+                                    'Metrics=true\n') as url:
+                # Each request is made on a connection of its own.
+                with concurrent.futures.ThreadPoolExecutor(16) as e:
+                    responses = list(e.map(lambda path: self.__get(url + path),
+                                           paths))
+
+                for name, (status, _, body) in zip(file_names, responses):
+                    self.assertEqual(status, 200)
+                    self.assertEqual(self.__decode_filez(body),
+                                     self.__files[name])
+
+                # Requests are counted once their response has been sent,
+                # which may be just after the client has received it.
+                def all_counted():
+                    metrics = self.__get_metrics(url)
+                    return (metrics['eos_update_server_requests_total'
+                                    '{class="filez"}'] == len(paths))
+                self.__wait_for(all_counted)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_workers_configuration(self):
+        """Test an invalid number of workers causes the server to not
+        start."""
+        for value in ['several', '2147483648']:
+            with self.subTest(value=value):
+                self.__write_config('Workers=' + value + '\n')
+                status = self.__run_server()
+                self.assertEqual(status, 3)  # EXIT_BAD_CONFIGURATION
+
+    @contextlib.contextmanager
+    def __serve_upstream(self, repo):
+        """Serve repo over HTTP on a local port as a plain upstream server,
+        and yield its base URL and the list of paths requested from it."""
+        requested_paths = []
+
+        class Handler(http.server.SimpleHTTPRequestHandler):
+            def translate_path(self, path):
+                path = urllib.parse.urlsplit(path).path
+                return os.path.join(repo, urllib.parse.unquote(path)[1:])
+
+            def do_GET(self):
+                requested_paths.append(self.path)
+                super().do_GET()
+
+            def log_message(self, format, *args):
+                pass
+
+        class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+            daemon_threads = True
+
+        httpd = Server(('127.0.0.1', 0), Handler)
+        thread = threading.Thread(target=httpd.serve_forever)
+        thread.start()
+
+        try:
+            yield ('http://127.0.0.1:%d/' % httpd.server_address[1],
+                   requested_paths)
+        finally:
+            httpd.shutdown()
+            httpd.server_close()
+            thread.join()
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_proxy_upstream(self):
+        """Test objects missing from the repository are fetched from the
+        upstream server of the served remote, and cached once verified."""
+        upstream = self.__make_repo(mode='archive-z2', name='upstream')
+        commit_path = self.__commit_path(upstream)
+        with open(os.path.join(upstream, commit_path[1:]), 'rb') as f:
+            commit = f.read()
+        good_path = self.__object_path(upstream, 'small')
+        bad_path = self.__object_path(upstream, 'file1')
+
+        # Corrupt an object upstream by replacing it with a different, but
+        # well-formed, object.
+        shutil.copyfile(
+            os.path.join(upstream, self.__object_path(upstream, 'file0')[1:]),
+            os.path.join(upstream, bad_path[1:]))
+
+        repo = os.path.join(self.__tmp_dir.name, 'repo')
+        subprocess.check_call(['ostree', 'init', '--repo=' + repo,
+                               '--mode=bare'])
+
+        with self.__serve_upstream(upstream) as (upstream_url, requested):
+            subprocess.check_call(['ostree', 'remote', 'add',
+                                   '--repo=' + repo, '--no-gpg-verify',
+                                   'eos', upstream_url])
+
+            with self.__serve(repo, 'ProxyUpstream=true\n') as url:
+                status, _, body = self.__get(url + commit_path)
+                self.assertEqual(status, 200)
+                self.assertEqual(body, commit)
+
+                status, _, body = self.__get(url + good_path)
+                self.assertEqual(status, 200)
+                self.assertEqual(self.__decode_filez(body),
+                                 self.__files['small'])
+
+                self.__wait_for(lambda: os.path.exists(
+                    self.__cache_entry_path(repo, good_path)))
+                status, _, cached_body = self.__get(url + good_path)
+                self.assertEqual(status, 200)
+                self.assertEqual(cached_body, body)
+                self.assertEqual(requested.count(good_path), 1)
+
+                # The corrupt object is passed on, for the client to reject,
+                # but not cached.
+                status, _, body = self.__get(url + bad_path)
+                self.assertEqual(status, 200)
+                self.assertNotEqual(self.__decode_filez(body),
+                                    self.__files['file1'])
+
+                bad_name = bad_path[9:11] + bad_path[12:]
+                self.__wait_for(lambda: 'Not caching ' + bad_name in
+                                self.__read_server_log())
+                self.assertFalse(os.path.exists(
+                    self.__cache_entry_path(repo, bad_path)))
+
+                status, _, _ = self.__get(url + bad_path)
+                self.assertEqual(status, 200)
+                self.assertEqual(requested.count(bad_path), 2)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_proxy_upstream_configuration(self):
+        """Test an invalid ProxyUpstream value causes the server to not
+        start."""
+        self.__write_config('ProxyUpstream=sometimes\n')
+        status = self.__run_server()
+        self.assertEqual(status, 3)  # EXIT_BAD_CONFIGURATION
+
+    def __fetch_metrics(self):
+        """Run the server on a local port, fetch /metrics from it, and return
+        the response body, or raise urllib.error.HTTPError."""
+        port_file = tempfile.NamedTemporaryFile(
+            prefix='eos-update-server-test')
+        proc = subprocess.Popen(['/lib/x86_64-linux-gnu/eos-update-server',
+                                 '--port-file=' + port_file.name,
+                                 '--timeout=' + str(self.timeout_seconds)])
+
+        try:
+            port = self.__wait_for_port(port_file.name)
+            url = 'http://127.0.0.1:' + port + '/metrics'
+            with urllib.request.urlopen(url,
+                                        timeout=self.timeout_seconds) as r:
+                return r.read().decode('utf-8')
+        finally:
+            proc.terminate()
+            proc.wait(timeout=self.timeout_seconds)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_metrics_configuration(self):
+        """Test the server serves its metrics at /metrics if enabled."""
+        self.__write_config('Metrics=true\n')
+        text = self.__fetch_metrics()
+        self.assertIn('# TYPE eos_update_server_requests_total counter\n',
+                      text)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_metrics_disabled_configuration(self):
+        """Test the server does not serve /metrics by default."""
+        self.__write_config()
+        with self.assertRaises(urllib.error.HTTPError) as cm:
+            self.__fetch_metrics()
+        self.assertEqual(cm.exception.code, 404)
+
+    @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
+    def test_invalid_metrics_configuration(self):
+        """Test an invalid Metrics value causes the server to not start."""
+        self.__write_config('Metrics=sometimes\n')
+        status = self.__run_server()
+        self.assertEqual(status, 3)  # EXIT_BAD_CONFIGURATION
+
     @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
     @unittest.expectedFailure
     def test_disable_via_configuration_file_at_runtime(self):
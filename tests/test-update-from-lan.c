@@ -27,6 +27,8 @@
 
 #include <gio/gio.h>
 #include <locale.h>
+#include <string.h>
+#include <unistd.h>
 
 static void
 test_update_from_lan (EosUpdaterFixture *fixture,
@@ -200,6 +202,476 @@ test_update_from_lan (EosUpdaterFixture *fixture,
   g_assert_true (has_commit);
 }
 
+/* Runs the updater on @client with the given sources enabled, and lets the
+ * autoupdater apply what it finds. Each client gets an autoupdater of its
+ * own, since the autoupdater’s stamp file stops it updating twice a day. */
+static void
+update_client (EosUpdaterFixture *fixture,
+               EosTestClient *client,
+               DownloadSource *sources,
+               gsize n_sources,
+               CmdResult *reaped)
+{
+  g_autoptr(GError) error = NULL;
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autofree gchar *client_name = g_file_get_basename (client->root);
+  g_autofree gchar *autoupdater_name = g_strconcat ("autoupdater-", client_name, NULL);
+  g_autoptr(GFile) autoupdater_root = NULL;
+  g_autoptr(EosTestAutoupdater) autoupdater = NULL;
+  g_autoptr(GPtrArray) cmds = NULL;
+  GVariant *source_variants[] = { NULL, NULL, NULL };
+
+  g_assert_cmpuint (n_sources, <=, G_N_ELEMENTS (source_variants));
+
+  g_test_message ("Running updater");
+
+  eos_test_client_run_updater (client,
+                               sources,
+                               source_variants,
+                               n_sources,
+                               &updater_cmd,
+                               &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Running autoupdater apply step");
+
+  autoupdater_root = g_file_get_child (fixture->tmpdir, autoupdater_name);
+  autoupdater = eos_test_autoupdater_new (autoupdater_root,
+                                          UPDATE_STEP_APPLY,
+                                          1,
+                                          TRUE,
+                                          &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Reaping autoupdater");
+
+  eos_test_client_reap_updater (client,
+                                &updater_cmd,
+                                reaped,
+                                &error);
+  g_assert_no_error (error);
+
+  cmds = g_ptr_array_new ();
+  g_ptr_array_add (cmds, reaped);
+  g_ptr_array_add (cmds, autoupdater->cmd);
+  g_assert_true (cmd_result_ensure_all_ok_verbose (cmds));
+}
+
+/* Sets up a main server with commit 0 on it, and a client which has pulled
+ * it. */
+static void
+setup_server_and_client (EosUpdaterFixture *fixture,
+                         EosTestServer **out_server,
+                         EosTestClient **out_client)
+{
+  g_autoptr(GFile) server_root = NULL;
+  g_autoptr(EosTestServer) server = NULL;
+  g_autofree gchar *keyid = get_keyid (fixture->gpg_home);
+  g_autoptr(GFile) client_root = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_test_message ("Setting up server");
+
+  server_root = g_file_get_child (fixture->tmpdir, "main");
+  server = eos_test_server_new_quick (server_root,
+                                      default_vendor,
+                                      default_product,
+                                      default_ref,
+                                      0,
+                                      fixture->gpg_home,
+                                      keyid,
+                                      default_ostree_path,
+                                      &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (server->subservers->len, ==, 1u);
+
+  g_test_message ("Setting up client");
+
+  client_root = g_file_get_child (fixture->tmpdir, "client");
+  client = eos_test_client_new (client_root,
+                                default_remote_name,
+                                EOS_TEST_SUBSERVER (g_ptr_array_index (server->subservers, 0)),
+                                default_ref,
+                                default_vendor,
+                                default_product,
+                                &error);
+  g_assert_no_error (error);
+
+  *out_server = g_steal_pointer (&server);
+  *out_client = g_steal_pointer (&client);
+}
+
+/* Peers running eos-update-server send the objects of an update in packs. */
+static void
+test_update_from_lan_packs (EosUpdaterFixture *fixture,
+                            gconstpointer user_data)
+{
+  g_autoptr(EosTestServer) server = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  EosTestSubserver *subserver;
+  g_autoptr(GFile) lan_server_root = NULL;
+  g_autoptr(EosTestClient) lan_server = NULL;
+  g_auto(CmdAsyncResult) lan_server_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_auto(CmdResult) reaped_server = CMD_RESULT_CLEARED;
+  g_autoptr(GKeyFile) definition = NULL;
+  g_auto(CmdResult) reaped = CMD_RESULT_CLEARED;
+  DownloadSource lan_source = DOWNLOAD_LAN;
+  gboolean has_commit;
+  g_autoptr(GError) error = NULL;
+
+  setup_server_and_client (fixture, &server, &client);
+  subserver = EOS_TEST_SUBSERVER (g_ptr_array_index (server->subservers, 0));
+
+  g_test_message ("Updating subserver");
+
+  g_hash_table_insert (subserver->ref_to_commit,
+                       g_strdup (default_ref),
+                       GUINT_TO_POINTER (1));
+  eos_test_subserver_update (subserver, &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Setting up LAN server");
+
+  lan_server_root = g_file_get_child (fixture->tmpdir, "lan_server");
+  lan_server = eos_test_client_new (lan_server_root,
+                                    default_remote_name,
+                                    subserver,
+                                    default_ref,
+                                    default_vendor,
+                                    default_product,
+                                    &error);
+  g_assert_no_error (error);
+
+  eos_test_client_run_update_server (lan_server,
+                                     &lan_server_cmd,
+                                     &definition,
+                                     &error);
+  g_assert_no_error (error);
+
+  eos_test_client_store_definition (client,
+                                    "lan_server",
+                                    definition,
+                                    &error);
+  g_assert_no_error (error);
+
+  update_client (fixture, client, &lan_source, 1, &reaped);
+
+  g_test_message ("Reaping LAN server");
+
+  eos_test_client_reap_update_server (lan_server,
+                                      &lan_server_cmd,
+                                      &reaped_server,
+                                      &error);
+  g_assert_no_error (error);
+  cmd_result_ensure_ok (&reaped_server, &error);
+  g_assert_no_error (error);
+
+  g_assert_nonnull (strstr (reaped.standard_error,
+                            "Fetch: fetched objects in packs from"));
+
+  eos_test_client_has_commit (client,
+                              default_remote_name,
+                              1,
+                              &has_commit,
+                              &error);
+  g_assert_no_error (error);
+  g_assert_true (has_commit);
+}
+
+/* Peers which cannot send packs are pulled from object by object. */
+static void
+test_update_from_lan_no_packs (EosUpdaterFixture *fixture,
+                               gconstpointer user_data)
+{
+  g_autoptr(EosTestServer) server = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  EosTestSubserver *subserver;
+  g_autoptr(GFile) httpd_dir = NULL;
+  g_autoptr(GKeyFile) definition = NULL;
+  g_auto(CmdResult) reaped = CMD_RESULT_CLEARED;
+  DownloadSource lan_source = DOWNLOAD_LAN;
+  gboolean has_commit;
+  g_autoptr(GError) error = NULL;
+
+  setup_server_and_client (fixture, &server, &client);
+  subserver = EOS_TEST_SUBSERVER (g_ptr_array_index (server->subservers, 0));
+
+  g_test_message ("Updating subserver");
+
+  g_hash_table_insert (subserver->ref_to_commit,
+                       g_strdup (default_ref),
+                       GUINT_TO_POINTER (1));
+  eos_test_subserver_update (subserver, &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Serving the subserver’s repository as a plain LAN peer");
+
+  httpd_dir = g_file_get_child (fixture->tmpdir, "lan_httpd");
+  eos_test_subserver_run_httpd (subserver,
+                                default_ref,
+                                httpd_dir,
+                                &definition,
+                                &error);
+  g_assert_no_error (error);
+
+  eos_test_client_store_definition (client,
+                                    "lan_httpd",
+                                    definition,
+                                    &error);
+  g_assert_no_error (error);
+
+  update_client (fixture, client, &lan_source, 1, &reaped);
+
+  g_assert_nonnull (strstr (reaped.standard_error,
+                            "Fetch: not fetching objects in packs"));
+
+  eos_test_client_has_commit (client,
+                              default_remote_name,
+                              1,
+                              &has_commit,
+                              &error);
+  g_assert_no_error (error);
+  g_assert_true (has_commit);
+}
+
+/* The main server and a LAN peer are polled at the same time, from threads
+ * of their own sharing one HTTP session, and both must answer. */
+static void
+test_update_from_main_and_lan (EosUpdaterFixture *fixture,
+                               gconstpointer user_data)
+{
+  g_autoptr(EosTestServer) server = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  EosTestSubserver *subserver;
+  g_autoptr(GFile) lan_server_root = NULL;
+  g_autoptr(EosTestClient) lan_server = NULL;
+  g_auto(CmdAsyncResult) lan_server_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_auto(CmdResult) reaped_server = CMD_RESULT_CLEARED;
+  g_autoptr(GKeyFile) definition = NULL;
+  g_auto(CmdResult) reaped = CMD_RESULT_CLEARED;
+  DownloadSource sources[] = { DOWNLOAD_MAIN, DOWNLOAD_LAN };
+  gboolean has_commit;
+  g_autoptr(GError) error = NULL;
+
+  setup_server_and_client (fixture, &server, &client);
+  subserver = EOS_TEST_SUBSERVER (g_ptr_array_index (server->subservers, 0));
+
+  g_test_message ("Updating subserver");
+
+  g_hash_table_insert (subserver->ref_to_commit,
+                       g_strdup (default_ref),
+                       GUINT_TO_POINTER (1));
+  eos_test_subserver_update (subserver, &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Setting up LAN server");
+
+  lan_server_root = g_file_get_child (fixture->tmpdir, "lan_server");
+  lan_server = eos_test_client_new (lan_server_root,
+                                    default_remote_name,
+                                    subserver,
+                                    default_ref,
+                                    default_vendor,
+                                    default_product,
+                                    &error);
+  g_assert_no_error (error);
+
+  eos_test_client_run_update_server (lan_server,
+                                     &lan_server_cmd,
+                                     &definition,
+                                     &error);
+  g_assert_no_error (error);
+
+  eos_test_client_store_definition (client,
+                                    "lan_server",
+                                    definition,
+                                    &error);
+  g_assert_no_error (error);
+
+  update_client (fixture, client, sources, G_N_ELEMENTS (sources), &reaped);
+
+  g_test_message ("Reaping LAN server");
+
+  eos_test_client_reap_update_server (lan_server,
+                                      &lan_server_cmd,
+                                      &reaped_server,
+                                      &error);
+  g_assert_no_error (error);
+  cmd_result_ensure_ok (&reaped_server, &error);
+  g_assert_no_error (error);
+
+  g_assert_null (strstr (reaped.standard_error,
+                         "Failed to poll metadata from source"));
+  g_assert_null (strstr (reaped.standard_error,
+                         "Timed out polling metadata from source"));
+
+  eos_test_client_has_commit (client,
+                              default_remote_name,
+                              1,
+                              &has_commit,
+                              &error);
+  g_assert_no_error (error);
+  g_assert_true (has_commit);
+}
+
+/* Seconds to wait for a LAN server to generate a static delta in the
+ * background. */
+#define GENERATE_DELTA_TIMEOUT_SECONDS 30
+
+/* A peer with GenerateDeltas=true learns from the delta superblock requested
+ * by a client which commit it is updating from, and generates the static
+ * delta from that commit to the one it advertises. The peer therefore needs
+ * both commits, so it is updated from the main server rather than being set
+ * up at the newer commit. */
+static void
+test_update_from_lan_generate_deltas (EosUpdaterFixture *fixture,
+                                      gconstpointer user_data)
+{
+  g_autoptr(EosTestServer) server = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  EosTestSubserver *subserver;
+  g_autoptr(GFile) lan_server_root = NULL;
+  g_autoptr(EosTestClient) lan_server = NULL;
+  g_auto(CmdResult) reaped_lan_server_update = CMD_RESULT_CLEARED;
+  g_auto(CmdAsyncResult) lan_server_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_auto(CmdResult) reaped_server = CMD_RESULT_CLEARED;
+  g_autoptr(GKeyFile) definition = NULL;
+  g_auto(CmdResult) reaped = CMD_RESULT_CLEARED;
+  DownloadSource main_source = DOWNLOAD_MAIN;
+  DownloadSource lan_source = DOWNLOAD_LAN;
+  gboolean has_delta = FALSE;
+  gboolean has_commit;
+  guint i;
+  g_autoptr(GError) error = NULL;
+
+  setup_server_and_client (fixture, &server, &client);
+  subserver = EOS_TEST_SUBSERVER (g_ptr_array_index (server->subservers, 0));
+
+  g_test_message ("Setting up LAN server");
+
+  lan_server_root = g_file_get_child (fixture->tmpdir, "lan_server");
+  lan_server = eos_test_client_new (lan_server_root,
+                                    default_remote_name,
+                                    subserver,
+                                    default_ref,
+                                    default_vendor,
+                                    default_product,
+                                    &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Updating subserver");
+
+  g_hash_table_insert (subserver->ref_to_commit,
+                       g_strdup (default_ref),
+                       GUINT_TO_POINTER (1));
+  eos_test_subserver_update (subserver, &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Updating LAN server from the main server");
+
+  update_client (fixture, lan_server, &main_source, 1, &reaped_lan_server_update);
+
+  eos_test_client_run_update_server_with_config (lan_server,
+                                                 "GenerateDeltas=true\n",
+                                                 &lan_server_cmd,
+                                                 &definition,
+                                                 &error);
+  g_assert_no_error (error);
+
+  eos_test_client_store_definition (client,
+                                    "lan_server",
+                                    definition,
+                                    &error);
+  g_assert_no_error (error);
+
+  update_client (fixture, client, &lan_source, 1, &reaped);
+
+  g_test_message ("Waiting for the LAN server to generate a delta");
+
+  for (i = 0; i < GENERATE_DELTA_TIMEOUT_SECONDS && !has_delta; i++)
+    {
+      eos_test_client_has_static_delta (lan_server, &has_delta, &error);
+      g_assert_no_error (error);
+
+      if (!has_delta)
+        sleep (1);
+    }
+
+  g_test_message ("Reaping LAN server");
+
+  eos_test_client_reap_update_server (lan_server,
+                                      &lan_server_cmd,
+                                      &reaped_server,
+                                      &error);
+  g_assert_no_error (error);
+  cmd_result_ensure_ok (&reaped_server, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (has_delta);
+
+  eos_test_client_has_commit (client,
+                              default_remote_name,
+                              1,
+                              &has_commit,
+                              &error);
+  g_assert_no_error (error);
+  g_assert_true (has_commit);
+}
+
+/* Seconds to wait for a LAN server to warm its cache in the background. */
+#define WARM_CACHE_TIMEOUT_SECONDS 30
+
+/* A peer with WarmCache=true compresses the objects of the commit it
+ * advertises while it is idle, before any client has asked for them. */
+static void
+test_update_from_lan_warm_cache (EosUpdaterFixture *fixture,
+                                 gconstpointer user_data)
+{
+  g_autoptr(EosTestServer) server = NULL;
+  g_autoptr(EosTestClient) lan_server = NULL;
+  g_auto(CmdAsyncResult) lan_server_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_auto(CmdResult) reaped_server = CMD_RESULT_CLEARED;
+  g_autoptr(GKeyFile) definition = NULL;
+  gboolean has_cached_objects = FALSE;
+  guint i;
+  g_autoptr(GError) error = NULL;
+
+  setup_server_and_client (fixture, &server, &lan_server);
+
+  g_test_message ("Running LAN server");
+
+  eos_test_client_run_update_server_with_config (lan_server,
+                                                 "WarmCache=true\n",
+                                                 &lan_server_cmd,
+                                                 &definition,
+                                                 &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Waiting for the LAN server to warm its cache");
+
+  for (i = 0; i < WARM_CACHE_TIMEOUT_SECONDS && !has_cached_objects; i++)
+    {
+      eos_test_client_has_cached_objects (lan_server, &has_cached_objects, &error);
+      g_assert_no_error (error);
+
+      if (!has_cached_objects)
+        sleep (1);
+    }
+
+  g_test_message ("Reaping LAN server");
+
+  eos_test_client_reap_update_server (lan_server,
+                                      &lan_server_cmd,
+                                      &reaped_server,
+                                      &error);
+  g_assert_no_error (error);
+  cmd_result_ensure_ok (&reaped_server, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (has_cached_objects);
+}
+
 int
 main (int argc,
       char **argv)
@@ -209,6 +681,11 @@ main (int argc,
   g_test_init (&argc, &argv, NULL);
 
   eos_test_add ("/updater/update-from-lan", NULL, test_update_from_lan);
+  eos_test_add ("/updater/update-from-lan/packs", NULL, test_update_from_lan_packs);
+  eos_test_add ("/updater/update-from-lan/no-packs", NULL, test_update_from_lan_no_packs);
+  eos_test_add ("/updater/update-from-lan/generate-deltas", NULL, test_update_from_lan_generate_deltas);
+  eos_test_add ("/updater/update-from-lan/warm-cache", NULL, test_update_from_lan_warm_cache);
+  eos_test_add ("/updater/update-from-main-and-lan", NULL, test_update_from_main_and_lan);
 
   return g_test_run ();
 }
@@ -115,6 +115,140 @@ test_update_from_main (EosUpdaterFixture *fixture,
   g_assert_true (has_commit);
 }
 
+/* How long the updater is told to wait for each source in
+ * test_update_from_main_stalled_lan(), and how long the whole update may take
+ * at most: less than the HTTP timeouts, so it can only pass if the source
+ * which never answers is given up on. */
+#define FETCHER_TIMEOUT_SECONDS "10"
+#define MAX_UPDATE_SECONDS 60
+
+/* A LAN peer which accepts connections but never answers must not hold up
+ * the update from the main server, which is polled at the same time. */
+static void
+test_update_from_main_stalled_lan (EosUpdaterFixture *fixture,
+                                   gconstpointer user_data)
+{
+  g_autoptr(GFile) server_root = NULL;
+  g_autoptr(EosTestServer) server = NULL;
+  g_autofree gchar *keyid = get_keyid (fixture->gpg_home);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EosTestSubserver) subserver = NULL;
+  g_autoptr(GFile) client_root = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  g_autoptr(GSocketListener) stalled_peer = NULL;
+  guint16 stalled_port;
+  g_autoptr(GFile) stalled_root = NULL;
+  g_autoptr(GDateTime) stalled_timestamp = NULL;
+  g_autoptr(GKeyFile) definition = NULL;
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(GFile) autoupdater_root = NULL;
+  g_autoptr(EosTestAutoupdater) autoupdater = NULL;
+  g_auto(CmdResult) reaped = CMD_RESULT_CLEARED;
+  g_autoptr(GPtrArray) cmds = NULL;
+  gboolean has_commit;
+  DownloadSource sources[] = { DOWNLOAD_MAIN, DOWNLOAD_LAN };
+  GVariant *source_variants[] = { NULL, NULL };
+  gint64 start_time;
+  gint64 elapsed_seconds;
+
+  server_root = g_file_get_child (fixture->tmpdir, "main");
+  server = eos_test_server_new_quick (server_root,
+                                      default_vendor,
+                                      default_product,
+                                      default_ref,
+                                      0,
+                                      fixture->gpg_home,
+                                      keyid,
+                                      default_ostree_path,
+                                      &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (server->subservers->len, ==, 1u);
+
+  subserver = g_object_ref (EOS_TEST_SUBSERVER (g_ptr_array_index (server->subservers, 0)));
+  client_root = g_file_get_child (fixture->tmpdir, "client");
+  client = eos_test_client_new (client_root,
+                                default_remote_name,
+                                subserver,
+                                default_ref,
+                                default_vendor,
+                                default_product,
+                                &error);
+  g_assert_no_error (error);
+
+  g_hash_table_insert (subserver->ref_to_commit,
+                       g_strdup (default_ref),
+                       GUINT_TO_POINTER (1));
+  eos_test_subserver_update (subserver,
+                             &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Setting up a LAN peer which never answers");
+
+  /* The kernel completes the connections to a listening socket, but nothing
+   * ever accepts them. */
+  stalled_peer = g_socket_listener_new ();
+  stalled_port = g_socket_listener_add_any_inet_port (stalled_peer, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Claim a newer commit than the main server has, so the peer would be
+   * preferred if it ever answered. */
+  stalled_root = g_file_get_child (fixture->tmpdir, "stalled_peer");
+  stalled_timestamp = g_date_time_new_now_utc ();
+  definition = eos_test_generate_avahi_definition (stalled_root,
+                                                   stalled_port,
+                                                   stalled_timestamp,
+                                                   default_ostree_path);
+  eos_test_client_store_definition (client,
+                                    "stalled_peer",
+                                    definition,
+                                    &error);
+  g_assert_no_error (error);
+
+  g_setenv ("EOS_UPDATER_TEST_UPDATER_FETCHER_TIMEOUT",
+            FETCHER_TIMEOUT_SECONDS, TRUE);
+  eos_test_client_run_updater (client,
+                               sources,
+                               source_variants,
+                               G_N_ELEMENTS (sources),
+                               &updater_cmd,
+                               &error);
+  g_unsetenv ("EOS_UPDATER_TEST_UPDATER_FETCHER_TIMEOUT");
+  g_assert_no_error (error);
+
+  start_time = g_get_monotonic_time ();
+
+  autoupdater_root = g_file_get_child (fixture->tmpdir, "autoupdater");
+  autoupdater = eos_test_autoupdater_new (autoupdater_root,
+                                          UPDATE_STEP_APPLY,
+                                          1,
+                                          TRUE,
+                                          &error);
+  g_assert_no_error (error);
+
+  elapsed_seconds = (g_get_monotonic_time () - start_time) / G_USEC_PER_SEC;
+
+  eos_test_client_reap_updater (client,
+                                &updater_cmd,
+                                &reaped,
+                                &error);
+  g_assert_no_error (error);
+
+  cmds = g_ptr_array_new ();
+  g_ptr_array_add (cmds, &reaped);
+  g_ptr_array_add (cmds, autoupdater->cmd);
+  g_assert_true (cmd_result_ensure_all_ok_verbose (cmds));
+
+  g_assert_cmpint (elapsed_seconds, <, MAX_UPDATE_SECONDS);
+
+  eos_test_client_has_commit (client,
+                              default_remote_name,
+                              1,
+                              &has_commit,
+                              &error);
+  g_assert_no_error (error);
+  g_assert_true (has_commit);
+}
+
 int
 main (int argc,
       char **argv)
@@ -124,6 +258,7 @@ main (int argc,
   g_test_init (&argc, &argv, NULL);
 
   eos_test_add ("/updater/update-from-main", NULL, test_update_from_main);
+  eos_test_add ("/updater/update-from-main/stalled-lan", NULL, test_update_from_main_stalled_lan);
 
   return g_test_run ();
 }